@@ -0,0 +1,59 @@
+/*
+ * M-Stack USB Bootloader
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#ifndef BL_CRC_H__
+#define BL_CRC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC32 used by the CRC requests of the bootloader protocol. It is shared
+ * by the firmware and the software, so that both sides compute the same
+ * value.
+ *
+ * This is the common CRC-32 (polynomial 0x04c11db7, reflected), the same
+ * one computed by zlib's crc32(). Like zlib's, it is started with a crc of
+ * zero, and may be continued by passing the previous return value.
+ *
+ * It is table-driven a nibble at a time, which keeps the table at 64 bytes
+ * so that it fits alongside the smallest bootloaders. */
+
+static uint32_t bl_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	static const uint32_t table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+	};
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *buf++;
+		crc = (crc >> 4) ^ table[crc & 0xf];
+		crc = (crc >> 4) ^ table[crc & 0xf];
+	}
+
+	return ~crc;
+}
+
+#endif /* BL_CRC_H__ */
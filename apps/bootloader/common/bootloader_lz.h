@@ -0,0 +1,115 @@
+/*
+ * M-Stack USB Bootloader
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#ifndef BL_LZ_H__
+#define BL_LZ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bootloader_protocol.h"
+
+/* Decoder for the compressed rows of BULK_WRITE_LZ records. The format is
+ * described in bootloader_protocol.h.
+ *
+ * Data is decoded a byte at a time, as it arrives from the host, straight
+ * into the row buffer. Since matches can only refer back into the row
+ * being decoded, no other buffer is needed. */
+
+enum {
+	BL_LZ_TOKEN,
+	BL_LZ_LITERAL,
+	BL_LZ_DISTANCE_LOW,
+	BL_LZ_DISTANCE_HIGH,
+};
+
+struct bl_lz_state {
+	uint16_t pos;      /* Bytes decoded so far */
+	uint16_t distance; /* Of the current match, less one */
+	uint8_t count;     /* Literals left, or length of the current match */
+	uint8_t state;     /* BL_LZ_* */
+};
+
+static void bl_lz_init(struct bl_lz_state *s)
+{
+	s->pos = 0;
+	s->state = BL_LZ_TOKEN;
+}
+
+/* Return whether the decoder is between tokens, which it must be at the
+ * end of the data. */
+static bool bl_lz_done(const struct bl_lz_state *s)
+{
+	return s->state == BL_LZ_TOKEN;
+}
+
+/* Decode one byte of compressed data into out, which has room for out_len
+ * bytes. Return -1 if the data is invalid or doesn't fit. */
+static int8_t bl_lz_decode(struct bl_lz_state *s, uint8_t c,
+                           uint8_t *out, uint16_t out_len)
+{
+	uint16_t from;
+
+	switch (s->state) {
+	case BL_LZ_TOKEN:
+		if (c < 0x80) {
+			s->count = c + 1;
+			s->state = BL_LZ_LITERAL;
+		}
+		else {
+			s->count = (c & 0x7f) + BL_LZ_MIN_MATCH;
+			s->state = BL_LZ_DISTANCE_LOW;
+		}
+		return 0;
+
+	case BL_LZ_LITERAL:
+		if (s->pos >= out_len)
+			return -1;
+		out[s->pos++] = c;
+		if (--s->count == 0)
+			s->state = BL_LZ_TOKEN;
+		return 0;
+
+	case BL_LZ_DISTANCE_LOW:
+		s->distance = c;
+		s->state = BL_LZ_DISTANCE_HIGH;
+		return 0;
+
+	case BL_LZ_DISTANCE_HIGH:
+		s->distance |= (uint16_t) c << 8;
+		if (s->distance >= s->pos || s->count > out_len - s->pos)
+			return -1;
+
+		/* Copy forward a byte at a time, since the match may overlap
+		 * the bytes it is producing. */
+		from = s->pos - s->distance - 1;
+		while (s->count > 0) {
+			out[s->pos++] = out[from++];
+			s->count--;
+		}
+		s->state = BL_LZ_TOKEN;
+		return 0;
+	}
+
+	return -1;
+}
+
+#endif /* BL_LZ_H__ */
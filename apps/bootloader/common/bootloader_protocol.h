@@ -39,6 +39,26 @@
 #define GET_CHIP_INFO 102
 #define REQUEST_DATA 103
 #define SEND_RESET 105
+#define GET_WRITE_STATUS 106
+#define SET_CRC_RANGE 107
+#define GET_CRC 108
+#define ERASE_RANGE 109
+#define GET_BLOCK_CRCS 110
+
+/* Protocol versions, reported in chip_info.protocol_version. Firmware
+ * which predates the versioning of the protocol reports zero there, which
+ * is to be treated the same as version 1 (control transfers only). */
+#define BOOTLOADER_PROTOCOL_V1 1
+#define BOOTLOADER_PROTOCOL_V2 2
+
+/* Capability bits, reported in chip_info.capabilities */
+#define BOOTLOADER_CAP_BULK_DATA 0x0001 /* Bulk data path (see below) */
+#define BOOTLOADER_CAP_WRITE_STATUS 0x0002 /* GET_WRITE_STATUS (see below) */
+#define BOOTLOADER_CAP_CRC 0x0004 /* SET_CRC_RANGE/GET_CRC (see below) */
+#define BOOTLOADER_CAP_ERASE_RANGE 0x0008 /* ERASE_RANGE, GET_BLOCK_CRCS */
+#define BOOTLOADER_CAP_PHANTOM_BYTE 0x0010 /* The last byte of each
+                                              instruction reads as zero */
+#define BOOTLOADER_CAP_COMPRESSION 0x0020 /* BULK_WRITE_LZ (see below) */
 
 #define MAX_SKIP_REGIONS 10
 
@@ -58,10 +78,137 @@ struct chip_info {
 	uint8_t number_of_skip_regions;
 	uint8_t pad1;
 
-	uint32_t reserved;
-	uint32_t reserved2;
+	uint8_t protocol_version; /* BOOTLOADER_PROTOCOL_*, or 0 */
+	uint8_t pad2;
+	uint16_t capabilities;    /* BOOTLOADER_CAP_* bits */
+	uint32_t flash_block_size; /* Erase block size, in bytes, or 0 */
 
 	struct skip_region skip_regions[10];
 };
 
+/* Bulk data path (protocol v2, BOOTLOADER_CAP_BULK_DATA)
+ *
+ * Instead of moving each flash row in its own control transfer, the host
+ * streams records to the bulk OUT endpoint. Each record is a struct
+ * bulk_record header, followed (for BULK_WRITE) by length bytes of data.
+ * Records are packed back-to-back and may span USB packets. Addresses and
+ * lengths have the same meaning as for SEND_DATA and REQUEST_DATA, and a
+ * BULK_WRITE record is limited to one flash row.
+ *
+ * For a BULK_READ record, the device sends length bytes of flash data,
+ * starting at address, on the bulk IN endpoint. BULK_READ is not limited
+ * to one row, but the range must be within the user region on every
+ * device (REQUEST_DATA may read beyond it on some). The records after a
+ * BULK_READ are processed once its data has been sent.
+ *
+ * An invalid record causes the device to halt the bulk OUT endpoint. The
+ * host must clear the halt before using the bulk data path again. Since
+ * the halt only fails the transfers which follow, the rejection is also
+ * reported by GET_WRITE_STATUS (see below).
+ *
+ * All multi-byte fields are little endian.
+ */
+#define BULK_OUT_ENDPOINT 0x01
+#define BULK_IN_ENDPOINT  0x81
+
+#define BULK_WRITE 1
+#define BULK_READ 2
+#define BULK_WRITE_LZ 3
+
+struct bulk_record {
+	uint32_t address;
+	uint16_t length;
+	uint8_t command;  /* BULK_WRITE, BULK_READ or BULK_WRITE_LZ */
+	uint8_t reserved;
+};
+
+/* Deferred writes (BOOTLOADER_CAP_WRITE_STATUS)
+ *
+ * The device acknowledges a SEND_DATA request (or accepts a BULK_WRITE
+ * record) as soon as the row has been received, and programs it into
+ * flash afterward, while the next row is being received. A failure to
+ * program a row can therefore not be reported on the request which
+ * carried it. Instead, the host reads a struct write_status with the
+ * GET_WRITE_STATUS request once it has sent all its data. The device
+ * finishes any pending write before answering, and clears the error
+ * after it has been reported.
+ *
+ * Pending writes are also finished before any flash is read or erased,
+ * and before the device resets.
+ */
+#define WRITE_STATUS_OK 0
+#define WRITE_STATUS_WRITE_FAILED 1
+#define WRITE_STATUS_BAD_RECORD 2 /* A bulk record was rejected */
+
+struct write_status {
+	uint8_t error;          /* WRITE_STATUS_* */
+	uint8_t reserved;
+	uint16_t reserved2;
+	uint32_t error_address; /* Address of the first row which failed */
+};
+
+/* Flash CRC (BOOTLOADER_CAP_CRC)
+ *
+ * SET_CRC_RANGE is an OUT request with a struct crc_range as its data
+ * stage. The device computes the CRC32 (see bootloader_crc.h) of the
+ * flash in that range before completing the request, and STALLs it if
+ * the range is not readable. The result is then read, as a uint32_t, with
+ * the GET_CRC request. The address and length have the same meaning as
+ * for REQUEST_DATA, but the length is not limited to one row. The range
+ * must be within the user region, and at most MAX_CRC_LENGTH bytes long,
+ * since the device doesn't service USB while it computes the CRC. Larger
+ * regions are checked in pieces.
+ */
+#define MAX_CRC_LENGTH 8192
+
+struct crc_range {
+	uint32_t address;
+	uint32_t length;
+};
+
+/* Block erase and block CRCs (BOOTLOADER_CAP_ERASE_RANGE)
+ *
+ * ERASE_RANGE is an OUT request with a struct erase_range as its data
+ * stage. The device erases the flash blocks in that range before
+ * completing the request. The address and length must be multiples of
+ * chip_info.flash_block_size, and the range must be within the user
+ * region, otherwise the request is STALLed.
+ *
+ * GET_BLOCK_CRCS is an IN request for the CRC32s of consecutive flash
+ * blocks, as a uint32_t each. The address of the first block is passed
+ * in wValue (low) and wIndex (high), and the number of blocks is wLength
+ * divided by four, up to MAX_BLOCK_CRCS. As with SET_CRC_RANGE, the blocks
+ * must be within the user region, and cover at most MAX_CRC_LENGTH bytes,
+ * unless only one block is requested.
+ *
+ * Erased flash reads as 0xff, except where BOOTLOADER_CAP_PHANTOM_BYTE is
+ * set (PIC24), in which case the last byte of every instruction reads as
+ * zero whether it is erased or not.
+ */
+#define MAX_BLOCK_CRCS 64
+
+struct erase_range {
+	uint32_t address;
+	uint32_t length;
+};
+
+/* Compressed rows (BOOTLOADER_CAP_COMPRESSION)
+ *
+ * A BULK_WRITE_LZ record is a BULK_WRITE record whose data is compressed.
+ * Its length is the length of the compressed data, and the row it
+ * decompresses to has the same limits as the data of a BULK_WRITE record.
+ * Each row is compressed on its own, so the device can decompress it
+ * straight into its row buffer as it arrives (see bootloader_lz.h).
+ *
+ * The compressed data is a sequence of tokens. A token byte below 0x80
+ * is followed by (token + 1) literal bytes. A token byte of 0x80 or more
+ * is a match of ((token & 0x7f) + BL_LZ_MIN_MATCH) bytes, and is followed
+ * by a 16-bit distance, less one: the match copies bytes from that far
+ * back in the decompressed row, and may overlap the bytes it produces, so
+ * that a run of one value is a literal and a single match.
+ */
+#define BL_LZ_MIN_MATCH 3
+#define BL_LZ_MAX_MATCH (0x7f + BL_LZ_MIN_MATCH)
+#define BL_LZ_MAX_LITERALS 0x80
+
 #endif /* BL_PROTOCOL_H__ */
@@ -32,6 +32,8 @@
 #include "usb_ch9.h"
 #include "hardware.h"
 #include "../common/bootloader_protocol.h"
+#include "../common/bootloader_crc.h"
+#include "../common/bootloader_lz.h"
 
 /* Variables from linker script.
  *
@@ -78,13 +80,51 @@ static uint32_t CONFIG_WORDS_TOP;
 
 #define BUFFER_LENGTH (INSTRUCTIONS_PER_ROW * BYTES_PER_INSTRUCTION)
 
-/* Data-to-program: buffer and attributes. */
-static uint32_t write_address; /* Physical flash address */
-static size_t write_length;    /* Bytes */
-static uint8_t prog_buf[BUFFER_LENGTH];
+/* Data-to-program: buffer and attributes. There are two of these, so
+ * that one row can be received from the host while the other is waiting
+ * to be written to flash. */
+struct prog_row {
+	uint32_t write_address; /* Physical flash address */
+	size_t write_length;    /* Bytes */
+	uint8_t buf[BUFFER_LENGTH];
+};
+
+static struct prog_row prog_rows[2];
+static struct prog_row *rx_row = &prog_rows[0]; /* Being received into */
+static struct prog_row *pending_row;            /* Waiting to be written */
+
+/* Data sent back by REQUEST_DATA and GET_BLOCK_CRCS. This can't be in
+ * rx_row, which may already hold part of a BULK_WRITE record. */
+static union {
+	uint8_t data[BUFFER_LENGTH];
+	uint32_t crcs[MAX_BLOCK_CRCS];
+} tx_buf;
+
+static struct write_status write_status;
+
+/* Range and result of the last SET_CRC_RANGE request */
+static struct crc_range crc_range;
+static uint32_t crc_result;
+
+/* Range of the last ERASE_RANGE request */
+static struct erase_range erase_range;
 
 static struct chip_info chip_info = { };
 
+/* Bulk data path state. See bootloader_protocol.h */
+static struct bulk_record bulk_record;
+static uint8_t bulk_header_pos; /* Bytes of bulk_record received so far */
+static uint16_t bulk_data_pos;  /* Bytes of BULK_WRITE data received */
+static struct bl_lz_state lz_state; /* Decoder for BULK_WRITE_LZ data */
+static uint8_t bulk_out_pos;    /* Bytes of the OUT packet processed */
+
+/* BULK_READ data still to be sent. It is sent from the main loop, and the
+ * records after the BULK_READ are processed once it has all gone. */
+static uint32_t bulk_read_address;
+static uint16_t bulk_read_len;
+
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+
 /* Perform the non-volatile memory command
    Return 0 for success, -1 on error */
 static __attribute__((nomips16)) int8_t nvm_command(uint32_t command)
@@ -135,13 +175,13 @@ static __attribute__((nomips16)) int8_t nvm_command(uint32_t command)
 	return (NVMCON & 0x3000)? -1: 0;
 }
 
-static int8_t clear_flash()
+/* Erase the flash blocks from prog_addr up to (but not including) top.
+ * Both are physical addresses, aligned to FLASH_BLOCK_SIZE. */
+static int8_t erase_blocks(uint32_t prog_addr, uint32_t top)
 {
-
-	uint32_t prog_addr = USER_REGION_BASE;
 	int8_t res;
 
-	while (prog_addr < USER_REGION_TOP) {
+	while (prog_addr < top) {
 		NVMADDR = prog_addr;
 		res = nvm_command(0x04);
 		if (res < 0)
@@ -153,34 +193,249 @@ static int8_t clear_flash()
 	return 0;
 }
 
-/* This function makes use of globals:
-      write_address
-      write_length
-      prog_buf
- */
-static int8_t write_flash_row()
+static int8_t clear_flash()
+{
+	return erase_blocks(USER_REGION_BASE, USER_REGION_TOP);
+}
+
+static int8_t write_flash_row(struct prog_row *row)
 {
 	/* Make sure a short buffer is padded with 0xff. */
-	if (write_length < BUFFER_LENGTH)
-		memset(prog_buf + write_length, 0xff,
-		       BUFFER_LENGTH - write_length);
+	if (row->write_length < BUFFER_LENGTH)
+		memset(row->buf + row->write_length, 0xff,
+		       BUFFER_LENGTH - row->write_length);
 
-	NVMADDR = write_address; /* physical flash address */
-	NVMSRCADDR =  KVA_TO_PA(prog_buf);
+	NVMADDR = row->write_address; /* physical flash address */
+	NVMSRCADDR =  KVA_TO_PA(row->buf);
 
 	return nvm_command(0x03);
 }
 
-/* Read data starting at prog_addr into the global prog_buf. prog_addr
- * is a physical address. */
+/* Write the pending row (if any) to flash, recording the first failure
+ * for GET_WRITE_STATUS. */
+static void flush_pending_row(void)
+{
+	if (!pending_row)
+		return;
+
+	if (write_flash_row(pending_row) < 0 &&
+	    write_status.error == WRITE_STATUS_OK) {
+		write_status.error = WRITE_STATUS_WRITE_FAILED;
+		write_status.error_address = pending_row->write_address;
+	}
+
+	pending_row = NULL;
+}
+
+/* Hand the row which has just been received over to be written from the
+ * main loop, and receive the next row into the other buffer. */
+static void queue_row(void)
+{
+	flush_pending_row();
+
+	pending_row = rx_row;
+	rx_row = (rx_row == &prog_rows[0])? &prog_rows[1]: &prog_rows[0];
+}
+
+/* Read data starting at prog_addr into tx_buf. prog_addr is a physical
+ * address. */
 static void read_prog_data(uint32_t prog_addr, uint32_t len/*bytes*/)
 {
 	uint32_t *virt_addr_uncached = (uint32_t*) PA_TO_KVA1(prog_addr);
 
-	if (len > sizeof(prog_buf))
-		len = sizeof(prog_buf);
+	if (len > sizeof(tx_buf.data))
+		len = sizeof(tx_buf.data);
+
+	memcpy(tx_buf.data, virt_addr_uncached, len);
+}
+
+/* Compute the CRC of len bytes of flash, starting at the physical address
+ * address. Return -1 if the range is not in the user region. */
+static int8_t flash_crc(uint32_t address, uint32_t len, uint32_t *crc)
+{
+	/* Range-check address (and check for overflow) */
+	if (address < USER_REGION_BASE)
+		return -1;
+	if (address + len > USER_REGION_TOP)
+		return -1;
+	if (address + len < address)
+		return -1;
+
+	*crc = bl_crc32(0, (const uint8_t*) PA_TO_KVA1(address), len);
+	return 0;
+}
+
+/* Set up rx_row for a write of len bytes to the physical address address,
+ * and clear its buffer. Return 0 if the write is valid or -1 if it is
+ * not. */
+static int8_t set_write_target(uint32_t address, uint16_t len)
+{
+	if (len > sizeof(rx_row->buf))
+		return -1;
+
+	/* Make sure it is within writable range (ie: don't
+	 * overwrite the bootloader or config words). */
+	if (address < USER_REGION_BASE)
+		return -1;
+	if (address + len > USER_REGION_TOP)
+		return -1;
+
+	/* Check for overflow (unlikely on known MCUs) */
+	if (address + len < address)
+		return -1;
 
-	memcpy(prog_buf, virt_addr_uncached, len);
+	rx_row->write_address = address;
+	rx_row->write_length = len;
+	memset(rx_row->buf, 0xff, sizeof(rx_row->buf));
+	return 0;
+}
+
+/* Send the next packet of BULK_READ data on the bulk IN endpoint, once
+ * the endpoint is free. */
+static void continue_bulk_read(void)
+{
+	uint8_t chunk = MIN(bulk_read_len, EP_1_IN_LEN);
+
+	/* The host has given up on the data. */
+	if (usb_in_endpoint_halted(1)) {
+		bulk_read_len = 0;
+		return;
+	}
+
+	if (usb_in_endpoint_busy(1))
+		return;
+
+	memcpy(usb_get_in_buffer(1), (void*) PA_TO_KVA1(bulk_read_address),
+	       chunk);
+	usb_send_in_buffer(1, chunk);
+
+	bulk_read_address += chunk;
+	bulk_read_len -= chunk;
+}
+
+/* Finish a BULK_WRITE_LZ record, whose data has been decompressed into
+ * rx_row. Return -1 if the data was incomplete or the row doesn't fit. */
+static int8_t finish_lz_record(void)
+{
+	if (!bl_lz_done(&lz_state))
+		return -1;
+	if (rx_row->write_address + lz_state.pos > USER_REGION_TOP)
+		return -1;
+
+	rx_row->write_length = lz_state.pos;
+	return 0;
+}
+
+/* Handle a newly-received bulk_record header. Return -1 if the record
+ * is invalid. */
+static int8_t start_bulk_record(void)
+{
+	uint32_t address = bulk_record.address;
+	uint16_t len = bulk_record.length;
+
+	if (bulk_record.command == BULK_WRITE) {
+		bulk_data_pos = 0;
+		return set_write_target(address, len);
+	}
+	else if (bulk_record.command == BULK_WRITE_LZ) {
+		/* The length of the row is only known once it has been
+		 * decompressed, so it is checked then. */
+		bulk_data_pos = 0;
+		bl_lz_init(&lz_state);
+		return set_write_target(address, 0);
+	}
+	else if (bulk_record.command == BULK_READ) {
+		/* Range-check address (and check for overflow) */
+		if (address < USER_REGION_BASE)
+			return -1;
+		if (address + len > USER_REGION_TOP)
+			return -1;
+		if (address + len < address)
+			return -1;
+
+		flush_pending_row();
+		bulk_read_address = address;
+		bulk_read_len = len;
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Consume a packet from the bulk OUT endpoint. Records are parsed a byte
+ * at a time, as they may span packets. */
+static void process_bulk_data(void)
+{
+	const unsigned char *data;
+	uint8_t len;
+	uint8_t i = bulk_out_pos;
+
+	len = usb_get_out_buffer(1, &data);
+
+	while (i < len) {
+		if (bulk_header_pos < sizeof(bulk_record)) {
+			((uint8_t*) &bulk_record)[bulk_header_pos++] = data[i++];
+			if (bulk_header_pos < sizeof(bulk_record))
+				continue;
+
+			/* The header is complete. */
+			if (start_bulk_record() < 0)
+				goto fail;
+
+			if (bulk_record.command == BULK_READ ||
+			    bulk_record.length == 0)
+				bulk_header_pos = 0;
+
+			/* Leave the rest of the packet until the data has
+			 * been sent. */
+			if (bulk_record.command == BULK_READ) {
+				bulk_out_pos = i;
+				return;
+			}
+		}
+		else if (bulk_record.command == BULK_WRITE_LZ) {
+			/* Compressed data is decompressed as it arrives */
+			if (bl_lz_decode(&lz_state, data[i++], (uint8_t*) rx_row->buf,
+			                 sizeof(rx_row->buf)) < 0)
+				goto fail;
+			bulk_data_pos++;
+
+			if (bulk_data_pos == bulk_record.length) {
+				if (finish_lz_record() < 0)
+					goto fail;
+				queue_row();
+				bulk_header_pos = 0;
+			}
+		}
+		else {
+			/* BULK_WRITE data */
+			uint8_t n = MIN(len - i,
+			                bulk_record.length - bulk_data_pos);
+			memcpy(rx_row->buf + bulk_data_pos, data + i, n);
+			i += n;
+			bulk_data_pos += n;
+
+			if (bulk_data_pos == bulk_record.length) {
+				queue_row();
+				bulk_header_pos = 0;
+			}
+		}
+	}
+
+	bulk_out_pos = 0;
+	usb_arm_out_endpoint(1);
+	return;
+
+fail:
+	/* Tell the host something went wrong. It will have to clear the
+	 * halt before sending any more records. */
+	if (write_status.error == WRITE_STATUS_OK) {
+		write_status.error = WRITE_STATUS_BAD_RECORD;
+		write_status.error_address = bulk_record.address;
+	}
+	bulk_header_pos = 0;
+	bulk_out_pos = 0;
+	usb_halt_ep_out(1);
 }
 
 int main(void)
@@ -214,6 +469,17 @@ int main(void)
 		#ifndef USB_USE_INTERRUPTS
 		usb_service();
 		#endif
+
+		if (usb_is_configured()) {
+			if (bulk_read_len > 0)
+				continue_bulk_read();
+			else if (usb_out_endpoint_has_data(1))
+				process_bulk_data();
+		}
+
+		/* Program the last row received while the host sends the
+		 * next one. */
+		flush_pending_row();
 	}
 
 	return 0;
@@ -230,6 +496,8 @@ static int8_t reset_cb(bool transfer_ok, void *context)
 	uint32_t x;
 	uint16_t i = 65535;
 
+	flush_pending_row();
+
 	/* Delay before resetting*/
 	while(i--)
 		;
@@ -255,21 +523,52 @@ static int8_t reset_cb(bool transfer_ok, void *context)
 static int8_t write_data_cb(bool transfer_ok, void *context)
 {
 	/* For OUT control transfers, data from the data stage of the request
-	 * is in prog_buf[]. */
-	int8_t res = -1;
+	 * is in rx_row. It is written to flash from the main loop, so that
+	 * the STATUS stage doesn't have to wait for it. */
+	if (!transfer_ok)
+		return -1;
 
+	queue_row();
+
+	return 0;
+}
+
+static int8_t crc_range_cb(bool transfer_ok, void *context)
+{
+	/* Compute the CRC now, so that a bad range fails this request
+	 * rather than GET_CRC. USB isn't serviced meanwhile, which is why
+	 * the length is limited. Rows still waiting to be written are part
+	 * of what the host expects to be in flash. */
 	if (!transfer_ok)
 		return -1;
+	if (crc_range.length > MAX_CRC_LENGTH)
+		return -1;
 
-	res = write_flash_row();
+	flush_pending_row();
+	return flash_crc(crc_range.address, crc_range.length, &crc_result);
+}
+
+static int8_t erase_range_cb(bool transfer_ok, void *context)
+{
+	uint32_t base = erase_range.address;
+	uint32_t top = base + erase_range.length;
 
-	return res;
+	if (!transfer_ok)
+		return -1;
+
+	/* Make sure the range is whole blocks, and is within the
+	 * writable range. */
+	if ((base | top) & (FLASH_BLOCK_SIZE - 1))
+		return -1;
+	if (base < USER_REGION_BASE || top > USER_REGION_TOP || top < base)
+		return -1;
+
+	flush_pending_row();
+	return erase_blocks(base, top);
 }
 
 int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 {
-#define MIN(X,Y) ((X)<(Y)?(X):(Y))
-
 	/* This handler handles request 254/dest=other/type=vendor only.*/
 	if (setup->REQUEST.destination == DEST_OTHER_ELEMENT &&
 	    setup->REQUEST.type == REQUEST_TYPE_VENDOR &&
@@ -277,6 +576,7 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 
 		if (setup->bRequest == CLEAR_FLASH) {
 			/* Clear flash Request */
+			flush_pending_row();
 			clear_flash();
 
 			/* There will be NO data stage. This sends back the
@@ -285,29 +585,27 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 		}
 		else if (setup->bRequest == SEND_DATA) {
 			/* Write Data Request */
-			if (setup->wLength > sizeof(prog_buf))
-				return -1;
-
-			write_address = setup->wValue | ((uint32_t) setup->wIndex) << 16;
-			write_length = setup->wLength;
+			uint32_t address;
 
-			/* Make sure it is within writable range (ie: don't
-			 * overwrite the bootloader or config words). */
-			if (write_address < USER_REGION_BASE)
-				return -1;
-			if (write_address + write_length > USER_REGION_TOP)
+			address = setup->wValue | ((uint32_t) setup->wIndex) << 16;
+			if (set_write_target(address, setup->wLength) < 0)
 				return -1;
 
-			/* Check for overflow (unlikely on known MCUs) */
-			if (write_address + write_length < write_address)
+			usb_start_receive_ep0_data_stage((char*)rx_row->buf, setup->wLength, &write_data_cb, NULL);
+		}
+		else if (setup->bRequest == SET_CRC_RANGE) {
+			/* CRC Range Request */
+			if (setup->wLength != sizeof(crc_range))
 				return -1;
 
-			/* Check length */
-			if (setup->wLength > sizeof(prog_buf))
+			usb_start_receive_ep0_data_stage((char*)&crc_range, sizeof(crc_range), &crc_range_cb, NULL);
+		}
+		else if (setup->bRequest == ERASE_RANGE) {
+			/* Erase Range Request */
+			if (setup->wLength != sizeof(erase_range))
 				return -1;
 
-			memset(prog_buf, 0xff, sizeof(prog_buf));
-			usb_start_receive_ep0_data_stage((char*)prog_buf, setup->wLength, &write_data_cb, NULL);
+			usb_start_receive_ep0_data_stage((char*)&erase_range, sizeof(erase_range), &erase_range_cb, NULL);
 		}
 		else if (setup->bRequest == SEND_RESET) {
 			/* Reset to Application Request*/
@@ -332,6 +630,13 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 			chip_info.bytes_per_instruction = BYTES_PER_INSTRUCTION;
 			chip_info.instructions_per_row = INSTRUCTIONS_PER_ROW;
 			chip_info.number_of_skip_regions = 1;
+			chip_info.flash_block_size = FLASH_BLOCK_SIZE;
+			chip_info.protocol_version = BOOTLOADER_PROTOCOL_V2;
+			chip_info.capabilities = BOOTLOADER_CAP_BULK_DATA |
+			                         BOOTLOADER_CAP_WRITE_STATUS |
+			                         BOOTLOADER_CAP_CRC |
+			                         BOOTLOADER_CAP_ERASE_RANGE |
+			                         BOOTLOADER_CAP_COMPRESSION;
 
 			/* Skip the debug executive which it's impossible
 			 * to remove using the linker script. This has to be
@@ -344,6 +649,51 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 				empty_cb/*TODO*/, NULL);
 		}
 
+		if (setup->bRequest == GET_WRITE_STATUS) {
+			/* Report (and clear) deferred write errors */
+			static struct write_status status;
+
+			flush_pending_row();
+			status = write_status;
+			memset(&write_status, 0, sizeof(write_status));
+
+			usb_send_data_stage((char*)&status,
+				MIN(sizeof(status), setup->wLength),
+				empty_cb, NULL);
+		}
+
+		if (setup->bRequest == GET_CRC) {
+			/* Request the CRC computed by SET_CRC_RANGE */
+			usb_send_data_stage((char*)&crc_result,
+				MIN(sizeof(crc_result), setup->wLength),
+				empty_cb, NULL);
+		}
+
+		if (setup->bRequest == GET_BLOCK_CRCS) {
+			/* Request the CRCs of consecutive flash blocks */
+			uint32_t address;
+			uint8_t count = setup->wLength / sizeof(uint32_t);
+			uint8_t i;
+
+			address = setup->wValue | ((uint32_t) setup->wIndex) << 16;
+
+			if (count > MAX_BLOCK_CRCS)
+				return -1;
+			if (count > 1 &&
+			    (uint32_t) count * FLASH_BLOCK_SIZE > MAX_CRC_LENGTH)
+				return -1;
+
+			flush_pending_row();
+			for (i = 0; i < count; i++) {
+				if (flash_crc(address, FLASH_BLOCK_SIZE, &tx_buf.crcs[i]) < 0)
+					return -1;
+				address += FLASH_BLOCK_SIZE;
+			}
+
+			usb_send_data_stage((char*)tx_buf.crcs,
+				count * sizeof(uint32_t), empty_cb, NULL);
+		}
+
 		if (setup->bRequest == REQUEST_DATA) {
 			/* Request program data */
 			uint32_t read_address;
@@ -351,7 +701,7 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 			read_address = setup->wValue | ((uint32_t) setup->wIndex) << 16;
 
 			/* Range-check address */
-			if (write_address < USER_REGION_BASE)
+			if (read_address < USER_REGION_BASE)
 				return -1;
 			if (read_address + setup->wLength > USER_REGION_TOP)
 				return -1;
@@ -361,19 +711,22 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 				return -1;
 
 			/* Check length */
-			if (setup->wLength > sizeof(prog_buf))
+			if (setup->wLength > sizeof(tx_buf.data))
 				return -1;
 
+			flush_pending_row();
 			read_prog_data(read_address, setup->wLength);
-			usb_send_data_stage((char*)prog_buf, setup->wLength, empty_cb/*TODO*/, NULL);
+			usb_send_data_stage((char*)tx_buf.data, setup->wLength, empty_cb/*TODO*/, NULL);
 		}
 	}
 
 	return 0; /* 0 = can handle this request. */
-#undef MIN
 }
 
 void app_usb_reset_callback(void)
 {
-
+	/* Abandon any partially-received bulk record, and any read. */
+	bulk_header_pos = 0;
+	bulk_out_pos = 0;
+	bulk_read_len = 0;
 }
@@ -33,8 +33,23 @@
 /* Only 8, 16, 32 and 64 are supported for endpoint zero length. */
 #define EP_0_LEN 8
 
-#define EP_1_OUT_LEN 64
-#define EP_1_IN_LEN 64
+/* The interface and endpoints of configuration 1: one vendor-defined
+   interface with a bulk IN and a bulk OUT endpoint. The configuration
+   descriptor in usb_descriptors.c and the endpoint lengths below are
+   generated from this list. See usb_desc_builder.h for the format. */
+#include "usb_desc_builder.h"
+
+#define APP_CONFIGURATION_1(X) \
+	X##_INTERFACE(bootloader_interface, 0, 0, 2, \
+	              0xff /* Vendor Defined */, 0x00, 0x00, \
+	              2 /* iInterface */, NONE) \
+	X##_ENDPOINT(bootloader_in, 0x01 | 0x80, EP_BULK, 64, 1) \
+	X##_ENDPOINT(bootloader_out, 0x01, EP_BULK, 64, 1)
+
+USB_DESC_ENDPOINT_SIZES(configuration_1, APP_CONFIGURATION_1);
+
+#define EP_1_OUT_LEN USB_DESC_MAX_PACKET_SIZE(bootloader_out)
+#define EP_1_IN_LEN USB_DESC_MAX_PACKET_SIZE(bootloader_in)
 
 #define NUMBER_OF_CONFIGURATIONS 1
 
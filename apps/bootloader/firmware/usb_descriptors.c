@@ -33,13 +33,15 @@
  * This packet contains a configuration descriptor, one or more interface
  * descriptors, class descriptors(optional), and endpoint descriptors for a
  * single configuration of the device.  This struct is specific to the
- * device, so the application will need to add any interfaces, classes and
- * endpoints it intends to use.  It is sent to the host in response to a
+ * device, and is generated from the APP_CONFIGURATION_1 list in
+ * usb_config.h, which contains the interfaces, classes and endpoints it
+ * intends to use.  It is sent to the host in response to a
  * GET_DESCRIPTOR[CONFIGURATION] request.
  *
  * While Most devices will only have one configuration, a device can have as
  * many configurations as it needs.  To have more than one, simply make as
- * many of these structs as are required, one for each configuration.
+ * many of these structs (and lists) as are required, one for each
+ * configuration.
  *
  * An instance of each configuration packet must be put in the
  * usb_application_config_descs[] array below (which is #defined in
@@ -48,18 +50,10 @@
  * See Chapter 9 of the USB specification from usb.org for details.
  *
  * It's worth noting that adding endpoints here does not automatically
- * enable them in the USB stack.  To use an endpoint, it must be declared
- * here and also in usb_config.h.
- *
- * The configuration packet below is for the demo application.  Yours will
- * of course vary.
+ * enable them in the USB stack.  To use an endpoint, NUM_ENDPOINT_NUMBERS
+ * in usb_config.h must also be large enough to include it.
  */
-struct configuration_1_packet {
-	struct configuration_descriptor  config;
-	struct interface_descriptor      interface;
-	struct endpoint_descriptor       ep;
-	struct endpoint_descriptor       ep1_out;
-};
+USB_DESC_CONFIGURATION_STRUCT(configuration_1_packet, APP_CONFIGURATION_1);
 
 
 /* Device Descriptor
@@ -73,7 +67,7 @@ const ROMPTR struct device_descriptor this_device_descriptor =
 {
 	sizeof(struct device_descriptor), // bLength
 	DESC_DEVICE, // bDescriptorType
-	0x0200, // 0x0200 = USB 2.0, 0x0110 = USB 1.1
+	0x0201, // 0x0201 = USB 2.0 + BOS (for MS OS 2.0 descriptors)
 	0x00, // Device class
 	0x00, // Device Subclass
 	0x00, // Protocol.
@@ -91,59 +85,16 @@ const ROMPTR struct device_descriptor this_device_descriptor =
 /* Configuration Packet Instance
  *
  * This is an instance of the configuration_packet struct containing all the
- * data describing a single configuration of this device.  It is wise to use
- * as much C here as possible, such as sizeof() operators, and #defines from
- * usb_config.h.  When stuff is wrong here, it can be difficult to track
- * down exactly why, so it's good to get the compiler to do as much of it
- * for you as it can.
+ * data describing a single configuration of this device.  wTotalLength,
+ * bNumInterfaces, and the interface and endpoint descriptors are all
+ * computed from APP_CONFIGURATION_1 at compile time.
  */
 static const ROMPTR struct configuration_1_packet configuration_1 =
-{
-	{
-	// Members from struct configuration_descriptor
-	sizeof(struct configuration_descriptor),
-	DESC_CONFIGURATION,
-	sizeof(configuration_1), //wTotalLength (length of the whole packet)
-	1, // bNumInterfaces
-	1, // bConfigurationValue
-	2, // iConfiguration (index of string descriptor)
-	0b10000000,
-	100/2,   // 100/2 indicates 100mA
-	},
-
-	{
-	// Members from struct interface_descriptor
-	sizeof(struct interface_descriptor), // bLength;
-	DESC_INTERFACE,
-	0x0, // InterfaceNumber
-	0x0, // AlternateSetting
-	0x2, // bNumEndpoints (num besides endpoint 0)
-	0xff, // bInterfaceClass 3=HID, 0xFF=VendorDefined
-	0x00, // bInterfaceSubclass (0=NoBootInterface for HID)
-	0x00, // bInterfaceProtocol
-	0x02, // iInterface (index of string describing interface)
-	},
-
-	{
-	// Members of the Endpoint Descriptor (EP1 IN)
-	sizeof(struct endpoint_descriptor),
-	DESC_ENDPOINT,
-	0x01 | 0x80, // endpoint #1 0x80=IN
-	EP_BULK, // bmAttributes
-	64, // wMaxPacketSize
-	1,   // bInterval in ms.
-	},
-
-	{
-	// Members of the Endpoint Descriptor (EP1 OUT)
-	sizeof(struct endpoint_descriptor),
-	DESC_ENDPOINT,
-	0x01 /*| 0x00*/, // endpoint #1 0x00=IN
-	EP_BULK, // bmAttributes
-	64, // wMaxPacketSize
-	1,   // bInterval in ms.
-	},
-};
+	USB_DESC_CONFIGURATION(configuration_1, APP_CONFIGURATION_1,
+		1, // bConfigurationValue
+		2, // iConfiguration (index of string descriptor)
+		0b10000000, // bmAttributes
+		100/2);  // bMaxPower: 100/2 indicates 100mA
 
 /* String Descriptors
  *
@@ -42,22 +42,77 @@
 #include <libusb.h>
 
 #include "hex.h"
+#include "image.h"
 #include "bootloader.h"
 #include "log.h"
 #include "../common/bootloader_protocol.h"
+#include "../common/bootloader_crc.h"
 
 #ifdef _MSC_VER
 	#pragma warning (disable:4996)
 #endif
 
 #define MIN(X,Y) ((X)<(Y)? (X): (Y))
+#define MAX(X,Y) ((X)>(Y)? (X): (Y))
+
+/* Size of the buffer in which bulk records are collected before being sent
+ * to the device in a single bulk transfer, and the largest read requested
+ * in a single BULK_READ record. */
+#define BULK_BUFFER_SIZE 16384
+#define BULK_READ_SIZE 4096
+
+/* Number of asynchronous transfers kept in flight (see below) */
+#define DEFAULT_QUEUE_DEPTH 4
+#define MAX_QUEUE_DEPTH 64
+#define XFER_BUFFER_SIZE (LIBUSB_CONTROL_SETUP_SIZE + BULK_BUFFER_SIZE)
+
+/* Most flash blocks erased by a single ERASE_RANGE request, to keep each
+ * request well inside its timeout. */
+#define MAX_BLOCKS_PER_ERASE 64
+
+/* Size of the hash table used to find matches when compressing a row */
+#define LZ_HASH_BITS 10
 
 /* Bootloader Object */
 struct bootloader {
-	struct hex_data *hd;
+	struct hex_data *image; /* Prepared for this device's flash */
+	uint64_t image_key;     /* Hash of the file and the flash layout */
 	libusb_device_handle *handle;
 	struct chip_info chip_info;
 	int bytes_per_row;
+
+	char path[BOOTLOADER_PATH_LEN]; /* Bus/port path of the device */
+	bool owns_image; /* image is freed with this object */
+
+	/* Bulk data path (protocol v2) */
+	bool use_bulk;
+	unsigned char *bulk_buf;
+	size_t bulk_len;
+	size_t bulk_address; /* Address of the first record in bulk_buf */
+
+	/* Compression of rows on the bulk data path */
+	bool use_compression;
+	unsigned char *lz_buf; /* One compressed row */
+	size_t data_bytes;     /* Bytes of row data written */
+	size_t sent_bytes;     /* Bytes actually sent for them */
+
+	/* Asynchronous transfers. xfers is a ring of queue_depth slots, of
+	 * which xfer_count, starting at xfer_head, are in flight. */
+	struct async_xfer *xfers;
+	int queue_depth;
+	int xfer_head;
+	int xfer_count;
+};
+
+/* An asynchronous transfer, and what it's for */
+struct async_xfer {
+	struct libusb_transfer *transfer;
+	unsigned char *buf;            /* XFER_BUFFER_SIZE bytes */
+	unsigned char *data;           /* Data stage, within buf */
+	size_t address;                /* First flash address covered */
+	size_t len;                    /* Expected length of the data */
+	const unsigned char *expected; /* For reads, data to compare */
+	int completed;
 };
 
 /* Open a libusb device.
@@ -129,65 +184,158 @@ static int clear_flash(libusb_device_handle *handle)
 	return 0;
 }
 
-static int send_data(libusb_device_handle *handle, size_t address, const unsigned char *buf, size_t len)
+static int get_chip_info(libusb_device_handle *handle, struct chip_info *info)
+{
+	int res;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		GET_CHIP_INFO /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		(unsigned char*)info, sizeof(*info)/*wLength*/,
+		1000/*timeout millis*/);
+
+	/* TODO: Take care of byte swapping issues in chip_info. */
+
+	if (res < 0) {
+		log_libusb("Error request chip info: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	return 0;
+}
+
+static int request_data(libusb_device_handle *handle, size_t address, unsigned char *buf, size_t len)
 {
 	int res;
 	
 	res = libusb_control_transfer(handle,
-		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
-		SEND_DATA /* bRequest */,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		REQUEST_DATA /* bRequest */,
 		address & 0xffff, /* wValue: Low Address */
 		(address & 0xffff0000) >> 16, /* wIndex: High Address */
-		(unsigned char*) buf, len/*wLength*/,
+		buf, len/*wLength*/,
 		1000/*timeout millis*/);
 
 	if (res < 0) {
-		log_libusb("Error Sending Data : %s\n", libusb_error_name(res));
+		log_libusb("Error requesting data: %s\n", libusb_error_name(res));
 		return res;
 	}
 
 	return 0;
 }
 
-static int get_chip_info(libusb_device_handle *handle, struct chip_info *info)
+static int get_write_status(libusb_device_handle *handle, struct write_status *status)
 {
 	int res;
 
 	res = libusb_control_transfer(handle,
 		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
-		GET_CHIP_INFO /* bRequest */,
+		GET_WRITE_STATUS /* bRequest */,
 		0, /* wValue */
 		0, /* wIndex */
-		(unsigned char*)info, sizeof(*info)/*wLength*/,
+		(unsigned char*)status, sizeof(*status)/*wLength*/,
+		5000/*timeout millis*/);
+
+	/* TODO: Take care of byte swapping issues in write_status. */
+
+	if (res < 0) {
+		log_libusb("Error requesting write status: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	return 0;
+}
+
+/* Have the device compute the CRC of len bytes of flash starting at
+ * address. */
+static int get_crc(libusb_device_handle *handle, size_t address, size_t len, uint32_t *crc)
+{
+	struct crc_range range;
+	int res;
+
+	/* TODO: Take care of byte swapping issues in crc_range and crc. */
+	range.address = address;
+	range.length = len;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		SET_CRC_RANGE /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		(unsigned char*)&range, sizeof(range)/*wLength*/,
+		10000/*timeout millis*/);
+
+	if (res < 0) {
+		log_libusb("Error setting CRC range: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		GET_CRC /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		(unsigned char*)crc, sizeof(*crc)/*wLength*/,
 		1000/*timeout millis*/);
 
-	/* TODO: Take care of byte swapping issues in chip_info. */
+	if (res < 0) {
+		log_libusb("Error requesting CRC: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	return 0;
+}
+
+static int erase_range(libusb_device_handle *handle, size_t address, size_t len)
+{
+	struct erase_range range;
+	int res;
+
+	/* TODO: Take care of byte swapping issues in erase_range. */
+	range.address = address;
+	range.length = len;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		ERASE_RANGE /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		(unsigned char*)&range, sizeof(range)/*wLength*/,
+		10000/*timeout millis*/);
 
 	if (res < 0) {
-		log_libusb("Error request chip info: %s\n", libusb_error_name(res));
+		log_libusb("Error erasing range: %s\n", libusb_error_name(res));
 		return res;
 	}
 
 	return 0;
 }
 
-static int request_data(libusb_device_handle *handle, size_t address, unsigned char *buf, size_t len)
+/* Get the CRCs of count flash blocks, starting with the one at address. */
+static int get_block_crcs(libusb_device_handle *handle, size_t address, uint32_t *crcs, size_t count)
 {
 	int res;
-	
+
 	res = libusb_control_transfer(handle,
 		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
-		REQUEST_DATA /* bRequest */,
+		GET_BLOCK_CRCS /* bRequest */,
 		address & 0xffff, /* wValue: Low Address */
 		(address & 0xffff0000) >> 16, /* wIndex: High Address */
-		buf, len/*wLength*/,
-		1000/*timeout millis*/);
+		(unsigned char*)crcs, count * sizeof(*crcs)/*wLength*/,
+		10000/*timeout millis*/);
+
+	/* TODO: Take care of byte swapping issues in crcs. */
 
 	if (res < 0) {
-		log_libusb("Error requesting data: %s\n", libusb_error_name(res));
+		log_libusb("Error requesting block CRCs: %s\n", libusb_error_name(res));
 		return res;
 	}
 
+	if ((size_t) res != count * sizeof(*crcs))
+		return LIBUSB_ERROR_IO;
+
 	return 0;
 }
 
@@ -212,6 +360,21 @@ static int send_reset(libusb_device_handle *handle)
 }
 
 
+/* Serialize a bulk_record header into buf, which must have room for
+ * sizeof(struct bulk_record) bytes. */
+static void put_bulk_record(unsigned char *buf, uint32_t address,
+                            uint16_t length, uint8_t command)
+{
+	buf[0] = address & 0xff;
+	buf[1] = (address >> 8) & 0xff;
+	buf[2] = (address >> 16) & 0xff;
+	buf[3] = (address >> 24) & 0xff;
+	buf[4] = length & 0xff;
+	buf[5] = (length >> 8) & 0xff;
+	buf[6] = command;
+	buf[7] = 0;
+}
+
 static void print_data(const unsigned char *data, size_t len)
 {
 	size_t i;
@@ -226,252 +389,1533 @@ static void print_data(const unsigned char *data, size_t len)
 	printf("\n");
 }
 
-int bootloader_verify(struct bootloader *bl)
+/* Print a block which failed to verify, and what was expected there. */
+static void report_mismatch(size_t address, const unsigned char *read, const unsigned char *expected, size_t len)
 {
-	struct hex_data_region *region;
-	int res = 0;
+	fprintf(stderr, "Verify Failed on block starting at %lx\n", (unsigned long) address);
 
-	region = bl->hd->regions;
-	while (region) {
-		const unsigned char *ptr = region->data;
-		const unsigned char *endptr = region->data + region->len;
-		size_t address = region->address;
-		unsigned char buf[128]; /* This array size is arbitrary */
-		int skip_regions;
-		int i;
+	printf("Read from device: \n");
+	print_data(read, len);
 
-		if (address >= bl->chip_info.config_words_base &&
-		    address < bl->chip_info.config_words_top) {
-			log("Verify: skipping config words at %lx\n", address);
-			goto end_region_verify;
-		}
+	printf("\nExpected:\n");
+	print_data(expected, len);
+}
 
-		skip_regions = bl->chip_info.number_of_skip_regions;
-		if (skip_regions > MAX_SKIP_REGIONS)
-			skip_regions = MAX_SKIP_REGIONS;
-		for (i = 0; i < skip_regions; i++) {
-			uint32_t skip_base = bl->chip_info.skip_regions[i].base;
-			uint32_t skip_top = bl->chip_info.skip_regions[i].top;
-			if (address >= skip_base &&
-			    address + region->len <  skip_top) {
-				log("Verify: skipping region at %lx\n",
-					address);
-				goto end_region_verify;
-			}
-		}
+/* Asynchronous transfers
+ *
+ * Rows (and, when verifying by reading back, reads) are sent using libusb's
+ * asynchronous API, with up to queue_depth transfers in flight, so that the
+ * device and the bus aren't left idle while the host handles a completion
+ * and prepares the next transfer. The device handles one control transfer
+ * at a time and NAKs bulk data it has no room for, so transfers complete
+ * in the order they were submitted, and the queue depth doesn't need to
+ * match anything on the device.
+ *
+ * When a transfer fails, the transfers behind it are cancelled and the
+ * address of the failing one is reported. The functions below which
+ * return -1 or a libusb error code have already printed the error.
+ */
+static void LIBUSB_CALL xfer_cb(struct libusb_transfer *transfer)
+{
+	struct async_xfer *x = transfer->user_data;
+	x->completed = 1;
+}
 
-		while (ptr < endptr) {
-			size_t len_to_request = MIN(sizeof(buf), endptr-ptr);
+static int transfer_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
 
-			res = request_data(bl->handle, address, buf, len_to_request);
-			if (res < 0) {
-				fprintf(stderr, "Reading data block %lx failed: %s\n", address, libusb_error_name(res));
-				res = -1;
-				goto failure;
-			}
-			
-			if (memcmp(ptr, buf, len_to_request) != 0) {
-				fprintf(stderr, "Verify Failed on block starting at %lx\n", address);
-
-				printf("Read from device: \n");
-				print_data(buf, len_to_request);
-				
-				printf("\nExpected:\n");
-				print_data(ptr, len_to_request);
-				
-				res = -1;
-				goto failure;
-			}
+static struct async_xfer *xfer_at(struct bootloader *bl, int i)
+{
+	return &bl->xfers[(bl->xfer_head + i) % bl->queue_depth];
+}
 
-			ptr += len_to_request;
-			address += len_to_request;
-		}
+static void wait_for_xfer(struct async_xfer *x)
+{
+	while (!x->completed)
+		libusb_handle_events_completed(NULL, &x->completed);
+}
 
-end_region_verify:
-		region = region->next;
+/* Cancel all the transfers in flight, and wait for them to finish. */
+static void cancel_xfers(struct bootloader *bl)
+{
+	int i;
+
+	for (i = 0; i < bl->xfer_count; i++) {
+		if (!xfer_at(bl, i)->completed)
+			libusb_cancel_transfer(xfer_at(bl, i)->transfer);
 	}
 
-failure:
-	return res;
+	for (i = 0; i < bl->xfer_count; i++)
+		wait_for_xfer(xfer_at(bl, i));
+
+	bl->xfer_count = 0;
 }
 
-int bootloader_program(struct bootloader *bl)
+/* Wait for the oldest transfer in flight to complete, and check it. */
+static int complete_oldest_xfer(struct bootloader *bl)
 {
-	struct hex_data_region *region;
-	int res = 0;
+	struct async_xfer *x = xfer_at(bl, 0);
+	struct libusb_transfer *transfer = x->transfer;
+	int res;
 
-	/* Send each memory region to the device */
-	region = bl->hd->regions;
-	while (region) {
-		const unsigned char *ptr = region->data;
-		const unsigned char *endptr = region->data + region->len;
-		size_t address = region->address;
-		int skip_regions;
-		int i;
-		
-		if (address >= bl->chip_info.config_words_base &&
-		    address < bl->chip_info.config_words_top) {
-			log("Program: skipping config words at %lx\n", address);
-			goto end_region;
-		}
-
-		skip_regions = bl->chip_info.number_of_skip_regions;
-		if (skip_regions > MAX_SKIP_REGIONS)
-			skip_regions = MAX_SKIP_REGIONS;
-		for (i = 0; i < skip_regions; i++) {
-			uint32_t skip_base = bl->chip_info.skip_regions[i].base;
-			uint32_t skip_top = bl->chip_info.skip_regions[i].top;
-			if (address >= skip_base &&
-			    address + region->len <  skip_top) {
-				log("Program: skipping region at %lx\n",
-					address);
-				goto end_region;
-			}
-		}
+	wait_for_xfer(x);
+	bl->xfer_head = (bl->xfer_head + 1) % bl->queue_depth;
+	bl->xfer_count--;
 
+	res = transfer_error(transfer->status);
+	if (res == 0 && (size_t) transfer->actual_length != x->len)
+		res = LIBUSB_ERROR_IO; /* Short transfer */
 
-		/* If the data isn't aligned to a row, add some extra padding
-		 * bytes (0xff) to the beginning of the first packet so that
-		 * all the packets align. */
-		if (address & (bl->bytes_per_row-1)) {
-			unsigned char *buf;
-			size_t data_bytes_to_send;
-			size_t total_bytes_to_send;
-			size_t bytes_to_add;
-			
-			bytes_to_add = address & (bl->bytes_per_row-1);
-			address -= bytes_to_add;
-			total_bytes_to_send = MIN(region->len + bytes_to_add,
-			                          bl->bytes_per_row);
-			data_bytes_to_send = MIN(region->len,
-			                         bl->bytes_per_row - bytes_to_add);
-			buf = malloc(total_bytes_to_send);
-			memset(buf, 0xff, total_bytes_to_send);
-			memcpy(buf+bytes_to_add, region->data, data_bytes_to_send);
-
-			log("Padding block at %lx down to %lx\n", region->address, address);
-			res = send_data(bl->handle, address, buf, total_bytes_to_send);
-			if (res < 0) {
-				log_libusb("Sending data block %lx failed: %s\n", region->address, libusb_error_name(res));
-				res = -1;
-				goto failure;
-			}
+	if (res < 0) {
+		fprintf(stderr, "Transfer for %lx failed: %s\n",
+		        (unsigned long) x->address, libusb_error_name(res));
+		cancel_xfers(bl);
+
+		/* The device halts the bulk OUT endpoint when it rejects
+		 * a record. Clear it so the device can be used again, but
+		 * still report the failure. */
+		if (res == LIBUSB_ERROR_PIPE && transfer->endpoint != 0)
+			libusb_clear_halt(bl->handle, transfer->endpoint);
+		return res;
+	}
 
-			ptr += data_bytes_to_send;
-			address += total_bytes_to_send;
+	if (x->expected && memcmp(x->data, x->expected, x->len) != 0) {
+		report_mismatch(x->address, x->data, x->expected, x->len);
+		cancel_xfers(bl);
+		return -1;
+	}
 
-			free(buf);
-		}
+	return 0;
+}
 
-		while (ptr < endptr) {
-			size_t len_to_send = MIN(bl->bytes_per_row, endptr-ptr);
+/* Wait for all the transfers in flight to complete. */
+static int complete_xfers(struct bootloader *bl)
+{
+	int res;
 
-			res = send_data(bl->handle, address, ptr, len_to_send);
-			if (res < 0) {
-				log_libusb("Sending data block %lx failed: %s\n", address, libusb_error_name(res));
-				res = -1;
-				goto failure;
-			}
+	while (bl->xfer_count > 0) {
+		res = complete_oldest_xfer(bl);
+		if (res < 0)
+			return res;
+	}
 
-			ptr += len_to_send;
-			address += len_to_send;
-		}
+	return 0;
+}
 
-end_region:
-		region = region->next;
+/* Get a free transfer slot, waiting for the oldest transfer in flight to
+ * complete if there isn't one. */
+static int get_xfer(struct bootloader *bl, struct async_xfer **x)
+{
+	int res;
+
+	if (bl->xfer_count == bl->queue_depth) {
+		res = complete_oldest_xfer(bl);
+		if (res < 0)
+			return res;
 	}
 
-failure:
-	return res;
+	*x = xfer_at(bl, bl->xfer_count);
+	(*x)->completed = 0;
+	(*x)->expected = NULL;
+
+	return 0;
 }
 
-int bootloader_erase(struct bootloader *bl)
+static int submit_xfer(struct bootloader *bl, struct async_xfer *x)
 {
-	return clear_flash(bl->handle);
+	int res;
+
+	res = libusb_submit_transfer(x->transfer);
+	if (res < 0) {
+		fprintf(stderr, "Transfer for %lx failed: %s\n",
+		        (unsigned long) x->address, libusb_error_name(res));
+		cancel_xfers(bl);
+		return res;
+	}
+
+	bl->xfer_count++;
+	return 0;
 }
 
-int bootloader_reset(struct bootloader *bl)
+/* Queue a vendor request for len bytes at address. For OUT requests, data
+ * is sent. For IN requests, the data received is compared to data. */
+static int queue_control(struct bootloader *bl, uint8_t direction, uint8_t request, size_t address, const unsigned char *data, size_t len)
 {
-	return send_reset(bl->handle);
+	struct async_xfer *x;
+	int res;
+
+	res = get_xfer(bl, &x);
+	if (res < 0)
+		return res;
+
+	libusb_fill_control_setup(x->buf,
+		direction|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		request /* bRequest */,
+		address & 0xffff, /* wValue: Low Address */
+		(address & 0xffff0000) >> 16, /* wIndex: High Address */
+		len /*wLength*/);
+	libusb_fill_control_transfer(x->transfer, bl->handle, x->buf,
+		xfer_cb, x, 1000/*timeout millis*/);
+
+	x->data = x->buf + LIBUSB_CONTROL_SETUP_SIZE;
+	x->address = address;
+	x->len = len;
+	if (direction == LIBUSB_ENDPOINT_OUT)
+		memcpy(x->data, data, len);
+	else
+		x->expected = data;
+
+	return submit_xfer(bl, x);
 }
 
-int bootloader_init(struct bootloader **bootl, const char *filename, uint16_t vid, uint16_t pid)
+/* Queue a bulk transfer of len bytes, for flash starting at address. On
+ * the OUT endpoint, data is sent. On the IN endpoint, the data received is
+ * compared to data. */
+static int queue_bulk(struct bootloader *bl, unsigned char endpoint, size_t address, const unsigned char *data, size_t len)
 {
-	struct bootloader *bl;
-	struct hex_data_region *region;
-	int libusb_return;
-	int res = 0;
-	
-	*bootl = calloc(1, sizeof(struct bootloader));
-	bl = *bootl; /* Convenience pointer */
+	struct async_xfer *x;
+	int res;
 
-	/* Load the Hex file */
-	if (filename) {
-		res = hex_load(filename, &bl->hd);
+	res = get_xfer(bl, &x);
+	if (res < 0)
+		return res;
 
-		if (res < 0) {
-			fprintf(stderr, "Unable to load hex file. Error: %d\n", res);
-			return BOOTLOADER_CANT_OPEN_FILE;
-		}
-	}
-	else {
-		/* No filename, so load up an empty structure. */
-		hex_init_empty(&bl->hd);
-	}
+	libusb_fill_bulk_transfer(x->transfer, bl->handle, endpoint,
+		x->buf, len, xfer_cb, x, 5000/*timeout millis*/);
 
-	log("Hex file regions:\n");
-	region = bl->hd->regions;
-	while (region) {
-		log("  Data Region at %08lx for %4lx bytes (hex)\n", region->address, region->len);
-		region = region->next;
-	}
-	
-	/* Init Libusb */
-	if (libusb_init(NULL)) {
-		res = BOOTLOADER_CANT_OPEN_DEVICE;
-		goto free_hex;
-	}
+	x->data = x->buf;
+	x->address = address;
+	x->len = len;
+	if (endpoint == BULK_OUT_ENDPOINT)
+		memcpy(x->data, data, len);
+	else
+		x->expected = data;
 
-	res = open_device(bl, vid, pid, &libusb_return);
-	if (res < 0) {
-		if (libusb_return < 0) {
-			fprintf(stderr, "libusb_open() failed: %s\n", libusb_error_name(libusb_return));
-		}
-		goto free_hex;
-	}
+	return submit_xfer(bl, x);
+}
 
-	res = libusb_claim_interface(bl->handle, 0);
-	if (res < 0) {
-		res = BOOTLOADER_CANT_OPEN_DEVICE;
-		goto free_usb;
+static void free_xfers(struct bootloader *bl)
+{
+	int i;
+
+	if (!bl->xfers)
+		return;
+
+	for (i = 0; i < bl->queue_depth; i++) {
+		libusb_free_transfer(bl->xfers[i].transfer);
+		free(bl->xfers[i].buf);
 	}
+	free(bl->xfers);
+	bl->xfers = NULL;
+}
 
-	res = get_chip_info(bl->handle, &bl->chip_info);
-	if (res < 0) {
-		fprintf(stderr, "Can't get chip info\n");
-		res = BOOTLOADER_CANT_QUERY_DEVICE;
-		goto free_usb;
+static int alloc_xfers(struct bootloader *bl, int queue_depth)
+{
+	int i;
+
+	bl->xfers = calloc(queue_depth, sizeof(*bl->xfers));
+	if (!bl->xfers)
+		return -1;
+	bl->queue_depth = queue_depth;
+	bl->xfer_head = 0;
+	bl->xfer_count = 0;
+
+	for (i = 0; i < queue_depth; i++) {
+		bl->xfers[i].transfer = libusb_alloc_transfer(0);
+		bl->xfers[i].buf = malloc(XFER_BUFFER_SIZE);
+		if (!bl->xfers[i].transfer || !bl->xfers[i].buf) {
+			free_xfers(bl);
+			return -1;
+		}
 	}
 
-	bl->bytes_per_row = bl->chip_info.bytes_per_instruction *
-	                    bl->chip_info.instructions_per_row;
+	return 0;
+}
 
-	log("Queried MCU to find:\n");
-	log("  bytes per inst: %d\n  inst per row %d\n",
-	       bl->chip_info.bytes_per_instruction,
-	       bl->chip_info.instructions_per_row);
+int bootloader_set_compression(struct bootloader *bl, int enable)
+{
+	if (enable && !bl->lz_buf)
+		return BOOTLOADER_NOT_SUPPORTED;
 
+	bl->use_compression = enable;
 	return 0;
+}
 
-free_usb:
-	libusb_close(bl->handle);
-free_hex:
-	hex_free(bl->hd);
-	return res;
+void bootloader_get_transfer_stats(struct bootloader *bl, size_t *data_bytes, size_t *sent_bytes)
+{
+	*data_bytes = bl->data_bytes;
+	*sent_bytes = bl->sent_bytes;
 }
 
-void bootloader_free(struct bootloader *bl)
+int bootloader_set_queue_depth(struct bootloader *bl, int queue_depth)
 {
-	libusb_close(bl->handle);
-	hex_free(bl->hd);
+	if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH)
+		return BOOTLOADER_ERROR;
+
+	free_xfers(bl);
+	return alloc_xfers(bl, queue_depth);
+}
+
+static int bulk_transfer(struct bootloader *bl, unsigned char endpoint,
+                         unsigned char *buf, size_t len)
+{
+	int res;
+	int transferred;
+
+	res = libusb_bulk_transfer(bl->handle, endpoint, buf, len,
+	                           &transferred, 5000/*timeout millis*/);
+	if (res == LIBUSB_ERROR_PIPE) {
+		/* The device halts the endpoint when it rejects a record.
+		 * Clear it so the device can be used again, but still
+		 * report the failure. */
+		libusb_clear_halt(bl->handle, endpoint);
+	}
+
+	if (res < 0) {
+		log_libusb("Error in bulk transfer : %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	if ((size_t) transferred != len) {
+		log_libusb("Short bulk transfer: %d of %lu bytes\n",
+		           transferred, (unsigned long) len);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return 0;
+}
+
+/* Send any pending bulk records to the device */
+static int bulk_flush(struct bootloader *bl)
+{
+	int res;
+
+	if (bl->bulk_len == 0)
+		return 0;
+
+	res = queue_bulk(bl, BULK_OUT_ENDPOINT, bl->bulk_address,
+	                 bl->bulk_buf, bl->bulk_len);
+	bl->bulk_len = 0;
+
+	return res;
+}
+
+/* Add a bulk record, sending the pending records to the device first if
+ * there isn't room for it. */
+static int bulk_put(struct bootloader *bl, size_t address, const unsigned char *buf, size_t len, uint8_t command)
+{
+	int res;
+
+	if (bl->bulk_len + sizeof(struct bulk_record) + len > BULK_BUFFER_SIZE) {
+		res = bulk_flush(bl);
+		if (res < 0)
+			return res;
+	}
+
+	if (bl->bulk_len == 0)
+		bl->bulk_address = address;
+
+	put_bulk_record(bl->bulk_buf + bl->bulk_len, address, len, command);
+	bl->bulk_len += sizeof(struct bulk_record);
+	if (command != BULK_READ) {
+		memcpy(bl->bulk_buf + bl->bulk_len, buf, len);
+		bl->bulk_len += len;
+	}
+
+	return 0;
+}
+
+/* Send everything pending, and wait for it to complete */
+static int flush_xfers(struct bootloader *bl)
+{
+	int res;
+
+	res = bulk_flush(bl);
+	if (res < 0)
+		return res;
+
+	return complete_xfers(bl);
+}
+
+/* Abandon everything pending after a failure */
+static void abort_xfers(struct bootloader *bl)
+{
+	cancel_xfers(bl);
+	bl->bulk_len = 0;
+}
+
+/* Return whether len bytes at address are in the user region, which is
+ * all that BULK_READ and the CRC requests can reach. */
+static bool in_user_region(struct bootloader *bl, size_t address, size_t len)
+{
+	return address >= bl->chip_info.user_region_base &&
+	       address + len <= bl->chip_info.user_region_top;
+}
+
+/* Read len bytes at address synchronously, after everything pending. */
+static int read_data(struct bootloader *bl, size_t address, unsigned char *buf, size_t len)
+{
+	unsigned char header[sizeof(struct bulk_record)];
+	int res;
+
+	res = flush_xfers(bl);
+	if (res < 0)
+		return res;
+
+	if (!bl->use_bulk || !in_user_region(bl, address, len))
+		return request_data(bl->handle, address, buf, len);
+
+	put_bulk_record(header, address, len, BULK_READ);
+	res = bulk_transfer(bl, BULK_OUT_ENDPOINT, header, sizeof(header));
+	if (res < 0)
+		return res;
+
+	return bulk_transfer(bl, BULK_IN_ENDPOINT, buf, len);
+}
+
+static uint32_t lz_hash(const unsigned char *p)
+{
+	uint32_t v = (uint32_t) p[0] << 16 | p[1] << 8 | p[2];
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Length of the match between the bytes at from and those at pos, which
+ * is after from, up to max bytes. */
+static size_t lz_match_len(const unsigned char *buf, size_t from, size_t pos, size_t max)
+{
+	size_t len = 0;
+
+	while (len < max && buf[from + len] == buf[pos + len])
+		len++;
+
+	return len;
+}
+
+/* Add literal tokens for n bytes at lit to out. Return false if they
+ * don't fit in out_len bytes. */
+static bool lz_put_literals(const unsigned char *lit, size_t n, unsigned char *out, size_t *pos, size_t out_len)
+{
+	while (n > 0) {
+		size_t chunk = MIN(n, BL_LZ_MAX_LITERALS);
+
+		if (*pos + 1 + chunk > out_len)
+			return false;
+		out[(*pos)++] = chunk - 1;
+		memcpy(out + *pos, lit, chunk);
+		*pos += chunk;
+		lit += chunk;
+		n -= chunk;
+	}
+
+	return true;
+}
+
+/* Compress a row for a BULK_WRITE_LZ record (see bootloader_protocol.h).
+ * Matches are found greedily, from a hash table of the last position each
+ * three bytes were seen at and from the byte before, which catches runs
+ * such as the 0xff of unused flash. Return the compressed length, or 0 if
+ * it doesn't fit in out_len bytes. */
+static size_t lz_compress(const unsigned char *in, size_t len, unsigned char *out, size_t out_len)
+{
+	long head[1 << LZ_HASH_BITS];
+	size_t pos = 0;
+	size_t lit_start = 0;
+	size_t out_pos = 0;
+	int i;
+
+	for (i = 0; i < (1 << LZ_HASH_BITS); i++)
+		head[i] = -1;
+
+	while (pos < len) {
+		size_t best_len = 0;
+		size_t best_dist = 0;
+
+		if (len - pos >= BL_LZ_MIN_MATCH) {
+			size_t max = MIN(len - pos, BL_LZ_MAX_MATCH);
+			uint32_t h = lz_hash(in + pos);
+			long candidate = head[h];
+			size_t match_len;
+
+			head[h] = pos;
+			if (candidate >= 0) {
+				best_len = lz_match_len(in, candidate, pos, max);
+				best_dist = pos - candidate;
+			}
+			if (pos > 0) {
+				match_len = lz_match_len(in, pos - 1, pos, max);
+				if (match_len > best_len) {
+					best_len = match_len;
+					best_dist = 1;
+				}
+			}
+		}
+
+		if (best_len < BL_LZ_MIN_MATCH) {
+			pos++;
+			continue;
+		}
+
+		if (!lz_put_literals(in + lit_start, pos - lit_start, out, &out_pos, out_len))
+			return 0;
+		if (out_pos + 3 > out_len)
+			return 0;
+		out[out_pos++] = 0x80 | (best_len - BL_LZ_MIN_MATCH);
+		out[out_pos++] = (best_dist - 1) & 0xff;
+		out[out_pos++] = (best_dist - 1) >> 8;
+
+		pos += best_len;
+		lit_start = pos;
+	}
+
+	if (!lz_put_literals(in + lit_start, pos - lit_start, out, &out_pos, out_len))
+		return 0;
+
+	return out_pos;
+}
+
+/* Queue the write of a single row, using the bulk data path if the device
+ * supports it, and compressing the row if that makes it smaller. The row
+ * is sent later, by flush_xfers() at the latest. */
+static int write_row(struct bootloader *bl, size_t address, const unsigned char *buf, size_t len)
+{
+	bl->data_bytes += len;
+
+	if (bl->use_compression && len > 1) {
+		size_t compressed = lz_compress(buf, len, bl->lz_buf, len - 1);
+		if (compressed > 0) {
+			bl->sent_bytes += compressed;
+			return bulk_put(bl, address, bl->lz_buf, compressed,
+			                BULK_WRITE_LZ);
+		}
+	}
+
+	bl->sent_bytes += len;
+	if (bl->use_bulk)
+		return bulk_put(bl, address, buf, len, BULK_WRITE);
+	else
+		return queue_control(bl, LIBUSB_ENDPOINT_OUT, SEND_DATA,
+		                     address, buf, len);
+}
+
+/* Queue a read of len bytes at address, to be compared to expected when
+ * it completes. */
+static int queue_verify(struct bootloader *bl, size_t address, const unsigned char *expected, size_t len)
+{
+	int res;
+
+	if (!bl->use_bulk || !in_user_region(bl, address, len))
+		return queue_control(bl, LIBUSB_ENDPOINT_IN, REQUEST_DATA,
+		                     address, expected, len);
+
+	res = bulk_put(bl, address, NULL, len, BULK_READ);
+	if (res == 0)
+		res = bulk_flush(bl);
+	if (res < 0)
+		return res;
+
+	return queue_bulk(bl, BULK_IN_ENDPOINT, address, expected, len);
+}
+
+/* Read back len bytes at address and compare them to data, printing both
+ * if they differ. Return 0 if they match, -1 if they don't, or a libusb
+ * error code. */
+static int verify_block(struct bootloader *bl, size_t address, const unsigned char *data, size_t len)
+{
+	unsigned char buf[BULK_READ_SIZE];
+	int res;
+
+	res = read_data(bl, address, buf, len);
+	if (res < 0) {
+		fprintf(stderr, "Reading data block %lx failed: %s\n", (unsigned long) address, libusb_error_name(res));
+		return res;
+	}
+
+	if (memcmp(data, buf, len) != 0) {
+		report_mismatch(address, buf, data, len);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Return 1 if the device's CRC of len bytes at address matches data, 0 if
+ * it doesn't, or a libusb error code. The device computes at most
+ * MAX_CRC_LENGTH bytes per request, so longer ranges are split. */
+static int crc_matches(struct bootloader *bl, size_t address, const unsigned char *data, size_t len)
+{
+	while (len > 0) {
+		size_t n = MIN(len, MAX_CRC_LENGTH);
+		uint32_t crc;
+		int res;
+
+		res = get_crc(bl->handle, address, n, &crc);
+		if (res < 0) {
+			fprintf(stderr, "Getting CRC of %lx failed: %s\n", (unsigned long) address, libusb_error_name(res));
+			return res;
+		}
+
+		if (crc != bl_crc32(0, data, n))
+			return 0;
+
+		address += n;
+		data += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/* Locate a mismatch somewhere in len bytes at address by bisecting with
+ * CRCs, and dump the block which contains it. Only that block is read
+ * back. */
+static int find_mismatch(struct bootloader *bl, size_t address, const unsigned char *data, size_t len, size_t read_size)
+{
+	int res;
+
+	while (len > read_size) {
+		size_t half = len / 2;
+
+		res = crc_matches(bl, address, data, half);
+		if (res < 0)
+			return res;
+
+		if (res) {
+			/* The first half matches; the problem is in the
+			 * second half. */
+			address += half;
+			data += half;
+			len -= half;
+		}
+		else {
+			len = half;
+		}
+	}
+
+	res = verify_block(bl, address, data, len);
+	if (res == 0) {
+		/* The flash changed while bisecting. */
+		fprintf(stderr, "Verify Failed near %lx\n", (unsigned long) address);
+		res = -1;
+	}
+
+	return res;
+}
+
+/* Return whether a hex region is not to be programmed or verified, because
+ * it is in the config words or in one of the device's skip regions. */
+static bool region_is_skipped(struct bootloader *bl, const struct hex_data_region *region)
+{
+	size_t address = region->address;
+	int skip_regions;
+	int i;
+
+	if (address >= bl->chip_info.config_words_base &&
+	    address < bl->chip_info.config_words_top) {
+		log("Skipping config words at %lx\n", (unsigned long) address);
+		return true;
+	}
+
+	skip_regions = bl->chip_info.number_of_skip_regions;
+	if (skip_regions > MAX_SKIP_REGIONS)
+		skip_regions = MAX_SKIP_REGIONS;
+	for (i = 0; i < skip_regions; i++) {
+		uint32_t skip_base = bl->chip_info.skip_regions[i].base;
+		uint32_t skip_top = bl->chip_info.skip_regions[i].top;
+		if (address >= skip_base &&
+		    address + region->len <  skip_top) {
+			log("Skipping region at %lx\n", (unsigned long) address);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int bootloader_verify(struct bootloader *bl)
+{
+	struct hex_data_region *region;
+	int res = 0;
+
+	region = bl->image->regions;
+	while (region) {
+		const unsigned char *ptr = region->data;
+		const unsigned char *endptr = region->data + region->len;
+		size_t address = region->address;
+		bool bulk = bl->use_bulk &&
+		            in_user_region(bl, address, region->len);
+		size_t read_size = bulk? BULK_READ_SIZE:
+		                   128; /* This size is arbitrary */
+
+		/* With device-side CRC, check the whole region at once, and
+		 * only read anything back to diagnose a mismatch. The device
+		 * only computes CRCs within the user region. */
+		if ((bl->chip_info.capabilities & BOOTLOADER_CAP_CRC) &&
+		    in_user_region(bl, address, region->len)) {
+			res = crc_matches(bl, address, ptr, region->len);
+			if (res == 0) {
+				fprintf(stderr, "Verify Failed on region starting at %lx\n", (unsigned long) address);
+				find_mismatch(bl, address, ptr, region->len, read_size);
+			}
+			if (res <= 0) {
+				res = -1;
+				goto failure;
+			}
+
+			res = 0;
+			goto end_region_verify;
+		}
+
+		while (ptr < endptr) {
+			size_t len_to_request = MIN(read_size, (size_t) (endptr-ptr));
+
+			res = queue_verify(bl, address, ptr, len_to_request);
+			if (res < 0) {
+				res = -1;
+				goto failure;
+			}
+
+			ptr += len_to_request;
+			address += len_to_request;
+		}
+
+end_region_verify:
+		region = region->next;
+	}
+
+	res = flush_xfers(bl);
+	if (res < 0)
+		res = -1;
+
+failure:
+	abort_xfers(bl);
+	return res;
+}
+
+/* Send any queued rows, and find out whether they have all been written to
+ * flash successfully. */
+static int finish_writes(struct bootloader *bl)
+{
+	int res;
+
+	res = flush_xfers(bl);
+	if (res < 0)
+		return -1;
+
+	/* Rows are written to flash after the device has acknowledged them,
+	 * so failures are only known once the device has been asked. */
+	if (bl->chip_info.capabilities & BOOTLOADER_CAP_WRITE_STATUS) {
+		struct write_status status;
+
+		res = get_write_status(bl->handle, &status);
+		if (res < 0)
+			return -1;
+
+		if (status.error == WRITE_STATUS_BAD_RECORD) {
+			fprintf(stderr, "Device rejected data at %x\n",
+			        status.error_address);
+			return -1;
+		}
+		else if (status.error != WRITE_STATUS_OK) {
+			fprintf(stderr, "Programming flash failed at %x\n",
+			        status.error_address);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int bootloader_program(struct bootloader *bl)
+{
+	struct hex_data_region *region;
+	int res = 0;
+
+	/* Send each memory region to the device. The regions of the image
+	 * are whole rows (see prepare_image()). */
+	region = bl->image->regions;
+	while (region) {
+		const unsigned char *ptr = region->data;
+		const unsigned char *endptr = region->data + region->len;
+		size_t address = region->address;
+
+		while (ptr < endptr) {
+			size_t len_to_send = MIN(bl->bytes_per_row, endptr-ptr);
+
+			res = write_row(bl, address, ptr, len_to_send);
+			if (res < 0) {
+				res = -1;
+				goto failure;
+			}
+
+			ptr += len_to_send;
+			address += len_to_send;
+		}
+
+		region = region->next;
+	}
+
+	res = finish_writes(bl);
+
+failure:
+	abort_xfers(bl);
+	return res;
+}
+
+/* Build the expected contents of the user region from the image, with
+ * everything not in the image erased. Return NULL if there is data
+ * which can't be programmed. */
+static unsigned char *build_user_image(struct bootloader *bl)
+{
+	struct hex_data_region *region;
+	size_t base = bl->chip_info.user_region_base;
+	size_t top = bl->chip_info.user_region_top;
+	unsigned char *image;
+	size_t i;
+
+	image = malloc(top - base);
+	if (!image)
+		return NULL;
+
+	memset(image, 0xff, top - base);
+	if (bl->chip_info.capabilities & BOOTLOADER_CAP_PHANTOM_BYTE) {
+		for (i = bl->chip_info.bytes_per_instruction - 1;
+		     i < top - base;
+		     i += bl->chip_info.bytes_per_instruction)
+			image[i] = 0x00;
+	}
+
+	region = bl->image->regions;
+	while (region) {
+		if (region->address < base ||
+		    region->address + region->len > top) {
+			fprintf(stderr, "Data at %lx is outside the user region\n",
+			        (unsigned long) region->address);
+			free(image);
+			return NULL;
+		}
+
+		memcpy(image + region->address - base,
+		       region->data, region->len);
+		region = region->next;
+	}
+
+	return image;
+}
+
+int bootloader_program_incremental(struct bootloader *bl)
+{
+	size_t base = bl->chip_info.user_region_base;
+	size_t top = bl->chip_info.user_region_top;
+	size_t block_size = bl->chip_info.flash_block_size;
+	size_t num_blocks, changed_blocks = 0;
+	size_t blocks_per_request;
+	unsigned char *image;
+	unsigned char *erased_row;
+	size_t block;
+	int res = 0;
+
+	if (!(bl->chip_info.capabilities & BOOTLOADER_CAP_ERASE_RANGE) ||
+	    !(bl->chip_info.capabilities & BOOTLOADER_CAP_CRC) ||
+	    block_size == 0 || (top - base) % block_size != 0) {
+		return BOOTLOADER_NOT_SUPPORTED;
+	}
+
+	image = build_user_image(bl);
+	if (!image)
+		return -1;
+
+	/* A row which reads as erased doesn't need to be written. */
+	erased_row = malloc(bl->bytes_per_row);
+	if (!erased_row) {
+		free(image);
+		return -1;
+	}
+	memset(erased_row, 0xff, bl->bytes_per_row);
+	if (bl->chip_info.capabilities & BOOTLOADER_CAP_PHANTOM_BYTE) {
+		size_t i;
+		for (i = bl->chip_info.bytes_per_instruction - 1;
+		     i < (size_t) bl->bytes_per_row;
+		     i += bl->chip_info.bytes_per_instruction)
+			erased_row[i] = 0x00;
+	}
+
+	/* The device computes at most MAX_CRC_LENGTH bytes of CRCs per
+	 * request, but always at least one block. */
+	blocks_per_request = MIN(MAX_BLOCK_CRCS, MAX_CRC_LENGTH / block_size);
+	if (blocks_per_request == 0)
+		blocks_per_request = 1;
+
+	num_blocks = (top - base) / block_size;
+	for (block = 0; block < num_blocks; block += blocks_per_request) {
+		uint32_t crcs[MAX_BLOCK_CRCS];
+		size_t count = MIN(blocks_per_request, num_blocks - block);
+		size_t i;
+
+		res = get_block_crcs(bl->handle, base + block * block_size,
+		                     crcs, count);
+		if (res < 0) {
+			res = -1;
+			goto failure;
+		}
+
+		for (i = 0; i < count; i++) {
+			size_t address = base + (block + i) * block_size;
+			const unsigned char *ptr = image + address - base;
+			size_t offset;
+
+			if (crcs[i] == bl_crc32(0, ptr, block_size))
+				continue;
+
+			changed_blocks++;
+			log("Program: block at %lx changed\n", (unsigned long) address);
+
+			/* Rows already queued must reach the device before
+			 * the erase. */
+			res = flush_xfers(bl);
+			if (res < 0) {
+				res = -1;
+				goto failure;
+			}
+
+			res = erase_range(bl->handle, address, block_size);
+			if (res < 0) {
+				fprintf(stderr, "Erasing block %lx failed: %s\n", (unsigned long) address, libusb_error_name(res));
+				res = -1;
+				goto failure;
+			}
+
+			for (offset = 0; offset < block_size; offset += bl->bytes_per_row) {
+				if (!memcmp(ptr + offset, erased_row, bl->bytes_per_row))
+					continue;
+
+				res = write_row(bl, address + offset, ptr + offset, bl->bytes_per_row);
+				if (res < 0) {
+					res = -1;
+					goto failure;
+				}
+			}
+		}
+	}
+
+	res = finish_writes(bl);
+	if (res == 0)
+		printf("%lu of %lu flash blocks changed\n",
+		       (unsigned long) changed_blocks,
+		       (unsigned long) num_blocks);
+
+failure:
+	abort_xfers(bl);
+	free(erased_row);
+	free(image);
+	return res;
+}
+
+int bootloader_erase(struct bootloader *bl)
+{
+	return clear_flash(bl->handle);
+}
+
+int bootloader_erase_used(struct bootloader *bl)
+{
+	struct hex_data_region *region;
+	size_t base = bl->chip_info.user_region_base;
+	size_t top = bl->chip_info.user_region_top;
+	size_t block_size = bl->chip_info.flash_block_size;
+	size_t num_blocks, erased_blocks = 0;
+	bool *used;
+	size_t block;
+	int res = 0;
+
+	if (!(bl->chip_info.capabilities & BOOTLOADER_CAP_ERASE_RANGE) ||
+	    block_size == 0 || (top - base) % block_size != 0)
+		return BOOTLOADER_NOT_SUPPORTED;
+
+	num_blocks = (top - base) / block_size;
+	used = calloc(num_blocks, sizeof(*used));
+	if (!used)
+		return -1;
+
+	/* Mark each block which contains data to be programmed. Data
+	 * outside the user region isn't programmed, so doesn't need any
+	 * block erased. */
+	region = bl->image->regions;
+	while (region) {
+		size_t start = MAX(region->address, base);
+		size_t end = MIN(region->address + region->len, top);
+
+		if (start < end) {
+			for (block = (start - base) / block_size;
+			     block <= (end - 1 - base) / block_size;
+			     block++)
+				used[block] = true;
+		}
+
+		region = region->next;
+	}
+
+	/* Erase runs of consecutive used blocks */
+	block = 0;
+	while (block < num_blocks) {
+		size_t count = 0;
+
+		if (!used[block]) {
+			block++;
+			continue;
+		}
+
+		while (block + count < num_blocks && used[block + count] &&
+		       count < MAX_BLOCKS_PER_ERASE)
+			count++;
+
+		log("Erase: %lu blocks at %lx\n", (unsigned long) count,
+		    (unsigned long) (base + block * block_size));
+		res = erase_range(bl->handle, base + block * block_size,
+		                  count * block_size);
+		if (res < 0) {
+			fprintf(stderr, "Erasing blocks at %lx failed: %s\n", (unsigned long) (base + block * block_size), libusb_error_name(res));
+			res = -1;
+			goto out;
+		}
+
+		erased_blocks += count;
+		block += count;
+	}
+
+	log("Erased %lu of %lu blocks\n", (unsigned long) erased_blocks,
+	    (unsigned long) num_blocks);
+
+out:
+	free(used);
+	return res;
+}
+
+int bootloader_reset(struct bootloader *bl)
+{
+	return send_reset(bl->handle);
+}
+
+/* Format the bus/port path of a device the way Linux does, such as
+ * "1-4.2" for port 2 of the hub on port 4 of bus 1. */
+static void get_device_path(libusb_device *dev, char *path, size_t len)
+{
+	uint8_t ports[7];
+	int num_ports;
+	int i;
+	size_t pos;
+
+	pos = snprintf(path, len, "%d", libusb_get_bus_number(dev));
+
+	num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < num_ports && pos < len; i++) {
+		pos += snprintf(path + pos, len - pos, "%c%d",
+		                (i == 0)? '-': '.', ports[i]);
+	}
+}
+
+/* A firmware file, read once for any number of devices */
+struct loaded_file {
+	const struct bootloader_file *file;
+	char *buf;           /* Contents of the file */
+	size_t size;
+	uint64_t hash;       /* Of the contents, format and base address */
+	struct hex_data *hd; /* Parsed, once a device needs it */
+};
+
+static int read_file(const struct bootloader_file *file, struct loaded_file *lf)
+{
+	int res;
+
+	memset(lf, 0, sizeof(*lf));
+	lf->file = file;
+	if (!file || !file->filename)
+		return 0;
+
+	res = hex_read_file(file->filename, &lf->buf, &lf->size);
+	if (res < 0) {
+		fprintf(stderr, "Unable to read %s. Error: %d\n", file->filename, res);
+		return BOOTLOADER_CANT_OPEN_FILE;
+	}
+
+	lf->hash = image_hash(IMAGE_HASH_INIT, lf->buf, lf->size);
+	lf->hash = image_hash(lf->hash, &file->format, sizeof(file->format));
+	lf->hash = image_hash(lf->hash, &file->base_address, sizeof(file->base_address));
+
+	return 0;
+}
+
+static void free_file(struct loaded_file *lf)
+{
+	free(lf->buf);
+	if (lf->hd)
+		hex_free(lf->hd);
+}
+
+/* Hash the file together with everything about the device's flash which
+ * prepare_image() depends on, so that devices (and cache files) with the
+ * same key have the same image. */
+static uint64_t image_key(struct bootloader *bl, const struct loaded_file *lf)
+{
+	const struct chip_info *info = &bl->chip_info;
+	uint64_t key = lf->hash;
+	uint8_t phantom = (info->capabilities & BOOTLOADER_CAP_PHANTOM_BYTE)? 1: 0;
+	int skip_regions = MIN(info->number_of_skip_regions, MAX_SKIP_REGIONS);
+	int i;
+
+	key = image_hash(key, &bl->bytes_per_row, sizeof(bl->bytes_per_row));
+	key = image_hash(key, &info->bytes_per_instruction, sizeof(info->bytes_per_instruction));
+	key = image_hash(key, &phantom, sizeof(phantom));
+	key = image_hash(key, &info->config_words_base, sizeof(info->config_words_base));
+	key = image_hash(key, &info->config_words_top, sizeof(info->config_words_top));
+	for (i = 0; i < skip_regions; i++) {
+		key = image_hash(key, &info->skip_regions[i].base, sizeof(info->skip_regions[i].base));
+		key = image_hash(key, &info->skip_regions[i].top, sizeof(info->skip_regions[i].top));
+	}
+
+	return key;
+}
+
+/* Prepare the data from the file for programming: leave out the regions
+ * which aren't programmed, and extend the rest to whole rows, padded the
+ * way erased flash reads, merging the regions which share a row. The
+ * program, verify and erase operations then only deal in whole rows. */
+static int prepare_image(struct bootloader *bl, const struct hex_data *hd, struct hex_data **image_out)
+{
+	const struct hex_data_region *region;
+	struct hex_extent *extents = NULL;
+	struct hex_extent *e;
+	struct hex_data *image = NULL;
+	unsigned char *data = NULL;
+	bool *skipped = NULL;
+	size_t row_mask = bl->bytes_per_row - 1;
+	size_t num_regions = 0;
+	size_t count = 0;
+	size_t data_len = 0;
+	size_t i;
+	int res;
+
+	for (region = hd->regions; region; region = region->next)
+		num_regions++;
+
+	extents = malloc((num_regions + 1) * sizeof(*extents));
+	skipped = malloc((num_regions + 1) * sizeof(*skipped));
+	hex_init_empty(&image);
+	if (!extents || !skipped || !image)
+		goto failure;
+
+	/* Work out the rows covered. The regions are in address order, so
+	 * a region can only share a row with the one before it. */
+	for (region = hd->regions, i = 0; region; region = region->next, i++) {
+		size_t start = region->address & ~row_mask;
+		size_t end = (region->address + region->len + row_mask) & ~row_mask;
+
+		skipped[i] = region_is_skipped(bl, region);
+		if (skipped[i])
+			continue;
+
+		if (count > 0) {
+			e = &extents[count - 1];
+			if (start <= e->address + e->len) {
+				data_len += end - (e->address + e->len);
+				e->len = end - e->address;
+				continue;
+			}
+		}
+
+		e = &extents[count++];
+		e->address = start;
+		e->len = end - start;
+		e->offset = data_len;
+		data_len += end - start;
+	}
+
+	data = malloc(data_len + 1);
+	if (!data)
+		goto failure;
+
+	memset(data, 0xff, data_len);
+	if (bl->chip_info.capabilities & BOOTLOADER_CAP_PHANTOM_BYTE) {
+		/* Each extent starts on a row, and so on an instruction */
+		for (i = bl->chip_info.bytes_per_instruction - 1;
+		     i < data_len;
+		     i += bl->chip_info.bytes_per_instruction)
+			data[i] = 0x00;
+	}
+
+	e = extents;
+	for (region = hd->regions, i = 0; region; region = region->next, i++) {
+		if (skipped[i])
+			continue;
+
+		while (region->address >= e->address + e->len)
+			e++;
+		memcpy(data + e->offset + (region->address - e->address),
+		       region->data, region->len);
+	}
+
+	/* hex_build_regions() takes ownership of the data buffer */
+	res = hex_build_regions(image, extents, count, data, data_len);
+	data = NULL;
+	if (res < 0)
+		goto failure;
+
+	free(extents);
+	free(skipped);
+	*image_out = image;
+	return 0;
+
+failure:
+	free(extents);
+	free(skipped);
+	free(data);
+	if (image)
+		hex_free(image);
+	return BOOTLOADER_ERROR;
+}
+
+/* Return the name of the cache file for a firmware file. Free it with
+ * free(). */
+static char *cache_filename(const char *filename)
+{
+	static const char suffix[] = ".blimg";
+	char *name = malloc(strlen(filename) + sizeof(suffix));
+
+	if (name) {
+		strcpy(name, filename);
+		strcat(name, suffix);
+	}
+
+	return name;
+}
+
+/* Give the bootloader object the image for its device: the image of
+ * another of the devices if it has the same key, a cached image if there
+ * is one, or the data from the file, prepared for this device. */
+static int load_image(struct bootloader *bl, struct loaded_file *lf,
+                      struct bootloader **others, int num_others)
+{
+	const struct bootloader_file *file = lf->file;
+	struct hex_data_region *region;
+	char *cache_name = NULL;
+	int res;
+	int i;
+
+	if (!file || !file->filename) {
+		/* No filename, so load up an empty structure. */
+		hex_init_empty(&bl->image);
+		bl->owns_image = true;
+		return bl->image? 0: BOOTLOADER_ERROR;
+	}
+
+	bl->image_key = image_key(bl, lf);
+
+	for (i = 0; i < num_others; i++) {
+		if (others[i]->image && others[i]->image_key == bl->image_key) {
+			bl->image = others[i]->image;
+			return 0;
+		}
+	}
+
+	/* stdin can't have a cache file next to it */
+	if (file->use_cache && strcmp(file->filename, "-")) {
+		cache_name = cache_filename(file->filename);
+		if (cache_name &&
+		    image_cache_load(cache_name, bl->image_key, &bl->image) == HEX_ERROR_OK) {
+			log("Loaded the image from %s\n", cache_name);
+			bl->owns_image = true;
+			free(cache_name);
+			return 0;
+		}
+	}
+
+	if (!lf->hd) {
+		res = image_load_buffer(lf->buf, lf->size, file->format,
+		                        file->base_address, &lf->hd);
+		if (res < 0) {
+			fprintf(stderr, "Unable to load %s. Error: %d\n", file->filename, res);
+			free(cache_name);
+			return BOOTLOADER_CANT_OPEN_FILE;
+		}
+
+		log("File regions:\n");
+		region = lf->hd->regions;
+		while (region) {
+			log("  Data Region at %08lx for %4lx bytes (hex)\n", region->address, region->len);
+			region = region->next;
+		}
+	}
+
+	res = prepare_image(bl, lf->hd, &bl->image);
+	if (res < 0) {
+		free(cache_name);
+		return res;
+	}
+	bl->owns_image = true;
+
+	/* Failing to write the cache only makes the next run slower */
+	if (cache_name) {
+		if (image_cache_save(cache_name, bl->image_key, bl->image) != HEX_ERROR_OK)
+			fprintf(stderr, "Unable to write %s\n", cache_name);
+		free(cache_name);
+	}
+
+	return 0;
+}
+
+/* Set up a bootloader object for its newly-opened device */
+static int setup_device(struct bootloader *bl)
+{
+	int res;
+
+	get_device_path(libusb_get_device(bl->handle), bl->path, sizeof(bl->path));
+
+	res = libusb_claim_interface(bl->handle, 0);
+	if (res < 0)
+		return BOOTLOADER_CANT_OPEN_DEVICE;
+
+	res = get_chip_info(bl->handle, &bl->chip_info);
+	if (res < 0) {
+		fprintf(stderr, "Can't get chip info\n");
+		return BOOTLOADER_CANT_QUERY_DEVICE;
+	}
+
+	bl->bytes_per_row = bl->chip_info.bytes_per_instruction *
+	                    bl->chip_info.instructions_per_row;
+
+	/* Use the bulk data path if the firmware supports it. Older firmware
+	 * reports zero for protocol_version and capabilities. */
+	if (bl->chip_info.protocol_version >= BOOTLOADER_PROTOCOL_V2 &&
+	    (bl->chip_info.capabilities & BOOTLOADER_CAP_BULK_DATA)) {
+		bl->bulk_buf = malloc(BULK_BUFFER_SIZE);
+		bl->use_bulk = (bl->bulk_buf != NULL);
+	}
+
+	/* Compress rows, if the firmware can decompress them */
+	if (bl->use_bulk &&
+	    (bl->chip_info.capabilities & BOOTLOADER_CAP_COMPRESSION)) {
+		bl->lz_buf = malloc(bl->bytes_per_row);
+		bl->use_compression = (bl->lz_buf != NULL);
+	}
+
+	if (alloc_xfers(bl, DEFAULT_QUEUE_DEPTH) < 0)
+		return BOOTLOADER_ERROR;
+
+	log("Queried MCU at %s to find:\n", bl->path);
+	log("  bytes per inst: %d\n  inst per row %d\n",
+	       bl->chip_info.bytes_per_instruction,
+	       bl->chip_info.instructions_per_row);
+	log("  protocol version: %d\n  capabilities: %04x\n",
+	       bl->chip_info.protocol_version,
+	       bl->chip_info.capabilities);
+
+	return 0;
+}
+
+int bootloader_init(struct bootloader **bootl, const struct bootloader_file *file, uint16_t vid, uint16_t pid)
+{
+	struct bootloader *bl;
+	struct loaded_file lf;
+	int libusb_return;
+	int res = 0;
+	
+	*bootl = NULL;
+
+	res = read_file(file, &lf);
+	if (res < 0)
+		return res;
+
+	bl = calloc(1, sizeof(struct bootloader));
+	if (!bl) {
+		res = BOOTLOADER_ERROR;
+		goto free_file;
+	}
+
+	/* Init Libusb */
+	if (libusb_init(NULL)) {
+		res = BOOTLOADER_CANT_OPEN_DEVICE;
+		goto free_bl;
+	}
+
+	res = open_device(bl, vid, pid, &libusb_return);
+	if (res < 0) {
+		if (libusb_return < 0) {
+			fprintf(stderr, "libusb_open() failed: %s\n", libusb_error_name(libusb_return));
+		}
+		goto free_bl;
+	}
+
+	res = setup_device(bl);
+	if (res < 0)
+		goto free_bl;
+
+	/* The image depends on the device's flash layout */
+	res = load_image(bl, &lf, NULL, 0);
+	if (res < 0)
+		goto free_bl;
+
+	free_file(&lf);
+	*bootl = bl;
+	return 0;
+
+free_bl:
+	bootloader_free(bl);
+free_file:
+	free_file(&lf);
+	return res;
+}
+
+/* Return whether path is one of the paths in the list */
+static bool path_listed(const char *path, const char * const *paths, int num_paths)
+{
+	int i;
+
+	for (i = 0; i < num_paths; i++) {
+		if (!strcmp(path, paths[i]))
+			return true;
+	}
+
+	return false;
+}
+
+int bootloader_init_multiple(struct bootloader ***bootls, int *count,
+                             const struct bootloader_file *file,
+                             uint16_t vid, uint16_t pid,
+                             const char * const *paths, int num_paths)
+{
+	struct bootloader **bls = NULL;
+	struct loaded_file lf;
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	int num_bls = 0;
+	int d = 0;
+	int res;
+
+	*bootls = NULL;
+	*count = 0;
+
+	/* The file is only read (and parsed) once for all the devices */
+	res = read_file(file, &lf);
+	if (res < 0)
+		return res;
+
+	if (libusb_init(NULL)) {
+		free_file(&lf);
+		return BOOTLOADER_CANT_OPEN_DEVICE;
+	}
+
+	libusb_get_device_list(NULL, &devs);
+	while ((usb_dev = devs[d++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct bootloader *bl, **new_bls;
+		char path[BOOTLOADER_PATH_LEN];
+
+		get_device_path(usb_dev, path, sizeof(path));
+		libusb_get_device_descriptor(usb_dev, &desc);
+		if (num_paths > 0 && !path_listed(path, paths, num_paths))
+			continue;
+
+		/* A device at a given path must still be a bootloader */
+		if (desc.idVendor != vid || desc.idProduct != pid) {
+			if (num_paths > 0)
+				fprintf(stderr, "Device at %s is %04hx:%04hx, "
+				        "not %04hx:%04hx\n", path,
+				        desc.idVendor, desc.idProduct, vid, pid);
+			continue;
+		}
+
+		bl = calloc(1, sizeof(struct bootloader));
+		if (!bl) {
+			res = BOOTLOADER_ERROR;
+			goto failure;
+		}
+
+		new_bls = realloc(bls, (num_bls + 1) * sizeof(*bls));
+		if (!new_bls) {
+			free(bl);
+			res = BOOTLOADER_ERROR;
+			goto failure;
+		}
+		bls = new_bls;
+		bls[num_bls++] = bl;
+
+		res = libusb_open(usb_dev, &bl->handle);
+		if (res < 0) {
+			fprintf(stderr, "Unable to open device at %s: %s\n",
+			        path, libusb_error_name(res));
+			res = BOOTLOADER_CANT_OPEN_DEVICE;
+			goto failure;
+		}
+
+		res = setup_device(bl);
+		if (res < 0) {
+			fprintf(stderr, "Unable to set up device at %s\n", path);
+			goto failure;
+		}
+
+		res = load_image(bl, &lf, bls, num_bls - 1);
+		if (res < 0)
+			goto failure;
+	}
+
+	if (num_bls == 0 || (num_paths > 0 && num_bls != num_paths)) {
+		res = BOOTLOADER_CANT_OPEN_DEVICE;
+		goto failure;
+	}
+
+	libusb_free_device_list(devs, 1/*unref devices*/);
+	free_file(&lf);
+	*bootls = bls;
+	*count = num_bls;
+	return 0;
+
+failure:
+	libusb_free_device_list(devs, 1/*unref devices*/);
+	free_file(&lf);
+	if (num_bls > 0)
+		bootloader_free_multiple(bls, num_bls);
+	return res;
+}
+
+const char *bootloader_get_path(struct bootloader *bl)
+{
+	return bl->path;
+}
+
+void bootloader_free(struct bootloader *bl)
+{
+	free_xfers(bl);
+	if (bl->handle)
+		libusb_close(bl->handle);
+	if (bl->owns_image)
+		hex_free(bl->image);
+	free(bl->bulk_buf);
+	free(bl->lz_buf);
+	free(bl);
+}
+
+void bootloader_free_multiple(struct bootloader **bls, int count)
+{
+	int i;
+
+	/* Each shared image is freed with the object which loaded it */
+	for (i = 0; i < count; i++)
+		bootloader_free(bls[i]);
+
+	free(bls);
 }
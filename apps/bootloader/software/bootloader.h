@@ -32,7 +32,9 @@
 #else
 	#include <stdint.h>
 #endif
+#include <stddef.h>
 
+#include "image.h"
 
 /* The Bootloader API functions return 0 on success and a negative error
  * code on error. */
@@ -42,17 +44,59 @@
 #define BOOTLOADER_CANT_OPEN_DEVICE -3 /* Returned from *_init() */
 #define BOOTLOADER_CANT_QUERY_DEVICE -4 /* Returned from *_init() */
 #define BOOTLOADER_MULTIPLE_CONNECTED -5 /* Returned from *_init() */
+#define BOOTLOADER_NOT_SUPPORTED -6 /* The device's firmware can't do it */
+
+/* Longest bus/port path of a device, such as "1-4.2", and its NUL. */
+#define BOOTLOADER_PATH_LEN 32
 
 struct bootloader; /* opaque struct */
 
+/* The firmware image to program. filename may be "-" for stdin, or NULL
+ * for no image. base_address is only used for IMAGE_FORMAT_BINARY. With
+ * use_cache set, the image, once prepared for the device, is cached in a
+ * file next to filename (see image.h), and loaded from there next time if
+ * neither the file nor the device's flash layout has changed. */
+struct bootloader_file {
+	const char *filename;
+	enum image_format format;
+	size_t base_address;
+	int use_cache;
+};
+
 int  bootloader_init(struct bootloader **bootl,
-                     const char *filename,
+                     const struct bootloader_file *file,
                      uint16_t vid,
                      uint16_t pid);
+int  bootloader_set_queue_depth(struct bootloader *bl, int queue_depth);
+int  bootloader_set_compression(struct bootloader *bl, int enable);
 int  bootloader_erase(struct bootloader *bl);
+int  bootloader_erase_used(struct bootloader *bl);
 int  bootloader_program(struct bootloader *bl);
+int  bootloader_program_incremental(struct bootloader *bl);
 int  bootloader_verify(struct bootloader *bl);
 int  bootloader_reset(struct bootloader *bl);
 void bootloader_free(struct bootloader *bl);
 
+/* Bytes of flash data written so far, and the bytes sent to the device
+ * for them, which is fewer when they are compressed. */
+void bootloader_get_transfer_stats(struct bootloader *bl,
+                                   size_t *data_bytes,
+                                   size_t *sent_bytes);
+
+/* Gang programming. Open every device with the given VID/PID or, if
+ * num_paths is not zero, the devices at each of the bus/port paths, which
+ * must also have that VID/PID. The file is loaded once, and devices with
+ * the same flash layout share one copy of the image. On success, *bootls is an array of *count bootloader
+ * objects which may be used from separate threads, one thread per
+ * object. Free them with bootloader_free_multiple(). */
+int  bootloader_init_multiple(struct bootloader ***bootls,
+                              int *count,
+                              const struct bootloader_file *file,
+                              uint16_t vid,
+                              uint16_t pid,
+                              const char * const *paths,
+                              int num_paths);
+void bootloader_free_multiple(struct bootloader **bls, int count);
+const char *bootloader_get_path(struct bootloader *bl);
+
 #endif /* BOOTLOADER_H__ */
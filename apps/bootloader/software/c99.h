@@ -35,9 +35,11 @@
 	#error "c99.h shouldn't be included on GCC compilers"
 #endif
 
+typedef __int8 int8_t;
 typedef unsigned __int8 uint8_t;
 typedef unsigned __int16 uint16_t;
 typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
 typedef unsigned char bool;
 #define false 0
 #define true  1
@@ -39,16 +39,10 @@
 	#pragma warning (disable:4996)
 #endif
 
-#ifdef WIN32
-	#include <winsock2.h>
-#else
-	#include <arpa/inet.h>
-#endif
-
 #include "hex.h"
 #include "log.h"
 
-#define LINE_LENGTH 1024
+#define READ_CHUNK_SIZE 65536
 
 /* Intel Hex File format record types */
 enum {
@@ -60,281 +54,369 @@ enum {
 	REC_START_LINEAR_ADDRESS = 5,
 };
 
-/* Character offsets for each piece of data in a record (line). */ 
+/* Byte offsets for each piece of data in a decoded record. The record
+ * starts with a colon, which is not decoded. */
 enum {
-	START_INDEX = 0,
-	BYTE_COUNT_INDEX = 1,
-	ADDRESS_INDEX = 3,
-	RECORD_TYPE_INDEX = 7,
-	DATA_INDEX = 9,
+	BYTE_COUNT_INDEX = 0,
+	ADDRESS_INDEX = 1,
+	RECORD_TYPE_INDEX = 3,
+	DATA_INDEX = 4,
+	RECORD_OVERHEAD = 5, /* Count, address, type and checksum */
 };
 
+/* The runs of contiguous data records, in the order they appear in the
+ * file */
+struct extent_list {
+	struct hex_extent *extents;
+	size_t count;
+	size_t capacity;
+};
 
-#define MAX(X,Y) ((X)>(Y)? (X): (Y))
+/* Value of each hex digit character, or -1 for any other character */
+static int8_t hex_values[256];
 
-static uint8_t read_byte(const char *line, size_t offset)
+static void init_hex_values(void)
 {
-	char chars[3];
-	char *endptr;
-	uint8_t res;
-	
-	chars[0] = line[offset];
-	chars[1] = line[offset+1];
-	chars[2] = '\0';
-
-	res = (uint8_t) strtoul(chars, &endptr, 16);
-	
-	return res;
+	int i;
+
+	memset(hex_values, -1, sizeof(hex_values));
+	for (i = 0; i < 10; i++)
+		hex_values['0' + i] = i;
+	for (i = 0; i < 6; i++) {
+		hex_values['a' + i] = 10 + i;
+		hex_values['A' + i] = 10 + i;
+	}
 }
 
-static uint16_t read_short(const char *line, size_t offset)
+/* Decode num_bytes bytes from pairs of hex digits. Return false if there
+ * is a character which is not a hex digit. */
+static bool decode_hex(const char *chars, size_t num_bytes, uint8_t *out)
 {
-	char chars[6];
-	char *endptr;
-	uint16_t res;
-	
-	memcpy(chars, line + offset, 4);
-	chars[5] = '\0';
-
-	res = (uint16_t) strtoul(chars, &endptr, 16);
-	
-	return res;
+	const unsigned char *c = (const unsigned char *) chars;
+	size_t i;
+
+	for (i = 0; i < num_bytes; i++) {
+		int hi = hex_values[c[0]];
+		int lo = hex_values[c[1]];
+
+		if ((hi | lo) < 0)
+			return false;
+		out[i] = (hi << 4) | lo;
+		c += 2;
+	}
+
+	return true;
 }
 
-static bool
-create_update_region(struct hex_data *hd, size_t address, uint8_t len) {
-	struct hex_data_region *r;
-	bool done = false;
-
-	r = hd->regions;
-	while (r) {
-		if (address == r->address + r->len) {
-			/* Address range is exactly at the end of this region.
-			   Extend this region to include it. */
-			   r->len += len;
-			   done = true;
+enum hex_error_code
+hex_read_file(const char *filename, char **buf_out, size_t *size_out)
+{
+	FILE *fp;
+	bool use_stdin = !strcmp(filename, "-");
+	char *buf = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	enum hex_error_code ret = HEX_ERROR_OK;
+
+	fp = use_stdin? stdin: fopen(filename, "rb");
+	if (!fp)
+		return HEX_ERROR_CANT_OPEN_FILE;
+
+	while (true) {
+		size_t res;
+
+		if (capacity - size < READ_CHUNK_SIZE) {
+			char *new_buf;
+
+			capacity = capacity? capacity * 2: READ_CHUNK_SIZE;
+			new_buf = realloc(buf, capacity);
+			if (!new_buf) {
+				ret = HEX_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			buf = new_buf;
 		}
-		else if (address + len == r->address) {
-			/* Address range is exactly before this region. Extend
-			   this region backward to include it */
-			   r->address -= len;
-			   r->len += len;
-			   done = true;
+
+		res = fread(buf + size, 1, capacity - size, fp);
+		size += res;
+		if (res == 0) {
+			if (ferror(fp))
+				ret = HEX_ERROR_FILE_LOAD_ERROR;
+			break;
 		}
-		else if (address <= r->address && address + len > r->address) {
-			/* Address range overlaps the beginning of this region.
-			   This is an error. */
-			return false;
+	}
+
+	if (!use_stdin)
+		fclose(fp);
+
+	if (ret != HEX_ERROR_OK) {
+		free(buf);
+		return ret;
+	}
+
+	*buf_out = buf;
+	*size_out = size;
+	return HEX_ERROR_OK;
+}
+
+/* Add the data of one record. Records usually follow on from the one
+ * before, so that only extends the last extent. */
+static bool add_data(struct extent_list *list, size_t address, size_t len,
+                     size_t offset)
+{
+	struct hex_extent *last;
+
+	if (list->count > 0) {
+		last = &list->extents[list->count - 1];
+		if (last->address + last->len == address) {
+			last->len += len;
+			return true;
 		}
-		else if (address >= r->address && address < r->address + r->len) {
-			/* Address range overlaps the middle or possibly the
-			   the end of this region. This is an error */
+	}
+
+	if (list->count == list->capacity) {
+		struct hex_extent *new_extents;
+		size_t capacity = list->capacity? list->capacity * 2: 16;
+
+		new_extents = realloc(list->extents, capacity * sizeof(*new_extents));
+		if (!new_extents)
 			return false;
+		list->extents = new_extents;
+		list->capacity = capacity;
+	}
+
+	last = &list->extents[list->count++];
+	last->address = address;
+	last->len = len;
+	last->offset = offset;
+
+	return true;
+}
+
+static int compare_extents(const void *a, const void *b)
+{
+	const struct hex_extent *ea = a;
+	const struct hex_extent *eb = b;
+
+	if (ea->address < eb->address)
+		return -1;
+	return (ea->address > eb->address)? 1: 0;
+}
+
+enum hex_error_code
+hex_build_regions(struct hex_data *hd, struct hex_extent *extents,
+                  size_t count, unsigned char *data, size_t data_len)
+{
+	struct hex_data_region *regions;
+	struct hex_data_region *r = NULL;
+	bool in_order = true;
+	size_t num_regions = 0;
+	size_t offset = 0;
+	size_t i;
+
+	if (count == 0) {
+		free(data);
+		return HEX_ERROR_OK;
+	}
+
+	/* The data can stay where it is if it is in address order already,
+	 * with nothing between the extents, as it is for most hex files. */
+	for (i = 0; i < count; i++) {
+		if (extents[i].offset != offset ||
+		    (i > 0 && extents[i].address < extents[i-1].address)) {
+			in_order = false;
+			break;
 		}
-		
-		r = r->next;
+		offset += extents[i].len;
 	}
 
-	if (!done) {
-		/* Need to create a new region */
-		r = calloc(1, sizeof(struct hex_data_region));
-		r->address = address;
-		r->len = len;
-		
-		if (!hd->regions) {
-			/* The new one is the only region */
-			hd->regions = r;
+	if (!in_order) {
+		/* Copy the data into address order */
+		unsigned char *sorted_data = malloc(data_len);
+
+		offset = 0;
+		if (!sorted_data) {
+			free(data);
+			return HEX_ERROR_OUT_OF_MEMORY;
 		}
-		else {
-			/* Add it to the end of the list */
-			struct hex_data_region *iter = hd->regions;
-			while(iter->next) {
-				iter = iter->next;
+
+		qsort(extents, count, sizeof(*extents),
+		      compare_extents);
+		for (i = 0; i < count; i++) {
+			struct hex_extent *e = &extents[i];
+			memcpy(sorted_data + offset, data + e->offset, e->len);
+			e->offset = offset;
+			offset += e->len;
+		}
+		free(data);
+		data = sorted_data;
+	}
+
+	/* Check for overlaps and count the regions */
+	for (i = 0; i < count; i++) {
+		struct hex_extent *e = &extents[i];
+
+		if (i > 0) {
+			struct hex_extent *prev = &extents[i-1];
+			if (e->address < prev->address + prev->len) {
+				fprintf(stderr, "Overlapping data at 0x%lx\n",
+				        (unsigned long) e->address);
+				free(data);
+				return HEX_ERROR_FILE_LOAD_ERROR;
 			}
-			iter->next = r;
+			if (e->address == prev->address + prev->len)
+				continue;
 		}
+		num_regions++;
 	}
-	
-	return true;
-}
 
-static struct hex_data_region *
-find_region(const struct hex_data *hd, size_t address, uint8_t len)
-{
-	struct hex_data_region *r;
+	regions = calloc(num_regions, sizeof(*regions));
+	if (!regions) {
+		free(data);
+		return HEX_ERROR_OUT_OF_MEMORY;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct hex_extent *e = &extents[i];
+
+		if (r && e->address == r->address + r->len) {
+			r->len += e->len;
+			continue;
+		}
 
-	r = hd->regions;
-	while (r) {
-		if (address >= r->address &&
-		    address + len <= r->address + r->len) {
-			return r;
+		if (r) {
+			r->next = r + 1;
+			r++;
 		}
-		r = r->next;
+		else {
+			r = regions;
+		}
+		r->address = e->address;
+		r->data = data + e->offset;
+		r->len = e->len;
 	}
 
-	return NULL;
+	hd->regions = regions;
+	hd->region_storage = regions;
+	hd->data_storage = data;
+
+	return HEX_ERROR_OK;
 }
 
-enum hex_error_code hex_load(const char *filename, struct hex_data **data_out)
+/* Parse the file in one pass. The data records are decoded into one
+ * buffer, in file order, while a list of the runs of contiguous data is
+ * kept. The runs are then sorted and merged into the regions. */
+enum hex_error_code
+hex_load_buffer(const char *buf, size_t size, struct hex_data **data_out)
 {
-	FILE *fp;
-	char line[LINE_LENGTH];
+	const char *pos;
+	const char *end;
 	size_t extended_addr = 0;
 	struct hex_data *hd;
-	enum hex_error_code ret = HEX_ERROR_OK;
-	struct hex_data_region *iter;
-
+	struct extent_list list = { NULL, 0, 0 };
+	unsigned char *data = NULL;
+	size_t data_len = 0;
+	enum hex_error_code ret;
+
+	init_hex_values();
+	hex_init_empty(&hd);
+
+	/* Each data byte takes two characters in the file, so the data can
+	 * not be larger than half of the file. */
+	data = malloc(size / 2 + 1);
+	if (!hd || !data) {
+		ret = HEX_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
 
-	fp = fopen(filename, "r");
-	if (!fp)
-		return HEX_ERROR_CANT_OPEN_FILE;
+	log_hex("Parsing data...\n");
 
-	/* Set up the return structure */
-	hd = malloc(sizeof(struct hex_data));
-	hd->regions = NULL;
-	
-	log_hex("Checking HEX file for data integrity...\n");
-	
-	/* First pass: check for data integrity and create the
-	 * hex_data_region objects which which will contain the data. */
-	while (!feof(fp)) {
-		char *res;
-		int len;
+	pos = buf;
+	end = buf + size;
+	while (pos < end) {
+		const char *line = pos;
+		const char *newline;
+		size_t len;
+		size_t num_bytes;
+		uint8_t record[RECORD_OVERHEAD + 255];
 		uint8_t record_type;
 		uint8_t byte_count;
-		int i;
 		uint8_t sum = 0;
-		
-		res = fgets(line, sizeof(line), fp);
-		if (!res)
-			break;
-		
-		/* Eliminate the trailing newline */
-		len = strlen(line);
-		if (line[len-1] == '\n') {
-			line[len-1] = '\0';
-			len--;
+		size_t i;
+
+		newline = memchr(pos, '\n', end - pos);
+		if (newline) {
+			len = newline - line;
+			pos = newline + 1;
+		}
+		else {
+			len = end - line;
+			pos = end;
 		}
 
 		/* Eliminate the trailing CR (if there is one) */
-		len = strlen(line);
-		if (line[len-1] == '\r') {
-			line[len-1] = '\0';
+		if (len > 0 && line[len-1] == '\r')
 			len--;
+
+		/* Make sure the record is well formed: a colon, followed by
+		 * the right number of pairs of hex digits */
+		if (len < 11 || line[0] != ':' || (len & 1) == 0 ||
+		    len > 1 + 2 * sizeof(record)) {
+			ret = HEX_ERROR_FILE_LOAD_ERROR;
+			goto out;
 		}
-		
-		/* Make sure the record is long enough */
-		if (len < 11) {
+
+		num_bytes = (len - 1) / 2;
+		if (!decode_hex(line + 1, num_bytes, record)) {
 			ret = HEX_ERROR_FILE_LOAD_ERROR;
 			goto out;
 		}
 
-		record_type = read_byte(line, RECORD_TYPE_INDEX);
-		byte_count = read_byte(line, BYTE_COUNT_INDEX);
+		byte_count = record[BYTE_COUNT_INDEX];
+		record_type = record[RECORD_TYPE_INDEX];
 
 		/* Make sure there are the right number of data bytes */
-		if (len != byte_count * 2 + 11) {
+		if (num_bytes != (size_t) byte_count + RECORD_OVERHEAD) {
 			ret = HEX_ERROR_FILE_LOAD_ERROR;
 			goto out;
 		}
-		
-		/* Read each byte and calculate the checksum */
-		for (i = 1; i < len; i += 2) {
-			sum += read_byte(line, i);
-		}
 
 		/* Verify the checksum */
+		for (i = 0; i < num_bytes; i++)
+			sum += record[i];
 		if (sum != 0) {
 			ret = HEX_ERROR_FILE_LOAD_ERROR;
 			goto out;
 		}
 
-		switch (record_type) {
-		bool res;
-		case REC_DATA:
-			res = create_update_region(
-				hd,
-				extended_addr + read_short(line, ADDRESS_INDEX),
-				byte_count);
-				
-			if (!res) {
-				ret = HEX_ERROR_FILE_LOAD_ERROR;
-				goto out;
-			}
-			break;
-		case REC_EOF:
-			break;
-		case REC_EXTENDED_SEGMENT_ADDRESS:
-			extended_addr = read_short(line, DATA_INDEX) << 4;
-			break;
-		case REC_EXTENDED_LINEAR_ADDRESS:
-			extended_addr = read_short(line, DATA_INDEX) << 16;
-			break;
-		default:
-			fprintf(stderr, "Hex file load: Unsupported Record type: 0x%02hhx\n", record_type);
-			ret = HEX_ERROR_UNSUPPORTED_RECORD;
-			goto out;
-			break;
-		}
-	}
-
-	log_hex("Integrity check passed.\n");
-	log_hex("Parsing data...\n");
-
-	/* Allocate the memory buffer for each hex_data_region. */
-	iter = hd->regions;
-	while(iter) {
-		iter->data = malloc(iter->len);
-		memset(iter->data, 0xff, iter->len);
-		
-		iter = iter->next;
-	}
-
-	/* Second pass: Load the data into the hex_data_region buffers. */
-	extended_addr = 0;
-	rewind(fp);
-	
-	while (!feof(fp)) {
-		char *res;
-		uint8_t record_type;
-		
-		res = fgets(line, sizeof(line), fp);
-		if (!res)
-			break;
-		
-		record_type = read_byte(line, RECORD_TYPE_INDEX);
 		switch (record_type) {
 		case REC_DATA:
 		{
-			int i;
-			size_t offset;
-			int byte_count = read_byte(line, BYTE_COUNT_INDEX);
 			size_t addr = extended_addr +
-					read_short(line, ADDRESS_INDEX);
-			struct hex_data_region *region =
-					find_region(hd, addr, byte_count);
+				((record[ADDRESS_INDEX] << 8) |
+				 record[ADDRESS_INDEX + 1]);
 
-			if (!region) {
-				ret = HEX_ERROR_FILE_LOAD_ERROR;
-				goto out;
-			}
-				
 			log_hex("Reading %3d bytes at %06lx\n", byte_count, addr);
-			offset = addr - region->address;
-			for (i = 0; i < byte_count; i++) {
-				region->data[offset + i] =
-					read_byte(line, DATA_INDEX + 2 * i);
+			if (!add_data(&list, addr, byte_count, data_len)) {
+				ret = HEX_ERROR_OUT_OF_MEMORY;
+				goto out;
 			}
+			memcpy(data + data_len, record + DATA_INDEX, byte_count);
+			data_len += byte_count;
 			break;
 		}
 		case REC_EOF:
+			/* Ignore anything after the end of file record */
+			pos = end;
 			break;
 		case REC_EXTENDED_SEGMENT_ADDRESS:
-			extended_addr = read_short(line, DATA_INDEX) << 4;
+			extended_addr = ((record[DATA_INDEX] << 8) |
+			                 record[DATA_INDEX + 1]) << 4;
 			log_hex("Setting Extended addr: %lx\n", extended_addr);
 			break;
 		case REC_EXTENDED_LINEAR_ADDRESS:
-			extended_addr = read_short(line, DATA_INDEX) << 16;
+			extended_addr = (size_t) ((record[DATA_INDEX] << 8) |
+			                          record[DATA_INDEX + 1]) << 16;
 			log_hex("Setting Extended addr2: %lx\n", extended_addr);
 			break;
 		default:
@@ -345,35 +427,48 @@ enum hex_error_code hex_load(const char *filename, struct hex_data **data_out)
 		}
 	}
 
+	/* hex_build_regions() takes ownership of the data buffer */
+	ret = hex_build_regions(hd, list.extents, list.count, data, data_len);
+	data = NULL;
+	if (ret != HEX_ERROR_OK)
+		goto out;
+
 	log_hex("Hex data parsed successfully.\n");
 
+	free(list.extents);
 	*data_out = hd;
-	fclose(fp);
-	return ret;
+	return HEX_ERROR_OK;
 out:
-	fclose(fp);
-	hex_free(hd);
+	free(list.extents);
+	free(data);
+	if (hd)
+		hex_free(hd);
+	return ret;
+}
+
+enum hex_error_code hex_load(const char *filename, struct hex_data **data_out)
+{
+	char *buf;
+	size_t size;
+	enum hex_error_code ret;
+
+	ret = hex_read_file(filename, &buf, &size);
+	if (ret != HEX_ERROR_OK)
+		return ret;
+
+	ret = hex_load_buffer(buf, size, data_out);
+	free(buf);
 	return ret;
 }
 
 void hex_init_empty(struct hex_data **data)
 {
-	struct hex_data *hd;
-	hd = malloc(sizeof(struct hex_data));
-	hd->regions = NULL;
-	*data = hd;
+	*data = calloc(1, sizeof(struct hex_data));
 }
 
 void hex_free(struct hex_data *hd)
 {
-	struct hex_data_region *r;
-
-	r = hd->regions;
-	while (r) {
-		struct hex_data_region *this_one = r;
-		r = r->next;
-		free(this_one);
-	}
-
+	free(hd->region_storage);
+	free(hd->data_storage);
 	free(hd);
 }
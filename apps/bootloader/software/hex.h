@@ -36,8 +36,20 @@ struct hex_data_region {
 };
 
 struct hex_data {
-	/* Linked-list of data regions */
+	/* Linked-list of data regions, sorted by address */
 	struct hex_data_region *regions;
+
+	/* The regions and their data are each allocated in one piece */
+	struct hex_data_region *region_storage;
+	unsigned char *data_storage;
+};
+
+/* A run of data at address, which is at offset in a data buffer. Used to
+ * build a hex_data from data which doesn't come from a hex file. */
+struct hex_extent {
+	size_t address;
+	size_t len;
+	size_t offset;
 };
 
 enum hex_error_code {
@@ -46,9 +58,27 @@ enum hex_error_code {
 	HEX_ERROR_FILE_LOAD_ERROR = -2,
 	HEX_ERROR_UNSUPPORTED_RECORD = -3,
 	HEX_ERROR_DATA_TOO_LARGE = -4,
+	HEX_ERROR_OUT_OF_MEMORY = -5,
 };
 
+/* Load a hex file, or stdin if filename is "-" */
 enum hex_error_code hex_load(const char *filename, struct hex_data **data);
+enum hex_error_code hex_load_buffer(const char *buf, size_t size, struct hex_data **data);
+
+/* Read a whole file, or stdin if filename is "-", into a buffer, which
+ * must be freed with free(). */
+enum hex_error_code hex_read_file(const char *filename, char **buf, size_t *size);
+
+/* Sort the extents by address, and merge the adjacent ones into the
+ * regions of hd, which must be empty. The region data is laid out in
+ * address order in one buffer. Overlapping extents are an error. This
+ * takes ownership of data, which must have been allocated with malloc(),
+ * and may reorder the extents. */
+enum hex_error_code hex_build_regions(struct hex_data *hd,
+                                      struct hex_extent *extents,
+                                      size_t count,
+                                      unsigned char *data,
+                                      size_t data_len);
 void hex_init_empty(struct hex_data **data);
 void hex_free(struct hex_data *hd);
 
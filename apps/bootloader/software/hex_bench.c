@@ -0,0 +1,186 @@
+/*
+ * M-Stack Intel Hex File Reader Benchmark
+ *
+ * This file may be used under the terms of the Simplified BSD License
+ * (2-clause), which can be found in LICENSE-bsd.txt in the parent
+ * directory.
+ *
+ * It is worth noting that M-Stack itself is not under the same license as
+ * this file.  See the top-level README.txt for more information.
+ */
+
+/* Generate a large synthetic hex file, with its data scattered over many
+ * sections in the way a linker scatters a PIC32 image, and time how long
+ * hex_load() takes to load it.
+ *
+ * Usage: hex_bench [MEGABYTES [SECTIONS]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if _MSC_VER && _MSC_VER < 1600
+	#include "c99.h"
+#else
+	#include <stdint.h>
+	#include <stdbool.h>
+#endif
+
+#include "hex.h"
+
+#define BENCH_FILE "hex_bench.hex"
+#define BASE_ADDRESS 0x1d000000
+#define BYTES_PER_RECORD 16
+#define RECORDS_PER_CHUNK 16
+#define ITERATIONS 5
+
+static uint8_t pattern(size_t address)
+{
+	return (uint8_t) (address * 31 + (address >> 8));
+}
+
+static void write_record(FILE *fp, uint8_t type, uint16_t address,
+                         const uint8_t *data, uint8_t len)
+{
+	uint8_t sum = len + (address >> 8) + (address & 0xff) + type;
+	int i;
+
+	fprintf(fp, ":%02X%04X%02X", len, address, type);
+	for (i = 0; i < len; i++) {
+		fprintf(fp, "%02X", data[i]);
+		sum += data[i];
+	}
+	fprintf(fp, "%02X\n", (uint8_t) -sum);
+}
+
+/* Write the sections a chunk at a time, going round the sections, so that
+ * the records of each section are spread through the file. Sections are
+ * separated by a gap, so each one becomes its own region. */
+static size_t generate(const char *filename, size_t data_size, int sections)
+{
+	FILE *fp;
+	size_t section_size = data_size / sections;
+	size_t stride = section_size + 0x1000;
+	size_t done = 0;
+	size_t upper = (size_t) -1;
+	uint8_t data[BYTES_PER_RECORD];
+	int s, r, i;
+
+	section_size -= section_size % BYTES_PER_RECORD;
+
+	fp = fopen(filename, "w");
+	if (!fp)
+		return 0;
+
+	while (done < section_size) {
+		for (s = 0; s < sections; s++) {
+			for (r = 0; r < RECORDS_PER_CHUNK; r++) {
+				size_t address = BASE_ADDRESS + s * stride +
+				                 done + r * BYTES_PER_RECORD;
+
+				if (done + r * BYTES_PER_RECORD >= section_size)
+					break;
+
+				if ((address >> 16) != upper) {
+					uint8_t ext[2];
+					upper = address >> 16;
+					ext[0] = upper >> 8;
+					ext[1] = upper & 0xff;
+					write_record(fp, 4, 0, ext, 2);
+				}
+
+				for (i = 0; i < BYTES_PER_RECORD; i++)
+					data[i] = pattern(address + i);
+				write_record(fp, 0, address & 0xffff,
+				             data, BYTES_PER_RECORD);
+			}
+		}
+		done += RECORDS_PER_CHUNK * BYTES_PER_RECORD;
+	}
+
+	write_record(fp, 1, 0, NULL, 0);
+	fclose(fp);
+
+	return section_size * sections;
+}
+
+static bool check(const struct hex_data *hd, size_t expected_size, int sections)
+{
+	const struct hex_data_region *r;
+	size_t total = 0;
+	int count = 0;
+	size_t i;
+
+	for (r = hd->regions; r; r = r->next) {
+		for (i = 0; i < r->len; i++) {
+			if (r->data[i] != pattern(r->address + i))
+				return false;
+		}
+		total += r->len;
+		count++;
+	}
+
+	return total == expected_size && count == sections;
+}
+
+int main(int argc, char **argv)
+{
+	size_t megabytes = (argc > 1)? atoi(argv[1]): 4;
+	int sections = (argc > 2)? atoi(argv[2]): 64;
+	struct hex_data *hd;
+	size_t data_size;
+	double best = 0.0;
+	long file_size;
+	FILE *fp;
+	int i;
+
+	if (megabytes == 0 || sections <= 0) {
+		fprintf(stderr, "Usage: %s [MEGABYTES [SECTIONS]]\n", argv[0]);
+		return 1;
+	}
+
+	data_size = generate(BENCH_FILE, megabytes * 1024 * 1024, sections);
+	if (data_size == 0) {
+		fprintf(stderr, "Unable to write %s\n", BENCH_FILE);
+		return 1;
+	}
+
+	fp = fopen(BENCH_FILE, "r");
+	fseek(fp, 0, SEEK_END);
+	file_size = ftell(fp);
+	fclose(fp);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		clock_t start = clock();
+		double seconds;
+		int res;
+
+		res = hex_load(BENCH_FILE, &hd);
+		seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+		if (res < 0) {
+			fprintf(stderr, "hex_load() failed: %d\n", res);
+			remove(BENCH_FILE);
+			return 1;
+		}
+
+		if (i == 0 && !check(hd, data_size, sections)) {
+			fprintf(stderr, "Loaded data doesn't match\n");
+			hex_free(hd);
+			remove(BENCH_FILE);
+			return 1;
+		}
+
+		hex_free(hd);
+		if (i == 0 || seconds < best)
+			best = seconds;
+	}
+
+	printf("%.1f MB hex file, %lu bytes of data in %d sections\n",
+	       file_size / 1048576.0, (unsigned long) data_size, sections);
+	printf("Best of %d loads: %.3f s (%.1f MB/s)\n", ITERATIONS, best,
+	       best > 0.0? file_size / 1048576.0 / best: 0.0);
+
+	remove(BENCH_FILE);
+	return 0;
+}
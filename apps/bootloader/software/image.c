@@ -0,0 +1,421 @@
+/*
+ * M-Stack Firmware Image Loader
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ *
+ * Alan Ott
+ * Signal 11 Software
+ * 2026-10-18
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if _MSC_VER && _MSC_VER < 1600
+	#include "c99.h"
+#else
+	#include <stdint.h>
+	#include <stdbool.h>
+#endif
+
+#ifdef _MSC_VER
+	#pragma warning (disable:4996)
+#endif
+
+#include "image.h"
+#include "log.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+/* ELF32 file and program header fields used here */
+enum {
+	EI_CLASS = 4,
+	EI_DATA = 5,
+	E_PHOFF = 28,
+	E_PHENTSIZE = 42,
+	E_PHNUM = 44,
+	ELF32_EHDR_SIZE = 52,
+
+	P_TYPE = 0,
+	P_OFFSET = 4,
+	P_PADDR = 12,
+	P_FILESZ = 16,
+	ELF32_PHDR_SIZE = 32,
+};
+
+#define ELFCLASS32 1
+#define ELFDATA2LSB 1
+#define ELFDATA2MSB 2
+#define PT_LOAD 1
+
+/* Cache file layout: the magic, the 64-bit key and a 32-bit region count,
+ * followed by a 32-bit address, a 32-bit length and the data of each
+ * region. All fields are little endian. */
+#define CACHE_MAGIC "MSBLIMG1"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_HEADER_SIZE (CACHE_MAGIC_LEN + 8 + 4)
+#define CACHE_REGION_HEADER_SIZE 8
+
+static const unsigned char elf_magic[4] = { 0x7f, 'E', 'L', 'F' };
+
+static uint16_t get_u16(const unsigned char *p, bool big_endian)
+{
+	if (big_endian)
+		return (p[0] << 8) | p[1];
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p, bool big_endian)
+{
+	if (big_endian)
+		return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+		       ((uint32_t) p[2] << 8) | p[3];
+	return p[0] | ((uint32_t) p[1] << 8) |
+	       ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+	put_u32(p, (uint32_t) v);
+	put_u32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+	return get_u32(p, false) | ((uint64_t) get_u32(p + 4, false) << 32);
+}
+
+static bool is_elf(const char *buf, size_t size)
+{
+	return size >= sizeof(elf_magic) &&
+	       !memcmp(buf, elf_magic, sizeof(elf_magic));
+}
+
+/* Load the file contents of the PT_LOAD segments of a 32-bit ELF file at
+ * their physical (load) addresses. The virtual addresses are where the
+ * code runs from, which on PIC32 is a KSEG0/KSEG1 alias of the flash. */
+static enum hex_error_code load_elf(const char *buf, size_t size,
+                                    struct hex_data **data_out)
+{
+	const unsigned char *elf = (const unsigned char *) buf;
+	struct hex_extent *extents = NULL;
+	unsigned char *data = NULL;
+	struct hex_data *hd;
+	size_t count = 0;
+	size_t data_len = 0;
+	uint32_t phoff;
+	uint16_t phentsize;
+	uint16_t phnum;
+	bool big_endian;
+	enum hex_error_code ret;
+	int pass;
+	uint16_t i;
+
+	if (size < ELF32_EHDR_SIZE || elf[EI_CLASS] != ELFCLASS32 ||
+	    (elf[EI_DATA] != ELFDATA2LSB && elf[EI_DATA] != ELFDATA2MSB)) {
+		fprintf(stderr, "Only 32-bit ELF files are supported\n");
+		return HEX_ERROR_FILE_LOAD_ERROR;
+	}
+
+	big_endian = (elf[EI_DATA] == ELFDATA2MSB);
+	phoff = get_u32(elf + E_PHOFF, big_endian);
+	phentsize = get_u16(elf + E_PHENTSIZE, big_endian);
+	phnum = get_u16(elf + E_PHNUM, big_endian);
+
+	if (phnum == 0 || phentsize < ELF32_PHDR_SIZE || phoff > size ||
+	    (size - phoff) / phentsize < phnum) {
+		fprintf(stderr, "ELF file has no valid program headers\n");
+		return HEX_ERROR_FILE_LOAD_ERROR;
+	}
+
+	hex_init_empty(&hd);
+	if (!hd)
+		return HEX_ERROR_OUT_OF_MEMORY;
+
+	/* Size everything up in the first pass, and copy the segments in
+	 * the second. */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < phnum; i++) {
+			const unsigned char *ph = elf + phoff + (size_t) i * phentsize;
+			uint32_t type = get_u32(ph + P_TYPE, big_endian);
+			uint32_t offset = get_u32(ph + P_OFFSET, big_endian);
+			uint32_t paddr = get_u32(ph + P_PADDR, big_endian);
+			uint32_t filesz = get_u32(ph + P_FILESZ, big_endian);
+
+			/* Segments with no file data (.bss) don't go in
+			 * flash. */
+			if (type != PT_LOAD || filesz == 0)
+				continue;
+
+			if (offset > size || size - offset < filesz) {
+				fprintf(stderr, "ELF segment %u is past the end of the file\n", i);
+				ret = HEX_ERROR_FILE_LOAD_ERROR;
+				goto out;
+			}
+
+			if (pass == 0) {
+				count++;
+				data_len += filesz;
+				continue;
+			}
+
+			log_hex("Segment %u: %u bytes at %08x\n",
+			        i, filesz, paddr);
+			extents[count].address = paddr;
+			extents[count].len = filesz;
+			extents[count].offset = data_len;
+			memcpy(data + data_len, elf + offset, filesz);
+			count++;
+			data_len += filesz;
+		}
+
+		if (pass == 0) {
+			if (count == 0)
+				break;
+			extents = malloc(count * sizeof(*extents));
+			data = malloc(data_len);
+			if (!extents || !data) {
+				ret = HEX_ERROR_OUT_OF_MEMORY;
+				goto out;
+			}
+			count = 0;
+			data_len = 0;
+		}
+	}
+
+	/* hex_build_regions() takes ownership of the data buffer */
+	ret = hex_build_regions(hd, extents, count, data, data_len);
+	data = NULL;
+	if (ret != HEX_ERROR_OK)
+		goto out;
+
+	free(extents);
+	*data_out = hd;
+	return HEX_ERROR_OK;
+out:
+	free(extents);
+	free(data);
+	hex_free(hd);
+	return ret;
+}
+
+/* Load a raw binary file at base */
+static enum hex_error_code load_binary(const char *buf, size_t size,
+                                       size_t base,
+                                       struct hex_data **data_out)
+{
+	struct hex_extent extent;
+	struct hex_data *hd;
+	unsigned char *data;
+	enum hex_error_code ret;
+
+	hex_init_empty(&hd);
+	data = malloc(size? size: 1);
+	if (!hd || !data) {
+		free(data);
+		if (hd)
+			hex_free(hd);
+		return HEX_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(data, buf, size);
+
+	extent.address = base;
+	extent.len = size;
+	extent.offset = 0;
+
+	/* hex_build_regions() takes ownership of the data buffer */
+	ret = hex_build_regions(hd, &extent, size? 1: 0, data, size);
+	if (ret != HEX_ERROR_OK) {
+		hex_free(hd);
+		return ret;
+	}
+
+	*data_out = hd;
+	return HEX_ERROR_OK;
+}
+
+enum hex_error_code image_load_buffer(const char *buf, size_t size,
+                                      enum image_format format, size_t base,
+                                      struct hex_data **data_out)
+{
+	if (format == IMAGE_FORMAT_AUTO)
+		format = is_elf(buf, size)? IMAGE_FORMAT_ELF: IMAGE_FORMAT_HEX;
+
+	switch (format) {
+	case IMAGE_FORMAT_ELF:
+		return load_elf(buf, size, data_out);
+	case IMAGE_FORMAT_BINARY:
+		return load_binary(buf, size, base, data_out);
+	case IMAGE_FORMAT_HEX:
+	default:
+		return hex_load_buffer(buf, size, data_out);
+	}
+}
+
+uint64_t image_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+enum hex_error_code image_cache_load(const char *filename, uint64_t key,
+                                     struct hex_data **data_out)
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	struct hex_extent *extents = NULL;
+	unsigned char *data = NULL;
+	struct hex_data *hd = NULL;
+	char *buf;
+	size_t size;
+	size_t data_len = 0;
+	uint32_t count;
+	uint32_t i;
+	enum hex_error_code ret;
+
+	ret = hex_read_file(filename, &buf, &size);
+	if (ret != HEX_ERROR_OK)
+		return ret;
+
+	p = (const unsigned char *) buf;
+	end = p + size;
+
+	/* A cache file for different contents is not an error, it's just
+	 * not a hit. */
+	if (size < CACHE_HEADER_SIZE ||
+	    memcmp(p, CACHE_MAGIC, CACHE_MAGIC_LEN) ||
+	    get_u64(p + CACHE_MAGIC_LEN) != key) {
+		ret = HEX_ERROR_CANT_OPEN_FILE;
+		goto out;
+	}
+
+	/* Each region has at least its header in the file, which bounds the
+	 * count before it's used to size anything. */
+	count = get_u32(p + CACHE_MAGIC_LEN + 8, false);
+	if (count > (size - CACHE_HEADER_SIZE) / CACHE_REGION_HEADER_SIZE) {
+		ret = HEX_ERROR_FILE_LOAD_ERROR;
+		goto out;
+	}
+	p += CACHE_HEADER_SIZE;
+
+	extents = malloc((count? count: 1) * sizeof(*extents));
+	data = malloc(size);
+	hex_init_empty(&hd);
+	if (!extents || !data || !hd) {
+		ret = HEX_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint32_t len;
+
+		if ((size_t) (end - p) < CACHE_REGION_HEADER_SIZE) {
+			ret = HEX_ERROR_FILE_LOAD_ERROR;
+			goto out;
+		}
+		len = get_u32(p + 4, false);
+		if ((size_t) (end - p) - CACHE_REGION_HEADER_SIZE < len) {
+			ret = HEX_ERROR_FILE_LOAD_ERROR;
+			goto out;
+		}
+
+		extents[i].address = get_u32(p, false);
+		extents[i].len = len;
+		extents[i].offset = data_len;
+		memcpy(data + data_len, p + CACHE_REGION_HEADER_SIZE, len);
+		data_len += len;
+		p += CACHE_REGION_HEADER_SIZE + len;
+	}
+
+	/* hex_build_regions() takes ownership of the data buffer */
+	ret = hex_build_regions(hd, extents, count, data, data_len);
+	data = NULL;
+	if (ret != HEX_ERROR_OK)
+		goto out;
+
+	free(extents);
+	free(buf);
+	*data_out = hd;
+	return HEX_ERROR_OK;
+out:
+	free(extents);
+	free(data);
+	free(buf);
+	if (hd)
+		hex_free(hd);
+	return ret;
+}
+
+enum hex_error_code image_cache_save(const char *filename, uint64_t key,
+                                     const struct hex_data *hd)
+{
+	const struct hex_data_region *r;
+	unsigned char header[CACHE_HEADER_SIZE];
+	uint32_t count = 0;
+	bool ok = true;
+	FILE *fp;
+
+	for (r = hd->regions; r; r = r->next)
+		count++;
+
+	fp = fopen(filename, "wb");
+	if (!fp)
+		return HEX_ERROR_CANT_OPEN_FILE;
+
+	memcpy(header, CACHE_MAGIC, CACHE_MAGIC_LEN);
+	put_u64(header + CACHE_MAGIC_LEN, key);
+	put_u32(header + CACHE_MAGIC_LEN + 8, count);
+	ok = fwrite(header, sizeof(header), 1, fp) == 1;
+
+	for (r = hd->regions; r && ok; r = r->next) {
+		unsigned char region_header[CACHE_REGION_HEADER_SIZE];
+
+		put_u32(region_header, (uint32_t) r->address);
+		put_u32(region_header + 4, (uint32_t) r->len);
+		ok = fwrite(region_header, sizeof(region_header), 1, fp) == 1 &&
+		     (r->len == 0 || fwrite(r->data, r->len, 1, fp) == 1);
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+
+	/* Don't leave a partial cache file behind */
+	if (!ok) {
+		remove(filename);
+		return HEX_ERROR_FILE_LOAD_ERROR;
+	}
+
+	return HEX_ERROR_OK;
+}
@@ -0,0 +1,70 @@
+/*
+ * M-Stack Firmware Image Loader
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ *
+ * Alan Ott
+ * Signal 11 Software
+ * 2026-10-18
+ */
+
+#ifndef IMAGE_H__
+#define IMAGE_H__
+
+#if _MSC_VER && _MSC_VER < 1600
+	#include "c99.h"
+#else
+	#include <stdint.h>
+#endif
+#include <stddef.h>
+
+#include "hex.h"
+
+/* Formats of firmware image files */
+enum image_format {
+	IMAGE_FORMAT_AUTO,   /* ELF if the file looks like ELF, otherwise HEX */
+	IMAGE_FORMAT_HEX,
+	IMAGE_FORMAT_ELF,
+	IMAGE_FORMAT_BINARY, /* Raw binary, to be loaded at a base address */
+};
+
+/* Load a firmware image from the contents of its file (see
+ * hex_read_file()). The PT_LOAD segments of an ELF file are loaded at
+ * their physical addresses. A raw binary file is loaded at base. */
+enum hex_error_code image_load_buffer(const char *buf, size_t size,
+                                      enum image_format format, size_t base,
+                                      struct hex_data **hd);
+
+/* Cache of preprocessed images
+ *
+ * An image which has been prepared for programming can be saved next to
+ * the file it came from, and loaded back instead of loading and preparing
+ * the file again. The cache is keyed by a 64-bit FNV-1a hash, which the
+ * caller computes with image_hash() over the contents of the file and
+ * anything else the preparation depends on. Loading a cache file with a
+ * different key fails with HEX_ERROR_CANT_OPEN_FILE. */
+#define IMAGE_HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t image_hash(uint64_t hash, const void *data, size_t len);
+enum hex_error_code image_cache_load(const char *filename, uint64_t key,
+                                     struct hex_data **hd);
+enum hex_error_code image_cache_save(const char *filename, uint64_t key,
+                                     const struct hex_data *hd);
+
+#endif /* IMAGE_H__ */
@@ -43,14 +43,38 @@
 #ifdef WIN32
 	#include <Windows.h>
 	#define sleep(X) Sleep(X*1000)
+	#define snprintf _snprintf
 #else
 	#include <unistd.h>
+	#include <pthread.h>
+	#include <sys/time.h>
 #endif
 
 /* Change these for your application */
 #define DEFAULT_VID 0xa0a0
 #define DEFAULT_PID 0x0002
 
+#define MAX_PATHS 64
+
+/* What to do to each device, from the command line */
+struct options {
+	bool program;
+	bool verify;
+	bool incremental;
+	bool erase_all;
+	bool reset;
+	bool no_compress;
+	int queue_depth;
+};
+
+/* One device of a gang */
+struct gang_job {
+	struct bootloader *bl;
+	const struct options *opts;
+	const char *failed_step; /* NULL on success */
+	double seconds;
+};
+
 static bool verbose_output = false;
 #define info(...) do { if (verbose_output) printf(__VA_ARGS__); } while(0)
 
@@ -61,10 +85,44 @@ static void print_usage(const char *prog_name)
 	printf("OPTIONS can be one of:\n");
 	printf("  -d  --dev=VID:PID     USB VID/PID of the device to program\n");
 	printf("  -v, --verify          verify program write\n");
+	printf("  -e, --erase-all       erase the whole flash, not only the blocks\n"
+	       "                        used by the file\n");
+	printf("  -i, --incremental     only erase and program the flash blocks\n"
+	       "                        which differ from the file\n");
+	printf("  -q  --queue-depth=N   number of USB transfers kept in flight\n");
+	printf("  -a, --all             program every connected device with the\n"
+	       "                        VID/PID, in parallel\n");
+	printf("  -p  --path=PATH       program the device at bus/port PATH (such\n"
+	       "                        as 1-4.2). May be given more than once to\n"
+	       "                        program several devices in parallel\n");
+	printf("  -n, --no-compress     don't compress the data sent to the device\n");
+	printf("  -b  --binary=ADDRESS  FILE is a raw binary image, to be loaded\n"
+	       "                        at ADDRESS\n");
+	printf("  -c, --cache           cache the image prepared for the device\n"
+	       "                        in FILE.blimg, and use it next time if\n"
+	       "                        FILE hasn't changed\n");
 	printf("  -l  --verbose         Verbose (loud) output\n");
 	printf("  -r, --reset           reset device when done\n");
 	printf("  -h, --help            print help message and exit\n\n");
 	printf("Use a single hyphen (-) to read firmware hex file from stdin.\n");
+	printf("FILE may be an Intel hex file or an ELF file. ELF files are\n"
+	       "detected automatically.\n");
+}
+
+static bool parse_address(const char *str, size_t *address)
+{
+	char *endptr;
+	unsigned long val;
+
+	if (!*str)
+		return false;
+
+	val = strtoul(str, &endptr, 0);
+	if (*endptr)
+		return false;
+	*address = val;
+
+	return true;
 }
 
 static bool parse_vid_pid(const char *str, uint16_t *vid, uint16_t *pid)
@@ -103,19 +161,212 @@ static bool parse_vid_pid(const char *str, uint16_t *vid, uint16_t *pid)
 	return true;
 }
 
+static double now_seconds(void)
+{
+#ifdef WIN32
+	return GetTickCount() / 1000.0;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* Erase, program, verify and reset one device, as asked for on the
+ * command line. Return NULL on success, or the name of the step which
+ * failed. */
+static const char *flash_device(struct bootloader *bl, const struct options *opts)
+{
+	const char *path = bootloader_get_path(bl);
+	int res;
+
+	if (opts->queue_depth) {
+		res = bootloader_set_queue_depth(bl, opts->queue_depth);
+		if (res < 0)
+			return "Setting the queue depth";
+	}
+
+	if (opts->no_compress)
+		bootloader_set_compression(bl, 0);
+
+	if (opts->program && opts->incremental) {
+		/* Erase and program only what has changed */
+		info("Programming changed blocks of %s.\n", path);
+		res = bootloader_program_incremental(bl);
+		if (res == BOOTLOADER_NOT_SUPPORTED)
+			return "Incremental programming (not supported)";
+		else if (res < 0)
+			return "Programming";
+	}
+	else if (opts->program) {
+		/* Erase. Unless asked to erase everything, erase only the
+		 * flash blocks which the file uses, if the device can. */
+		res = BOOTLOADER_NOT_SUPPORTED;
+		if (!opts->erase_all) {
+			info("Erasing used flash blocks of %s.\n", path);
+			res = bootloader_erase_used(bl);
+		}
+		if (res == BOOTLOADER_NOT_SUPPORTED) {
+			info("Erasing flash of %s.\n", path);
+			res = bootloader_erase(bl);
+		}
+		if (res < 0)
+			return "Erasing";
+
+		/* Program */
+		info("Programming %s.\n", path);
+		res = bootloader_program(bl);
+		if (res < 0)
+			return "Programming";
+	}
+
+	/* Verify */
+	if (opts->verify) {
+		info("Verifying %s.\n", path);
+		res = bootloader_verify(bl);
+		if (res < 0)
+			return "Verification";
+	}
+
+	/* Reset */
+	if (opts->reset) {
+		info("Resetting %s.\n", path);
+		res = bootloader_reset(bl);
+		if (res < 0)
+			return "Reset";
+	}
+
+	return NULL;
+}
+
+/* Describe how much flash data was sent to the device, and how well it
+ * compressed. */
+static void format_transfer_stats(struct bootloader *bl, char *buf, size_t len)
+{
+	size_t data_bytes, sent_bytes;
+
+	bootloader_get_transfer_stats(bl, &data_bytes, &sent_bytes);
+	if (data_bytes == 0)
+		snprintf(buf, len, "no data sent");
+	else if (sent_bytes == data_bytes)
+		snprintf(buf, len, "%lu bytes sent", (unsigned long) data_bytes);
+	else
+		snprintf(buf, len, "%lu bytes sent as %lu (%.1f%%)",
+		         (unsigned long) data_bytes, (unsigned long) sent_bytes,
+		         100.0 * sent_bytes / data_bytes);
+}
+
+#ifdef WIN32
+static DWORD WINAPI gang_thread(LPVOID arg)
+#else
+static void *gang_thread(void *arg)
+#endif
+{
+	struct gang_job *job = arg;
+	double start = now_seconds();
+
+	job->failed_step = flash_device(job->bl, job->opts);
+	job->seconds = now_seconds() - start;
+
+	return 0;
+}
+
+/* Flash all the devices at once, one thread for each, and report how each
+ * one went. Return the number of devices which failed. */
+static int gang_flash(struct bootloader **bls, int count, const struct options *opts)
+{
+	struct gang_job *jobs;
+#ifdef WIN32
+	HANDLE *threads;
+#else
+	pthread_t *threads;
+#endif
+	double start = now_seconds();
+	int failures = 0;
+	int i;
+
+	jobs = calloc(count, sizeof(*jobs));
+	threads = calloc(count, sizeof(*threads));
+	if (!jobs || !threads) {
+		free(jobs);
+		free(threads);
+		return count;
+	}
+
+	printf("Flashing %d devices\n", count);
+	for (i = 0; i < count; i++) {
+		jobs[i].bl = bls[i];
+		jobs[i].opts = opts;
+#ifdef WIN32
+		threads[i] = CreateThread(NULL, 0, gang_thread, &jobs[i], 0, NULL);
+		if (!threads[i])
+			gang_thread(&jobs[i]);
+#else
+		if (pthread_create(&threads[i], NULL, gang_thread, &jobs[i]) != 0) {
+			/* Do this one here instead. */
+			threads[i] = pthread_self();
+			gang_thread(&jobs[i]);
+		}
+#endif
+	}
+
+	for (i = 0; i < count; i++) {
+#ifdef WIN32
+		if (threads[i]) {
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+#else
+		if (!pthread_equal(threads[i], pthread_self()))
+			pthread_join(threads[i], NULL);
+#endif
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *path = bootloader_get_path(bls[i]);
+		char stats[80];
+
+		format_transfer_stats(bls[i], stats, sizeof(stats));
+		if (jobs[i].failed_step) {
+			printf("  %-12s FAILED: %s (%.2f s)\n", path,
+			       jobs[i].failed_step, jobs[i].seconds);
+			failures++;
+		}
+		else {
+			printf("  %-12s OK (%.2f s, %s)\n", path,
+			       jobs[i].seconds, stats);
+		}
+	}
+	printf("%d of %d devices succeeded in %.2f s\n",
+	       count - failures, count, now_seconds() - start);
+
+	free(jobs);
+	free(threads);
+	return failures;
+}
+
 int main(int argc, char **argv)
 {
-	bool do_program = false;
-	bool do_verify = false;
-	bool do_reset = false;
+	struct options opts;
+	struct bootloader_file file;
 	char **itr;
 	const char *opt;
 	const char *filename = NULL;
+	const char *paths[MAX_PATHS];
+	int num_paths = 0;
+	bool do_all = false;
+	const char *failed_step;
+	double start;
+	char stats[80];
 	uint16_t vid = 0, pid = 0;
 	bool vidpid_valid = false;
 	struct bootloader *bl;
 	int res;
 
+	memset(&opts, 0, sizeof(opts));
+	memset(&file, 0, sizeof(file));
+	file.format = IMAGE_FORMAT_AUTO;
+
 	if (argc < 2) {
 		print_usage(argv[0]);
 		return 1;
@@ -134,11 +385,42 @@ int main(int argc, char **argv)
 					return 1;
 				}
 				else if (!strcmp(opt, "--reset"))
-					do_reset = true;
+					opts.reset = true;
 				else if (!strcmp(opt, "--verify"))
-					do_verify = true;
+					opts.verify = true;
+				else if (!strcmp(opt, "--erase-all"))
+					opts.erase_all = true;
+				else if (!strcmp(opt, "--incremental"))
+					opts.incremental = true;
 				else if (!strcmp(opt, "--verbose"))
 					verbose_output = true;
+				else if (!strncmp(opt, "--queue-depth=", 14)) {
+					opts.queue_depth = atoi(opt+14);
+					if (opts.queue_depth <= 0) {
+						fprintf(stderr, "Invalid queue depth\n\n");
+						return 1;
+					}
+				}
+				else if (!strcmp(opt, "--no-compress"))
+					opts.no_compress = true;
+				else if (!strcmp(opt, "--all"))
+					do_all = true;
+				else if (!strncmp(opt, "--binary=", 9)) {
+					if (!parse_address(opt+9, &file.base_address)) {
+						fprintf(stderr, "Invalid address\n\n");
+						return 1;
+					}
+					file.format = IMAGE_FORMAT_BINARY;
+				}
+				else if (!strcmp(opt, "--cache"))
+					file.use_cache = true;
+				else if (!strncmp(opt, "--path=", 7)) {
+					if (num_paths >= MAX_PATHS) {
+						fprintf(stderr, "Too many paths\n\n");
+						return 1;
+					}
+					paths[num_paths++] = opt+7;
+				}
 				else if (!strncmp(opt, "--dev", 5)) {
 					if (opt[5] != '=') {
 						fprintf(stderr, "--dev requires vid/pid pair\n\n");
@@ -162,19 +444,66 @@ int main(int argc, char **argv)
 					   hyphen, which means read from
 					   stdin. */
 					filename = opt;
+					opts.program = true;
 				}
 				while (*c) {
 					/* Short option, only one dash */
 					switch (*c) {
 					case 'v':
-						do_verify = true;
+						opts.verify = true;
 						break;
 					case 'r':
-						do_reset = true;
+						opts.reset = true;
+						break;
+					case 'i':
+						opts.incremental = true;
+						break;
+					case 'e':
+						opts.erase_all = true;
 						break;
 					case 'l':
 						verbose_output = true;
 						break;
+					case 'q':
+						itr++;
+						opt = *itr;
+						if (!opt || atoi(opt) <= 0) {
+							fprintf(stderr, "Must specify a queue depth after -q\n\n");
+							return 1;
+						}
+						opts.queue_depth = atoi(opt);
+						break;
+					case 'a':
+						do_all = true;
+						break;
+					case 'n':
+						opts.no_compress = true;
+						break;
+					case 'b':
+						itr++;
+						opt = *itr;
+						if (!opt || !parse_address(opt, &file.base_address)) {
+							fprintf(stderr, "Must specify an address after -b\n\n");
+							return 1;
+						}
+						file.format = IMAGE_FORMAT_BINARY;
+						break;
+					case 'c':
+						file.use_cache = true;
+						break;
+					case 'p':
+						itr++;
+						opt = *itr;
+						if (!opt) {
+							fprintf(stderr, "Must specify a bus/port path after -p\n\n");
+							return 1;
+						}
+						if (num_paths >= MAX_PATHS) {
+							fprintf(stderr, "Too many paths\n\n");
+							return 1;
+						}
+						paths[num_paths++] = opt;
+						break;
 					case 'd':
 						itr++;
 						opt = *itr;
@@ -204,7 +533,7 @@ int main(int argc, char **argv)
 			}
 			
 			filename = opt;
-			do_program = true;
+			opts.program = true;
 		}
 		itr++;
 		opt = *itr;
@@ -213,16 +542,53 @@ int main(int argc, char **argv)
 	vid = vidpid_valid? vid: DEFAULT_VID;
 	pid = vidpid_valid? pid: DEFAULT_PID;
 	
-	if (!filename && !do_reset) {
+	if (!filename && !opts.reset) {
 	        fprintf(stderr, "No Filename specified. Specify a filename of use \"-\" to read from stdin.\n");
 	        return 1;
 	}
 
 	/* Command line parsing is done. Do the programming of the device. */
+	file.filename = filename;
+
+	if (do_all || num_paths > 0) {
+		/* Gang programming */
+		struct bootloader **bls;
+		int count;
+
+		info("Opening the bootloader devices.\n");
+		res = bootloader_init_multiple(&bls, &count, &file, vid, pid,
+		                               paths, num_paths);
+		if (res == BOOTLOADER_CANT_OPEN_FILE) {
+			fprintf(stderr, "Unable to open file %s\n", filename);
+			return 1;
+		}
+		else if (res == BOOTLOADER_CANT_OPEN_DEVICE) {
+			if (num_paths > 0)
+				fprintf(stderr, "\nUnable to open all of the devices "
+					"at the given paths.\n");
+			else
+				fprintf(stderr, "\nUnable to open devices %04hx:%04hx.\n",
+					vid, pid);
+			fprintf(stderr, "Make sure that the devices are connected "
+				"and that you have proper permissions\nto "
+				"open them.\n");
+			return 1;
+		}
+		else if (res < 0) {
+			fprintf(stderr, "Unable to initialize the devices: %d\n", res);
+			return 1;
+		}
+
+		res = gang_flash(bls, count, &opts);
+		bootloader_free_multiple(bls, count);
+
+		return (res == 0)? 0: 1;
+	}
 
 	/* Open the device */
+	start = now_seconds();
 	info("Opening the bootloader device.\n");
-	res = bootloader_init(&bl, filename, vid, pid);
+	res = bootloader_init(&bl, &file, vid, pid);
 	if (res == BOOTLOADER_CANT_OPEN_FILE) {
 		fprintf(stderr, "Unable to open file %s\n", filename);
 		return 1;
@@ -240,53 +606,25 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	else if (res == BOOTLOADER_MULTIPLE_CONNECTED) {
-		fprintf(stderr, "Multiple devices are connected. Remove all but one.\n");
+		fprintf(stderr, "Multiple devices are connected. Remove all but one,\n"
+			"or use --all to program all of them.\n");
+		return 1;
 	}
 	else if (res < 0) {
 		fprintf(stderr, "Unspecified error initializing bootloader %d\n", res);
 		return 1;
 	}
-	
-	if (do_program) {
-		/* Erase */
-		info("Erasing flash.\n");
-		res = bootloader_erase(bl);
-		if (res < 0) {
-			fprintf(stderr, "Erasing of device failed\n");
-			return 1;
-		}
-
-		/* Program */
-		info("Programming.\n");
-		res = bootloader_program(bl);
-		if (res < 0) {
-			fprintf(stderr, "Programming of device failed\n");
-			return 1;
-		}
-	}
-
-	/* Verify */
-	if (do_verify) {
-		info("Verifying.\n");
-		res = bootloader_verify(bl);
-		if (res < 0) {
-			fprintf(stderr, "Verification of programmed memory failed\n");
-			return 1;
-		}
-	}
 
-	/* Reset */
-	if (do_reset) {
-		info("Resetting the device.\n");
-		res = bootloader_reset(bl);
-		if (res < 0) {
-			fprintf(stderr, "Device Reset failed\n");
-			return 1;
-		}
+	failed_step = flash_device(bl, &opts);
+	if (failed_step)
+		fprintf(stderr, "Failed: %s\n", failed_step);
+	else if (opts.program) {
+		format_transfer_stats(bl, stats, sizeof(stats));
+		printf("Done in %.2f s, %s\n", now_seconds() - start, stats);
 	}
 
 	/* Close */
 	bootloader_free(bl);
 
-	return 0;
+	return failed_step? 1: 0;
 }
@@ -77,6 +77,12 @@ int main(void)
 			}
 		}
 
+		/* A real mouse wakes the host when it is moved. This one
+		 * is always moving, so it wakes the host whenever the host
+		 * suspends it, if the host has enabled Remote Wakeup. */
+		if (usb_is_suspended())
+			usb_remote_wakeup();
+
 		#ifndef USB_USE_INTERRUPTS
 		usb_service();
 		#endif
@@ -38,6 +38,17 @@
 
 #define NUMBER_OF_CONFIGURATIONS 1
 
+/* The CPU clock, as set up by hardware_init(). usb_remote_wakeup() is
+ * timed from it. */
+#if defined(__PIC24FJ64GB002__) || defined(__PIC24FJ32GB002__) || \
+    defined(__PIC24FJ256DA206__)
+	#define FCY 16000000UL /* 32MHz from the FRC and PLL, over 2 */
+#elif defined(_18F46J50) || defined(_16F1459) || defined(_16F1454)
+	#define _XTAL_FREQ 48000000
+#elif defined(__32MX460F512L__) || defined(__32MX795F512L__)
+	#define SYS_CLOCK 60000000 /* 8MHz crystal, with the PLL */
+#endif
+
 /* Ping-pong buffering mode. Valid values are:
 	PPB_NONE         - Do not ping-pong any endpoints
 	PPB_EPO_OUT_ONLY - Ping-pong only endpoint 0 OUT
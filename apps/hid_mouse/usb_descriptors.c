@@ -140,7 +140,7 @@ static const ROMPTR struct configuration_1_packet configuration_1 =
 	1, // bNumInterfaces
 	1, // bConfigurationValue
 	2, // iConfiguration (index of string descriptor)
-	0b10000000,
+	0b10100000, // bmAttributes (0x20=Remote Wakeup)
 	100/2,   // 100/2 indicates 100mA
 	},
 
@@ -0,0 +1,153 @@
+/*
+ * Flash driver for PIC32MX
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#include <string.h>
+#include "flash.h"
+
+#ifdef FLASH_DISK_BLOCK_SIZE
+
+#if defined (__XC32__)
+	#include <xc.h>
+	#include <sys/kmem.h>
+#else
+	#error "Compiler not supported"
+#endif
+
+#define PAGE_SIZE 4096 /* Erase size */
+#define ROW_SIZE 512   /* Row program size */
+#define REGION_SIZE ((uint32_t) FLASH_DISK_NUM_BLOCKS * FLASH_DISK_BLOCK_SIZE)
+
+#if FLASH_DISK_BLOCK_SIZE % PAGE_SIZE != 0
+	#error "FLASH_DISK_BLOCK_SIZE must be a multiple of the page size"
+#endif
+
+/* The region, aligned to a page. Since it's const, it goes in program
+ * flash. It's only read through flash_map(), so the compiler can't assume
+ * it still holds its initial value. */
+static const uint8_t region[REGION_SIZE] __attribute__((aligned(PAGE_SIZE))) =
+	{ [0 ... REGION_SIZE - 1] = 0xff };
+
+static uint32_t region_address(uint32_t offset)
+{
+	return KVA_TO_PA(region) + offset;
+}
+
+/* Perform the non-volatile memory command. This is the same as in the
+ * bootloader (apps/bootloader/firmware/main_pic32mx.c). Return 0 for
+ * success, -1 on error */
+static __attribute__((nomips16)) int8_t nvm_command(uint32_t command)
+{
+	uint32_t irq_state;
+
+	/* Disable interrupts and store the state. */
+	asm volatile("di %0" : "=r" (irq_state));
+
+	/* Set WREN and the command */
+	NVMCON = 0x4000 | command;
+
+	/* Unlock and perform the NVM write, setting the registers in single
+	   instructions. */
+	__asm__ volatile(
+	        "LI $t0, 0xaa996655\n"
+	        "LI $t1, 0x556699aa\n"
+	        "LI $t2, 0x8000\n"  /* 8000 = Set WR */
+	        "LA $t3, NVMKEY\n"
+		"LA $t4, NVMCONSET\n"
+	        "SW $t0, ($t3)\n"
+	        "SW $t1, ($t3)\n"
+	        "SW $t2, ($t4)\n"
+	        : /* no outputs */
+		: /* no inputs */
+		: /* clobber */ "t0", "t1", "t2", "t3", "t4");
+
+	/* Wait for WR to become clear */
+	while (NVMCON & 0x8000)
+		;
+
+	/* Clear WREN */
+	NVMCONCLR = 0x00004000;
+
+	/* Restore interrupt state */
+	if (irq_state & 0x1)
+		asm volatile("ei");
+	else
+		asm volatile("di");
+
+	/* Return error WRERR | LVDERR */
+	return (NVMCON & 0x3000)? -1: 0;
+}
+
+int8_t flash_erase(uint32_t offset, uint32_t len)
+{
+	uint32_t end = offset + len;
+	int8_t res;
+
+	if (end > REGION_SIZE)
+		return -1;
+
+	for (; offset < end; offset += PAGE_SIZE) {
+		NVMADDR = region_address(offset);
+		res = nvm_command(0x04); /* Page erase */
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+int8_t flash_program(uint32_t offset, const uint8_t *data, uint16_t len)
+{
+	uint32_t word;
+	uint16_t i;
+	int8_t res;
+
+	if (offset + len > REGION_SIZE)
+		return -1;
+
+	/* Program whole rows (such as flash disk sectors) in one go, and
+	 * anything else a word at a time. */
+	if (len == ROW_SIZE && offset % ROW_SIZE == 0) {
+		NVMADDR = region_address(offset);
+		NVMSRCADDR = KVA_TO_PA(data);
+		return nvm_command(0x03); /* Row program */
+	}
+
+	for (i = 0; i < len; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		NVMADDR = region_address(offset + i);
+		NVMDATA = word;
+		res = nvm_command(0x01); /* Word program */
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+const uint8_t *flash_map(uint32_t offset)
+{
+	/* Read through KSEG1, which isn't cached, so that what has just
+	 * been programmed is seen. */
+	return (const uint8_t *) PA_TO_KVA1(region_address(offset));
+}
+
+#endif /* FLASH_DISK_BLOCK_SIZE */
@@ -0,0 +1,60 @@
+/*
+ * Flash driver for PIC32MX
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#ifndef S11_PIC_FLASH_H__
+#define S11_PIC_FLASH_H__
+
+#include <stdint.h>
+#include "flash_disk_config.h"
+
+/* Flash Region for the Flash Disk
+ *
+ * This is the back-end for the flash disk component (see flash_disk.h). It
+ * reserves FLASH_DISK_NUM_BLOCKS * FLASH_DISK_BLOCK_SIZE bytes of program
+ * flash, as a constant array, and erases and programs it. Offsets are from
+ * the start of the region.
+ *
+ * The array is initialized to 0xff, so programming the device (or loading
+ * the application with the bootloader) empties the flash disk.
+ *
+ * Like the SPI and timer implementations, this only exists to serve the
+ * supported boards. It is only built when flash_disk_config.h defines
+ * FLASH_DISK_BLOCK_SIZE, which it does for PIC32MX.
+ */
+
+#ifdef FLASH_DISK_BLOCK_SIZE
+
+/* Erase len bytes of the region at offset. Both must be multiples of the
+ * flash page size. Return 0 on success or -1 on failure. */
+int8_t flash_erase(uint32_t offset, uint32_t len);
+
+/* Program len bytes of data at offset. Both must be multiples of 4 bytes
+ * (one word), and data must be in RAM. Return 0 on success or -1 on
+ * failure. */
+int8_t flash_program(uint32_t offset, const uint8_t *data, uint16_t len);
+
+/* Return a pointer through which the region can be read at offset. */
+const uint8_t *flash_map(uint32_t offset);
+
+#endif
+
+#endif /* S11_PIC_FLASH_H__ */
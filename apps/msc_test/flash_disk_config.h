@@ -0,0 +1,39 @@
+/*
+ * Sample Flash Disk Configuration
+ *
+ * This file may be used by anyone for any purpose and may be used as a
+ * starting point making your own application using M-Stack.
+ *
+ * It is worth noting that M-Stack itself is not under the same license
+ * as this file.
+ *
+ * M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  For details, see sections 7, 8, and 9
+ * of the Apache License, version 2.0 which apply to this file.  If you have
+ * purchased a commercial license for this software from Signal 11 Software,
+ * your commerical license superceeds the information in this header.
+ *
+ * Alan Ott
+ * Signal 11 Software
+ * 2026-10-18
+ */
+
+#ifndef FLASH_DISK_CONFIG_H__
+#define FLASH_DISK_CONFIG_H__
+
+/* The flash disk is only on PIC32MX, where flash can be read through a
+ * pointer and there is plenty of it (see flash.c). */
+#ifdef __PIC32MX__
+
+#define FLASH_DISK_BLOCK_SIZE 4096 /* One flash page */
+#define FLASH_DISK_NUM_BLOCKS 16   /* 64 KiB of flash, for a 49 KiB disk */
+
+/* Callbacks from flash_disk.h */
+#define FLASH_DISK_ERASE   app_flash_erase
+#define FLASH_DISK_PROGRAM app_flash_program
+#define FLASH_DISK_MAP     app_flash_map
+
+#endif
+
+#endif /* FLASH_DISK_CONFIG_H__ */
@@ -27,9 +27,15 @@
 #include "usb_msc.h"
 
 #include "mmc.h"
+#include "ramdisk.h"
+#include "flash_disk_config.h"
+#ifdef FLASH_DISK_BLOCK_SIZE
+#include "flash_disk.h"
+#endif
 
 #include "spi.h"
 #include "timer.h"
+#include "flash.h"
 #include "hardware.h"
 
 
@@ -39,7 +45,31 @@
 #endif
 
 #ifdef MULTI_CLASS_DEVICE
-static uint8_t msc_interfaces[] = { 0 };
+static uint8_t msc_interfaces[] =
+	USB_DESC_INTERFACE_LIST(APP_CONFIGURATION_1, MSC);
+#endif
+
+/* Dispatch tables, indexed by interface number and by endpoint number. */
+#ifdef USB_INTERFACE_SETUP_HANDLERS
+const usb_setup_request_handler
+	USB_INTERFACE_SETUP_HANDLERS[NUMBER_OF_INTERFACES] =
+	USB_DESC_INTERFACE_SETUP_HANDLERS(APP_CONFIGURATION_1);
+#endif
+#ifdef USB_IN_TRANSACTION_HANDLERS
+const usb_transaction_handler
+	USB_IN_TRANSACTION_HANDLERS[NUM_ENDPOINT_NUMBERS+1] = {
+	NULL,
+	msc_in_transaction_complete, /* APP_MSC_IN_ENDPOINT */
+	msc_in_transaction_complete, /* APP_MSC_UAS_STATUS_ENDPOINT */
+};
+#endif
+#ifdef USB_OUT_TRANSACTION_HANDLERS
+const usb_transaction_handler
+	USB_OUT_TRANSACTION_HANDLERS[NUM_ENDPOINT_NUMBERS+1] = {
+	NULL,
+	msc_out_transaction_complete, /* APP_MSC_OUT_ENDPOINT */
+	msc_out_transaction_complete, /* APP_MSC_UAS_COMMAND_ENDPOINT */
+};
 #endif
 
 /* Data for each instance of the USB Mass Storage class. This needs to be made
@@ -66,9 +96,71 @@ struct msc_rw_data {
 	uint16_t num_blocks;
 	bool stopped;
 	uint32_t bytes_handled;
+	bool unmap_operation_needed;
+	uint32_t unmap_blocks;
+	bool sync_operation_needed;
 };
 struct msc_rw_data msc_rw_data;
 
+/* Define RAM_DISK_BLOCKS to add a RAM disk as LUN 1, next to the MMC card
+ * (LUN 0). Since it takes the MMC card and SPI out of the picture, it shows
+ * how fast the USB and MSC layers are on their own. Only PIC32MX has the
+ * RAM to make it a useful size. It's kept small enough to fit in the
+ * 32 KiB of the PIC32MX460F512L. */
+#ifdef __PIC32MX__
+#define RAM_DISK_BLOCKS 32 /* 16 KiB */
+#endif
+
+/* The RAM disk uses the MMC card's block size unless RAM_DISK_BLOCK_SIZE
+ * is set. Setting it to 4096 (with RAM_DISK_BLOCKS 4) makes a 4K-native
+ * LUN, which the host reads and writes in whole 4 KiB blocks. */
+#ifndef RAM_DISK_BLOCK_SIZE
+#define RAM_DISK_BLOCK_SIZE MMC_BLOCK_SIZE
+#endif
+
+#ifdef RAM_DISK_BLOCKS
+#define RAM_DISK_LUN 1
+static uint8_t ram_disk_data[RAM_DISK_BLOCKS * RAM_DISK_BLOCK_SIZE];
+static struct ramdisk ram_disk;
+#endif
+
+/* Where flash_disk_config.h describes a flash region (on PIC32MX), a flash
+ * disk in the MCU's own program flash is LUN 2. Sectors written to it are
+ * cached in RAM, and the cache is flushed to flash once the host has left
+ * it alone for FLASH_DISK_FLUSH_FRAMES Start-of-Frames (milliseconds), or
+ * when it is stopped. */
+#ifdef FLASH_DISK_BLOCK_SIZE
+#define FLASH_DISK_LUN 2
+#define FLASH_DISK_FLUSH_FRAMES 1000
+static struct flash_disk flash_disk;
+static volatile uint16_t flash_disk_idle_frames;
+#endif
+
+/* Define MMC_CACHE_BLOCKS to cache writes to the MMC card in RAM. A write
+ * which fits in the cache is acknowledged as soon as it has been received,
+ * and written to the card later, which hides the time the card is busy
+ * from the small, bursty writes a filesystem makes. The cache is written
+ * back once the host has left the card alone for MMC_CACHE_FLUSH_FRAMES
+ * Start-of-Frames (milliseconds), before a write which doesn't fit, for
+ * SYNCHRONIZE CACHE and FUA writes, and when the card is stopped or the
+ * interface is reset. */
+#if defined(__PIC32MX__) && defined(MSC_SYNCHRONIZE_CACHE)
+#define MMC_CACHE_BLOCKS 4 /* 2 KiB */
+#endif
+
+#ifdef MMC_CACHE_BLOCKS
+#define MMC_CACHE_FLUSH_FRAMES 100
+/* Blocks are appended to the cache in the order they're written, so a
+ * block written more than once is in it more than once, and the newest
+ * copy is the last. */
+static uint8_t mmc_cache_data[MMC_CACHE_BLOCKS][MMC_BLOCK_SIZE];
+static uint32_t mmc_cache_lba[MMC_CACHE_BLOCKS];
+static volatile uint8_t mmc_cache_count;    /* Blocks in the cache */
+static volatile uint8_t mmc_cache_filling;  /* Blocks being received */
+static volatile bool mmc_cache_flushing;
+static volatile uint16_t mmc_cache_idle_frames;
+#endif
+
 /* This flag is set when a USB protocol reset is initiated by the host,
  * requiring the MSC class to be reset */
 static bool msc_reset_required;
@@ -105,11 +197,12 @@ static uint8_t mmc_read_buf[MMC_BLOCK_SIZE];
 /* Make sure the write buffer is an appropriate size */
 #if WRITE_BUF_SIZE > MMC_BLOCK_SIZE
 	#error "WRITE_BUF_SIZE must be <= MMC_BLOCK_SIZE"
-#elif WRITE_BUF_SIZE < CONCAT(EP_, APP_MSC_OUT_ENDPOINT, _OUT_LEN)
-	#error WRITE_BUF_SIZE must be >= the OUT endpoint size
-#elif WRITE_BUF_SIZE % CONCAT(EP_, APP_MSC_OUT_ENDPOINT, _OUT_LEN) != 0
-	#error WRITE_BUF_SIZE must be divisible by the OUT endpoint size
 #endif
+
+/* The endpoint sizes come from the descriptor list (see usb_config.h) and
+ * are not visible to the preprocessor, so check them at compile time. */
+STATIC_SIZE_CHECK_EQUAL((WRITE_BUF_SIZE >= CONCAT(EP_, APP_MSC_OUT_ENDPOINT, _OUT_LEN)), 1);
+STATIC_SIZE_CHECK_EQUAL((WRITE_BUF_SIZE % CONCAT(EP_, APP_MSC_OUT_ENDPOINT, _OUT_LEN)), 0);
 #if !defined(MULTI_BLOCK_WRITE) && WRITE_BUF_SIZE != MMC_BLOCK_SIZE
 	#error WRITE_BUF_SIZE must be set to MMC_BLOCK_SIZE if MULTI_BLOCK_WRITE is not set.
 #endif
@@ -117,6 +210,105 @@ static uint8_t mmc_read_buf[MMC_BLOCK_SIZE];
 #undef CONCAT3
 #undef CONCAT
 
+#ifdef MSC_STATISTICS
+/* Count of Start-of-Frame packets, which come once per millisecond while
+ * the bus is active. This is the timestamp for the MSC statistics. */
+static volatile uint32_t sof_count;
+static uint32_t medium_busy_start;
+#endif
+
+/* Time the blocking MMC operations for the MSC statistics, which report
+ * the time spent waiting for the card separately. */
+static inline void medium_busy_begin(void)
+{
+#ifdef MSC_STATISTICS
+	medium_busy_start = app_msc_get_timestamp();
+#endif
+}
+
+static inline void medium_busy_end(struct msc_application_data *msc)
+{
+#ifdef MSC_STATISTICS
+	msc_statistics_add_medium_time(msc,
+	                  app_msc_get_timestamp() - medium_busy_start);
+#endif
+}
+
+#ifdef MMC_CACHE_BLOCKS
+/* Find the newest copy of a block in the cache, or return NULL if it's not
+ * there. */
+static const uint8_t *mmc_cache_find(uint32_t lba_address)
+{
+	uint8_t i;
+
+	for (i = mmc_cache_count; i > 0; i--) {
+		if (mmc_cache_lba[i - 1] == lba_address)
+			return mmc_cache_data[i - 1];
+	}
+
+	return NULL;
+}
+
+/* Write the cache to the MMC card, oldest block first, so the newest copy
+ * of each block is the one left on the card. This blocks, so call it from
+ * the main loop. If the card can't be written (or has been removed), the
+ * cache is emptied anyway, since there's nowhere else for the data to go.
+ *
+ * Returns 0 on success, 1 if a write is being received into the cache
+ * (so it can't be written now), or -1 if writing the card failed. */
+static int8_t mmc_cache_flush(struct msc_application_data *msc)
+{
+	uint8_t i;
+	int8_t res = 0;
+
+	/* Keep app_msc_start_write() from starting to fill the cache, then
+	 * check whether it already had. */
+	mmc_cache_flushing = true;
+	if (mmc_cache_filling) {
+		mmc_cache_flushing = false;
+		return 1;
+	}
+
+	for (i = 0; i < mmc_cache_count; i++) {
+		if (!mmc_is_initialized(&mmc)) {
+			res = -1;
+			break;
+		}
+
+		medium_busy_begin();
+		res = mmc_write_block(&mmc, mmc_cache_lba[i],
+		                      mmc_cache_data[i]);
+		medium_busy_end(msc);
+		if (res < 0)
+			break;
+	}
+
+	mmc_cache_count = 0;
+	mmc_cache_idle_frames = 0;
+	mmc_cache_flushing = false;
+
+	return res;
+}
+
+/* Receive complete callback for writes into the cache. The whole write
+ * has been received, so it's complete as far as the host is concerned.
+ * This is called from the MSC class, in interrupt context. */
+static void cache_rx_complete_callback(struct msc_application_data *app_data,
+                                       bool transfer_ok)
+{
+	uint8_t num_blocks = mmc_cache_filling;
+
+	if (transfer_ok)
+		mmc_cache_count += num_blocks;
+	mmc_cache_filling = 0;
+	mmc_cache_idle_frames = 0;
+
+	msc_notify_write_data_handled(app_data);
+	msc_notify_write_operation_complete(app_data, transfer_ok,
+	        transfer_ok? (uint32_t) num_blocks * MMC_BLOCK_SIZE: 0);
+}
+#endif
+
 /* Transmission complete callback. This is called when an entire block has
  * been transfered to the host. */
 static void tx_complete_callback(struct msc_application_data *app_data,
@@ -143,9 +335,22 @@ static int8_t do_read(struct msc_application_data *msc,
 		 * send the next one. */
 		msc_rw_data.read_operation_needed = false;
 
-		res = mmc_read_block(&mmc, d->lba_address, mmc_read_buf);
-		if (res < 0)
-			goto fail;
+#ifdef MMC_CACHE_BLOCKS
+		/* Blocks in the cache are newer than those on the card. */
+		const uint8_t *cached = mmc_cache_find(d->lba_address);
+		if (cached) {
+			memcpy(mmc_read_buf, cached, MMC_BLOCK_SIZE);
+		}
+		else
+#endif
+		{
+			medium_busy_begin();
+			res = mmc_read_block(&mmc, d->lba_address,
+			                     mmc_read_buf);
+			medium_busy_end(msc);
+			if (res < 0)
+				goto fail;
+		}
 
 		res = msc_start_send_to_host(msc,
 		                            mmc_read_buf, MMC_BLOCK_SIZE,
@@ -183,6 +388,19 @@ static int8_t do_write(struct msc_application_data *msc,
 {
 	int8_t res = 0;
 
+#ifdef MMC_CACHE_BLOCKS
+	/* Write the cache back before writing to the card directly, so that
+	 * what's in it can't overwrite newer data later. */
+	if (msc_rw_data.bytes_handled == 0 &&
+	    !msc_rw_data.cancel_multiblock_write) {
+		if (mmc_cache_flush(msc) < 0) {
+			msc_notify_write_operation_complete(msc, false, 0);
+			msc_rw_data.write_operation_needed = false;
+			return -1;
+		}
+	}
+#endif
+
 #ifdef MULTI_BLOCK_WRITE
 	if (msc_rw_data.cancel_multiblock_write) {
 		/* The transport has been canceled from the USB side either by
@@ -201,13 +419,17 @@ static int8_t do_write(struct msc_application_data *msc,
 	if (msc_rw_data.bytes_handled == 0) {
 		/* Write is requested, but hasn't started yet.
 		 * Start the write operation. */
+		medium_busy_begin();
 		res = mmc_multiblock_write_start(&mmc, msc_rw_data.lba_address);
+		medium_busy_end(msc);
 		if (res < 0)
 			goto fail;
 	}
 
 	/* Give the data to the MMC card */
+	medium_busy_begin();
 	res = mmc_multiblock_write_data(&mmc, mmc_read_buf, WRITE_BUF_SIZE);
+	medium_busy_end(msc);
 	if (res < 0)
 		goto fail;
 
@@ -228,7 +450,9 @@ static int8_t do_write(struct msc_application_data *msc,
 	    (uint32_t) msc_rw_data.num_blocks * MMC_BLOCK_SIZE) {
 		/* All the expected data has been received. Finish
 		 * the write operation. */
+		medium_busy_begin();
 		res = mmc_multiblock_write_end(&mmc);
+		medium_busy_end(msc);
 		if (res < 0)
 			goto fail;
 
@@ -250,7 +474,9 @@ fail:
 	return res;
 #else
 	/* Perform the blocking, single-block write */
+	medium_busy_begin();
 	res = mmc_write_block(&mmc, msc_rw_data.lba_address, mmc_read_buf);
+	medium_busy_end(msc);
 	msc_rw_data.write_operation_needed = false;
 
 	/* Increment the LBA address for the next write. Since the USB
@@ -282,6 +508,69 @@ fail:
 }
 #endif
 
+#ifdef MSC_UNMAP
+/* Discard the blocks passed to app_msc_unmap(). Erasing the MMC card
+ * blocks, so this is called from the main loop, like do_read() and
+ * do_write(). */
+static void do_unmap(struct msc_application_data *msc,
+                     struct msc_rw_data *d)
+{
+	int8_t res;
+
+	d->unmap_operation_needed = false;
+
+#ifdef FLASH_DISK_LUN
+	if (d->lun == FLASH_DISK_LUN) {
+		res = flash_disk_unmap(&flash_disk,
+		                       d->lba_address, d->unmap_blocks);
+		msc_notify_unmap_complete(msc, res == MSC_SUCCESS);
+		return;
+	}
+#endif
+
+#ifdef MMC_CACHE_BLOCKS
+	/* Cached blocks would come back when the cache is written. */
+	if (mmc_cache_flush(msc) < 0) {
+		msc_notify_unmap_complete(msc, false);
+		return;
+	}
+#endif
+
+	medium_busy_begin();
+	res = mmc_erase(&mmc, d->lba_address, d->unmap_blocks);
+	medium_busy_end(msc);
+
+	msc_notify_unmap_complete(msc, res == 0);
+}
+#endif
+
+#ifdef MSC_SYNCHRONIZE_CACHE
+/* Write back the cache of the LUN passed to app_msc_synchronize_cache().
+ * This blocks, so it's called from the main loop. */
+static void do_sync(struct msc_application_data *msc,
+                    struct msc_rw_data *d)
+{
+	int8_t res = 0;
+
+	d->sync_operation_needed = false;
+
+#ifdef FLASH_DISK_LUN
+	if (d->lun == FLASH_DISK_LUN) {
+		res = flash_disk_flush(&flash_disk);
+		flash_disk_idle_frames = 0;
+		msc_notify_synchronize_cache_complete(msc, res == 0);
+		return;
+	}
+#endif
+
+#ifdef MMC_CACHE_BLOCKS
+	res = mmc_cache_flush(msc);
+#endif
+
+	msc_notify_synchronize_cache_complete(msc, res == 0);
+}
+#endif
+
 int main(void)
 {
 	hardware_init();
@@ -303,17 +592,54 @@ int main(void)
 		 * one could be inserted into the drive later. */
 	}
 
+#ifdef RAM_DISK_LUN
+	ram_disk.data = ram_disk_data;
+	ram_disk.num_blocks = RAM_DISK_BLOCKS;
+	ram_disk.block_size = RAM_DISK_BLOCK_SIZE;
+	ram_disk.write_protect = false;
+	ramdisk_init(&ram_disk);
+#endif
+
+#ifdef FLASH_DISK_LUN
+	/* Mount the flash disk. If it can't be mounted, start over with an
+	 * empty one. */
+	flash_disk.instance = 0;
+	flash_disk.write_protect = false;
+	if (flash_disk_init(&flash_disk) < 0)
+		flash_disk_format(&flash_disk);
+#endif
+
 #ifdef MULTI_CLASS_DEVICE
 	msc_set_interface_list(msc_interfaces, sizeof(msc_interfaces));
 #endif
 	/* Initialize the MSC data for each interface. Make sure these
 	 * match the values in the device descriptor. */
 	msc_data.interface = APP_MSC_INTERFACE;
+#if defined(FLASH_DISK_LUN)
+	msc_data.max_lun = FLASH_DISK_LUN;
+#elif defined(RAM_DISK_LUN)
+	msc_data.max_lun = RAM_DISK_LUN;
+#else
 	msc_data.max_lun = 0;
+#endif
 	msc_data.in_endpoint = APP_MSC_IN_ENDPOINT;
 	msc_data.out_endpoint = APP_MSC_OUT_ENDPOINT;
 	msc_data.in_endpoint_size = EP_1_IN_LEN;
+#ifdef MSC_UAS_SUPPORT
+	msc_data.uas_command_endpoint = APP_MSC_UAS_COMMAND_ENDPOINT;
+	msc_data.uas_status_endpoint = APP_MSC_UAS_STATUS_ENDPOINT;
+#endif
 	msc_data.media_is_removable_mask = (1 << 0); /* One bit per LUN */
+#ifdef MSC_SYNCHRONIZE_CACHE
+	/* The LUNs which acknowledge writes before they reach the medium */
+	msc_data.write_cache_mask = 0;
+#ifdef MMC_CACHE_BLOCKS
+	msc_data.write_cache_mask |= (1 << 0);
+#endif
+#ifdef FLASH_DISK_LUN
+	msc_data.write_cache_mask |= (1 << FLASH_DISK_LUN);
+#endif
+#endif
 	msc_data.vendor = "Signal11"; /* Get a vendor ID from http://www.t10.org/lists/2vid.htm */
 	msc_data.product = "TEST";
 	msc_data.revision = "0001";
@@ -346,6 +672,27 @@ int main(void)
 				/* do_write() will now reset the MMC card to a
 				 * known state */
 				do_write(&msc_data, &msc_rw_data);
+#ifdef MSC_UNMAP
+				msc_rw_data.unmap_operation_needed = false;
+#endif
+#ifdef MSC_SYNCHRONIZE_CACHE
+				msc_rw_data.sync_operation_needed = false;
+#endif
+#ifdef MMC_CACHE_BLOCKS
+				/* Writes in the cache have been acknowledged
+				 * to the host, so write them to the card
+				 * rather than dropping them. A write which
+				 * was being received into the cache is
+				 * dropped, as the host never saw it
+				 * complete. */
+				mmc_cache_filling = 0;
+				mmc_cache_flush(&msc_data);
+#endif
+
+#ifdef FLASH_DISK_LUN
+				/* Abandon any flash disk transfer. */
+				flash_disk_cancel(&flash_disk);
+#endif
 
 				/* Reset the MSC. */
 				msc_init(&msc_data, 1);
@@ -359,6 +706,35 @@ int main(void)
 			if (msc_rw_data.write_operation_needed) {
 				do_write(&msc_data, &msc_rw_data);
 			}
+#endif
+#ifdef MSC_UNMAP
+			if (msc_rw_data.unmap_operation_needed) {
+				do_unmap(&msc_data, &msc_rw_data);
+			}
+#endif
+#ifdef MSC_SYNCHRONIZE_CACHE
+			if (msc_rw_data.sync_operation_needed) {
+				do_sync(&msc_data, &msc_rw_data);
+			}
+#endif
+#ifdef MMC_CACHE_BLOCKS
+			/* Write back the MMC card's cache once the host
+			 * has been idle for a while. */
+			if (mmc_cache_count > 0 &&
+			    mmc_cache_idle_frames >= MMC_CACHE_FLUSH_FRAMES) {
+				mmc_cache_flush(&msc_data);
+			}
+#endif
+
+#ifdef FLASH_DISK_LUN
+			/* Read and write the flash disk, and write back its
+			 * cache once the host has been idle for a while. */
+			flash_disk_service(&flash_disk);
+
+			if (flash_disk_idle_frames >= FLASH_DISK_FLUSH_FRAMES) {
+				flash_disk_flush(&flash_disk);
+				flash_disk_idle_frames = 0;
+			}
 #endif
                 }
 
@@ -391,23 +767,26 @@ void app_endpoint_halt_callback(uint8_t endpoint, bool halted)
 
 int8_t app_set_interface_callback(uint8_t interface, uint8_t alt_setting)
 {
-	return 0;
+	/* The MSC class switches between Bulk-Only Transport and UAS. */
+	return msc_set_interface(interface, alt_setting);
 }
 
 int8_t app_get_interface_callback(uint8_t interface)
 {
-	return 0;
+	return msc_get_interface(interface);
 }
 
 void app_out_transaction_callback(uint8_t endpoint)
 {
-	if (endpoint == APP_MSC_OUT_ENDPOINT)
+	if (endpoint == APP_MSC_OUT_ENDPOINT ||
+	    endpoint == APP_MSC_UAS_COMMAND_ENDPOINT)
 		msc_out_transaction_complete(endpoint);
 }
 
 void app_in_transaction_complete_callback(uint8_t endpoint)
 {
-	if (endpoint == APP_MSC_IN_ENDPOINT)
+	if (endpoint == APP_MSC_IN_ENDPOINT ||
+	    endpoint == APP_MSC_UAS_STATUS_ENDPOINT)
 		msc_in_transaction_complete(endpoint);
 }
 
@@ -432,7 +811,17 @@ int16_t app_unknown_get_descriptor_callback(const struct setup_packet *pkt, cons
 
 void app_start_of_frame_callback(void)
 {
-
+#ifdef MSC_STATISTICS
+	sof_count++;
+#endif
+#ifdef FLASH_DISK_LUN
+	if (flash_disk_idle_frames < FLASH_DISK_FLUSH_FRAMES)
+		flash_disk_idle_frames++;
+#endif
+#ifdef MMC_CACHE_BLOCKS
+	if (mmc_cache_idle_frames < MMC_CACHE_FLUSH_FRAMES)
+		mmc_cache_idle_frames++;
+#endif
 }
 
 void app_usb_reset_callback(void)
@@ -443,6 +832,21 @@ void app_usb_reset_callback(void)
 
 /* MSC class callbacks */
 
+#ifdef MSC_STATISTICS
+uint32_t app_msc_get_timestamp(void)
+{
+	uint32_t count;
+
+	/* The main loop calls this too, so read until two reads agree in
+	 * case the SOF interrupt changed the count in the middle of one. */
+	do {
+		count = sof_count;
+	} while (count != sof_count);
+
+	return count;
+}
+#endif
+
 int8_t app_msc_reset(uint8_t interface)
 {
 	/* RESET control transfer. In our case it's the same
@@ -458,6 +862,16 @@ int8_t app_get_storage_info(const struct msc_application_data *app_data,
                             uint32_t *num_blocks,
                             bool *write_protect)
 {
+#ifdef RAM_DISK_LUN
+	if (lun == RAM_DISK_LUN)
+		return ramdisk_get_storage_info(&ram_disk, block_size,
+		                                num_blocks, write_protect);
+#endif
+#ifdef FLASH_DISK_LUN
+	if (lun == FLASH_DISK_LUN)
+		return flash_disk_get_storage_info(&flash_disk, block_size,
+		                                   num_blocks, write_protect);
+#endif
 	if (lun > 0)
 		return MSC_ERROR_INVALID_LUN;
 
@@ -493,6 +907,15 @@ int8_t app_get_unit_ready(const struct msc_application_data *app_data,
 	 * could be pulled between the call to this function and that one.
 	 */
 
+#ifdef RAM_DISK_LUN
+	if (lun == RAM_DISK_LUN)
+		return ramdisk_unit_ready(&ram_disk);
+#endif
+#ifdef FLASH_DISK_LUN
+	if (lun == FLASH_DISK_LUN)
+		return flash_disk_unit_ready(&flash_disk);
+#endif
+
 	/* Check that the LUN is within range. In most cases there will only
 	 * be one LUN. */
 	if (lun > 0)
@@ -525,13 +948,33 @@ int8_t app_get_unit_ready(const struct msc_application_data *app_data,
 int8_t app_start_stop_unit(const struct msc_application_data *app_data,
 			   uint8_t lun, bool start, bool load_eject)
 {
+#ifdef RAM_DISK_LUN
+	/* The RAM disk is always started. */
+	if (lun == RAM_DISK_LUN)
+		return MSC_SUCCESS;
+#endif
+#ifdef FLASH_DISK_LUN
+	/* The flash disk is always started. With MSC_SYNCHRONIZE_CACHE, its
+	 * cache has been written back before a stop (such as when it's
+	 * ejected) is passed here. Otherwise, have it flushed now. */
+	if (lun == FLASH_DISK_LUN) {
+#ifndef MSC_SYNCHRONIZE_CACHE
+		if (!start)
+			flash_disk_idle_frames = FLASH_DISK_FLUSH_FRAMES;
+#endif
+		return MSC_SUCCESS;
+	}
+#endif
+
 	/* Check that the LUN is within range. In most cases there will only
 	 * be one LUN. */
 	if (lun > 0)
 		return MSC_ERROR_INVALID_LUN;
 
 	if (!start) {
-		/* Stop the unit */
+		/* Stop the unit. With a write-back cache, the MSC class has
+		 * already had the cache written back, so the card can be
+		 * released now. */
 		mmc_set_uninitialized(&mmc);
 		msc_rw_data.stopped = true;
 	}
@@ -565,6 +1008,21 @@ int8_t app_msc_start_read(struct msc_application_data *app_data, uint8_t lun,
 	if (msc_reset_required)
 		return MSC_ERROR_MEDIUM_NOT_PRESENT;
 
+#ifdef RAM_DISK_LUN
+	/* The RAM disk sends the data itself, from interrupt context. */
+	if (lun == RAM_DISK_LUN)
+		return ramdisk_start_read(&ram_disk, app_data,
+		                          lba_address, num_blocks);
+#endif
+#ifdef FLASH_DISK_LUN
+	/* The flash disk sends the data from flash_disk_service(). */
+	if (lun == FLASH_DISK_LUN) {
+		flash_disk_idle_frames = 0;
+		return flash_disk_start_read(&flash_disk, app_data,
+		                             lba_address, num_blocks);
+	}
+#endif
+
 	if (lun > 0)
 		return MSC_ERROR_INVALID_LUN;
 
@@ -590,12 +1048,49 @@ int8_t app_msc_start_write(
 	if (msc_reset_required)
 		return MSC_ERROR_MEDIUM_NOT_PRESENT;
 
+#if defined(RAM_DISK_LUN) && defined(MSC_WRITE_SUPPORT)
+	/* The data is received straight into the RAM disk. */
+	if (lun == RAM_DISK_LUN)
+		return ramdisk_start_write(&ram_disk, app_data, lba_address,
+		                           num_blocks, buffer, buffer_len,
+		                           callback);
+#endif
+#if defined(FLASH_DISK_LUN) && defined(MSC_WRITE_SUPPORT)
+	/* The flash disk takes the data from flash_disk_service(). */
+	if (lun == FLASH_DISK_LUN) {
+		flash_disk_idle_frames = 0;
+		return flash_disk_start_write(&flash_disk, app_data,
+		                              lba_address, num_blocks,
+		                              buffer, buffer_len, callback);
+	}
+#endif
+
 	if (lun > 0)
 		return MSC_ERROR_INVALID_LUN;
 
 	if (lba_address + num_blocks > mmc_get_num_blocks(&mmc))
 		return MSC_ERROR_INVALID_ADDRESS;
 
+#ifdef MMC_CACHE_BLOCKS
+	/* Receive the write into the cache if it fits, unless it has to go
+	 * to the card before it completes (FUA). */
+	if (!app_data->sync_after_write && !mmc_cache_flushing &&
+	    num_blocks <= MMC_CACHE_BLOCKS - mmc_cache_count) {
+		uint8_t i;
+
+		for (i = 0; i < num_blocks; i++)
+			mmc_cache_lba[mmc_cache_count + i] = lba_address + i;
+
+		mmc_cache_filling = num_blocks;
+		mmc_cache_idle_frames = 0;
+		*buffer = mmc_cache_data[mmc_cache_count];
+		*buffer_len = (size_t) num_blocks * MMC_BLOCK_SIZE;
+		*callback = cache_rx_complete_callback;
+
+		return MSC_SUCCESS;
+	}
+#endif
+
 	msc_rw_data.lba_address = lba_address;
 	msc_rw_data.num_blocks = num_blocks;
 	msc_rw_data.bytes_handled = 0;
@@ -606,6 +1101,76 @@ int8_t app_msc_start_write(
 	return MSC_SUCCESS;
 }
 
+#ifdef MSC_UNMAP
+/* MSC_UNMAP callback. The blocks are erased (or dropped from the flash
+ * disk) by do_unmap() in the main loop.
+ *
+ * This function is called from interrupt context and must not block.
+ */
+int8_t app_msc_unmap(struct msc_application_data *app_data,
+                     uint8_t lun, uint32_t lba_address, uint32_t num_blocks)
+{
+	/* If a reset is in progress, don't allow any unmaps to start. */
+	if (msc_reset_required)
+		return MSC_ERROR_MEDIUM_NOT_PRESENT;
+
+#ifdef RAM_DISK_LUN
+	/* There's nothing to gain from discarding RAM, and unmapped
+	 * blocks may keep their data, so just check the range. */
+	if (lun == RAM_DISK_LUN) {
+		if (lba_address >= ram_disk.num_blocks ||
+		    num_blocks > ram_disk.num_blocks - lba_address)
+			return MSC_ERROR_INVALID_ADDRESS;
+
+		msc_notify_unmap_complete(app_data, true);
+		return MSC_SUCCESS;
+	}
+#endif
+#ifdef FLASH_DISK_LUN
+	if (lun == FLASH_DISK_LUN) {
+		flash_disk_idle_frames = 0;
+	}
+	else
+#endif
+	{
+		if (lun > 0)
+			return MSC_ERROR_INVALID_LUN;
+
+		if (lba_address >= mmc_get_num_blocks(&mmc) ||
+		    num_blocks > mmc_get_num_blocks(&mmc) - lba_address)
+			return MSC_ERROR_INVALID_ADDRESS;
+	}
+
+	msc_rw_data.lun = lun;
+	msc_rw_data.lba_address = lba_address;
+	msc_rw_data.unmap_blocks = num_blocks;
+	msc_rw_data.unmap_operation_needed = true;
+
+	return MSC_SUCCESS;
+}
+#endif
+
+#ifdef MSC_SYNCHRONIZE_CACHE
+/* MSC_SYNCHRONIZE_CACHE callback. This is only called for the LUNs in
+ * write_cache_mask. The cache is written back by do_sync() in the main
+ * loop.
+ *
+ * This function is called from interrupt context and must not block.
+ */
+int8_t app_msc_synchronize_cache(struct msc_application_data *app_data,
+                                 uint8_t lun)
+{
+	/* If a reset is in progress, the cache is written back anyway. */
+	if (msc_reset_required)
+		return MSC_ERROR_MEDIUM_NOT_PRESENT;
+
+	msc_rw_data.lun = lun;
+	msc_rw_data.sync_operation_needed = true;
+
+	return MSC_SUCCESS;
+}
+#endif
+
 /* MMC implementation callbacks. These just glue the MMC implementation
  * to the SPI implementation and the timer implementation. */
 
@@ -648,6 +1213,30 @@ void app_timer_stop(uint8_t instance)
 	timer_stop();
 }
 
+#ifdef FLASH_DISK_LUN
+/* Flash disk implementation callbacks. These glue the flash disk
+ * implementation to the flash region in flash.c. */
+
+int8_t app_flash_erase(uint8_t instance, uint32_t offset)
+{
+	/* Ignore instance since we only have one flash disk. */
+	return flash_erase(offset, FLASH_DISK_BLOCK_SIZE);
+}
+
+int8_t app_flash_program(uint8_t instance, uint32_t offset,
+                         const uint8_t *data, uint16_t len)
+{
+	/* Ignore instance since we only have one flash disk. */
+	return flash_program(offset, data, len);
+}
+
+const uint8_t *app_flash_map(uint8_t instance, uint32_t offset)
+{
+	/* Ignore instance since we only have one flash disk. */
+	return flash_map(offset);
+}
+#endif
+
 #ifdef _PIC14E
 void interrupt isr()
 {
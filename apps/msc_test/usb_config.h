@@ -28,13 +28,58 @@
    BOTH IN and OUT endpoints for endpoint numbers (besides zero) up to the
    value specified.  For example, setting NUM_ENDPOINT_NUMBERS to 2 will
    activate endpoints EP 1 IN, EP 1 OUT, EP 2 IN, EP 2 OUT.  */
-#define NUM_ENDPOINT_NUMBERS 1
+#define NUM_ENDPOINT_NUMBERS 2
 
 /* Only 8, 16, 32 and 64 are supported for endpoint zero length. */
 #define EP_0_LEN 8
 
-#define EP_1_OUT_LEN 64
-#define EP_1_IN_LEN 64
+/* The interfaces and endpoints of configuration 1. The configuration
+   descriptor in usb_descriptors.c, the endpoint lengths below, and the
+   interface tables in main.c are all generated from this list. See
+   usb_desc_builder.h for the format.
+
+   Alternate setting 0 of the MSC interface is Bulk-Only Transport and
+   alternate setting 1 is UAS, which uses the same Data-In and Data-Out
+   endpoints plus a Command and a Status endpoint. Remove alternate setting
+   1 if MSC_UAS_SUPPORT is not defined below. */
+#include "usb_desc_builder.h"
+
+#define APP_CONFIGURATION_1(X) \
+	X##_INTERFACE(msc_interface, APP_MSC_INTERFACE, 0, 2, \
+	              MSC_DEVICE_CLASS, \
+	              MSC_SCSI_TRANSPARENT_COMMAND_SET_SUBCLASS, \
+	              MSC_PROTOCOL_CODE_BBB, \
+	              4 /* iInterface */, MSC) \
+	X##_ENDPOINT(msc_in, APP_MSC_IN_ENDPOINT | 0x80, EP_BULK, 64, 1) \
+	X##_ENDPOINT(msc_out, APP_MSC_OUT_ENDPOINT, EP_BULK, 64, 1) \
+	X##_INTERFACE(msc_uas_interface, APP_MSC_INTERFACE, 1, 4, \
+	              MSC_DEVICE_CLASS, \
+	              MSC_SCSI_TRANSPARENT_COMMAND_SET_SUBCLASS, \
+	              MSC_PROTOCOL_CODE_UAS, \
+	              4 /* iInterface */, MSC) \
+	X##_ENDPOINT(msc_uas_command, APP_MSC_UAS_COMMAND_ENDPOINT, \
+	             EP_BULK, 64, 1) \
+	X##_CLASS(msc_uas_command_pipe, struct msc_pipe_usage_descriptor, \
+	          4, MSC_PIPE_USAGE_DESCRIPTOR, MSC_UAS_COMMAND_PIPE, 0) \
+	X##_ENDPOINT(msc_uas_status, APP_MSC_UAS_STATUS_ENDPOINT | 0x80, \
+	             EP_BULK, 64, 1) \
+	X##_CLASS(msc_uas_status_pipe, struct msc_pipe_usage_descriptor, \
+	          4, MSC_PIPE_USAGE_DESCRIPTOR, MSC_UAS_STATUS_PIPE, 0) \
+	X##_ENDPOINT(msc_uas_data_in, APP_MSC_IN_ENDPOINT | 0x80, \
+	             EP_BULK, 64, 1) \
+	X##_CLASS(msc_uas_data_in_pipe, struct msc_pipe_usage_descriptor, \
+	          4, MSC_PIPE_USAGE_DESCRIPTOR, MSC_UAS_DATA_IN_PIPE, 0) \
+	X##_ENDPOINT(msc_uas_data_out, APP_MSC_OUT_ENDPOINT, \
+	             EP_BULK, 64, 1) \
+	X##_CLASS(msc_uas_data_out_pipe, struct msc_pipe_usage_descriptor, \
+	          4, MSC_PIPE_USAGE_DESCRIPTOR, MSC_UAS_DATA_OUT_PIPE, 0)
+
+USB_DESC_ENDPOINT_SIZES(configuration_1, APP_CONFIGURATION_1);
+
+#define EP_1_OUT_LEN USB_DESC_MAX_PACKET_SIZE(msc_out)
+#define EP_1_IN_LEN USB_DESC_MAX_PACKET_SIZE(msc_in)
+#define EP_2_OUT_LEN USB_DESC_MAX_PACKET_SIZE(msc_uas_command)
+#define EP_2_IN_LEN USB_DESC_MAX_PACKET_SIZE(msc_uas_status)
 
 #define NUMBER_OF_CONFIGURATIONS 1
 
@@ -76,10 +121,24 @@
 #define START_OF_FRAME_CALLBACK    app_start_of_frame_callback
 #define USB_RESET_CALLBACK         app_usb_reset_callback
 
+/* Optional dispatch tables from usb.c. Requests and transactions for the
+   interfaces and endpoints in them are passed directly to the device class
+   instead of through the callbacks above. The interface table is generated
+   from APP_CONFIGURATION_1 (main.c). Comment these out to use only the
+   callbacks. */
+#define NUMBER_OF_INTERFACES         USB_DESC_NUM_INTERFACES(APP_CONFIGURATION_1)
+#define USB_INTERFACE_SETUP_HANDLERS app_interface_setup_handlers
+#define USB_IN_TRANSACTION_HANDLERS  app_in_transaction_handlers
+#define USB_OUT_TRANSACTION_HANDLERS app_out_transaction_handlers
+
 /* Configuration from the MSC Class (usb_msc.h) */
-#define MSC_MAX_LUNS_PER_INTERFACE 1
+#define MSC_MAX_LUNS_PER_INTERFACE 3 /* MMC card, RAM disk and flash disk (main.c) */
 //#define MSC_SUPPORT_MULTIPLE_MSC_INTERFACES
 #define MSC_WRITE_SUPPORT
+#define MSC_UAS_SUPPORT
+#define MSC_UAS_QUEUE_DEPTH 4
+#define MSC_STATISTICS
+#define MSC_TIMESTAMP_TICKS_PER_SECOND 1000 /* Start-of-Frame count */
 
 /* Callbacks from the MSC class (usb_msc.h) */
 #define MSC_GET_MAX_LUN_CALLBACK app_get_max_lun
@@ -89,11 +148,16 @@
 #define MSC_START_STOP_UNIT app_start_stop_unit
 #define MSC_START_READ app_msc_start_read
 #define MSC_START_WRITE app_msc_start_write
+#define MSC_UNMAP app_msc_unmap
+#define MSC_SYNCHRONIZE_CACHE app_msc_synchronize_cache
+#define MSC_GET_TIMESTAMP app_msc_get_timestamp
 
 /* Application callbacks, not used by the MSC class or USB stack, but used
  * for the application. */
 #define APP_MSC_INTERFACE 0
 #define APP_MSC_IN_ENDPOINT 1
 #define APP_MSC_OUT_ENDPOINT 1
+#define APP_MSC_UAS_COMMAND_ENDPOINT 2
+#define APP_MSC_UAS_STATUS_ENDPOINT 2
 
 #endif /* USB_CONFIG_H__ */
@@ -34,13 +34,15 @@
  * This packet contains a configuration descriptor, one or more interface
  * descriptors, class descriptors(optional), and endpoint descriptors for a
  * single configuration of the device.  This struct is specific to the
- * device, so the application will need to add any interfaces, classes and
- * endpoints it intends to use.  It is sent to the host in response to a
+ * device, and is generated from the APP_CONFIGURATION_1 list in
+ * usb_config.h, which contains the interfaces, classes and endpoints it
+ * intends to use.  It is sent to the host in response to a
  * GET_DESCRIPTOR[CONFIGURATION] request.
  *
  * While Most devices will only have one configuration, a device can have as
  * many configurations as it needs.  To have more than one, simply make as
- * many of these structs as are required, one for each configuration.
+ * many of these structs (and lists) as are required, one for each
+ * configuration.
  *
  * An instance of each configuration packet must be put in the
  * usb_application_config_descs[] array below (which is #defined in
@@ -49,18 +51,10 @@
  * See Chapter 9 of the USB specification from usb.org for details.
  *
  * It's worth noting that adding endpoints here does not automatically
- * enable them in the USB stack.  To use an endpoint, it must be declared
- * here and also in usb_config.h.
- *
- * The configuration packet below is for the demo application.  Yours will
- * of course vary.
+ * enable them in the USB stack.  To use an endpoint, NUM_ENDPOINT_NUMBERS
+ * in usb_config.h must also be large enough to include it.
  */
-struct configuration_1_packet {
-	struct configuration_descriptor  config;
-	struct interface_descriptor      interface;
-	struct endpoint_descriptor       ep;
-	struct endpoint_descriptor       ep1_out;
-};
+USB_DESC_CONFIGURATION_STRUCT(configuration_1_packet, APP_CONFIGURATION_1);
 
 
 /* Device Descriptor
@@ -91,59 +85,16 @@ const ROMPTR struct device_descriptor this_device_descriptor =
 /* Configuration Packet Instance
  *
  * This is an instance of the configuration_packet struct containing all the
- * data describing a single configuration of this device.  It is wise to use
- * as much C here as possible, such as sizeof() operators, and #defines from
- * usb_config.h.  When stuff is wrong here, it can be difficult to track
- * down exactly why, so it's good to get the compiler to do as much of it
- * for you as it can.
+ * data describing a single configuration of this device.  wTotalLength,
+ * bNumInterfaces, and the interface and endpoint descriptors are all
+ * computed from APP_CONFIGURATION_1 at compile time.
  */
 static const ROMPTR struct configuration_1_packet configuration_1 =
-{
-	{
-	// Members from struct configuration_descriptor
-	sizeof(struct configuration_descriptor),
-	DESC_CONFIGURATION,
-	sizeof(configuration_1), //wTotalLength (length of the whole packet)
-	1, // bNumInterfaces
-	1, // bConfigurationValue
-	2, // iConfiguration (index of string descriptor)
-	0b10000000,
-	100/2,   // 100/2 indicates 100mA
-	},
-
-	{
-	// Members from struct interface_descriptor
-	sizeof(struct interface_descriptor), // bLength;
-	DESC_INTERFACE,
-	APP_MSC_INTERFACE, // InterfaceNumber
-	0x0, // AlternateSetting
-	0x2, // bNumEndpoints (num besides endpoint 0)
-	MSC_DEVICE_CLASS, // bInterfaceClass
-	MSC_SCSI_TRANSPARENT_COMMAND_SET_SUBCLASS, // bInterfaceSubclass
-	MSC_PROTOCOL_CODE_BBB, // bInterfaceProtocol
-	0x04, // iInterface (index of string describing interface)
-	},
-
-	{
-	// Members of the Endpoint Descriptor (EP1 IN)
-	sizeof(struct endpoint_descriptor),
-	DESC_ENDPOINT,
-	APP_MSC_IN_ENDPOINT | 0x80, // endpoint #1 0x80=IN
-	EP_BULK, // bmAttributes
-	EP_1_IN_LEN, // wMaxPacketSize
-	1,   // bInterval in ms.
-	},
-
-	{
-	// Members of the Endpoint Descriptor (EP1 OUT)
-	sizeof(struct endpoint_descriptor),
-	DESC_ENDPOINT,
-	APP_MSC_OUT_ENDPOINT /*| 0x00*/, // endpoint #1 0x00=OUT
-	EP_BULK, // bmAttributes
-	EP_1_OUT_LEN, // wMaxPacketSize
-	1,   // bInterval in ms.
-	},
-};
+	USB_DESC_CONFIGURATION(configuration_1, APP_CONFIGURATION_1,
+		1, // bConfigurationValue
+		2, // iConfiguration (index of string descriptor)
+		0b10000000, // bmAttributes
+		100/2);  // bMaxPower: 100/2 indicates 100mA
 
 /* String Descriptors
  *
@@ -56,6 +56,9 @@ int main(void)
 
 		#ifndef USB_USE_INTERRUPTS
 		usb_service();
+		#else
+		/* Nothing to do until the next interrupt */
+		usb_idle();
 		#endif
 	}
 
@@ -168,6 +171,16 @@ void app_usb_reset_callback(void)
 
 }
 
+void app_usb_suspend_callback(void)
+{
+
+}
+
+void app_usb_resume_callback(void)
+{
+
+}
+
 #ifdef _PIC14E
 void interrupt isr()
 {
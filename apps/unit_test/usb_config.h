@@ -69,6 +69,10 @@
 #define MICROSOFT_OS_DESC_VENDOR_CODE 0x50
 /* Automatically send the descriptors to bind the WinUSB driver on Windows */
 #define AUTOMATIC_WINUSB_SUPPORT
+/* Optionally, bind WinUSB to only one interface of a composite device, and
+ * give the device a DeviceInterfaceGUID (MS OS 2.0 descriptors only). */
+//#define AUTOMATIC_WINUSB_INTERFACE 0
+//#define WINUSB_DEVICE_INTERFACE_GUID {'{','8','8','B','A','E','0','3','2','-','5','A','8','1','-','4','9','F','0','-','B','C','3','D','-','A','4','F','F','1','3','8','2','1','6','D','6','}'}
 
 /* Optional callbacks from usb.c. Leave them commented if you don't want to
    use them. For the prototypes and documentation for each one, see usb.h. */
@@ -84,6 +88,8 @@
 #define UNKNOWN_GET_DESCRIPTOR_CALLBACK app_unknown_get_descriptor_callback
 #define START_OF_FRAME_CALLBACK    app_start_of_frame_callback
 #define USB_RESET_CALLBACK         app_usb_reset_callback
+#define USB_SUSPEND_CALLBACK       app_usb_suspend_callback
+#define USB_RESUME_CALLBACK        app_usb_resume_callback
 
 
 #endif /* USB_CONFIG_H__ */
@@ -73,7 +73,7 @@ const ROMPTR struct device_descriptor this_device_descriptor =
 {
 	sizeof(struct device_descriptor), // bLength
 	DESC_DEVICE, // bDescriptorType
-	0x0200, // 0x0200 = USB 2.0, 0x0110 = USB 1.1
+	0x0201, // 0x0201 = USB 2.0 + BOS (for MS OS 2.0 descriptors)
 	0x00, // Device class
 	0x00, // Device Subclass
 	0x00, // Protocol.
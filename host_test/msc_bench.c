@@ -0,0 +1,785 @@
+/*
+ * Libusb MSC Bulk-Only Benchmark for M-Stack
+ *
+ * This file may be used by anyone for any purpose and may be used as a
+ * starting point making your own application using M-Stack.
+ *
+ * It is worth noting that M-Stack itself is not under the same license as
+ * this file.  See the top-level README.txt for more information.
+ *
+ * M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  For details, see sections 7, 8, and 9
+ * of the Apache License, version 2.0 which apply to this file.  If you have
+ * purchased a commercial license for this software from Signal 11 Software,
+ * your commerical license superceeds the information in this header.
+ *
+ * Alan Ott
+ * Signal 11 Software
+ * 2026-10-18
+ */
+
+/*
+Libusb MSC Bulk-Only benchmark for M-Stack
+
+This program measures what an MSC device sustains without the kernel's
+block layer, page cache, and filesystem in the way. It detaches the
+kernel's driver from the MSC interface and speaks Bulk-Only Transport to
+the device itself, issuing READ(10) and WRITE(10) commands of a fixed size
+at sequential or random (transfer-aligned) addresses. For each pass it
+prints the throughput, the commands per second, and percentiles of the
+latency from sending the CBW to receiving the CSW.
+
+Written data is a pattern made from the seed and the LBA of each block, so
+reads can be checked against it, in the same run (-t verify) or in a later
+one with the same seed and transfer size (-t read -v).
+
+Instead of a USB device, a plain file or a block device (such as a loop
+device, or the kernel's view of the same MSC device) can be given with -f,
+and is read and written with pread() and pwrite(), so the numbers can be
+compared with the kernel's path. Use -D to bypass the page cache.
+
+Writing destroys the contents of the medium, so -t write and -t verify
+also need -y.
+
+Usage:
+	msc_bench [options]
+
+	-d vid:pid  The vendor and product ID, in hex (default a0a0:0005)
+	-i iface    The MSC interface number (default 0)
+	-l lun      The LUN (default 0)
+	-f path     Use a file or block device instead of a USB device
+	-D          Open the file with O_DIRECT
+	-t test     read, write, or verify (write, then read back and check)
+	            (default read)
+	-p pattern  seq or rand (default seq)
+	-s bytes    Bytes per command, a multiple of the block size
+	            (default 65536)
+	-n count    Commands per pass (default 256)
+	-a blocks   Use only the first blocks of the medium (default all)
+	-S seed     Seed for the data pattern and random addresses (default 1)
+	-v          Check data read against the pattern
+	-y          Allow writing
+*/
+
+#define _GNU_SOURCE /* O_DIRECT */
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+/* Unix */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* GNU / LibUSB */
+#include "libusb.h"
+
+/* Bulk-Only Transport */
+#define CBW_SIGNATURE 0x43425355
+#define CSW_SIGNATURE 0x53425355
+#define CBW_LEN 31
+#define CSW_LEN 13
+#define BOT_RESET 0xff
+#define CSW_PASSED 0
+#define CSW_FAILED 1
+
+/* SCSI */
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE 0x03
+#define SCSI_READ_CAPACITY_10 0x25
+#define SCSI_READ_10 0x28
+#define SCSI_WRITE_10 0x2a
+
+#define TIMEOUT 5000 /* ms */
+#define MAX_MISMATCHES_SHOWN 10
+
+struct target {
+	/* USB device */
+	libusb_device_handle *handle;
+	int interface;
+	uint8_t lun;
+	uint8_t ep_in;
+	uint8_t ep_out;
+	uint32_t tag;
+
+	/* File or block device */
+	int fd;
+
+	uint32_t block_size;
+	uint64_t num_blocks;
+};
+
+enum test {
+	TEST_READ,
+	TEST_WRITE,
+	TEST_VERIFY,
+};
+
+static void put16be(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32be(unsigned char *p, uint32_t v)
+{
+	put16be(p, v >> 16);
+	put16be(p + 2, v);
+}
+
+static uint32_t get32be(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32le(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get32le(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, for the random addresses */
+static uint64_t rand_state;
+
+static uint64_t next_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545f4914f6cdd1dull;
+}
+
+/* The pattern word at word index i of block lba. Each word depends on the
+ * seed, the LBA, and its place in the block, so data read from the wrong
+ * block or the wrong offset doesn't match. */
+static uint32_t pattern_word(uint32_t seed, uint32_t lba, uint32_t i)
+{
+	uint32_t x = seed ^ lba * 0x9e3779b9u ^ i * 0x85ebca6bu;
+
+	/* murmur3 finalizer */
+	x ^= x >> 16;
+	x *= 0x85ebca6bu;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35u;
+	x ^= x >> 16;
+	return x;
+}
+
+static void fill_pattern(unsigned char *buf, uint32_t lba, uint32_t blocks,
+                         uint32_t block_size, uint32_t seed)
+{
+	uint32_t b, i;
+
+	for (b = 0; b < blocks; b++)
+		for (i = 0; i < block_size / 4; i++)
+			put32le(buf + b * block_size + i * 4,
+			        pattern_word(seed, lba + b, i));
+}
+
+/* Returns the number of blocks which don't match the pattern, printing
+ * the first few. */
+static uint32_t check_pattern(const unsigned char *buf, uint32_t lba,
+                              uint32_t blocks, uint32_t block_size,
+                              uint32_t seed, uint64_t *shown)
+{
+	uint32_t b, i;
+	uint32_t bad = 0;
+
+	for (b = 0; b < blocks; b++) {
+		for (i = 0; i < block_size / 4; i++) {
+			const unsigned char *p = buf + b * block_size + i * 4;
+			if (get32le(p) != pattern_word(seed, lba + b, i))
+				break;
+		}
+
+		if (i == block_size / 4)
+			continue;
+
+		bad++;
+		if (*shown < MAX_MISMATCHES_SHOWN)
+			printf("  Mismatch in LBA %" PRIu32 " at byte %" PRIu32
+			       "\n", lba + b, i * 4);
+		(*shown)++;
+	}
+
+	return bad;
+}
+
+/* Bulk-Only Mass Storage Reset, followed by clearing both halts (BOT
+ * 5.3.4, Reset Recovery) */
+static void reset_recovery(struct target *t)
+{
+	libusb_control_transfer(t->handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE,
+		BOT_RESET,
+		0, /*wValue*/
+		t->interface, /*wIndex*/
+		NULL, 0 /*wLength*/,
+		TIMEOUT);
+	libusb_clear_halt(t->handle, t->ep_in);
+	libusb_clear_halt(t->handle, t->ep_out);
+}
+
+/* Carry out one SCSI command with Bulk-Only Transport. data_in says which
+ * way len bytes of data go. Returns the CSW status (CSW_PASSED or
+ * CSW_FAILED), or a negative libusb error, after which the device has been
+ * reset. */
+static int bot_command(struct target *t, const unsigned char *cdb,
+                       uint8_t cdb_len, int data_in,
+                       unsigned char *data, uint32_t len)
+{
+	unsigned char cbw[CBW_LEN];
+	unsigned char csw[CSW_LEN];
+	int transferred;
+	int res;
+	int tries;
+
+	memset(cbw, 0, sizeof(cbw));
+	put32le(cbw, CBW_SIGNATURE);
+	put32le(cbw + 4, ++t->tag);
+	put32le(cbw + 8, len);
+	cbw[12] = data_in? 0x80: 0x00;
+	cbw[13] = t->lun;
+	cbw[14] = cdb_len;
+	memcpy(cbw + 15, cdb, cdb_len);
+
+	res = libusb_bulk_transfer(t->handle, t->ep_out, cbw, sizeof(cbw),
+	                           &transferred, TIMEOUT);
+	if (res < 0 || transferred != sizeof(cbw)) {
+		fprintf(stderr, "Sending CBW failed: %s\n",
+		        libusb_error_name(res));
+		reset_recovery(t);
+		return res < 0? res: LIBUSB_ERROR_IO;
+	}
+
+	/* Data. A stall here ends the data stage early, and the status
+	 * follows (BOT 6.7.2, 6.7.3). */
+	if (len > 0) {
+		uint8_t ep = data_in? t->ep_in: t->ep_out;
+
+		res = libusb_bulk_transfer(t->handle, ep, data, len,
+		                           &transferred, TIMEOUT);
+		if (res == LIBUSB_ERROR_PIPE) {
+			libusb_clear_halt(t->handle, ep);
+		}
+		else if (res < 0) {
+			fprintf(stderr, "Data transfer failed: %s\n",
+			        libusb_error_name(res));
+			reset_recovery(t);
+			return res;
+		}
+	}
+
+	/* Status. If the IN endpoint stalls, it's cleared and the CSW read
+	 * again (BOT 5.3.3, Figure 2). */
+	for (tries = 0; tries < 2; tries++) {
+		res = libusb_bulk_transfer(t->handle, t->ep_in,
+		                           csw, sizeof(csw),
+		                           &transferred, TIMEOUT);
+		if (res != LIBUSB_ERROR_PIPE)
+			break;
+		libusb_clear_halt(t->handle, t->ep_in);
+	}
+
+	if (res < 0 || transferred != sizeof(csw) ||
+	    get32le(csw) != CSW_SIGNATURE ||
+	    get32le(csw + 4) != t->tag ||
+	    csw[12] > CSW_FAILED) {
+		fprintf(stderr, "Invalid CSW: %s\n", libusb_error_name(res));
+		reset_recovery(t);
+		return res < 0? res: LIBUSB_ERROR_IO;
+	}
+
+	return csw[12];
+}
+
+static void print_sense(struct target *t)
+{
+	unsigned char cdb[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0 };
+	unsigned char sense[18];
+
+	memset(sense, 0, sizeof(sense));
+	if (bot_command(t, cdb, sizeof(cdb), 1, sense, sizeof(sense)) ==
+	    CSW_PASSED)
+		fprintf(stderr, "  Sense key %x, ASC %02x, ASCQ %02x\n",
+		        sense[2] & 0xf, sense[12], sense[13]);
+}
+
+static int open_usb(struct target *t, unsigned int vid, unsigned int pid)
+{
+	libusb_device *dev;
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *desc;
+	unsigned char cdb[10];
+	unsigned char cap[8];
+	int res;
+	int i;
+
+	if (libusb_init(NULL))
+		return -1;
+
+	t->handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	if (!t->handle) {
+		perror("libusb_open failed: ");
+		return -1;
+	}
+	dev = libusb_get_device(t->handle);
+
+	/* Find the bulk endpoints of the Bulk-Only alternate setting */
+	res = libusb_get_active_config_descriptor(dev, &config);
+	if (res < 0) {
+		fprintf(stderr, "Unable to get the configuration: %s\n",
+		        libusb_error_name(res));
+		return -1;
+	}
+
+	if (t->interface >= config->bNumInterfaces) {
+		fprintf(stderr, "No interface %d\n", t->interface);
+		return -1;
+	}
+
+	desc = &config->interface[t->interface].altsetting[0];
+	if (desc->bInterfaceClass != LIBUSB_CLASS_MASS_STORAGE ||
+	    desc->bInterfaceProtocol != 0x50) {
+		fprintf(stderr, "Interface %d isn't Bulk-Only Mass Storage\n",
+		        t->interface);
+		return -1;
+	}
+
+	for (i = 0; i < desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep =
+			&desc->endpoint[i];
+
+		if ((ep->bmAttributes & 0x3) != LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+		if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+			t->ep_in = ep->bEndpointAddress;
+		else
+			t->ep_out = ep->bEndpointAddress;
+	}
+	libusb_free_config_descriptor(config);
+
+	if (!t->ep_in || !t->ep_out) {
+		fprintf(stderr, "Bulk endpoints not found\n");
+		return -1;
+	}
+
+	/* Take the interface from the kernel's driver. It's given back
+	 * when the interface is released. The kernel may have selected
+	 * UAS, so go back to Bulk-Only. */
+	libusb_set_auto_detach_kernel_driver(t->handle, 1);
+	res = libusb_claim_interface(t->handle, t->interface);
+	if (res < 0) {
+		fprintf(stderr, "Unable to claim interface %d: %s\n",
+		        t->interface, libusb_error_name(res));
+		return -1;
+	}
+	libusb_set_interface_alt_setting(t->handle, t->interface, 0);
+
+	/* Wait for the medium, clearing any Unit Attention */
+	for (i = 0; i < 10; i++) {
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = SCSI_TEST_UNIT_READY;
+		res = bot_command(t, cdb, 6, 0, NULL, 0);
+		if (res == CSW_PASSED)
+			break;
+		usleep(100000);
+	}
+
+	if (res != CSW_PASSED) {
+		fprintf(stderr, "LUN %d isn't ready\n", t->lun);
+		if (res == CSW_FAILED)
+			print_sense(t);
+		return -1;
+	}
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_READ_CAPACITY_10;
+	res = bot_command(t, cdb, 10, 1, cap, sizeof(cap));
+	if (res != CSW_PASSED) {
+		fprintf(stderr, "READ CAPACITY(10) failed\n");
+		if (res == CSW_FAILED)
+			print_sense(t);
+		return -1;
+	}
+
+	t->num_blocks = (uint64_t) get32be(cap) + 1;
+	t->block_size = get32be(cap + 4);
+
+	return 0;
+}
+
+static void close_usb(struct target *t)
+{
+	libusb_release_interface(t->handle, t->interface);
+	libusb_close(t->handle);
+	libusb_exit(NULL);
+}
+
+static int open_file(struct target *t, const char *path, int writing,
+                     int direct)
+{
+	struct stat st;
+	int flags = writing? O_RDWR: O_RDONLY;
+
+	if (direct)
+		flags |= O_DIRECT;
+
+	t->fd = open(path, flags);
+	if (t->fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(t->fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t size;
+		int block_size;
+
+		if (ioctl(t->fd, BLKGETSIZE64, &size) < 0 ||
+		    ioctl(t->fd, BLKSSZGET, &block_size) < 0) {
+			perror("ioctl");
+			return -1;
+		}
+		t->block_size = block_size;
+		t->num_blocks = size / block_size;
+	}
+	else {
+		t->block_size = 512;
+		t->num_blocks = st.st_size / 512;
+	}
+
+	return 0;
+}
+
+/* Read or write blocks at lba. Returns 0 on success. */
+static int transfer(struct target *t, int writing, uint32_t lba,
+                    uint32_t blocks, unsigned char *buf)
+{
+	uint32_t len = blocks * t->block_size;
+	unsigned char cdb[10];
+	int res;
+
+	if (!t->handle) {
+		off_t offset = (off_t) lba * t->block_size;
+		ssize_t n;
+
+		if (writing)
+			n = pwrite(t->fd, buf, len, offset);
+		else
+			n = pread(t->fd, buf, len, offset);
+
+		if (n != (ssize_t) len) {
+			fprintf(stderr, "%s of LBA %" PRIu32 " failed: %s\n",
+			        writing? "Write": "Read", lba,
+			        n < 0? strerror(errno): "short transfer");
+			return -1;
+		}
+		return 0;
+	}
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = writing? SCSI_WRITE_10: SCSI_READ_10;
+	put32be(cdb + 2, lba);
+	put16be(cdb + 7, blocks);
+
+	res = bot_command(t, cdb, sizeof(cdb), !writing, buf, len);
+	if (res != CSW_PASSED) {
+		fprintf(stderr, "%s of LBA %" PRIu32 " failed\n",
+		        writing? "WRITE(10)": "READ(10)", lba);
+		if (res == CSW_FAILED)
+			print_sense(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of n sorted values */
+static double percentile(const double *sorted, uint32_t n, double p)
+{
+	uint32_t rank = (uint32_t) (p / 100.0 * n + 0.999999);
+
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	return sorted[rank - 1];
+}
+
+/* Carry out one pass of count commands. Returns the number of blocks which
+ * didn't match the pattern, or -1 on an error. */
+static int64_t run_pass(struct target *t, int writing, int random,
+                        int check, uint32_t blocks, uint32_t count,
+                        uint64_t area, uint32_t seed, unsigned char *buf,
+                        double *latencies)
+{
+	const uint64_t slots = area / blocks;
+	uint64_t shown = 0;
+	int64_t bad = 0;
+	double start, total, sum = 0;
+	uint32_t i;
+
+	rand_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		uint32_t lba;
+		double t0;
+
+		if (random)
+			lba = next_rand() % slots * blocks;
+		else
+			lba = i % slots * blocks;
+
+		if (writing)
+			fill_pattern(buf, lba, blocks, t->block_size, seed);
+
+		t0 = now();
+		if (transfer(t, writing, lba, blocks, buf) < 0)
+			return -1;
+		latencies[i] = now() - t0;
+		sum += latencies[i];
+
+		if (check)
+			bad += check_pattern(buf, lba, blocks, t->block_size,
+			                     seed, &shown);
+	}
+	total = now() - start;
+
+	qsort(latencies, count, sizeof(*latencies), compare_doubles);
+
+	printf("%s %s, %" PRIu32 " x %" PRIu32 " bytes: "
+	       "%.2f MB/s, %.1f IOPS\n",
+	       writing? "Write": "Read",
+	       random? "random": "sequential",
+	       count, blocks * t->block_size,
+	       (double) count * blocks * t->block_size / total / 1e6,
+	       count / total);
+	printf("  Latency (ms): avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, "
+	       "p99.9 %.3f, max %.3f\n",
+	       sum / count * 1000,
+	       percentile(latencies, count, 50) * 1000,
+	       percentile(latencies, count, 90) * 1000,
+	       percentile(latencies, count, 99) * 1000,
+	       percentile(latencies, count, 99.9) * 1000,
+	       latencies[count - 1] * 1000);
+
+	if (check)
+		printf("  Verify: %s (%" PRId64 " bad blocks)\n",
+		       bad? "FAILED": "OK", bad);
+
+	return bad;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "%s: [-d vid:pid] [-i interface] [-l lun] "
+	        "[-f path] [-D]\n"
+	        "\t[-t read|write|verify] [-p seq|rand] [-s bytes] "
+	        "[-n count]\n"
+	        "\t[-a blocks] [-S seed] [-v] [-y]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct target t;
+	unsigned int vid = 0xa0a0, pid = 0x0005;
+	const char *path = NULL;
+	int direct = 0;
+	enum test test = TEST_READ;
+	int random = 0;
+	uint32_t size = 65536;
+	uint32_t count = 256;
+	uint64_t area = 0;
+	uint32_t seed = 1;
+	int check = 0;
+	int allow_write = 0;
+	uint32_t blocks;
+	unsigned char *buf;
+	double *latencies;
+	int64_t bad = 0;
+	int opt;
+	int res;
+
+	memset(&t, 0, sizeof(t));
+	t.fd = -1;
+
+	while ((opt = getopt(argc, argv, "d:i:l:f:Dt:p:s:n:a:S:vy")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				fprintf(stderr, "Invalid vid:pid: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'i':
+			t.interface = atoi(optarg);
+			break;
+		case 'l':
+			t.lun = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		case 't':
+			if (!strcmp(optarg, "read"))
+				test = TEST_READ;
+			else if (!strcmp(optarg, "write"))
+				test = TEST_WRITE;
+			else if (!strcmp(optarg, "verify"))
+				test = TEST_VERIFY;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (!strcmp(optarg, "seq"))
+				random = 0;
+			else if (!strcmp(optarg, "rand"))
+				random = 1;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			area = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			check = 1;
+			break;
+		case 'y':
+			allow_write = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (test != TEST_READ && !allow_write) {
+		fprintf(stderr, "Writing destroys the contents of the medium. "
+		        "Use -y to allow it.\n");
+		return 1;
+	}
+
+	if (count == 0) {
+		fprintf(stderr, "The count must be at least 1\n");
+		return 1;
+	}
+
+	if (path)
+		res = open_file(&t, path, test != TEST_READ, direct);
+	else
+		res = open_usb(&t, vid, pid);
+	if (res < 0)
+		return 1;
+
+	if (path)
+		printf("Target: %s%s", path, direct? " (O_DIRECT)": "");
+	else
+		printf("Target: %04x:%04x interface %d LUN %d",
+		       vid, pid, t.interface, t.lun);
+	printf(", %" PRIu64 " blocks of %" PRIu32 " bytes\n",
+	       t.num_blocks, t.block_size);
+
+	/* READ(10) and WRITE(10) address 2^32 blocks, 65535 at a time. */
+	if (t.block_size == 0 || size == 0 || size % t.block_size != 0 ||
+	    size / t.block_size > 0xffff) {
+		fprintf(stderr, "The size must be a multiple of the block "
+		        "size, up to 65535 blocks\n");
+		return 1;
+	}
+	blocks = size / t.block_size;
+
+	if (area == 0 || area > t.num_blocks)
+		area = t.num_blocks;
+	if (area > 0xffffffffull)
+		area = 0xffffffffull;
+	if (area < blocks) {
+		fprintf(stderr, "The medium is smaller than one transfer\n");
+		return 1;
+	}
+
+	/* Aligned for O_DIRECT */
+	if (posix_memalign((void **) &buf, 4096, size) != 0) {
+		fprintf(stderr, "Unable to allocate the buffer\n");
+		return 1;
+	}
+	latencies = calloc(count, sizeof(*latencies));
+	if (!latencies) {
+		fprintf(stderr, "Unable to allocate the latencies\n");
+		return 1;
+	}
+
+	if (test == TEST_WRITE || test == TEST_VERIFY) {
+		bad = run_pass(&t, 1, random, 0, blocks, count, area, seed,
+		               buf, latencies);
+		if (bad == 0 && path && fsync(t.fd) < 0)
+			perror("fsync");
+	}
+
+	if (bad == 0 && (test == TEST_READ || test == TEST_VERIFY))
+		bad = run_pass(&t, 0, random, check || test == TEST_VERIFY,
+		               blocks, count, area, seed, buf, latencies);
+
+	free(latencies);
+	free(buf);
+	if (path)
+		close(t.fd);
+	else
+		close_usb(&t);
+
+	return bad == 0? 0: 1;
+}
@@ -0,0 +1,270 @@
+/*
+ * Libusb MSC Statistics Dump for M-Stack
+ *
+ * This file may be used by anyone for any purpose and may be used as a
+ * starting point making your own application using M-Stack.
+ *
+ * It is worth noting that M-Stack itself is not under the same license as
+ * this file.  See the top-level README.txt for more information.
+ *
+ * M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  For details, see sections 7, 8, and 9
+ * of the Apache License, version 2.0 which apply to this file.  If you have
+ * purchased a commercial license for this software from Signal 11 Software,
+ * your commerical license superceeds the information in this header.
+ *
+ * Alan Ott
+ * Signal 11 Software
+ * 2026-10-18
+ */
+
+/*
+Libusb MSC statistics dump for M-Stack
+
+This program reads the command and timing statistics kept by the MSC class
+when MSC_STATISTICS is defined (see struct msc_statistics in usb_msc.h),
+and prints them. The statistics are read with a vendor request to the MSC
+interface, which doesn't need the interface to be claimed, so this can be
+run while the device is mounted and in use by the kernel's driver.
+
+Usage:
+	msc_stats [-c] [-i interface] [-d vid:pid]
+
+	-c  Clear the statistics after printing them
+	-i  The MSC interface number (default 0)
+	-d  The vendor and product ID, in hex (default a0a0:0005)
+*/
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+/* Unix */
+#include <unistd.h>
+
+/* GNU / LibUSB */
+#include "libusb.h"
+
+/* From usb_msc.h */
+#define MSC_GET_STATISTICS 0x01
+#define MSC_CLEAR_STATISTICS 0x02
+#define MSC_STATISTICS_VERSION 1
+
+#define HEADER_LEN 20
+#define COMMAND_LEN(buckets) (28 + 2 * (buckets))
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static const char *opcode_name(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x00: return "TEST UNIT READY";
+	case 0x03: return "REQUEST SENSE";
+	case 0x12: return "INQUIRY";
+	case 0x1a: return "MODE SENSE(6)";
+	case 0x1b: return "START STOP UNIT";
+	case 0x25: return "READ CAPACITY(10)";
+	case 0x28: return "READ(10)";
+	case 0x2a: return "WRITE(10)";
+	case 0x35: return "SYNCHRONIZE CACHE(10)";
+	case 0x42: return "UNMAP";
+	case 0x88: return "READ(16)";
+	case 0x8a: return "WRITE(16)";
+	case 0x9e: return "READ CAPACITY(16)";
+	default:   return "?";
+	}
+}
+
+static double ticks_to_ms(uint64_t ticks, uint32_t ticks_per_second)
+{
+	return ticks * 1000.0 / ticks_per_second;
+}
+
+static void print_statistics(const unsigned char *buf, int len)
+{
+	uint8_t num_commands = buf[1];
+	uint8_t num_buckets = buf[2];
+	uint32_t tps = get32(buf + 4);
+	uint32_t app = get32(buf + 8);
+	uint32_t ep = get32(buf + 12);
+	uint32_t medium = get32(buf + 16);
+	uint32_t total;
+	int i, j;
+
+	if (tps == 0) {
+		fprintf(stderr, "Device reports a timestamp rate of zero\n");
+		return;
+	}
+
+	/* The medium time is part of the application time. */
+	if (medium > app)
+		medium = app;
+	total = app + ep;
+
+	printf("Time in commands: %.1f ms\n", ticks_to_ms(total, tps));
+	printf("  Waiting for endpoint:    %10.1f ms (%5.1f%%)\n",
+	       ticks_to_ms(ep, tps), total? 100.0 * ep / total: 0.0);
+	printf("  Waiting for application: %10.1f ms (%5.1f%%)\n",
+	       ticks_to_ms(app - medium, tps),
+	       total? 100.0 * (app - medium) / total: 0.0);
+	printf("  Medium busy:             %10.1f ms (%5.1f%%)\n",
+	       ticks_to_ms(medium, tps), total? 100.0 * medium / total: 0.0);
+	printf("Timestamp resolution: %.3f ms\n\n", 1000.0 / tps);
+
+	printf("%-18s %8s %6s %12s %9s %9s %9s\n",
+	       "Command", "Count", "Failed", "Bytes",
+	       "Avg (ms)", "Max (ms)", "KB/s");
+
+	for (i = 0; i < num_commands; i++) {
+		const unsigned char *c =
+			buf + HEADER_LEN + i * COMMAND_LEN(num_buckets);
+		const char *name;
+		uint32_t count, failed, total_ticks, max_ticks;
+		uint64_t bytes;
+
+		if (c + COMMAND_LEN(num_buckets) > buf + len)
+			break;
+
+		count = get32(c + 4);
+		failed = get32(c + 8);
+		bytes = get64(c + 12);
+		total_ticks = get32(c + 20);
+		max_ticks = get32(c + 24);
+
+		if (count == 0)
+			continue;
+
+		/* The last entry is for all other commands */
+		name = (i == num_commands - 1)? "(other)": opcode_name(c[0]);
+
+		printf("%-18s %8" PRIu32 " %6" PRIu32 " %12" PRIu64
+		       " %9.2f %9.1f",
+		       name, count, failed, bytes,
+		       ticks_to_ms(total_ticks, tps) / count,
+		       ticks_to_ms(max_ticks, tps));
+		if (bytes && total_ticks)
+			printf(" %9.1f", bytes / 1024.0 /
+			       (ticks_to_ms(total_ticks, tps) / 1000.0));
+		printf("\n");
+
+		/* Latency histogram. Bucket N holds latencies below 2^N
+		 * ticks, and the last bucket holds the rest. */
+		for (j = 0; j < num_buckets; j++) {
+			uint16_t n = get16(c + 28 + 2 * j);
+
+			if (n == 0)
+				continue;
+
+			if (j == num_buckets - 1)
+				printf("    >= %8.1f ms: %5u\n",
+				       ticks_to_ms(1u << (j - 1), tps), n);
+			else
+				printf("    <  %8.1f ms: %5u\n",
+				       ticks_to_ms(1u << j, tps), n);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	libusb_device_handle *handle;
+	unsigned char buf[4096];
+	int interface = 0;
+	unsigned int vid = 0xa0a0, pid = 0x0005;
+	int clear = 0;
+	int opt;
+	int res;
+
+	while ((opt = getopt(argc, argv, "ci:d:")) != -1) {
+		switch (opt) {
+		case 'c':
+			clear = 1;
+			break;
+		case 'i':
+			interface = atoi(optarg);
+			break;
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				fprintf(stderr, "Invalid vid:pid: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "%s: [-c] [-i interface] "
+			        "[-d vid:pid]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Init Libusb */
+	if (libusb_init(NULL))
+		return -1;
+
+	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	if (!handle) {
+		perror("libusb_open failed: ");
+		return 1;
+	}
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_INTERFACE,
+		MSC_GET_STATISTICS,
+		0, /*wValue*/
+		interface, /*wIndex*/
+		buf, sizeof(buf)/*wLength*/,
+		1000/*timeout millis*/);
+
+	if (res < 0) {
+		fprintf(stderr, "Unable to read statistics: %s\n",
+		        libusb_error_name(res));
+		return 1;
+	}
+
+	if (res < HEADER_LEN || buf[0] != MSC_STATISTICS_VERSION) {
+		fprintf(stderr, "Unsupported statistics (%d bytes, version "
+		        "%d)\n", res, res > 0? buf[0]: -1);
+		return 1;
+	}
+
+	print_statistics(buf, res);
+
+	if (clear) {
+		res = libusb_control_transfer(handle,
+			LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_INTERFACE,
+			MSC_CLEAR_STATISTICS,
+			0, /*wValue*/
+			interface, /*wIndex*/
+			NULL, 0/*wLength*/,
+			1000/*timeout millis*/);
+
+		if (res < 0) {
+			fprintf(stderr, "Unable to clear statistics: %s\n",
+			        libusb_error_name(res));
+			return 1;
+		}
+		printf("\nStatistics cleared\n");
+	}
+
+	libusb_close(handle);
+	libusb_exit(NULL);
+
+	return 0;
+}
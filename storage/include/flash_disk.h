@@ -0,0 +1,496 @@
+/*
+ *  M-Stack USB Device Stack - Flash Disk implementation
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+
+#ifndef M_STACK_FLASH_DISK_H__
+#define M_STACK_FLASH_DISK_H__
+
+/** @file flash_disk.h
+ *  @brief M-Stack Flash Disk
+ *  @defgroup public_api Public API
+ *
+ * This component is a Mass Storage Class medium kept in a region of the
+ * microcontroller's own program flash, for boards which have flash to
+ * spare but no MMC/SD socket. Like the RAM disk (see ramdisk.h), its
+ * functions have the same form as the storage callbacks of the MSC class,
+ * without the LUN.
+ *
+ * Flash can only be erased in large blocks and wears out after a limited
+ * number of erases, so the flash disk contains a small flash translation
+ * layer (FTL). Each sector written by the host goes to the next
+ * free slot of the current erase block, and a map in RAM points each
+ * logical sector at the slot holding its newest copy. A tag written next
+ * to each slot records which logical sector it holds, so the map is
+ * rebuilt from flash by @p flash_disk_init(). When the free erase blocks
+ * run out, the erase block with the fewest live sectors is garbage
+ * collected: its live sectors are copied out and it is erased. Free erase
+ * blocks are used least-erased first, and when the erase counts of the
+ * erase blocks drift too far apart, the live data of the least-erased
+ * erase block is moved so that it can be used too.
+ *
+ * Hosts rewrite some sectors (such as the FAT and directory entries) over
+ * and over, so written sectors are kept in a small write-back cache in RAM
+ * and are only written to flash when they are evicted from the cache or
+ * when the application calls @p flash_disk_flush(). Sectors which are read
+ * are sent to the host straight from flash when flash is mapped into the
+ * address space (see @p FLASH_DISK_MAP()), or from the cache if they are in
+ * it.
+ *
+ * Erasing and programming flash blocks the CPU, so data is read and written
+ * from the application's main loop by @p flash_disk_service(), rather than
+ * from interrupt context.
+ *
+ * Client software using this component will need to provide a file called
+ * flash_disk_config.h which describes the flash region and #defines the
+ * functions which erase, program, and read it. Offsets passed to these
+ * functions are byte offsets from the start of the flash region. If
+ * flash_disk_config.h doesn't define FLASH_DISK_BLOCK_SIZE (for example on
+ * platforms the application doesn't have a flash disk on), flash_disk.c
+ * builds to nothing.
+ */
+
+/** @addtogroup public_api
+ *  @{
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "usb_config.h"
+#include "usb_ch9.h"
+#include "usb_msc.h"
+#include "flash_disk_config.h"
+
+#ifndef FLASH_DISK_SECTOR_SIZE
+/** @brief Flash Disk Sector Size
+ *
+ * The block size reported to the host, in bytes. This is a power of two
+ * from 512 to 4096, and the default is 512. On flash with large program
+ * pages, making it the page size (with FLASH_DISK_BLOCK_SIZE several pages)
+ * has the host read and write whole pages. Each sector of the write-back
+ * cache, and the read buffer, take FLASH_DISK_SECTOR_SIZE bytes of RAM.
+ */
+#define FLASH_DISK_SECTOR_SIZE 512
+#endif
+
+#ifndef FLASH_DISK_BLOCK_SIZE
+	#error "You must define FLASH_DISK_BLOCK_SIZE"
+#endif
+/** @def FLASH_DISK_BLOCK_SIZE
+ *
+ * The size of an erase block of the flash disk in bytes. This is the size
+ * which @p FLASH_DISK_ERASE() erases, and may be a multiple of the flash's
+ * page size. Larger erase blocks waste less of the flash on the per-block
+ * tags (see @p FLASH_DISK_SECTORS_PER_BLOCK).
+ */
+
+#ifndef FLASH_DISK_NUM_BLOCKS
+	#error "You must define FLASH_DISK_NUM_BLOCKS"
+#endif
+/** @def FLASH_DISK_NUM_BLOCKS
+ *
+ * The number of erase blocks in the flash region.
+ */
+
+#ifndef FLASH_DISK_PROGRAM_SIZE
+/** @brief Flash Program Size
+ *
+ * The smallest amount of flash, in bytes, which can be programmed at once.
+ * This is a power of two, and @p FLASH_DISK_PROGRAM() is only called with
+ * offsets and lengths which are multiples of it. The default is 4, which
+ * suits the word programming of PIC24 and PIC32MX.
+ */
+#define FLASH_DISK_PROGRAM_SIZE 4
+#endif
+
+#ifndef FLASH_DISK_CACHE_SECTORS
+/** @brief Write-back Cache Size
+ *
+ * The number of sectors kept in the write-back cache, each of which takes
+ * FLASH_DISK_SECTOR_SIZE bytes of RAM.
+ */
+#define FLASH_DISK_CACHE_SECTORS 2
+#endif
+
+#ifndef FLASH_DISK_SEND_SEGMENTS
+/** @brief Send Segments
+ *
+ * Where flash is mapped (see @p FLASH_DISK_MAP()), the most runs of
+ * sectors which are contiguous in memory that are passed to the MSC class
+ * in one send. A sequential read is then sent without returning to the
+ * main loop until this many runs have been sent. Each one takes 8 bytes
+ * of RAM.
+ */
+#define FLASH_DISK_SEND_SEGMENTS 8
+#endif
+
+#ifndef FLASH_DISK_WEAR_LEVEL_THRESHOLD
+/** @brief Wear Leveling Threshold
+ *
+ * When the erase count of the least-erased erase block in use is this far
+ * below the erase count of the most-erased erase block, the data in it is
+ * moved so that it can be erased and reused.
+ */
+#define FLASH_DISK_WEAR_LEVEL_THRESHOLD 64
+#endif
+
+/** @brief Tag Size
+ *
+ * The size of each tag in the metadata at the end of an erase block. A tag
+ * holds 32 bits and is padded out to the program size.
+ */
+#if FLASH_DISK_PROGRAM_SIZE < 4
+	#define FLASH_DISK_TAG_SIZE 4
+#else
+	#define FLASH_DISK_TAG_SIZE FLASH_DISK_PROGRAM_SIZE
+#endif
+
+/** @brief Sectors per Erase Block
+ *
+ * Each erase block holds as many sector slots as fit after leaving room for
+ * three header tags (erase count, magic number, and sequence number) and a
+ * tag for each slot.
+ */
+#define FLASH_DISK_SECTORS_PER_BLOCK \
+	((FLASH_DISK_BLOCK_SIZE - 3 * FLASH_DISK_TAG_SIZE) / \
+	 (FLASH_DISK_SECTOR_SIZE + FLASH_DISK_TAG_SIZE))
+
+/** @brief Number of Sectors
+ *
+ * The number of sectors the host sees. Two erase blocks' worth of slots are
+ * held back so that garbage collection can always make progress.
+ */
+#define FLASH_DISK_NUM_SECTORS \
+	((uint32_t) (FLASH_DISK_NUM_BLOCKS - 2) * FLASH_DISK_SECTORS_PER_BLOCK)
+
+#if FLASH_DISK_SECTORS_PER_BLOCK < 2
+	#error "FLASH_DISK_BLOCK_SIZE is too small for two sectors"
+#endif
+#if FLASH_DISK_SECTORS_PER_BLOCK > 255
+	#error "FLASH_DISK_BLOCK_SIZE is too large"
+#endif
+#if FLASH_DISK_NUM_BLOCKS < 3
+	#error "FLASH_DISK_NUM_BLOCKS must be at least 3"
+#endif
+#if FLASH_DISK_NUM_BLOCKS * FLASH_DISK_SECTORS_PER_BLOCK >= 0xffff
+	#error "The flash disk is too large"
+#endif
+#if FLASH_DISK_SECTOR_SIZE < 512 || FLASH_DISK_SECTOR_SIZE > 4096 || \
+    (FLASH_DISK_SECTOR_SIZE & (FLASH_DISK_SECTOR_SIZE - 1)) != 0
+	#error "FLASH_DISK_SECTOR_SIZE must be a power of two from 512 to 4096"
+#endif
+#if FLASH_DISK_SECTOR_SIZE % FLASH_DISK_PROGRAM_SIZE != 0
+	#error "FLASH_DISK_PROGRAM_SIZE must divide FLASH_DISK_SECTOR_SIZE"
+#endif
+
+#ifdef FLASH_DISK_ERASE
+/** @brief Erase a Flash Disk Erase Block
+ *
+ * FLASH_DISK_ERASE() is called by the flash disk implementation to erase
+ * the FLASH_DISK_BLOCK_SIZE bytes starting at @p offset, leaving them all
+ * 0xff. This function should block until the erase has completed.
+ *
+ * @param instance   The instance member of the flash disk
+ * @param offset     The offset of the erase block in the flash region
+ *
+ * @returns
+ *   Return 0 on success or -1 on failure.
+ */
+int8_t FLASH_DISK_ERASE(uint8_t instance, uint32_t offset);
+#else
+	#error "You must define FLASH_DISK_ERASE"
+#endif
+
+#ifdef FLASH_DISK_PROGRAM
+/** @brief Program Flash
+ *
+ * FLASH_DISK_PROGRAM() is called by the flash disk implementation to
+ * program @p len bytes of erased flash at @p offset. Both are multiples of
+ * FLASH_DISK_PROGRAM_SIZE, and @p len is at most FLASH_DISK_SECTOR_SIZE.
+ * @p data is always in RAM. This function should block until the data has
+ * been programmed.
+ *
+ * @param instance   The instance member of the flash disk
+ * @param offset     The offset in the flash region to program
+ * @param data       The data to program
+ * @param len        The number of bytes to program
+ *
+ * @returns
+ *   Return 0 on success or -1 on failure.
+ */
+int8_t FLASH_DISK_PROGRAM(uint8_t instance, uint32_t offset,
+                          const uint8_t *data, uint16_t len);
+#else
+	#error "You must define FLASH_DISK_PROGRAM"
+#endif
+
+#ifdef FLASH_DISK_MAP
+/** @brief Map Flash into the Address Space
+ *
+ * Define FLASH_DISK_MAP() on platforms where flash can be read directly
+ * through a pointer (such as PIC32). It is called by the flash disk
+ * implementation to get a pointer to the flash at @p offset, so that
+ * sectors can be sent to the host without copying them. The pointer must
+ * not be served by a cache which programming and erasing don't update.
+ *
+ * @param instance   The instance member of the flash disk
+ * @param offset     The offset in the flash region
+ *
+ * @returns
+ *   Return a pointer to the flash at @p offset.
+ */
+const uint8_t *FLASH_DISK_MAP(uint8_t instance, uint32_t offset);
+#elif defined(FLASH_DISK_READ)
+/** @brief Read Flash
+ *
+ * Define FLASH_DISK_READ() on platforms where flash can't be read through
+ * a pointer (such as PIC24, where it is read with table reads). It is
+ * called by the flash disk implementation to read @p len bytes at
+ * @p offset into @p buf.
+ *
+ * @param instance   The instance member of the flash disk
+ * @param offset     The offset in the flash region to read
+ * @param buf        The buffer to read into
+ * @param len        The number of bytes to read
+ */
+void FLASH_DISK_READ(uint8_t instance, uint32_t offset,
+                     uint8_t *buf, uint16_t len);
+#else
+	#error "You must define either FLASH_DISK_MAP or FLASH_DISK_READ"
+#endif
+
+/** @brief Flash Disk Write-back Cache Entry
+ *
+ * This is used by the flash disk implementation.
+ */
+struct flash_disk_cache_entry {
+	uint16_t lba;       /**< Sector held, or 0xffff if none */
+	bool dirty;         /**< Not yet written to flash */
+	uint32_t last_used; /**< For choosing the entry to evict */
+};
+
+/** @brief Flash Disk
+ *
+ * The application provides one of these for each flash disk, and keeps it
+ * for the lifetime of the application. Global variables work well for
+ * this.
+ *
+ * The application shall initialize the members in the first section
+ * before calling @p flash_disk_init(). The members in the second section
+ * are used by the flash disk implementation.
+ */
+struct flash_disk {
+	/* Application should initialize the following: */
+	uint8_t instance;   /**< Passed to the FLASH_DISK_*() functions */
+	bool write_protect;
+
+	/* The flash disk implementation uses the following: */
+	bool mounted;
+	struct msc_application_data *msc; /**< Interface of the transfer */
+	bool active;                 /**< A transfer is in progress */
+	volatile bool read_needed;   /**< Send the next sectors */
+	volatile bool write_needed;  /**< A sector has been received */
+	uint16_t lba;                /**< Next sector to send or receive */
+	uint16_t remaining;          /**< Sectors not yet sent or received */
+	uint16_t sending;            /**< Sectors in the current send */
+	uint32_t bytes_written;
+
+	/* The FTL */
+	uint16_t map[FLASH_DISK_NUM_SECTORS]; /**< Slot of each sector */
+	uint32_t sequence[FLASH_DISK_NUM_BLOCKS]; /**< Order blocks opened */
+	uint32_t erase_count[FLASH_DISK_NUM_BLOCKS];
+	uint8_t live[FLASH_DISK_NUM_BLOCKS]; /**< Mapped slots in each block */
+	uint16_t free_blocks;
+	uint16_t open_block;         /**< Block being written, or 0xffff */
+	uint8_t next_slot;           /**< Next free slot in open_block */
+	uint32_t next_sequence;
+
+	/* The write-back cache */
+	struct flash_disk_cache_entry cache[FLASH_DISK_CACHE_SECTORS];
+	uint8_t cache_data[FLASH_DISK_CACHE_SECTORS][FLASH_DISK_SECTOR_SIZE];
+	uint32_t cache_counter;
+
+	/* Received write data, and read data when flash isn't mapped */
+	uint8_t buf[FLASH_DISK_SECTOR_SIZE];
+#ifdef FLASH_DISK_MAP
+	/* Where the sectors of the current send are */
+	struct msc_send_segment segments[FLASH_DISK_SEND_SEGMENTS];
+#endif
+
+	struct flash_disk *next;
+};
+
+/** @brief Initialize a Flash Disk
+ *
+ * Initialize a flash disk whose members have been set as described in
+ * @p struct flash_disk, and rebuild its map from the flash region. Erase
+ * blocks which don't hold flash disk data are erased, so the first time
+ * this is called on a region it formats it as an empty disk. A garbage
+ * collection which was interrupted by a reset is completed.
+ *
+ * This function may erase and program flash, so call it from the main
+ * loop (or before the USB stack is started), not from interrupt context.
+ *
+ * @param fd    The flash disk
+ *
+ * @returns
+ *   Return 0 on success or -1 if the flash disk could not be mounted.
+ */
+int8_t flash_disk_init(struct flash_disk *fd);
+
+/** @brief Format a Flash Disk
+ *
+ * Erase every erase block of a flash disk, discarding all its data
+ * (including the write-back cache), and mount it as an empty disk. This
+ * can be used to recover a flash disk which @p flash_disk_init() couldn't
+ * mount. Call it from the main loop, after @p flash_disk_init().
+ *
+ * @param fd    The flash disk
+ *
+ * @returns
+ *   Return 0 on success or -1 if any erase block could not be erased.
+ */
+int8_t flash_disk_format(struct flash_disk *fd);
+
+/** @brief Get Flash Disk Storage Information
+ *
+ * Call from the application's @p MSC_GET_STORAGE_INFORMATION callback.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t flash_disk_get_storage_info(const struct flash_disk *fd,
+                                   uint32_t *block_size,
+                                   uint32_t *num_blocks,
+                                   bool *write_protect);
+
+/** @brief Check whether a Flash Disk is Ready
+ *
+ * Call from the application's @p MSC_UNIT_READY callback. A flash disk is
+ * ready once it has been mounted.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t flash_disk_unit_ready(const struct flash_disk *fd);
+
+/** @brief Start a Read from a Flash Disk
+ *
+ * Call from the application's @p MSC_START_READ callback. The data is sent
+ * to the host by @p flash_disk_service(), which calls
+ * @p msc_notify_read_operation_complete() when it has all been sent.
+ *
+ * @param fd           The flash disk
+ * @param app_data     The @p app_data passed to @p MSC_START_READ
+ * @param lba_address  The @p lba_address passed to @p MSC_START_READ
+ * @param num_blocks   The @p num_blocks passed to @p MSC_START_READ
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t flash_disk_start_read(struct flash_disk *fd,
+                             struct msc_application_data *app_data,
+                             uint32_t lba_address,
+                             uint16_t num_blocks);
+
+#ifdef MSC_WRITE_SUPPORT
+/** @brief Start a Write to a Flash Disk
+ *
+ * Call from the application's @p MSC_START_WRITE callback, passing its
+ * parameters through. Each sector is received into a buffer and moved into
+ * the write-back cache by @p flash_disk_service(), which notifies the MSC
+ * class when the write has completed.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t flash_disk_start_write(struct flash_disk *fd,
+                              struct msc_application_data *app_data,
+                              uint32_t lba_address,
+                              uint16_t num_blocks,
+                              uint8_t **buffer,
+                              size_t *buffer_len,
+                              msc_completion_callback *callback);
+#endif
+
+/** @brief Service a Flash Disk
+ *
+ * Carry out the reading and writing started by @p flash_disk_start_read()
+ * and @p flash_disk_start_write(). Call this repeatedly from the
+ * application's main loop. It may block while flash is programmed and
+ * erased.
+ *
+ * @param fd    The flash disk
+ */
+void flash_disk_service(struct flash_disk *fd);
+
+/** @brief Flush a Flash Disk's Write-back Cache
+ *
+ * Write the sectors in the write-back cache which have not yet been written
+ * to flash. Until this is done, written data will be lost if the device is
+ * reset. A good time to call this is when the host hasn't accessed the
+ * flash disk for a second or so, and when it is stopped or ejected. Call it
+ * from the main loop. Nothing is done while a read or write is in
+ * progress.
+ *
+ * @param fd    The flash disk
+ *
+ * @returns
+ *   Return 0 on success or -1 if any sector could not be written.
+ */
+int8_t flash_disk_flush(struct flash_disk *fd);
+
+/** @brief Unmap Sectors of a Flash Disk
+ *
+ * Discard sectors the host no longer needs, for the application's
+ * @p MSC_UNMAP callback. The sectors are dropped from the write-back cache
+ * and the map, so garbage collection doesn't copy them. Until they are
+ * written again, they read as zeros, or after the next
+ * @p flash_disk_init(), possibly as their old data. This doesn't access
+ * the flash, but it changes the map, so call it from the main loop rather
+ * than from @p MSC_UNMAP itself, and not during a read or write.
+ *
+ * @param fd           The flash disk
+ * @param lba_address  The first sector to unmap
+ * @param num_blocks   The number of sectors to unmap
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t flash_disk_unmap(struct flash_disk *fd,
+                        uint32_t lba_address,
+                        uint32_t num_blocks);
+
+/** @brief Cancel a Flash Disk Transfer
+ *
+ * Abandon any read or write in progress, for example when the MSC class is
+ * being reset. Sectors already received stay in the write-back cache. Call
+ * this from the main loop, before calling @p msc_init().
+ *
+ * @param fd    The flash disk
+ */
+void flash_disk_cancel(struct flash_disk *fd);
+
+/* Doxygen end-of-group for public_api */
+/** @}*/
+
+#endif /* M_STACK_FLASH_DISK_H__ */
@@ -186,6 +186,7 @@ enum MMCState {
 	MMC_STATE_IDLE = 0,
 	MMC_STATE_READY = 1,
 	MMC_STATE_WRITE_MULTIPLE = 2,
+	MMC_STATE_READ_MULTIPLE = 3,
 };
 
 /** MMC Card Structure
@@ -219,9 +220,13 @@ struct mmc_card {
 	bool card_ccs; /* false: SDSC, true: SDHC or SDXC */
 	uint8_t state; /* enum MMCState */
 	uint32_t card_size_blocks; /* Card size in 512-byte blocks */
+	uint32_t erase_unit_blocks; /* The smallest erasable piece, in
+				     * 512-byte blocks */
 	uint16_t write_position;   /* Position in the current block during a
 				    * multi-block write (in bytes). */
 	uint16_t checksum;         /* Current checksum value */
+	bool busy;                 /* Writing the last block of a multi-block
+				    * write. */
 };
 
 /** @brief Initialize the MMC System
@@ -323,6 +328,50 @@ int8_t mmc_read_block(struct mmc_card *mmc,
                       uint32_t block_addr,
                       uint8_t *data);
 
+/** @brief Begin a multi-block read operation from the MMC card
+ *
+ * Multi-block reads save sending a command for each block, and let the card
+ * fetch the next block while the current one is being read. This function
+ * only begins the multi-block read, and must be followed by calls to @p
+ * mmc_multiblock_read_data() (one per block, which read the consecutive
+ * blocks starting at @p block_addr), and a call to @p
+ * mmc_multiblock_read_end(), which must also be called if a read fails.
+ *
+ * The card's chip select is left asserted until @p
+ * mmc_multiblock_read_end() is called, so other devices on the same SPI bus
+ * can't be used in the meantime.
+ *
+ * @param mmc        The MMC card to read from
+ * @param block_addr The first block number to read from
+ *
+ * @returns
+ *   Return 0 if the command completed successfully or -1 otherwise.
+ */
+int8_t mmc_multiblock_read_start(struct mmc_card *mmc,
+                                 uint32_t block_addr);
+
+/** @brief Read the next block of a multi-block read
+ *
+ * @param mmc        The MMC card to read from
+ * @param data       A buffer to place the data in. This buffer must be at
+ *                   least MMC_BLOCK_SIZE (512) bytes in length.
+ * @returns
+ *   Return 0 if the data was read successfully or -1 otherwise.
+ */
+int8_t mmc_multiblock_read_data(struct mmc_card *mmc, uint8_t *data);
+
+/** @brief End a multi-block read operation
+ *
+ * Stop the card sending blocks. Call this when the blocks needed have been
+ * read, or when @p mmc_multiblock_read_data() fails.
+ *
+ * @param mmc        The MMC card being read
+ *
+ * @returns
+ *   Return 0 if the card stopped successfully or -1 otherwise.
+ */
+int8_t mmc_multiblock_read_end(struct mmc_card *mmc);
+
 /** @brief Write a block of data to the MMC card
  *
  * Write a block of data to the SD card. For the purposes of this library,
@@ -365,7 +414,13 @@ int8_t mmc_multiblock_write_start(struct mmc_card *mmc,
  * repeatedly to pass data to the MMC card.  The amount of data can be less
  * than an entire block, but it is important that the data passed in does
  * not cross a block boundary.  The implementation will automatically handle
- * the starting and stopping of blocks on the media when necessary.  @p
+ * the starting and stopping of blocks on the media when necessary.
+ *
+ * When a block has been completed, this function returns once the card has
+ * accepted the data, without waiting for the card to finish writing it. The
+ * wait is done by the next call to this function or to @p
+ * mmc_multiblock_write_end(), so the caller can prepare the next block (or
+ * write to a card on another SPI bus) while the card is busy.  @p
  * mmc_multiblock_write_start() must be called prior to this function, and
  * @p mmc_multiblock_write_end() must be called after all the data from all
  * the blocks has been passed in.
@@ -405,6 +460,33 @@ int8_t mmc_multiblock_write_end(struct mmc_card *mmc);
  */
 int8_t mmc_multiblock_write_cancel(struct mmc_card *mmc);
 
+/** @brief Erase blocks on the MMC card
+ *
+ * Erase a range of blocks with the card's erase commands, which is much
+ * faster than writing them. What erased blocks read as (all zeros or all
+ * ones) depends on the card. Some SDSC cards can only erase whole sectors
+ * of several blocks; on those, the blocks at the start and end of the
+ * range which don't fill a sector are left as they are, and a range
+ * smaller than a sector isn't erased at all. This blocks until the card
+ * has finished erasing, which can take some time for a large range. It
+ * can't be called during a multi-block read or write.
+ *
+ * If the card is still busy after the erase timeout of the SD spec (250
+ * ms per block), -1 is returned and the card may still be erasing. It must
+ * then be initialized again with @p mmc_init_card() before it is used.
+ *
+ * @param mmc        The MMC card to erase
+ * @param block_addr The first block to erase
+ * @param num_blocks The number of blocks to erase. This must be at least
+ *                   one.
+ *
+ * @returns
+ *   Return 0 if the blocks were erased successfully or -1 otherwise.
+ */
+int8_t mmc_erase(struct mmc_card *mmc,
+                 uint32_t block_addr,
+                 uint32_t num_blocks);
+
 
 /* Doxygen end-of-group for public_api */
 /** @}*/
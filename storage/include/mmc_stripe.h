@@ -0,0 +1,225 @@
+/*
+ *  M-Stack USB Device Stack - MMC/SD Card Striping implementation
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+
+#ifndef M_STACK_MMC_STRIPE_H__
+#define M_STACK_MMC_STRIPE_H__
+
+/** @file mmc_stripe.h
+ *  @brief M-Stack MMC/SD Card Striping
+ *  @defgroup public_api Public API
+ *
+ * This component presents several MMC/SD cards as one Mass Storage Class
+ * medium (RAID-0). The medium is divided into stripes of @p stripe_blocks
+ * blocks, which are laid out on the cards in turn: stripe 0 on the first
+ * card, stripe 1 on the second, and so on, wrapping around to the first
+ * card. Like the RAM disk (see ramdisk.h), its functions have the same
+ * form as the storage callbacks of the MSC class, without the LUN.
+ *
+ * The blocks of a transfer which are on one card are consecutive on that
+ * card, so a transfer is carried out with one multi-block read or write on
+ * each card involved, and the blocks are passed to and from the cards in
+ * order. The SPI transfers themselves block (see @p MMC_SPI_TRANSFER()),
+ * but the cards work at the same time: while a block is being written to
+ * one card, the others are finishing the blocks written to them, and while
+ * a block is being read from one card, the others are fetching their next
+ * block. Reads are double-buffered, so a block is read from the cards while
+ * the previous one is being sent to the host.
+ *
+ * A multi-block read or write keeps the card's chip select asserted until
+ * it ends, so each card must be on its own SPI bus (a separate
+ * @p spi_instance which doesn't share pins with the others).
+ *
+ * The cards block the CPU while they are being read and written, so data
+ * is transferred from the application's main loop by
+ * @p mmc_stripe_service(), rather than from interrupt context.
+ *
+ * The cards are initialized by the application (as with a single card, see
+ * mmc.h), which knows whether they are present. The capacity of the
+ * medium is that of the smallest card, rounded down to whole stripes, times
+ * the number of cards.
+ */
+
+/** @addtogroup public_api
+ *  @{
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "usb_config.h"
+#include "usb_ch9.h"
+#include "usb_msc.h"
+#include "mmc.h"
+
+/** @brief Striped MMC/SD Cards
+ *
+ * The application provides one of these for each set of striped cards,
+ * and keeps it for the lifetime of the application. Global variables work
+ * well for this.
+ *
+ * The application shall initialize the members in the first section
+ * before calling @p mmc_stripe_init(). The members in the second section
+ * are used by the striping implementation.
+ */
+struct mmc_stripe {
+	/* Application should initialize the following: */
+	struct mmc_card *cards;  /**< num_cards cards, passed to mmc_init() */
+	uint8_t num_cards;
+	uint16_t stripe_blocks;  /**< Blocks in each stripe */
+	bool write_protect;
+
+	/* The striping implementation uses the following: */
+	struct msc_application_data *msc; /**< Interface of the transfer */
+	bool active;                 /**< A transfer is in progress */
+	bool writing;
+	volatile bool starting;      /**< The cards need to be started */
+	bool streaming;              /**< The cards have been started */
+	bool failed;
+	uint32_t lba;                /**< Next block to read or write */
+	uint16_t remaining;          /**< Blocks not yet read or written */
+	uint16_t unsent;             /**< Blocks not yet sent to the host */
+	uint32_t bytes_written;
+
+	/* Read buffers. buf[head] is sent first, and filled buffers follow
+	 * it. Written data is received into buf[0]. */
+	uint8_t buf[2][MMC_BLOCK_SIZE];
+	uint8_t head;
+	uint8_t filled;
+	bool sending;
+	volatile bool send_done;
+	volatile bool send_ok;
+	volatile bool write_needed;  /**< A block has been received */
+
+	struct mmc_stripe *next;
+};
+
+/** @brief Initialize Striped MMC/SD Cards
+ *
+ * Initialize a set of striped cards whose members have been set as
+ * described in @p struct mmc_stripe. The cards themselves are initialized
+ * separately, with @p mmc_init() and @p mmc_init_card().
+ *
+ * @param ms    The striped cards
+ *
+ * @returns
+ *   Return 0 on success or -1 if the members are not valid.
+ */
+int8_t mmc_stripe_init(struct mmc_stripe *ms);
+
+/** @brief Get the Number of Blocks of Striped MMC/SD Cards
+ *
+ * @param ms    The striped cards
+ *
+ * @returns
+ *   Return the number of 512-byte blocks on the medium, or 0 if any of the
+ *   cards is not initialized.
+ */
+uint32_t mmc_stripe_get_num_blocks(const struct mmc_stripe *ms);
+
+/** @brief Get Striped MMC/SD Card Storage Information
+ *
+ * Call from the application's @p MSC_GET_STORAGE_INFORMATION callback.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t mmc_stripe_get_storage_info(const struct mmc_stripe *ms,
+                                   uint32_t *block_size,
+                                   uint32_t *num_blocks,
+                                   bool *write_protect);
+
+/** @brief Check whether Striped MMC/SD Cards are Ready
+ *
+ * Call from the application's @p MSC_UNIT_READY callback, once the
+ * application has checked that the cards are present and initialized any
+ * which weren't. The medium is ready when all of its cards are
+ * initialized. The cards are not accessed.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t mmc_stripe_unit_ready(const struct mmc_stripe *ms);
+
+/** @brief Start a Read from Striped MMC/SD Cards
+ *
+ * Call from the application's @p MSC_START_READ callback. The data is read
+ * from the cards and sent to the host by @p mmc_stripe_service(), which
+ * calls @p msc_notify_read_operation_complete() when it has all been sent.
+ *
+ * @param ms           The striped cards
+ * @param app_data     The @p app_data passed to @p MSC_START_READ
+ * @param lba_address  The @p lba_address passed to @p MSC_START_READ
+ * @param num_blocks   The @p num_blocks passed to @p MSC_START_READ
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t mmc_stripe_start_read(struct mmc_stripe *ms,
+                             struct msc_application_data *app_data,
+                             uint32_t lba_address,
+                             uint16_t num_blocks);
+
+#ifdef MSC_WRITE_SUPPORT
+/** @brief Start a Write to Striped MMC/SD Cards
+ *
+ * Call from the application's @p MSC_START_WRITE callback, passing its
+ * parameters through. Each block is received into a buffer and written to
+ * its card by @p mmc_stripe_service(), which notifies the MSC class when
+ * the write has completed.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t mmc_stripe_start_write(struct mmc_stripe *ms,
+                              struct msc_application_data *app_data,
+                              uint32_t lba_address,
+                              uint16_t num_blocks,
+                              uint8_t **buffer,
+                              size_t *buffer_len,
+                              msc_completion_callback *callback);
+#endif
+
+/** @brief Service Striped MMC/SD Cards
+ *
+ * Carry out the reading and writing started by @p mmc_stripe_start_read()
+ * and @p mmc_stripe_start_write(). Call this repeatedly from the
+ * application's main loop. It blocks while the cards are read and written.
+ *
+ * @param ms    The striped cards
+ */
+void mmc_stripe_service(struct mmc_stripe *ms);
+
+/** @brief Cancel a Transfer on Striped MMC/SD Cards
+ *
+ * Abandon any transfer in progress, without notifying the MSC class, and
+ * stop any multi-block reads or writes on the cards. Call this from the
+ * main loop when the MSC interface is reset, before @p msc_init().
+ *
+ * @param ms    The striped cards
+ */
+void mmc_stripe_cancel(struct mmc_stripe *ms);
+
+/* Doxygen end-of-group for public_api */
+/** @}*/
+
+#endif /* M_STACK_MMC_STRIPE_H__ */
@@ -0,0 +1,157 @@
+/*
+ *  M-Stack USB Device Stack - RAM Disk implementation
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+
+#ifndef M_STACK_RAMDISK_H__
+#define M_STACK_RAMDISK_H__
+
+/** @file ramdisk.h
+ *  @brief M-Stack RAM Disk
+ *  @defgroup public_api Public API
+ *
+ * This component is a Mass Storage Class medium kept in an array in RAM.
+ * Its functions have the same form as the storage callbacks of the MSC
+ * class (see usb_msc.h), without the LUN, so that the application's
+ * callbacks can pass the requests for one LUN to a RAM disk and the
+ * requests for other LUNs to other media (such as an MMC/SD card).
+ *
+ * Reads are sent to the host straight from the array, and written data is
+ * received straight into it, so no copies are made and the application's
+ * main loop is not involved. This makes a RAM disk useful for measuring
+ * the throughput of the USB and MSC layers on their own, and as a fast
+ * scratch disk. The contents are lost when the device is reset.
+ */
+
+/** @addtogroup public_api
+ *  @{
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "usb_config.h"
+#include "usb_ch9.h"
+#include "usb_msc.h"
+
+/** @brief RAM Disk
+ *
+ * The application provides one of these for each RAM disk, and keeps it
+ * for the lifetime of the application. Global variables work well for
+ * this.
+ *
+ * The application shall initialize the members in the first section
+ * before calling @p ramdisk_init(). The members in the second section are
+ * used by the RAM disk implementation.
+ */
+struct ramdisk {
+	/* Application should initialize the following: */
+	uint8_t *data;       /**< num_blocks * block_size bytes */
+	uint32_t num_blocks;
+	uint16_t block_size; /**< A multiple of the endpoint size */
+	bool write_protect;
+
+	/* The RAM disk implementation uses the following: */
+	struct msc_application_data *msc; /**< Interface of the transfer */
+	bool active;             /**< A transfer is in progress */
+	const uint8_t *read_pos; /**< Next data to send */
+	uint32_t remaining;      /**< Bytes not yet sent or received */
+	struct ramdisk *next;
+};
+
+/** @brief Initialize a RAM Disk
+ *
+ * Initialize a RAM disk whose members have been set as described in
+ * @p struct ramdisk. The contents of the array are left as they are.
+ *
+ * @param rd    The RAM disk
+ *
+ * @returns
+ *   Return 0 on success or -1 if the RAM disk is not valid.
+ */
+int8_t ramdisk_init(struct ramdisk *rd);
+
+/** @brief Get RAM Disk Storage Information
+ *
+ * Call from the application's @p MSC_GET_STORAGE_INFORMATION callback.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t ramdisk_get_storage_info(const struct ramdisk *rd,
+                                uint32_t *block_size,
+                                uint32_t *num_blocks,
+                                bool *write_protect);
+
+/** @brief Check whether a RAM Disk is Ready
+ *
+ * Call from the application's @p MSC_UNIT_READY callback. A RAM disk is
+ * always ready.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t ramdisk_unit_ready(const struct ramdisk *rd);
+
+/** @brief Start a Read from a RAM Disk
+ *
+ * Call from the application's @p MSC_START_READ callback. The data is sent
+ * to the host from the array, and @p msc_notify_read_operation_complete()
+ * is called when it has all been sent, so the application has nothing
+ * further to do for the read.
+ *
+ * @param rd           The RAM disk
+ * @param app_data     The @p app_data passed to @p MSC_START_READ
+ * @param lba_address  The @p lba_address passed to @p MSC_START_READ
+ * @param num_blocks   The @p num_blocks passed to @p MSC_START_READ
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t ramdisk_start_read(struct ramdisk *rd,
+                          struct msc_application_data *app_data,
+                          uint32_t lba_address,
+                          uint16_t num_blocks);
+
+#ifdef MSC_WRITE_SUPPORT
+/** @brief Start a Write to a RAM Disk
+ *
+ * Call from the application's @p MSC_START_WRITE callback, passing its
+ * parameters through. The data is received into the array, and the MSC
+ * class is notified when it has all been received, so the application has
+ * nothing further to do for the write.
+ *
+ * @returns
+ *   Returns a code from @p MSCReturnCodes.
+ */
+int8_t ramdisk_start_write(struct ramdisk *rd,
+                           struct msc_application_data *app_data,
+                           uint32_t lba_address,
+                           uint16_t num_blocks,
+                           uint8_t **buffer,
+                           size_t *buffer_len,
+                           msc_completion_callback *callback);
+#endif
+
+/* Doxygen end-of-group for public_api */
+/** @}*/
+
+#endif /* M_STACK_RAMDISK_H__ */
@@ -0,0 +1,1056 @@
+/*
+ *  M-Stack USB Device Stack - Flash Disk implementation
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flash_disk_config.h"
+
+/* The flash disk is only built when flash_disk_config.h describes a flash
+ * region, so that it can be part of a project for several platforms. */
+#ifdef FLASH_DISK_BLOCK_SIZE
+
+#include "flash_disk.h"
+
+/* Layout of an erase block. The sector slots come first, followed by the
+ * metadata: the erase count, the magic number, the sequence number, and a
+ * tag for each slot. Each of these takes FLASH_DISK_TAG_SIZE bytes and is
+ * programmed on its own, in this order:
+ *
+ *  - The erase count and then the magic number, right after the block is
+ *    erased. A block without the magic number is erased at mount.
+ *  - The sequence number, when the block is opened for writing. Blocks
+ *    opened later hold newer data.
+ *  - The data of a slot, and then its tag, which holds the logical sector
+ *    number and its complement. A slot whose tag isn't valid is ignored.
+ */
+#define SLOTS FLASH_DISK_SECTORS_PER_BLOCK
+#define SECTOR_SIZE FLASH_DISK_SECTOR_SIZE
+#define TAG_SIZE FLASH_DISK_TAG_SIZE
+#define META_OFFSET ((uint32_t) SLOTS * SECTOR_SIZE)
+#define ERASE_COUNT_OFFSET (META_OFFSET)
+#define MAGIC_OFFSET       (META_OFFSET + TAG_SIZE)
+#define SEQUENCE_OFFSET    (META_OFFSET + 2 * TAG_SIZE)
+#define TAG_OFFSET(slot)   (META_OFFSET + (3 + (uint32_t) (slot)) * TAG_SIZE)
+
+#define MAGIC 0x314c5446 /* "FTL1" */
+#define ERASED 0xffffffff
+
+#define UNMAPPED 0xffff   /* map[] entry for a sector never written */
+#define NO_BLOCK 0xffff   /* open_block when no block is open */
+#define NO_SEQUENCE 0xffffffff /* sequence[] of an erased block */
+#define UNFORMATTED 0xfffffffe /* sequence[] of a block to be erased */
+
+/* Programming only clears bits, so a sequence number whose programming was
+ * interrupted reads as a larger number than it should. Sequence numbers
+ * above this are taken to be such, and the block is erased at mount. */
+#define MAX_SEQUENCE 0x7fffffff
+
+/* Flash is copied (during garbage collection) through a buffer on the
+ * stack of this size. */
+#if FLASH_DISK_PROGRAM_SIZE > 64
+	#define COPY_SIZE FLASH_DISK_PROGRAM_SIZE
+#else
+	#define COPY_SIZE 64
+#endif
+
+/* All the initialized flash disks. The MSC completion callbacks are only
+ * passed the interface's application data, so the flash disk which is
+ * transferring data for an interface is found from this list. */
+static struct flash_disk *flash_disks;
+
+static int8_t write_sector(struct flash_disk *fd, uint16_t lba,
+                           const uint8_t *data);
+
+static struct flash_disk *find_active(struct msc_application_data *app_data)
+{
+	struct flash_disk *fd;
+
+	for (fd = flash_disks; fd; fd = fd->next) {
+		if (fd->active && fd->msc == app_data)
+			return fd;
+	}
+
+	return NULL;
+}
+
+static uint32_t block_offset(uint16_t block)
+{
+	return (uint32_t) block * FLASH_DISK_BLOCK_SIZE;
+}
+
+static uint32_t slot_offset(uint16_t slot)
+{
+	return block_offset(slot / SLOTS) + (uint32_t) (slot % SLOTS) *
+	                                                   SECTOR_SIZE;
+}
+
+static void read_flash(struct flash_disk *fd, uint32_t offset,
+                       uint8_t *buf, uint16_t len)
+{
+#ifdef FLASH_DISK_MAP
+	memcpy(buf, FLASH_DISK_MAP(fd->instance, offset), len);
+#else
+	FLASH_DISK_READ(fd->instance, offset, buf, len);
+#endif
+}
+
+static uint32_t read_tag(struct flash_disk *fd, uint32_t offset)
+{
+	uint32_t value;
+
+	read_flash(fd, offset, (uint8_t*) &value, sizeof(value));
+	return value;
+}
+
+static int8_t program_tag(struct flash_disk *fd, uint32_t offset,
+                          uint32_t value)
+{
+	uint8_t tag[TAG_SIZE];
+
+	memset(tag, 0xff, sizeof(tag));
+	memcpy(tag, &value, sizeof(value));
+
+	return FLASH_DISK_PROGRAM(fd->instance, offset, tag, sizeof(tag));
+}
+
+/* Return the logical sector in a slot tag, or UNMAPPED if the tag isn't
+ * valid (or the slot hasn't been written). */
+static uint16_t tag_sector(uint32_t tag)
+{
+	uint16_t lba = tag & 0xffff;
+
+	if ((uint16_t) ~lba != tag >> 16 || lba >= FLASH_DISK_NUM_SECTORS)
+		return UNMAPPED;
+
+	return lba;
+}
+
+static bool is_erased(struct flash_disk *fd, uint32_t offset, uint32_t len)
+{
+	uint8_t buf[COPY_SIZE];
+	uint16_t i, n;
+
+	while (len > 0) {
+		n = (len > sizeof(buf))? sizeof(buf): len;
+		read_flash(fd, offset, buf, n);
+
+		for (i = 0; i < n; i++) {
+			if (buf[i] != 0xff)
+				return false;
+		}
+
+		offset += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Point lba at slot, updating the live counts of the erase blocks. */
+static void remap(struct flash_disk *fd, uint16_t lba, uint16_t slot)
+{
+	uint16_t old = fd->map[lba];
+
+	if (old != UNMAPPED)
+		fd->live[old / SLOTS]--;
+
+	fd->map[lba] = slot;
+	fd->live[slot / SLOTS]++;
+}
+
+/* Erase a block and write its header, leaving it free. */
+static int8_t erase_block(struct flash_disk *fd, uint16_t block)
+{
+	uint32_t offset = block_offset(block);
+	int8_t res;
+
+	/* Take the block out of use first, so that its sequence number
+	 * isn't reused if the erase fails. */
+	if (fd->sequence[block] == NO_SEQUENCE)
+		fd->free_blocks--;
+	fd->sequence[block] = UNFORMATTED;
+	fd->live[block] = 0;
+	if (fd->open_block == block)
+		fd->open_block = NO_BLOCK;
+
+	res = FLASH_DISK_ERASE(fd->instance, offset);
+	if (res < 0)
+		return res;
+
+	fd->erase_count[block]++;
+
+	res = program_tag(fd, offset + ERASE_COUNT_OFFSET,
+	                  fd->erase_count[block]);
+	if (res < 0)
+		return res;
+	res = program_tag(fd, offset + MAGIC_OFFSET, MAGIC);
+	if (res < 0)
+		return res;
+
+	fd->sequence[block] = NO_SEQUENCE;
+	fd->free_blocks++;
+
+	return 0;
+}
+
+/* Open the free block with the lowest erase count for writing. */
+static int8_t open_free_block(struct flash_disk *fd)
+{
+	uint16_t block = NO_BLOCK;
+	uint16_t i;
+	int8_t res;
+
+	for (i = 0; i < FLASH_DISK_NUM_BLOCKS; i++) {
+		if (fd->sequence[i] != NO_SEQUENCE)
+			continue;
+		if (block == NO_BLOCK ||
+		    fd->erase_count[i] < fd->erase_count[block])
+			block = i;
+	}
+
+	if (block == NO_BLOCK || fd->next_sequence > MAX_SEQUENCE)
+		return -1;
+
+	res = program_tag(fd, block_offset(block) + SEQUENCE_OFFSET,
+	                  fd->next_sequence);
+	if (res < 0)
+		return res;
+
+	fd->sequence[block] = fd->next_sequence++;
+	fd->free_blocks--;
+	fd->open_block = block;
+	fd->next_slot = 0;
+
+	return 0;
+}
+
+static bool open_block_full(const struct flash_disk *fd)
+{
+	return fd->open_block == NO_BLOCK || fd->next_slot >= SLOTS;
+}
+
+/* Take the next free slot, opening a new block if necessary. Return the
+ * slot or UNMAPPED if there are none. */
+static uint16_t alloc_slot(struct flash_disk *fd)
+{
+	if (open_block_full(fd) && open_free_block(fd) < 0)
+		return UNMAPPED;
+
+	return fd->open_block * SLOTS + fd->next_slot++;
+}
+
+/* Program the tag of a slot which has just been programmed and point the
+ * sector at it. */
+static int8_t commit_slot(struct flash_disk *fd, uint16_t lba,
+                          uint16_t slot)
+{
+	int8_t res;
+
+	res = program_tag(fd, block_offset(slot / SLOTS) +
+	                      TAG_OFFSET(slot % SLOTS),
+	                  lba | (uint32_t) (uint16_t) ~lba << 16);
+	if (res < 0)
+		return res;
+
+	remap(fd, lba, slot);
+	return 0;
+}
+
+/* Copy a sector into a new slot. */
+static int8_t move_sector(struct flash_disk *fd, uint16_t lba)
+{
+	uint8_t buf[COPY_SIZE];
+	uint32_t from, to;
+	uint16_t slot, i;
+	int8_t res;
+
+	slot = alloc_slot(fd);
+	if (slot == UNMAPPED)
+		return -1;
+
+	from = slot_offset(fd->map[lba]);
+	to = slot_offset(slot);
+
+	for (i = 0; i < SECTOR_SIZE; i += sizeof(buf)) {
+		read_flash(fd, from + i, buf, sizeof(buf));
+		res = FLASH_DISK_PROGRAM(fd->instance, to + i, buf, sizeof(buf));
+		if (res < 0)
+			return res;
+	}
+
+	return commit_slot(fd, lba, slot);
+}
+
+/* Move the live sectors out of a block and erase it. */
+static int8_t reclaim_block(struct flash_disk *fd, uint16_t block)
+{
+	uint16_t first = block * SLOTS;
+	uint16_t slot;
+	uint16_t lba;
+	int8_t res;
+
+	/* Stop writing to it first, if it's the open block. */
+	if (fd->open_block == block)
+		fd->open_block = NO_BLOCK;
+
+	for (slot = first; slot < first + SLOTS && fd->live[block]; slot++) {
+		lba = tag_sector(read_tag(fd, block_offset(block) +
+		                              TAG_OFFSET(slot - first)));
+		if (lba == UNMAPPED || fd->map[lba] != slot)
+			continue;
+
+		res = move_sector(fd, lba);
+		if (res < 0)
+			return res;
+	}
+
+	return erase_block(fd, block);
+}
+
+/* Garbage collect the block in use with the fewest live sectors (of those
+ * with the same number, the least-erased one), if it has no more than
+ * max_live of them. The open block is left alone unless it's full. */
+static int8_t collect_garbage(struct flash_disk *fd, uint8_t max_live)
+{
+	uint16_t victim = NO_BLOCK;
+	uint16_t i;
+
+	for (i = 0; i < FLASH_DISK_NUM_BLOCKS; i++) {
+		if (fd->sequence[i] >= UNFORMATTED)
+			continue;
+		if (i == fd->open_block && !open_block_full(fd))
+			continue;
+		if (fd->live[i] > max_live)
+			continue;
+		if (victim == NO_BLOCK ||
+		    fd->live[i] < fd->live[victim] ||
+		    (fd->live[i] == fd->live[victim] &&
+		     fd->erase_count[i] < fd->erase_count[victim]))
+			victim = i;
+	}
+
+	if (victim == NO_BLOCK)
+		return -1;
+
+	return reclaim_block(fd, victim);
+}
+
+/* Make room for a sector to be written, keeping a free block in reserve
+ * for garbage collection. */
+static int8_t make_room(struct flash_disk *fd)
+{
+	int8_t res;
+
+	while (open_block_full(fd) && fd->free_blocks < 2) {
+		res = collect_garbage(fd, SLOTS - 1);
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+/* Static wear leveling. Blocks holding data which is never rewritten are
+ * never garbage collected, so the others wear out faster. When the least
+ * erased block in use falls too far behind the most erased block, move its
+ * data into a new block so that it can be reused. This is done when the
+ * open block is full, before make_room(), and the block it frees replaces
+ * the free block it moves to. */
+static int8_t level_wear(struct flash_disk *fd)
+{
+	uint16_t cold = NO_BLOCK;
+	uint32_t max = 0;
+	uint16_t i;
+
+	if (!open_block_full(fd) || fd->free_blocks == 0)
+		return 0;
+
+	for (i = 0; i < FLASH_DISK_NUM_BLOCKS; i++) {
+		if (fd->erase_count[i] > max)
+			max = fd->erase_count[i];
+
+		if (fd->sequence[i] >= UNFORMATTED || i == fd->open_block)
+			continue;
+		if (cold == NO_BLOCK ||
+		    fd->erase_count[i] < fd->erase_count[cold])
+			cold = i;
+	}
+
+	if (cold == NO_BLOCK ||
+	    max - fd->erase_count[cold] < FLASH_DISK_WEAR_LEVEL_THRESHOLD)
+		return 0;
+
+	return reclaim_block(fd, cold);
+}
+
+/* Write a sector to flash. */
+static int8_t write_sector(struct flash_disk *fd, uint16_t lba,
+                           const uint8_t *data)
+{
+	uint16_t slot;
+	int8_t res;
+
+	res = level_wear(fd);
+	if (res < 0)
+		return res;
+
+	res = make_room(fd);
+	if (res < 0)
+		return res;
+
+	slot = alloc_slot(fd);
+	if (slot == UNMAPPED)
+		return -1;
+
+	res = FLASH_DISK_PROGRAM(fd->instance, slot_offset(slot),
+	                         data, SECTOR_SIZE);
+	if (res < 0)
+		return res;
+
+	return commit_slot(fd, lba, slot);
+}
+
+/* Write-back cache */
+
+static int8_t cache_find(const struct flash_disk *fd, uint16_t lba)
+{
+	uint8_t i;
+
+	for (i = 0; i < FLASH_DISK_CACHE_SECTORS; i++) {
+		if (fd->cache[i].lba == lba)
+			return i;
+	}
+
+	return -1;
+}
+
+static void cache_invalidate(struct flash_disk *fd)
+{
+	uint8_t i;
+
+	for (i = 0; i < FLASH_DISK_CACHE_SECTORS; i++) {
+		fd->cache[i].lba = UNMAPPED;
+		fd->cache[i].dirty = false;
+	}
+}
+
+static int8_t cache_write_back(struct flash_disk *fd, uint8_t i)
+{
+	struct flash_disk_cache_entry *e = &fd->cache[i];
+	int8_t res;
+
+	if (!e->dirty)
+		return 0;
+
+	res = write_sector(fd, e->lba, fd->cache_data[i]);
+	if (res < 0)
+		return res;
+
+	e->dirty = false;
+	return 0;
+}
+
+/* Put a sector received from the host into the cache, writing back the
+ * least recently used sector to make room for it if necessary. */
+static int8_t cache_store(struct flash_disk *fd, uint16_t lba,
+                          const uint8_t *data)
+{
+	int8_t i = cache_find(fd, lba);
+	uint8_t j;
+	int8_t res;
+
+	if (i < 0) {
+		i = 0;
+		for (j = 1; j < FLASH_DISK_CACHE_SECTORS; j++) {
+			if (fd->cache[j].lba == UNMAPPED ||
+			    (fd->cache[i].lba != UNMAPPED &&
+			     fd->cache[j].last_used < fd->cache[i].last_used))
+				i = j;
+		}
+
+		res = cache_write_back(fd, i);
+		if (res < 0)
+			return res;
+
+		fd->cache[i].lba = lba;
+	}
+
+	memcpy(fd->cache_data[i], data, SECTOR_SIZE);
+	fd->cache[i].dirty = true;
+	fd->cache[i].last_used = ++fd->cache_counter;
+
+	return 0;
+}
+
+/* Mounting */
+
+/* Build the map from the tags of the blocks in use. Where a sector has
+ * copies in several slots, the one in the block opened last, or the later
+ * one in the same block, is the newest. */
+static void build_map(struct flash_disk *fd)
+{
+	uint16_t block, i, slot, lba, cur;
+
+	for (i = 0; i < FLASH_DISK_NUM_SECTORS; i++)
+		fd->map[i] = UNMAPPED;
+	memset(fd->live, 0, sizeof(fd->live));
+
+	for (block = 0; block < FLASH_DISK_NUM_BLOCKS; block++) {
+		if (fd->sequence[block] >= UNFORMATTED)
+			continue;
+
+		for (i = 0; i < SLOTS; i++) {
+			lba = tag_sector(read_tag(fd, block_offset(block) +
+			                              TAG_OFFSET(i)));
+			if (lba == UNMAPPED)
+				continue;
+
+			slot = block * SLOTS + i;
+			cur = fd->map[lba];
+			if (cur == UNMAPPED ||
+			    fd->sequence[block] > fd->sequence[cur / SLOTS] ||
+			    (cur / SLOTS == block && slot > cur))
+				remap(fd, lba, slot);
+		}
+	}
+}
+
+/* Carry on writing to the block opened last, after its last written slot,
+ * so that a reset doesn't waste the rest of it. */
+static void resume_open_block(struct flash_disk *fd)
+{
+	uint16_t block = NO_BLOCK;
+	uint16_t i;
+	uint8_t slot;
+
+	for (i = 0; i < FLASH_DISK_NUM_BLOCKS; i++) {
+		if (fd->sequence[i] >= UNFORMATTED)
+			continue;
+		if (block == NO_BLOCK || fd->sequence[i] > fd->sequence[block])
+			block = i;
+	}
+
+	fd->open_block = block;
+	fd->next_slot = SLOTS;
+	if (block == NO_BLOCK)
+		return;
+
+	/* A slot whose data was programmed but whose tag wasn't (because of
+	 * a reset) can't be reused, so only the slots after the last one
+	 * which isn't entirely erased are free. */
+	for (slot = SLOTS; slot > 0; slot--) {
+		if (read_tag(fd, block_offset(block) + TAG_OFFSET(slot - 1))
+		                                                   != ERASED ||
+		    !is_erased(fd, slot_offset(block * SLOTS + slot - 1),
+		               SECTOR_SIZE))
+			break;
+	}
+
+	fd->next_slot = slot;
+}
+
+static void start_transfer(struct flash_disk *fd,
+                           struct msc_application_data *app_data,
+                           uint32_t lba, uint16_t num_blocks)
+{
+	struct flash_disk *other;
+
+	for (other = flash_disks; other; other = other->next) {
+		if (other->msc == app_data)
+			other->active = false;
+	}
+
+	fd->msc = app_data;
+	fd->lba = lba;
+	fd->remaining = num_blocks;
+	fd->sending = 0;
+	fd->bytes_written = 0;
+	fd->read_needed = false;
+	fd->write_needed = false;
+	fd->active = true;
+}
+
+int8_t flash_disk_init(struct flash_disk *fd)
+{
+	struct flash_disk *cur;
+	uint32_t max_erase_count = 0;
+	uint16_t block;
+	uint32_t offset;
+	int8_t res;
+
+	fd->mounted = false;
+	fd->msc = NULL;
+	fd->active = false;
+	fd->read_needed = false;
+	fd->write_needed = false;
+	fd->free_blocks = 0;
+	fd->open_block = NO_BLOCK;
+	fd->next_slot = SLOTS;
+	fd->next_sequence = 0;
+	fd->cache_counter = 0;
+	cache_invalidate(fd);
+
+	/* Add it to the list, unless it's already there. */
+	for (cur = flash_disks; cur; cur = cur->next) {
+		if (cur == fd)
+			break;
+	}
+	if (!cur) {
+		fd->next = flash_disks;
+		flash_disks = fd;
+	}
+
+	/* Read the block headers */
+	for (block = 0; block < FLASH_DISK_NUM_BLOCKS; block++) {
+		offset = block_offset(block);
+
+		if (read_tag(fd, offset + MAGIC_OFFSET) != MAGIC) {
+			fd->sequence[block] = UNFORMATTED;
+			fd->erase_count[block] = 0;
+			continue;
+		}
+
+		fd->erase_count[block] =
+			read_tag(fd, offset + ERASE_COUNT_OFFSET);
+		if (fd->erase_count[block] > max_erase_count)
+			max_erase_count = fd->erase_count[block];
+
+		fd->sequence[block] = read_tag(fd, offset + SEQUENCE_OFFSET);
+		if (fd->sequence[block] == NO_SEQUENCE)
+			fd->free_blocks++;
+		else if (fd->sequence[block] > MAX_SEQUENCE)
+			fd->sequence[block] = UNFORMATTED;
+		else if (fd->sequence[block] >= fd->next_sequence)
+			fd->next_sequence = fd->sequence[block] + 1;
+	}
+
+	build_map(fd);
+
+	/* Erase the blocks which don't have a header. Their erase counts
+	 * have been lost, so give them the highest one seen. A block
+	 * which is already erased only needs its header. */
+	for (block = 0; block < FLASH_DISK_NUM_BLOCKS; block++) {
+		if (fd->sequence[block] != UNFORMATTED)
+			continue;
+
+		offset = block_offset(block);
+		fd->erase_count[block] = max_erase_count;
+
+		if (is_erased(fd, offset, FLASH_DISK_BLOCK_SIZE)) {
+			res = program_tag(fd, offset + ERASE_COUNT_OFFSET,
+			                  max_erase_count);
+			if (res < 0)
+				return res;
+			res = program_tag(fd, offset + MAGIC_OFFSET, MAGIC);
+			if (res < 0)
+				return res;
+
+			fd->sequence[block] = NO_SEQUENCE;
+			fd->free_blocks++;
+		}
+		else {
+			res = erase_block(fd, block);
+			if (res < 0)
+				return res;
+		}
+	}
+
+	resume_open_block(fd);
+
+	/* A reset while a block was being collected (or moved for wear
+	 * leveling) can leave no free block. The open block is then the
+	 * one the live sectors were being moved to, so collect a block
+	 * whose live sectors fit in what is left of it. */
+	if (fd->free_blocks == 0) {
+		res = collect_garbage(fd, open_block_full(fd)? 0:
+		                          SLOTS - fd->next_slot);
+		if (res < 0)
+			return res;
+	}
+
+	fd->mounted = true;
+
+	return 0;
+}
+
+int8_t flash_disk_format(struct flash_disk *fd)
+{
+	uint16_t i;
+	int8_t res = 0;
+
+	fd->mounted = false;
+	fd->active = false;
+	cache_invalidate(fd);
+
+	for (i = 0; i < FLASH_DISK_NUM_SECTORS; i++)
+		fd->map[i] = UNMAPPED;
+
+	/* The erase counts read by flash_disk_init() are kept. */
+	fd->free_blocks = 0;
+	for (i = 0; i < FLASH_DISK_NUM_BLOCKS; i++)
+		fd->sequence[i] = UNFORMATTED;
+
+	for (i = 0; i < FLASH_DISK_NUM_BLOCKS; i++) {
+		if (erase_block(fd, i) < 0)
+			res = -1;
+	}
+
+	if (res < 0)
+		return res;
+
+	fd->open_block = NO_BLOCK;
+	fd->next_slot = SLOTS;
+	fd->next_sequence = 0;
+	fd->mounted = true;
+
+	return 0;
+}
+
+int8_t flash_disk_get_storage_info(const struct flash_disk *fd,
+                                   uint32_t *block_size,
+                                   uint32_t *num_blocks,
+                                   bool *write_protect)
+{
+	if (!fd->mounted)
+		return MSC_ERROR_MEDIUM;
+
+	*block_size = SECTOR_SIZE;
+	*num_blocks = FLASH_DISK_NUM_SECTORS;
+	*write_protect = fd->write_protect;
+
+	return MSC_SUCCESS;
+}
+
+int8_t flash_disk_unit_ready(const struct flash_disk *fd)
+{
+	return fd->mounted? MSC_SUCCESS: MSC_ERROR_MEDIUM;
+}
+
+static int8_t check_range(const struct flash_disk *fd,
+                          uint32_t lba_address, uint16_t num_blocks)
+{
+	if (!fd->mounted)
+		return MSC_ERROR_MEDIUM;
+
+	if (lba_address >= FLASH_DISK_NUM_SECTORS ||
+	    num_blocks > FLASH_DISK_NUM_SECTORS - lba_address)
+		return MSC_ERROR_INVALID_ADDRESS;
+
+	return MSC_SUCCESS;
+}
+
+/* A send to the host has completed. This is called from the MSC class, in
+ * interrupt context, so just have flash_disk_service() send the next
+ * sectors. */
+static void read_complete_callback(struct msc_application_data *app_data,
+                                   bool transfer_ok)
+{
+	struct flash_disk *fd = find_active(app_data);
+
+	if (!fd)
+		return;
+
+	fd->lba += fd->sending;
+	fd->remaining -= fd->sending;
+	fd->sending = 0;
+	fd->read_needed = true;
+}
+
+int8_t flash_disk_start_read(struct flash_disk *fd,
+                             struct msc_application_data *app_data,
+                             uint32_t lba_address,
+                             uint16_t num_blocks)
+{
+	int8_t res;
+
+	res = check_range(fd, lba_address, num_blocks);
+	if (res < 0)
+		return res;
+
+	start_transfer(fd, app_data, lba_address, num_blocks);
+	fd->read_needed = true;
+
+	return MSC_SUCCESS;
+}
+
+#ifdef FLASH_DISK_MAP
+/* Send the next sectors of a read to the host, or finish the read if they
+ * have all been sent. Every sector is in memory (in flash, in the cache,
+ * or all zeros), so as many sectors as fit in FLASH_DISK_SEND_SEGMENTS runs
+ * which are contiguous in memory are sent at once, and the MSC class moves
+ * from one run to the next itself. Sectors written in order are in the
+ * following slots of the same block, so a run is often a whole block. */
+static void do_read(struct flash_disk *fd)
+{
+	struct msc_send_segment *seg = NULL;
+	const uint8_t *data;
+	uint16_t slot;
+	uint16_t count = 0;
+	uint8_t num_segments = 0;
+	bool zeroed = false;
+	int8_t i;
+
+	fd->read_needed = false;
+
+	if (fd->remaining == 0) {
+		fd->active = false;
+		msc_notify_read_operation_complete(fd->msc, true);
+		return;
+	}
+
+	while (count < fd->remaining) {
+		i = cache_find(fd, fd->lba + count);
+		slot = fd->map[fd->lba + count];
+
+		if (i >= 0) {
+			data = fd->cache_data[i];
+		}
+		else if (slot == UNMAPPED) {
+			/* Sectors which have never been written read as
+			 * zeros. They all use the same buffer, so each one
+			 * is a run of its own. */
+			if (!zeroed) {
+				memset(fd->buf, 0, SECTOR_SIZE);
+				zeroed = true;
+			}
+			data = fd->buf;
+		}
+		else {
+			data = FLASH_DISK_MAP(fd->instance, slot_offset(slot));
+		}
+
+		if (seg && data != fd->buf && seg->data != fd->buf &&
+		    seg->data + seg->len == data) {
+			seg->len += SECTOR_SIZE;
+		}
+		else if (num_segments < FLASH_DISK_SEND_SEGMENTS) {
+			seg = &fd->segments[num_segments++];
+			seg->data = data;
+			seg->len = SECTOR_SIZE;
+		}
+		else {
+			break;
+		}
+
+		count++;
+	}
+
+	fd->sending = count;
+	if (msc_start_send_segments_to_host(fd->msc, fd->segments,
+	                                    num_segments,
+	                                    &read_complete_callback) != 0) {
+		fd->active = false;
+		msc_notify_read_operation_complete(fd->msc, false);
+	}
+}
+#else
+/* Send the next sector of a read to the host, or finish the read if they
+ * have all been sent. */
+static void do_read(struct flash_disk *fd)
+{
+	const uint8_t *data;
+	uint16_t slot;
+	int8_t i;
+
+	fd->read_needed = false;
+
+	if (fd->remaining == 0) {
+		fd->active = false;
+		msc_notify_read_operation_complete(fd->msc, true);
+		return;
+	}
+
+	i = cache_find(fd, fd->lba);
+	slot = fd->map[fd->lba];
+
+	if (i >= 0) {
+		data = fd->cache_data[i];
+	}
+	else if (slot == UNMAPPED) {
+		/* Sectors which have never been written read as zeros. */
+		memset(fd->buf, 0, SECTOR_SIZE);
+		data = fd->buf;
+	}
+	else {
+		read_flash(fd, slot_offset(slot), fd->buf, SECTOR_SIZE);
+		data = fd->buf;
+	}
+
+	fd->sending = 1;
+	if (msc_start_send_to_host(fd->msc, data, SECTOR_SIZE,
+	                           &read_complete_callback) != 0) {
+		fd->active = false;
+		msc_notify_read_operation_complete(fd->msc, false);
+	}
+}
+#endif
+
+#ifdef MSC_WRITE_SUPPORT
+/* A sector has been received. This is called from the MSC class, in
+ * interrupt context, so just have flash_disk_service() handle it. */
+static void write_complete_callback(struct msc_application_data *app_data,
+                                    bool transfer_ok)
+{
+	struct flash_disk *fd = find_active(app_data);
+
+	if (fd && transfer_ok)
+		fd->write_needed = true;
+}
+
+int8_t flash_disk_start_write(struct flash_disk *fd,
+                              struct msc_application_data *app_data,
+                              uint32_t lba_address,
+                              uint16_t num_blocks,
+                              uint8_t **buffer,
+                              size_t *buffer_len,
+                              msc_completion_callback *callback)
+{
+	int8_t res;
+
+	if (fd->write_protect)
+		return MSC_ERROR_WRITE_PROTECTED;
+
+	res = check_range(fd, lba_address, num_blocks);
+	if (res < 0)
+		return res;
+
+	start_transfer(fd, app_data, lba_address, num_blocks);
+
+	/* Receive one sector at a time. */
+	*buffer = fd->buf;
+	*buffer_len = SECTOR_SIZE;
+	*callback = &write_complete_callback;
+
+	return MSC_SUCCESS;
+}
+
+/* Move a received sector into the cache. */
+static void do_write(struct flash_disk *fd)
+{
+	struct msc_application_data *msc = fd->msc;
+
+	/* Clear the flag before calling msc_notify_write_data_handled(),
+	 * which may call write_complete_callback() if the next sector has
+	 * already arrived. */
+	fd->write_needed = false;
+
+	if (cache_store(fd, fd->lba, fd->buf) < 0) {
+		fd->active = false;
+		msc_notify_write_operation_complete(msc, false,
+		                                    fd->bytes_written);
+		return;
+	}
+
+	fd->lba++;
+	fd->remaining--;
+	fd->bytes_written += SECTOR_SIZE;
+
+	if (fd->remaining == 0)
+		fd->active = false;
+
+	msc_notify_write_data_handled(msc);
+
+	if (!fd->active)
+		msc_notify_write_operation_complete(msc, true,
+		                                    fd->bytes_written);
+}
+#endif
+
+void flash_disk_service(struct flash_disk *fd)
+{
+	if (!fd->active)
+		return;
+
+	if (fd->read_needed)
+		do_read(fd);
+#ifdef MSC_WRITE_SUPPORT
+	else if (fd->write_needed)
+		do_write(fd);
+#endif
+}
+
+int8_t flash_disk_flush(struct flash_disk *fd)
+{
+	uint8_t i;
+	int8_t res = 0;
+
+	/* Writing back can garbage collect the flash which a read is being
+	 * sent from, so wait until the transfer is over. */
+	if (!fd->mounted || fd->active)
+		return 0;
+
+	for (i = 0; i < FLASH_DISK_CACHE_SECTORS; i++) {
+		if (cache_write_back(fd, i) < 0)
+			res = -1;
+	}
+
+	return res;
+}
+
+int8_t flash_disk_unmap(struct flash_disk *fd,
+                        uint32_t lba_address,
+                        uint32_t num_blocks)
+{
+	uint16_t lba;
+	int8_t i;
+
+	if (!fd->mounted)
+		return MSC_ERROR_MEDIUM;
+
+	if (fd->write_protect)
+		return MSC_ERROR_WRITE_PROTECTED;
+
+	if (lba_address >= FLASH_DISK_NUM_SECTORS ||
+	    num_blocks > FLASH_DISK_NUM_SECTORS - lba_address)
+		return MSC_ERROR_INVALID_ADDRESS;
+
+	/* Drop the sectors from the cache and the map. Their slots are no
+	 * longer live, so garbage collection won't copy them. Nothing is
+	 * written to flash, so after the next flash_disk_init() the
+	 * sectors may read back as their old data, which SCSI allows. */
+	for (lba = lba_address; lba < lba_address + num_blocks; lba++) {
+		i = cache_find(fd, lba);
+		if (i >= 0) {
+			fd->cache[i].lba = UNMAPPED;
+			fd->cache[i].dirty = false;
+		}
+
+		if (fd->map[lba] != UNMAPPED) {
+			fd->live[fd->map[lba] / SLOTS]--;
+			fd->map[lba] = UNMAPPED;
+		}
+	}
+
+	return MSC_SUCCESS;
+}
+
+void flash_disk_cancel(struct flash_disk *fd)
+{
+	fd->active = false;
+	fd->read_needed = false;
+	fd->write_needed = false;
+	fd->msc = NULL;
+}
+
+#endif /* FLASH_DISK_BLOCK_SIZE */
@@ -62,6 +62,8 @@
 #define MMC_COMMAND_TIMEOUT  150 /* milliseconds (made up, not in spec) */
 #define MMC_READ_TIMEOUT     150 /* milliseconds (4.6.2.1) */
 #define MMC_WRITE_TIMEOUT    500 /* milliseconds (4.6.2.2) */
+#define MMC_ERASE_TIMEOUT    250 /* milliseconds per block (4.14, used
+                                    when the SD Status isn't read) */
 
 #ifndef MMC_USE_TIMER
 	#undef  MMC_TIMER_START
@@ -96,10 +98,12 @@ static uint8_t read[1024];
 static void reset_state(struct mmc_card *cd)
 {
 	cd->card_ccs = false;
+	cd->erase_unit_blocks = 1;
 	cd->state = MMC_STATE_IDLE;
 	cd->card_size_blocks = 0;
 	cd->write_position = 0;
 	cd->checksum = 0;
+	cd->busy = false;
 }
 
 int8_t mmc_init(struct mmc_card *card_data, uint8_t count)
@@ -194,6 +198,11 @@ static int8_t __send_mmc_command(uint8_t spi_instance, uint8_t *buf,
 
 	MMC_SPI_TRANSFER(spi_instance, buf, NULL, cmd_len);
 
+	/* CMD12 (STOP_TRANSMISSION) stops a multi-block read, and the byte
+	 * after it may be a byte of the data being read. Skip it. */
+	if ((buf[0] & 0x3f) == 12)
+		MMC_SPI_TRANSFER(spi_instance, NULL, NULL, 1);
+
 	/* Skip 0xff characters which come before the response */
 	res = skip_bytes_timeout(spi_instance, 0xff, &buf[0],
 	                         MMC_COMMAND_TIMEOUT, NUM_READ_RETRIES);
@@ -301,7 +310,8 @@ bool mmc_ready(struct mmc_card *mmc)
 
 	if (mmc->state == MMC_STATE_IDLE)
 		return false;
-	if (mmc->state == MMC_STATE_WRITE_MULTIPLE)
+	if (mmc->state == MMC_STATE_WRITE_MULTIPLE ||
+	    mmc->state == MMC_STATE_READ_MULTIPLE)
 		return true;
 
 	/* Issue SPI CMD13: SEND_STATUS */
@@ -378,6 +388,115 @@ err:
 	return res;
 }
 
+int8_t mmc_multiblock_read_start(struct mmc_card *mmc, uint32_t block_addr)
+{
+	uint8_t buf[6];
+	uint8_t spi_instance = mmc->spi_instance;
+	int8_t res = 0;
+
+	/* Range check the starting addr against the card size. */
+	if (block_addr >= mmc->card_size_blocks)
+		return -1;
+
+	/* For SDSC cards, the address specified is the byte address. For
+	 * SDHC and SDXC cards, the address specified is the block address */
+	if (!mmc->card_ccs)
+		block_addr *= 512;
+
+	/* Send CMD18: READ_MULTIPLE_BLOCK */
+	buf[0] = 0x40 | 18;
+	buf[1] = (block_addr & 0xff000000) >> 24;
+	buf[2] = (block_addr & 0x00ff0000) >> 16;
+	buf[3] = (block_addr & 0x0000ff00) >> 8;
+	buf[4] = block_addr & 0x000000ff;
+
+	MMC_SPI_SET_CS(spi_instance, 0);
+	res = __send_mmc_command(spi_instance, buf, CMD_LEN, RESP_R1_LEN);
+	if (res < 0) {
+		mmc->state = MMC_STATE_IDLE;
+		goto err;
+	}
+
+	if (buf[0] != 0x0) {
+		res = -1;
+		goto err;
+	}
+
+	/* Leave CS asserted. The card sends the blocks one after the other
+	 * until it is sent CMD12 by mmc_multiblock_read_end(). */
+	mmc->state = MMC_STATE_READ_MULTIPLE;
+
+	return 0;
+
+err:
+	/* An error occurred. End the read operation */
+	MMC_SPI_SET_CS(spi_instance, 1);
+
+	/* Give it 8 extra clocks per section 4.4. */
+	MMC_SPI_TRANSFER(spi_instance, NULL, NULL, 1);
+
+	return res;
+}
+
+int8_t mmc_multiblock_read_data(struct mmc_card *mmc, uint8_t *data)
+{
+	/* Make sure there is a multi-block read underway */
+	if (mmc->state != MMC_STATE_READ_MULTIPLE)
+		return -1;
+
+	return __read_data_block(mmc, data, MMC_BLOCK_SIZE);
+}
+
+/* Stop a multi-block read with CMD12, as in section 7.2.3, figure 7-4. */
+int8_t mmc_multiblock_read_end(struct mmc_card *mmc)
+{
+	uint8_t spi_instance = mmc->spi_instance;
+	uint8_t buf[6];
+	uint8_t c;
+	int8_t res;
+
+	/* After a card error, only CS is left to release. A read error
+	 * leaves the card in the multi-block read, so it still needs to be
+	 * stopped. */
+	if (mmc->state == MMC_STATE_IDLE) {
+		res = -1;
+		goto out;
+	}
+	if (mmc->state != MMC_STATE_READ_MULTIPLE)
+		return -1;
+
+	/* Send CMD12: STOP_TRANSMISSION */
+	buf[0] = 0x40 | 12;
+	buf[1] = 0;
+	buf[2] = 0;
+	buf[3] = 0;
+	buf[4] = 0;
+	res = __send_mmc_command(spi_instance, buf, CMD_LEN, RESP_R1_LEN);
+	if (res < 0 || buf[0] != 0x0)
+		goto card_error;
+
+	/* The response is R1b. Skip the busy bytes (0x00) which follow. */
+	res = skip_bytes_timeout(spi_instance, 0x0, &c,
+	                         MMC_COMMAND_TIMEOUT, NUM_READ_RETRIES);
+	if (res < 0)
+		goto card_error;
+
+	mmc->state = MMC_STATE_READY;
+	res = 0;
+	goto out;
+
+card_error:
+	mmc->state = MMC_STATE_IDLE;
+	res = -1;
+out:
+	MMC_SPI_SET_CS(spi_instance, 1);
+
+	/* Give it 8 extra clocks per section 4.4. */
+	MMC_SPI_TRANSFER(spi_instance, NULL, NULL, 1);
+
+	return res;
+}
+
 /* Perform the sequence shown in section 7.2.4, figure 7-6. */
 int8_t mmc_write_block(struct mmc_card *mmc,
                        uint32_t block_addr,
@@ -487,6 +606,27 @@ card_error_no_cs:
 	return -1;
 }
 
+/* Wait for the card to finish writing the last block sent by
+ * mmc_multiblock_write_data(), if it hasn't already. */
+static int8_t wait_not_busy(struct mmc_card *mmc)
+{
+	uint8_t c;
+	int8_t res;
+
+	if (!mmc->busy)
+		return 0;
+
+	/* Skip the busy bytes (0x00) which the MMC card sends while
+	 * writing */
+	res = skip_bytes_timeout(mmc->spi_instance, 0x0, &c,
+	                         MMC_WRITE_TIMEOUT, NUM_WRITE_RETRIES);
+	if (res < 0)
+		return -1;
+
+	mmc->busy = false;
+	return 0;
+}
+
 int8_t mmc_multiblock_write_start(struct mmc_card *mmc, uint32_t block_addr)
 {
 	uint8_t buf[6];
@@ -526,6 +666,7 @@ int8_t mmc_multiblock_write_start(struct mmc_card *mmc, uint32_t block_addr)
 
 	mmc->write_position = 0;
 	mmc->checksum = 0;
+	mmc->busy = false;
 
 	mmc->state = MMC_STATE_WRITE_MULTIPLE;
 
@@ -557,6 +698,11 @@ int8_t mmc_multiblock_write_data(struct mmc_card *mmc,
 		goto write_failed;
 	}
 
+	/* Wait for the card to finish writing the previous block. */
+	res = wait_not_busy(mmc);
+	if (res < 0)
+		goto card_error;
+
 	if (mmc->write_position == 0) {
 		/* A new block is starting. Send start token. */
 		buf[0] = 0xfc; /* Multi-Block Start Block Token (7.3.3.2) */
@@ -595,13 +741,12 @@ int8_t mmc_multiblock_write_data(struct mmc_card *mmc,
 		/* Give it 8 extra clocks per section 4.4. */
 		MMC_SPI_TRANSFER(spi_instance, NULL, NULL, 1);
 
-		/* Skip the busy bytes (0x00) which the MMC card
-		 * sends while writing */
-		res = skip_bytes_timeout(spi_instance, 0x0, &buf[0],
-					 MMC_WRITE_TIMEOUT, NUM_WRITE_RETRIES);
-		if (res < 0)
-			goto card_error;
-
+		/* The card is now busy writing the block. Rather than wait
+		 * for it here, wait before the next block or the stop token
+		 * is sent, so the caller can do something else (such as
+		 * receive the next block, or send a block to another card)
+		 * in the meantime. */
+		mmc->busy = true;
 		mmc->write_position = 0;
 	}
 
@@ -628,6 +773,12 @@ int8_t mmc_multiblock_write_end(struct mmc_card *mmc)
 	uint8_t buf[6];
 	uint8_t c, res;
 
+	/* Wait for the card to finish writing the last block. */
+	if (wait_not_busy(mmc) < 0) {
+		res = -1;
+		goto card_error;
+	}
+
 	/* Finishing write. Send stop token. */
 	c = 0xfd; /* Multi-Block Stop Transmission Token (7.3.3.2) */
 	MMC_SPI_TRANSFER(spi_instance, &c, NULL, 1);
@@ -721,6 +872,121 @@ int8_t mmc_multiblock_write_cancel(struct mmc_card *mmc)
 	return res;
 }
 
+/* Send an erase address command (CMD32 or CMD33) */
+static int8_t send_erase_address(struct mmc_card *mmc, uint8_t cmd,
+                                 uint32_t block_addr)
+{
+	uint8_t buf[6];
+	int8_t res;
+
+	/* For SDSC cards, the address specified is the byte address. For
+	 * SDHC and SDXC cards, the address specified is the block address */
+	if (!mmc->card_ccs)
+		block_addr *= 512;
+
+	buf[0] = 0x40 | cmd;
+	buf[1] = (block_addr & 0xff000000) >> 24;
+	buf[2] = (block_addr & 0x00ff0000) >> 16;
+	buf[3] = (block_addr & 0x0000ff00) >> 8;
+	buf[4] = block_addr & 0x000000ff;
+	res = send_mmc_command(mmc->spi_instance, buf, CMD_LEN, RESP_R1_LEN);
+	if (res < 0 || buf[0] != 0x0)
+		return -1;
+
+	return 0;
+}
+
+/* Perform the erase sequence of section 4.3.5 */
+int8_t mmc_erase(struct mmc_card *mmc,
+                 uint32_t block_addr,
+                 uint32_t num_blocks)
+{
+	uint8_t buf[6];
+	uint8_t spi_instance = mmc->spi_instance;
+	uint32_t unit = mmc->erase_unit_blocks;
+	uint32_t end, timeout_loops, i;
+	int8_t res;
+
+	/* Erasing isn't possible during a multi-block read or write. */
+	if (mmc->state != MMC_STATE_READY)
+		return -1;
+
+	/* Range check the blocks against the card size. */
+	if (num_blocks == 0 ||
+	    block_addr >= mmc->card_size_blocks ||
+	    num_blocks > mmc->card_size_blocks - block_addr)
+		return -1;
+
+	/* A card which can't erase single blocks erases whole sectors
+	 * (5.3.2, ERASE_BLK_EN), so only erase the sectors which are
+	 * entirely in the range. The blocks before and after them are left
+	 * as they are. */
+	end = (block_addr + num_blocks) / unit * unit;
+	block_addr = (block_addr + unit - 1) / unit * unit;
+	if (end <= block_addr)
+		return 0;
+	num_blocks = end - block_addr;
+
+	/* Send CMD32: ERASE_WR_BLK_START_ADDR */
+	res = send_erase_address(mmc, 32, block_addr);
+	if (res < 0)
+		goto card_error_no_cs;
+
+	/* Send CMD33: ERASE_WR_BLK_END_ADDR. The end block is included. */
+	res = send_erase_address(mmc, 33, block_addr + num_blocks - 1);
+	if (res < 0)
+		goto card_error_no_cs;
+
+	/* Send CMD38: ERASE */
+	buf[0] = 0x40 | 38;
+	buf[1] = 0;
+	buf[2] = 0;
+	buf[3] = 0;
+	buf[4] = 0;
+
+	MMC_SPI_SET_CS(spi_instance, 0);
+	res = __send_mmc_command(spi_instance, buf, CMD_LEN, RESP_R1_LEN);
+	if (res < 0)
+		goto card_error;
+
+	if (buf[0] != 0x0) {
+		res = -1;
+		goto card_error;
+	}
+
+	/* Skip the busy bytes (0x00) which the card sends while erasing
+	 * (R1b), for up to MMC_ERASE_TIMEOUT per block, in pieces of
+	 * MMC_WRITE_TIMEOUT. */
+	timeout_loops = num_blocks / (MMC_WRITE_TIMEOUT / MMC_ERASE_TIMEOUT) + 1;
+	for (i = 0; i < timeout_loops; i++) {
+		res = skip_bytes_timeout(spi_instance, 0x0, &buf[0],
+		                         MMC_WRITE_TIMEOUT, NUM_WRITE_RETRIES);
+		if (res == 0)
+			break;
+	}
+
+	if (res < 0)
+		goto card_error;
+
+	MMC_SPI_SET_CS(spi_instance, 1);
+
+	/* Give it 8 extra clocks per section 4.4. */
+	MMC_SPI_TRANSFER(spi_instance, NULL, NULL, 1);
+
+	return 0;
+
+card_error:
+	MMC_SPI_SET_CS(spi_instance, 1);
+
+	/* Give it 8 extra clocks per section 4.4. */
+	MMC_SPI_TRANSFER(spi_instance, NULL, NULL, 1);
+
+card_error_no_cs:
+	mmc->state = MMC_STATE_IDLE;
+
+	return -1;
+}
+
 int8_t mmc_init_card(struct mmc_card *mmc)
 {
 	uint8_t buf[16]; /* Used for commands and register response. */
@@ -895,6 +1161,9 @@ int8_t mmc_init_card(struct mmc_card *mmc)
 		mmc->card_size_blocks += ((uint32_t)(buf[7] & 0x3f)) << 16;
 		mmc->card_size_blocks += 1; /* Per the spec, 5.3.3 */
 		mmc->card_size_blocks *= 1024;
+
+		/* ERASE_BLK_EN is always 1: single blocks can be erased */
+		mmc->erase_unit_blocks = 1;
 	}
 	else if (!mmc->card_ccs) {
 		/* Card is SDSC. 5.3.2 */
@@ -935,6 +1204,25 @@ int8_t mmc_init_card(struct mmc_card *mmc)
 		/* Since we only support 512-byte blocks, divide capacity by
 		 * 512 to get the number of blocks for our use. */
 		mmc->card_size_blocks = capacity_in_bytes / 512;
+
+		/* If ERASE_BLK_EN is 0, the card only erases whole sectors
+		 * of SECTOR_SIZE + 1 write blocks, which are 2 raised to
+		 * WRITE_BL_LEN bytes long (at least 512). */
+		if (buf[10] & 0x40) {
+			mmc->erase_unit_blocks = 1;
+		}
+		else {
+			uint8_t sector_size;
+			uint8_t write_bl_len_exp;
+
+			sector_size = ((buf[10] & 0x3f) << 1 | buf[11] >> 7) + 1;
+			write_bl_len_exp = (buf[12] & 0x3) << 2 | buf[13] >> 6;
+			if (write_bl_len_exp < 9)
+				write_bl_len_exp = 9;
+
+			mmc->erase_unit_blocks =
+				(uint32_t) sector_size << (write_bl_len_exp - 9);
+		}
 	}
 
 	/* Get the speed from buf[3]. 5.3.2, 5.3.3. The transfer speed is the
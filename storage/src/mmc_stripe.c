@@ -0,0 +1,471 @@
+/*
+ *  M-Stack USB Device Stack - MMC/SD Card Striping implementation
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mmc_stripe.h"
+
+/* All the initialized sets of striped cards. The MSC completion callbacks
+ * are only passed the interface's application data, so the set which is
+ * transferring data for an interface is found from this list. */
+static struct mmc_stripe *stripes;
+
+static struct mmc_stripe *find_active(struct msc_application_data *app_data)
+{
+	struct mmc_stripe *ms;
+
+	for (ms = stripes; ms; ms = ms->next) {
+		if (ms->active && ms->msc == app_data)
+			return ms;
+	}
+
+	return NULL;
+}
+
+/* The card which holds a block of the medium */
+static struct mmc_card *card_of(const struct mmc_stripe *ms, uint32_t lba)
+{
+	return &ms->cards[(lba / ms->stripe_blocks) % ms->num_cards];
+}
+
+/* The block on its card which holds a block of the medium */
+static uint32_t card_block(const struct mmc_stripe *ms, uint32_t lba)
+{
+	uint32_t stripe = lba / ms->stripe_blocks;
+
+	return (stripe / ms->num_cards) * ms->stripe_blocks +
+	       lba % ms->stripe_blocks;
+}
+
+int8_t mmc_stripe_init(struct mmc_stripe *ms)
+{
+	struct mmc_stripe *cur;
+
+	if (!ms->cards || ms->num_cards == 0 || ms->stripe_blocks == 0)
+		return -1;
+
+	ms->msc = NULL;
+	ms->active = false;
+	ms->starting = false;
+	ms->streaming = false;
+	ms->sending = false;
+	ms->send_done = false;
+	ms->write_needed = false;
+
+	/* Add it to the list, unless it's already there. */
+	for (cur = stripes; cur; cur = cur->next) {
+		if (cur == ms)
+			return 0;
+	}
+
+	ms->next = stripes;
+	stripes = ms;
+
+	return 0;
+}
+
+uint32_t mmc_stripe_get_num_blocks(const struct mmc_stripe *ms)
+{
+	uint32_t min = 0;
+	uint32_t blocks;
+	uint8_t i;
+
+	for (i = 0; i < ms->num_cards; i++) {
+		blocks = mmc_get_num_blocks(&ms->cards[i]);
+		if (i == 0 || blocks < min)
+			min = blocks;
+	}
+
+	return (min - min % ms->stripe_blocks) * ms->num_cards;
+}
+
+int8_t mmc_stripe_get_storage_info(const struct mmc_stripe *ms,
+                                   uint32_t *block_size,
+                                   uint32_t *num_blocks,
+                                   bool *write_protect)
+{
+	*block_size = MMC_BLOCK_SIZE;
+	*num_blocks = mmc_stripe_get_num_blocks(ms);
+	*write_protect = ms->write_protect;
+
+	if (*num_blocks == 0)
+		return MSC_ERROR_MEDIUM_NOT_PRESENT;
+
+	return MSC_SUCCESS;
+}
+
+int8_t mmc_stripe_unit_ready(const struct mmc_stripe *ms)
+{
+	uint8_t i;
+
+	for (i = 0; i < ms->num_cards; i++) {
+		if (!mmc_is_initialized(&ms->cards[i]))
+			return MSC_ERROR_MEDIUM_NOT_PRESENT;
+	}
+
+	return MSC_SUCCESS;
+}
+
+static int8_t check_range(const struct mmc_stripe *ms,
+                          uint32_t lba_address, uint16_t num_blocks)
+{
+	uint32_t blocks = mmc_stripe_get_num_blocks(ms);
+
+	if (blocks == 0)
+		return MSC_ERROR_MEDIUM_NOT_PRESENT;
+
+	if (lba_address >= blocks || num_blocks > blocks - lba_address)
+		return MSC_ERROR_INVALID_ADDRESS;
+
+	return MSC_SUCCESS;
+}
+
+/* Start a transfer on ms. An interface runs one command at a time, so any
+ * other transfer for the interface has been abandoned (by a reset). The
+ * cards are started by mmc_stripe_service(), since this is called from
+ * interrupt context. */
+static void start_transfer(struct mmc_stripe *ms,
+                           struct msc_application_data *app_data,
+                           uint32_t lba, uint16_t num_blocks, bool writing)
+{
+	struct mmc_stripe *other;
+
+	for (other = stripes; other; other = other->next) {
+		if (other->msc == app_data)
+			other->active = false;
+	}
+
+	ms->msc = app_data;
+	ms->writing = writing;
+	ms->failed = false;
+	ms->lba = lba;
+	ms->remaining = num_blocks;
+	ms->unsent = num_blocks;
+	ms->bytes_written = 0;
+	ms->head = 0;
+	ms->filled = 0;
+	ms->sending = false;
+	ms->send_done = false;
+	ms->write_needed = false;
+	ms->starting = true;
+	ms->active = true;
+}
+
+/* End the multi-block reads or writes on the cards. */
+static int8_t stop_cards(struct mmc_stripe *ms)
+{
+	struct mmc_card *card;
+	int8_t res = 0;
+	uint8_t i;
+
+	for (i = 0; i < ms->num_cards; i++) {
+		card = &ms->cards[i];
+
+		if (card->state == MMC_STATE_READ_MULTIPLE) {
+			if (mmc_multiblock_read_end(card) < 0)
+				res = -1;
+		}
+		else if (card->state == MMC_STATE_WRITE_MULTIPLE) {
+			/* Only whole blocks are written, so there is no
+			 * partial block to cancel. */
+			if (mmc_multiblock_write_end(card) < 0)
+				res = -1;
+		}
+		else if (card->state == MMC_STATE_IDLE) {
+			/* Release CS after a card error. */
+			mmc_multiblock_read_end(card);
+		}
+	}
+
+	ms->streaming = false;
+	return res;
+}
+
+/* Start a multi-block read or write on each card which holds any of the
+ * blocks of the transfer, at the first of those blocks. */
+static int8_t start_cards(struct mmc_stripe *ms)
+{
+	uint32_t end = ms->lba + ms->remaining;
+	uint32_t stripe = ms->lba / ms->stripe_blocks;
+	uint32_t first;
+	uint8_t i;
+	int8_t res;
+
+	ms->streaming = true;
+
+	for (i = 0; i < ms->num_cards; i++) {
+		/* The transfer starts on the card holding the first stripe,
+		 * and reaches the others at the start of later stripes. */
+		if (i == 0)
+			first = ms->lba;
+		else
+			first = (stripe + i) * ms->stripe_blocks;
+
+		if (first >= end)
+			break;
+
+#ifdef MSC_WRITE_SUPPORT
+		if (ms->writing)
+			res = mmc_multiblock_write_start(card_of(ms, first),
+			                                 card_block(ms, first));
+		else
+#endif
+			res = mmc_multiblock_read_start(card_of(ms, first),
+			                                card_block(ms, first));
+		if (res < 0) {
+			stop_cards(ms);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* A send to the host has completed. This is called from the MSC class, in
+ * interrupt context, so just have mmc_stripe_service() carry on. */
+static void read_complete_callback(struct msc_application_data *app_data,
+                                   bool transfer_ok)
+{
+	struct mmc_stripe *ms = find_active(app_data);
+
+	if (!ms)
+		return;
+
+	ms->send_ok = transfer_ok;
+	ms->send_done = true;
+}
+
+int8_t mmc_stripe_start_read(struct mmc_stripe *ms,
+                             struct msc_application_data *app_data,
+                             uint32_t lba_address,
+                             uint16_t num_blocks)
+{
+	int8_t res;
+
+	res = check_range(ms, lba_address, num_blocks);
+	if (res < 0)
+		return res;
+
+	start_transfer(ms, app_data, lba_address, num_blocks, false);
+
+	return MSC_SUCCESS;
+}
+
+/* Send the block at the head of the buffers, if there is one and the last
+ * send has completed. */
+static void send_next(struct mmc_stripe *ms)
+{
+	if (ms->sending || ms->filled == 0 || ms->failed)
+		return;
+
+	ms->sending = true;
+	if (msc_start_send_to_host(ms->msc, ms->buf[ms->head], MMC_BLOCK_SIZE,
+	                           &read_complete_callback) != 0) {
+		ms->sending = false;
+		ms->failed = true;
+	}
+}
+
+/* Read the next block from its card while the block before it is sent to
+ * the host, and finish the read once every block has been sent. */
+static void do_read(struct mmc_stripe *ms)
+{
+	uint8_t *buf;
+
+	if (ms->send_done) {
+		ms->send_done = false;
+		ms->sending = false;
+		ms->head ^= 1;
+		ms->filled--;
+		ms->unsent--;
+		if (!ms->send_ok)
+			ms->failed = true;
+	}
+
+	send_next(ms);
+
+	if (ms->filled < 2 && ms->remaining > 0 && !ms->failed) {
+		buf = ms->buf[(ms->head + ms->filled) & 1];
+
+		if (mmc_multiblock_read_data(card_of(ms, ms->lba), buf) < 0) {
+			ms->failed = true;
+		}
+		else {
+			ms->lba++;
+			ms->remaining--;
+			ms->filled++;
+			send_next(ms);
+		}
+	}
+
+	/* Finish once nothing is being sent. The data which was sent was
+	 * good, whether or not the cards stop cleanly. */
+	if ((ms->unsent == 0 || ms->failed) && !ms->sending) {
+		stop_cards(ms);
+		ms->active = false;
+		msc_notify_read_operation_complete(ms->msc, !ms->failed);
+	}
+}
+
+#ifdef MSC_WRITE_SUPPORT
+/* A block has been received. This is called from the MSC class, in
+ * interrupt context, so just have mmc_stripe_service() handle it. */
+static void write_complete_callback(struct msc_application_data *app_data,
+                                    bool transfer_ok)
+{
+	struct mmc_stripe *ms = find_active(app_data);
+
+	if (ms && transfer_ok)
+		ms->write_needed = true;
+}
+
+int8_t mmc_stripe_start_write(struct mmc_stripe *ms,
+                              struct msc_application_data *app_data,
+                              uint32_t lba_address,
+                              uint16_t num_blocks,
+                              uint8_t **buffer,
+                              size_t *buffer_len,
+                              msc_completion_callback *callback)
+{
+	int8_t res;
+
+	if (ms->write_protect)
+		return MSC_ERROR_WRITE_PROTECTED;
+
+	res = check_range(ms, lba_address, num_blocks);
+	if (res < 0)
+		return res;
+
+	start_transfer(ms, app_data, lba_address, num_blocks, true);
+
+	/* Receive one block at a time, since consecutive blocks can be on
+	 * different cards. */
+	*buffer = ms->buf[0];
+	*buffer_len = MMC_BLOCK_SIZE;
+	*callback = &write_complete_callback;
+
+	return MSC_SUCCESS;
+}
+
+/* Write a received block to its card. */
+static void do_write(struct mmc_stripe *ms)
+{
+	struct msc_application_data *msc = ms->msc;
+	bool last = (ms->remaining == 1);
+	uint8_t *data = ms->buf[0];
+	int8_t res;
+
+	/* Clear the flag before calling msc_notify_write_data_handled(),
+	 * which may call write_complete_callback() if the next block has
+	 * already arrived. */
+	ms->write_needed = false;
+
+	/* Unless this is the last block, copy it out of the receive buffer
+	 * and have the next one received while this one is sent to its
+	 * card. */
+	if (!last) {
+		memcpy(ms->buf[1], ms->buf[0], MMC_BLOCK_SIZE);
+		data = ms->buf[1];
+		msc_notify_write_data_handled(msc);
+	}
+
+	res = mmc_multiblock_write_data(card_of(ms, ms->lba), data,
+	                                MMC_BLOCK_SIZE);
+	if (res < 0)
+		goto fail;
+
+	ms->lba++;
+	ms->remaining--;
+	if (!last) {
+		ms->bytes_written += MMC_BLOCK_SIZE;
+		return;
+	}
+
+	/* Wait for the cards to finish writing. */
+	res = stop_cards(ms);
+	if (res < 0)
+		goto fail;
+
+	ms->bytes_written += MMC_BLOCK_SIZE;
+	ms->active = false;
+	msc_notify_write_data_handled(msc);
+	msc_notify_write_operation_complete(msc, true, ms->bytes_written);
+	return;
+
+fail:
+	stop_cards(ms);
+	ms->active = false;
+	msc_notify_write_operation_complete(msc, false, ms->bytes_written);
+}
+#endif
+
+void mmc_stripe_service(struct mmc_stripe *ms)
+{
+	if (ms->starting) {
+		ms->starting = false;
+
+		/* Stop the cards if a transfer was abandoned. */
+		if (ms->streaming)
+			stop_cards(ms);
+
+		if (start_cards(ms) < 0) {
+			ms->active = false;
+#ifdef MSC_WRITE_SUPPORT
+			if (ms->writing)
+				msc_notify_write_operation_complete(ms->msc,
+				                                    false, 0);
+			else
+#endif
+				msc_notify_read_operation_complete(ms->msc,
+				                                   false);
+			return;
+		}
+	}
+
+	if (!ms->active)
+		return;
+
+#ifdef MSC_WRITE_SUPPORT
+	if (ms->writing) {
+		if (ms->write_needed)
+			do_write(ms);
+		return;
+	}
+#endif
+
+	do_read(ms);
+}
+
+void mmc_stripe_cancel(struct mmc_stripe *ms)
+{
+	ms->active = false;
+	ms->starting = false;
+	ms->write_needed = false;
+	ms->send_done = false;
+	ms->sending = false;
+	ms->msc = NULL;
+
+	if (ms->streaming)
+		stop_cards(ms);
+}
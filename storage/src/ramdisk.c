@@ -0,0 +1,221 @@
+/*
+ *  M-Stack USB Device Stack - RAM Disk implementation
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ramdisk.h"
+
+/* All the initialized RAM disks. The MSC completion callbacks are only
+ * passed the interface's application data, so the RAM disk which is
+ * transferring data for an interface is found from this list. */
+static struct ramdisk *ramdisks;
+
+static void read_complete_callback(struct msc_application_data *app_data,
+                                   bool transfer_ok);
+
+static struct ramdisk *find_active(struct msc_application_data *app_data)
+{
+	struct ramdisk *rd;
+
+	for (rd = ramdisks; rd; rd = rd->next) {
+		if (rd->active && rd->msc == app_data)
+			return rd;
+	}
+
+	return NULL;
+}
+
+/* Start a transfer on rd. An interface runs one command at a time, so
+ * any other transfer for the interface has been abandoned (by a reset). */
+static void start_transfer(struct ramdisk *rd,
+                           struct msc_application_data *app_data,
+                           uint32_t len)
+{
+	struct ramdisk *other;
+
+	for (other = ramdisks; other; other = other->next) {
+		if (other->msc == app_data)
+			other->active = false;
+	}
+
+	rd->msc = app_data;
+	rd->active = true;
+	rd->remaining = len;
+}
+
+static int8_t check_range(const struct ramdisk *rd,
+                          uint32_t lba_address, uint16_t num_blocks)
+{
+	if (lba_address >= rd->num_blocks ||
+	    num_blocks > rd->num_blocks - lba_address)
+		return MSC_ERROR_INVALID_ADDRESS;
+
+	return MSC_SUCCESS;
+}
+
+int8_t ramdisk_init(struct ramdisk *rd)
+{
+	struct ramdisk *cur;
+
+	if (!rd->data || rd->num_blocks == 0 || rd->block_size == 0)
+		return -1;
+
+	rd->msc = NULL;
+	rd->active = false;
+	rd->read_pos = NULL;
+	rd->remaining = 0;
+
+	/* Add it to the list, unless it's already there. */
+	for (cur = ramdisks; cur; cur = cur->next) {
+		if (cur == rd)
+			return 0;
+	}
+
+	rd->next = ramdisks;
+	ramdisks = rd;
+
+	return 0;
+}
+
+int8_t ramdisk_get_storage_info(const struct ramdisk *rd,
+                                uint32_t *block_size,
+                                uint32_t *num_blocks,
+                                bool *write_protect)
+{
+	*block_size = rd->block_size;
+	*num_blocks = rd->num_blocks;
+	*write_protect = rd->write_protect;
+
+	return MSC_SUCCESS;
+}
+
+int8_t ramdisk_unit_ready(const struct ramdisk *rd)
+{
+	return MSC_SUCCESS;
+}
+
+/* Send the rest of a read, straight from the array, or finish the read if
+ * it has all been sent. The whole read is passed to the MSC class at once,
+ * so this is called twice: from ramdisk_start_read() and from the MSC
+ * completion callback, in interrupt context. */
+static void send_next(struct ramdisk *rd)
+{
+	struct msc_application_data *msc = rd->msc;
+	uint32_t len;
+	uint8_t res;
+
+	if (rd->remaining == 0) {
+		rd->active = false;
+		msc_notify_read_operation_complete(msc, true);
+		return;
+	}
+
+	len = rd->remaining;
+	rd->remaining = 0;
+	res = msc_start_send_to_host(msc, rd->read_pos, len,
+	                             &read_complete_callback);
+	rd->read_pos += len;
+
+	if (res != 0) {
+		rd->active = false;
+		msc_notify_read_operation_complete(msc, false);
+	}
+}
+
+static void read_complete_callback(struct msc_application_data *app_data,
+                                   bool transfer_ok)
+{
+	struct ramdisk *rd = find_active(app_data);
+
+	if (rd)
+		send_next(rd);
+}
+
+int8_t ramdisk_start_read(struct ramdisk *rd,
+                          struct msc_application_data *app_data,
+                          uint32_t lba_address,
+                          uint16_t num_blocks)
+{
+	int8_t res;
+
+	res = check_range(rd, lba_address, num_blocks);
+	if (res < 0)
+		return res;
+
+	start_transfer(rd, app_data, (uint32_t) num_blocks * rd->block_size);
+	rd->read_pos = rd->data + lba_address * rd->block_size;
+
+	send_next(rd);
+
+	return MSC_SUCCESS;
+}
+
+#ifdef MSC_WRITE_SUPPORT
+/* The whole write has been received into the array. This is called from
+ * the MSC class, in interrupt context. */
+static void write_complete_callback(struct msc_application_data *app_data,
+                                    bool transfer_ok)
+{
+	struct ramdisk *rd = find_active(app_data);
+	uint32_t len;
+
+	if (!rd)
+		return;
+
+	len = rd->remaining;
+	rd->remaining = 0;
+	rd->active = false;
+
+	msc_notify_write_data_handled(app_data);
+	msc_notify_write_operation_complete(app_data, transfer_ok,
+	                                    transfer_ok? len: 0);
+}
+
+int8_t ramdisk_start_write(struct ramdisk *rd,
+                           struct msc_application_data *app_data,
+                           uint32_t lba_address,
+                           uint16_t num_blocks,
+                           uint8_t **buffer,
+                           size_t *buffer_len,
+                           msc_completion_callback *callback)
+{
+	int8_t res;
+
+	if (rd->write_protect)
+		return MSC_ERROR_WRITE_PROTECTED;
+
+	res = check_range(rd, lba_address, num_blocks);
+	if (res < 0)
+		return res;
+
+	start_transfer(rd, app_data, (uint32_t) num_blocks * rd->block_size);
+
+	/* Have the MSC class put the data straight into the array. */
+	*buffer = rd->data + lba_address * rd->block_size;
+	*buffer_len = rd->remaining;
+	*callback = &write_complete_callback;
+
+	return MSC_SUCCESS;
+}
+#endif
@@ -82,6 +82,24 @@ struct setup_packet;
  */
 extern int16_t USB_STRING_DESCRIPTOR_FUNC(uint8_t string_number, const void **ptr);
 
+#ifdef USB_BOS_DESCRIPTOR_FUNC
+/** BOS Descriptor Function
+ *
+ * The USB stack will call this function to retrieve the Binary Device
+ * Object Store (BOS) descriptor, along with all the Device Capability
+ * descriptors which follow it. Hosts only request the BOS descriptor from
+ * devices whose device descriptor reports a bcdUSB of 0x0201 or higher.
+ * This is defined automatically when AUTOMATIC_WINUSB_SUPPORT is used.
+ *
+ * @param ptr             A pointer to a pointer which should be set to the
+ *                        BOS descriptor by this function.
+ * @returns
+ *   Return the total length of the BOS descriptor in bytes or -1 if the
+ *   device does not have one.
+ */
+extern int16_t USB_BOS_DESCRIPTOR_FUNC(const void **ptr);
+#endif
+
 /** Device Descriptor
  *
  * This is the device's device descriptor as defined by the USB
@@ -110,6 +128,82 @@ extern const struct device_descriptor USB_DEVICE_DESCRIPTOR;
 extern const struct configuration_descriptor *USB_CONFIG_DESCRIPTOR_MAP[];
 
 
+/** @brief Interface SETUP Request Handler
+ *
+ * The type of the functions in the @p USB_INTERFACE_SETUP_HANDLERS
+ * dispatch table. The prototype and return value are the same as for
+ * @p UNKNOWN_SETUP_REQUEST_CALLBACK, and match the device class setup
+ * request functions (eg: @p process_hid_setup_request(),
+ * @p process_cdc_setup_request(), and @p process_msc_setup_request()).
+ */
+typedef int8_t (*usb_setup_request_handler)(const struct setup_packet *pkt);
+
+/** @brief Endpoint Transaction Handler
+ *
+ * The type of the functions in the @p USB_IN_TRANSACTION_HANDLERS and
+ * @p USB_OUT_TRANSACTION_HANDLERS dispatch tables. The prototype is the
+ * same as for @p IN_TRANSACTION_COMPLETE_CALLBACK and @p
+ * OUT_TRANSACTION_CALLBACK, and matches the device class transaction
+ * functions (eg: @p msc_in_transaction_complete()).
+ */
+typedef void (*usb_transaction_handler)(uint8_t endpoint);
+
+#ifdef USB_INTERFACE_SETUP_HANDLERS
+/** Interface SETUP Request Dispatch Table (Optional)
+ *
+ * Composite devices normally route SETUP requests from @p
+ * UNKNOWN_SETUP_REQUEST_CALLBACK by calling each device class's setup
+ * request function in turn, each of which searches its own list of
+ * interfaces. Instead, @p USB_INTERFACE_SETUP_HANDLERS can be defined to
+ * the name of an array of @p NUMBER_OF_INTERFACES handlers, indexed by
+ * interface number. SETUP requests which are not handled by the USB stack
+ * and whose recipient is an interface are then passed directly to the
+ * handler for that interface.
+ *
+ * Entries may be NULL. If an interface has a handler and it returns -1,
+ * the request is stalled. If an interface has no handler, the request is
+ * passed on to @p UNKNOWN_SETUP_REQUEST_CALLBACK (if defined) as usual,
+ * as are requests whose recipient is not an interface. This table only
+ * routes the requests: with @p MULTI_CLASS_DEVICE, the device classes
+ * still check that an interface is theirs (for the requests passed to
+ * them, and in functions such as @p msc_set_interface()), so they must
+ * still be given an interface list (eg: by @p cdc_set_interface_list()).
+ * What the table saves is the application calling each class's function
+ * in turn; the class's own check of its short list remains.
+ *
+ * The table can be generated from the list describing the configuration
+ * descriptor, with @p USB_DESC_INTERFACE_SETUP_HANDLERS() (see
+ * usb_desc_builder.h), as the msc_test example does.
+ */
+extern const usb_setup_request_handler USB_INTERFACE_SETUP_HANDLERS[NUMBER_OF_INTERFACES];
+#endif
+
+#ifdef USB_IN_TRANSACTION_HANDLERS
+/** IN Transaction Dispatch Table (Optional)
+ *
+ * If defined, @p USB_IN_TRANSACTION_HANDLERS must be the name of an array
+ * of NUM_ENDPOINT_NUMBERS+1 handlers, indexed by endpoint number. IN
+ * transactions which complete on an endpoint with a handler are passed
+ * directly to that handler. Entry zero is unused. Endpoints with a NULL
+ * entry are passed to @p IN_TRANSACTION_COMPLETE_CALLBACK (if defined) as
+ * usual. The handler still finds its own instance from the endpoint (for
+ * MSC with @p MSC_SUPPORT_MULTIPLE_MSC_INTERFACES, by searching them).
+ * This table is written by hand; the configuration descriptor builder
+ * doesn't know which class owns each endpoint.
+ */
+extern const usb_transaction_handler USB_IN_TRANSACTION_HANDLERS[NUM_ENDPOINT_NUMBERS+1];
+#endif
+
+#ifdef USB_OUT_TRANSACTION_HANDLERS
+/** OUT Transaction Dispatch Table (Optional)
+ *
+ * The same as @p USB_IN_TRANSACTION_HANDLERS, but for OUT transactions.
+ * Endpoints with a NULL entry are passed to @p OUT_TRANSACTION_CALLBACK
+ * (if defined) as usual.
+ */
+extern const usb_transaction_handler USB_OUT_TRANSACTION_HANDLERS[NUM_ENDPOINT_NUMBERS+1];
+#endif
+
 /* Doxygen end-of-group for descriptor_items */
 /** @}*/
 
@@ -154,6 +248,10 @@ void SET_CONFIGURATION_CALLBACK(uint8_t configuration);
  *   Bit 0 (LSB) - 0=bus_powered, 1=self_powered
  *   Bit 1       - 0=no_remote_wakeup, 1=remote_wakeup
  *   Bits 2-15   - reserved, set to zero.
+ *
+ * Bit 1 is managed by the USB stack, which tracks the Remote Wakeup feature
+ * as set and cleared by the host with @a SET_FEATURE and @a CLEAR_FEATURE.
+ * The value returned by the callback for bit 1 is ignored.
  */
 uint16_t GET_DEVICE_STATUS_CALLBACK();
 #endif
@@ -337,6 +435,45 @@ void START_OF_FRAME_CALLBACK(void);
 void USB_RESET_CALLBACK(void);
 #endif
 
+#ifdef USB_SUSPEND_CALLBACK
+/** @brief USB Suspend Callback
+ *
+ * USB_SUSPEND_CALLBACK() is called when the host has suspended the bus
+ * (the bus has been idle for 3ms). The USB module has already been put
+ * into its low-power suspend state. The application should reduce its
+ * current draw to the limit for suspended devices, for example by turning
+ * off LEDs. The main loop can then put the CPU into Sleep or Idle with
+ * usb_idle(), and bus activity will cause an interrupt which wakes it.
+ *
+ * This callback is called from interrupt context when using
+ * @p USB_USE_INTERRUPTS, so it should not itself enter Sleep.
+ */
+void USB_SUSPEND_CALLBACK(void);
+#endif
+
+#ifdef USB_RESUME_CALLBACK
+/** @brief USB Resume Callback
+ *
+ * USB_RESUME_CALLBACK() is called when activity is detected on the bus
+ * while the device is suspended, either resume signaling or a reset. The
+ * USB module has already been taken out of suspend. The application should
+ * restore whatever was shut down in @p USB_SUSPEND_CALLBACK.
+ */
+void USB_RESUME_CALLBACK(void);
+#endif
+
+#ifdef USB_DELAY_MS_FUNC
+/** @brief Delay Callback
+ *
+ * If defined, USB_DELAY_MS_FUNC() is called by @p usb_remote_wakeup() to
+ * block for the given number of milliseconds, before and while resume
+ * signaling is driven on the bus, for example using a hardware timer. If it is not
+ * defined, the delay is timed from the CPU clock (see
+ * @p usb_remote_wakeup()).
+ */
+void USB_DELAY_MS_FUNC(uint8_t milliseconds);
+#endif
+
 /* Doxygen end-of-group for static_callbacks */
 /** @}*/
 
@@ -386,6 +523,58 @@ uint8_t usb_get_configuration(void);
  */
 #define usb_is_configured() (usb_get_configuration() != 0)
 
+/** @brief Determine whether the device is suspended
+ *
+ * Return whether the host has suspended the bus. While suspended, the
+ * device must limit its current draw, and no transactions will occur until
+ * the host resumes the bus or the device signals remote wakeup.
+ *
+ * @see USB_SUSPEND_CALLBACK
+ * @see usb_remote_wakeup()
+ */
+bool usb_is_suspended(void);
+
+/** @brief Signal Remote Wakeup to the host
+ *
+ * Drive resume signaling on the bus to wake the host from suspend. This is
+ * only allowed if the host has enabled the Remote Wakeup feature, which it
+ * will only do if the configuration descriptor advertises remote wakeup in
+ * bmAttributes. The USB specification requires the bus to have been idle
+ * for at least 5ms before remote wakeup is signaled. Suspend is detected
+ * after 3ms, so this function first waits 2ms more, and then blocks for the
+ * duration of the resume signaling (5ms). Both are timed by
+ * @p USB_DELAY_MS_FUNC if it is defined, or otherwise from the CPU clock,
+ * so usb_config.h (or the compiler command line) must define SYS_CLOCK
+ * (the system clock in Hz) on PIC32, FCY (the instruction clock in Hz) on
+ * PIC24, or _XTAL_FREQ on PIC18 and PIC16 with XC8. Without any of these,
+ * this function is not available. See the hid_mouse example.
+ *
+ * @returns
+ *   Return 0 if resume signaling was sent, or -1 if the device is not
+ *   suspended (or the host resumed the bus during the wait) or the host has
+ *   not enabled Remote Wakeup.
+ */
+int8_t usb_remote_wakeup(void);
+
+#ifdef USB_USE_INTERRUPTS
+/** @brief Put the CPU into a low-power state until the next interrupt
+ *
+ * Call this from the application's main loop when there is no more work to
+ * do, instead of spinning. The CPU will be put into Idle mode, in which the
+ * USB module (and other peripherals) stay clocked, and any interrupt,
+ * including a USB interrupt, will wake it. If @p USB_SLEEP_WHEN_SUSPENDED
+ * is defined in usb_config.h and the device is suspended, the CPU is put
+ * into Sleep instead, and bus activity (or any other enabled interrupt)
+ * will wake it.
+ *
+ * On parts without an Idle mode (PIC16F1459), this returns immediately
+ * unless sleeping while suspended.
+ *
+ * This is only available when using @p USB_USE_INTERRUPTS.
+ */
+void usb_idle(void);
+#endif
+
 /** @brief Get a pointer to an endpoint's input buffer
  *
  * This function returns a pointer to an endpoint's input buffer. Call this
@@ -270,7 +270,7 @@ struct cdc_line_coding {
  * @returns
  *   Returns 0 if the setup packet could be processed or -1 if it could not.
  */
-uint8_t process_cdc_setup_request(const struct setup_packet *setup);
+int8_t process_cdc_setup_request(const struct setup_packet *setup);
 
 /** CDC SEND_ENCAPSULATED_COMMAND callback
  *
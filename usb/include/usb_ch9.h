@@ -129,6 +129,19 @@ enum DescriptorTypes {
 	DESC_OTG = 0x9,
 	DESC_DEBUG = 0xA,
 	DESC_INTERFACE_ASSOCIATION = 0xB,
+	DESC_BOS = 0xF,
+	DESC_DEVICE_CAPABILITY = 0x10,
+};
+
+/** Device Capability Types
+ *
+ * Values for the bDevCapabilityType field of a Device Capability
+ * Descriptor. See the USB 2.0 LPM ECN and the USB 3.1 specification,
+ * section 9.6.2.
+ */
+enum DeviceCapabilityTypes {
+	DEVICE_CAPABILITY_USB_2_0_EXTENSION = 0x2,
+	DEVICE_CAPABILITY_PLATFORM = 0x5,
 };
 
 /** Device Classes
@@ -254,6 +267,33 @@ struct interface_association_descriptor {
 	uint8_t iFunction; /**< String Descriptor Index */
 };
 
+/** Binary Device Object Store (BOS) Descriptor
+ *
+ * The BOS descriptor is the header for a set of Device Capability
+ * Descriptors, which follow it immediately. A host will only request the
+ * BOS descriptor from a device which reports a bcdUSB of 0x0201 or higher
+ * in its device descriptor. See the USB 2.0 Link Power Management ECN.
+ */
+struct bos_descriptor {
+	uint8_t bLength;         /**< Set to 5 bytes */
+	uint8_t bDescriptorType; /**< Set to DESC_BOS = 0xF */
+	uint16_t wTotalLength;   /**< Length of this + all capabilities */
+	uint8_t bNumDeviceCaps;  /**< Number of capability descriptors */
+};
+
+/** USB 2.0 Extension Device Capability Descriptor
+ *
+ * A device which reports a bcdUSB of 0x0201 should include this
+ * capability in its BOS descriptor, even if it does not support Link
+ * Power Management.
+ */
+struct usb_2_0_extension_capability_descriptor {
+	uint8_t bLength;            /**< Set to 7 bytes */
+	uint8_t bDescriptorType;    /**< Set to DESC_DEVICE_CAPABILITY */
+	uint8_t bDevCapabilityType; /**< DEVICE_CAPABILITY_USB_2_0_EXTENSION */
+	uint32_t bmAttributes;      /**< Bit 1 set = LPM supported */
+};
+
 /* Doxygen end-of-group for ch9_items */
 /** @}*/
 
@@ -0,0 +1,314 @@
+/*
+ *  M-Stack Configuration Descriptor Builder
+ *  Copyright (C) 2015 Alan Ott <alan@signal11.us>
+ *  Copyright (C) 2015 Signal 11 Software
+ *
+ *  2015-06-02
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3; or the Apache License, version 2.0
+ *  as published by the Apache Software Foundation.  If you have purchased a
+ *  commercial license for this software from Signal 11 Software, your
+ *  commerical license superceeds the information in this header.
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  You should have received a copy of the Apache License, verion 2.0 along
+ *  with this software.  If not, see <http://www.apache.org/licenses/>.
+ */
+
+#ifndef USB_DESC_BUILDER_H__
+#define USB_DESC_BUILDER_H__
+
+/** @file usb_desc_builder.h
+ *  @brief M-Stack Configuration Descriptor Builder
+ *  @defgroup public_api Public API
+ */
+
+/** @addtogroup public_api
+ *  @{
+ */
+
+/** @defgroup desc_builder Configuration Descriptor Builder
+ *  @brief Macros for generating a configuration descriptor, and the items
+ *  which depend on it, from a single list.
+ *
+ *  Hand-writing a configuration descriptor means keeping several things
+ *  in agreement with it by hand: wTotalLength, bNumInterfaces, the
+ *  EP_n_IN_LEN and EP_n_OUT_LEN buffer sizes in usb_config.h, the
+ *  interface lists passed to the device classes (eg: @p
+ *  cdc_set_interface_list()), and the @p USB_INTERFACE_SETUP_HANDLERS
+ *  table. The macros in this file generate all of these at compile time
+ *  from a single list (an X-macro) describing the configuration.
+ *
+ *  The list is a function-like macro taking one parameter (called X
+ *  below), usually defined in usb_config.h, whose body is a sequence of
+ *  the following items, in the order in which they are to appear in the
+ *  configuration descriptor:
+ *
+ *  @code
+ *  X##_INTERFACE(name, number, alternate_setting, num_endpoints,
+ *                class, subclass, protocol, istring, function)
+ *  X##_ENDPOINT(name, address, attributes, max_packet_size, interval)
+ *  X##_IAD(name, first_interface, interface_count,
+ *          class, subclass, protocol, istring)
+ *  X##_CLASS(name, type, initializer...)
+ *  @endcode
+ *
+ *  @p name must be unique within the list and becomes the name of the
+ *  descriptor's member in the generated struct. @p function is one of
+ *  CDC, HID, MSC, or NONE, and names the M-Stack device class which
+ *  handles the interface. @p X##_CLASS is for class-specific descriptors
+ *  (eg: HID and CDC functional descriptors); @p type is the descriptor's
+ *  struct type and the remaining parameters are its initializer.
+ *
+ *  For example, for a Mass Storage device:
+ *
+ *  @code
+ *  #define APP_CONFIGURATION_1(X) \
+ *  	X##_INTERFACE(msc_interface, 0, 0, 2, MSC_DEVICE_CLASS, \
+ *  	              MSC_SCSI_TRANSPARENT_COMMAND_SET_SUBCLASS, \
+ *  	              MSC_PROTOCOL_CODE_BBB, 4, MSC) \
+ *  	X##_ENDPOINT(msc_in,  0x81, EP_BULK, 64, 1) \
+ *  	X##_ENDPOINT(msc_out, 0x01, EP_BULK, 64, 1)
+ *
+ *  USB_DESC_ENDPOINT_SIZES(configuration_1, APP_CONFIGURATION_1);
+ *  #define EP_1_IN_LEN  USB_DESC_MAX_PACKET_SIZE(msc_in)
+ *  #define EP_1_OUT_LEN USB_DESC_MAX_PACKET_SIZE(msc_out)
+ *  @endcode
+ *
+ *  and then in usb_descriptors.c:
+ *
+ *  @code
+ *  USB_DESC_CONFIGURATION_STRUCT(configuration_1_packet, APP_CONFIGURATION_1);
+ *
+ *  static const ROMPTR struct configuration_1_packet configuration_1 =
+ *  	USB_DESC_CONFIGURATION(configuration_1, APP_CONFIGURATION_1,
+ *  	                       1, 2, 0b10000000, 100/2);
+ *  @endcode
+ *
+ *  The generated sizes are enumeration constants, so they can be used
+ *  anywhere a constant expression is required (as the USB stack does for
+ *  its endpoint buffers) but not in preprocessor conditionals.
+ *
+ *  @p X##_CLASS uses a variadic macro and the interface setup handler table
+ *  uses designated initializers, so these features require a C99 compiler.
+ *
+ *  @addtogroup desc_builder
+ *  @{
+ */
+
+/** @brief Declare the Struct for a Configuration
+ *
+ * Declare a struct type named @p type containing the configuration
+ * descriptor (as member @p config) followed by each descriptor in @p LIST.
+ */
+#define USB_DESC_CONFIGURATION_STRUCT(type, LIST) \
+	struct type { \
+		struct configuration_descriptor config; \
+		LIST(USB_DESC_MEMBER) \
+	}
+
+/** @brief Initializer for a Configuration
+ *
+ * Expand to the initializer for @p var, an object of the type declared
+ * with @p USB_DESC_CONFIGURATION_STRUCT(). wTotalLength and bNumInterfaces
+ * are computed from @p LIST.
+ *
+ * @param var            The name of the object being initialized
+ * @param LIST           The list describing the configuration
+ * @param value          bConfigurationValue
+ * @param istring        iConfiguration (index of string descriptor)
+ * @param attributes     bmAttributes
+ * @param max_power      bMaxPower (in 2mA units)
+ */
+#define USB_DESC_CONFIGURATION(var, LIST, value, istring, attributes, max_power) \
+	{ \
+		{ \
+			sizeof(struct configuration_descriptor), \
+			DESC_CONFIGURATION, \
+			sizeof(var), \
+			USB_DESC_NUM_INTERFACES(LIST), \
+			value, \
+			istring, \
+			attributes, \
+			max_power, \
+		}, \
+		LIST(USB_DESC_INIT) \
+	}
+
+/** @brief Number of Interfaces in a Configuration
+ *
+ * Expand to the number of interfaces in @p LIST (the number of interface
+ * descriptors with an alternate setting of zero). This is suitable for
+ * defining NUMBER_OF_INTERFACES in usb_config.h.
+ */
+#define USB_DESC_NUM_INTERFACES(LIST) (0 LIST(USB_DESC_NUMIF))
+
+/** @brief Declare Endpoint Sizes for a Configuration
+ *
+ * Declare an enumeration named @p tag containing the wMaxPacketSize of
+ * every endpoint in @p LIST. Use @p USB_DESC_MAX_PACKET_SIZE() to refer to
+ * them, typically in the EP_n_IN_LEN and EP_n_OUT_LEN definitions in
+ * usb_config.h.
+ */
+#define USB_DESC_ENDPOINT_SIZES(tag, LIST) \
+	enum tag##_endpoint_sizes { \
+		LIST(USB_DESC_EPSIZE) \
+		tag##_endpoint_sizes_end \
+	}
+
+/** @brief Endpoint Size
+ *
+ * The wMaxPacketSize of the endpoint named @p name, as declared by
+ * @p USB_DESC_ENDPOINT_SIZES().
+ */
+#define USB_DESC_MAX_PACKET_SIZE(name) USB_DESC_EP_SIZE_##name
+
+/** @brief Interface List for a Device Class
+ *
+ * Expand to an array initializer containing the interface numbers in
+ * @p LIST which are handled by device class @p function (CDC, HID, or
+ * MSC), suitable for passing to that class's *_set_interface_list()
+ * function. Interfaces with multiple alternate settings will appear more
+ * than once, which is harmless.
+ */
+#define USB_DESC_INTERFACE_LIST(LIST, function) \
+	{ LIST(USB_DESC_IFLIST_##function) }
+
+/** @brief Interface SETUP Request Handler Table
+ *
+ * Expand to an initializer for the @p USB_INTERFACE_SETUP_HANDLERS table
+ * (see usb.h), mapping each interface in @p LIST to the setup request
+ * function of the device class named by its @p function parameter.  The
+ * headers for those device classes must be included where this is used.
+ */
+#define USB_DESC_INTERFACE_SETUP_HANDLERS(LIST) \
+	{ LIST(USB_DESC_SETUP) }
+
+
+/** @cond INTERNAL */
+
+/* Struct members */
+#define USB_DESC_MEMBER_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	struct interface_descriptor name;
+#define USB_DESC_MEMBER_ENDPOINT(name, address, attributes, max_packet_size, interval) \
+	struct endpoint_descriptor name;
+#define USB_DESC_MEMBER_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring) \
+	struct interface_association_descriptor name;
+#define USB_DESC_MEMBER_CLASS(name, type, ...) \
+	type name;
+
+/* Initializers */
+#define USB_DESC_INIT_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	{ \
+		sizeof(struct interface_descriptor), \
+		DESC_INTERFACE, \
+		number, \
+		alt, \
+		num_endpoints, \
+		cls, \
+		subclass, \
+		protocol, \
+		istring, \
+	},
+#define USB_DESC_INIT_ENDPOINT(name, address, attributes, max_packet_size, interval) \
+	{ \
+		sizeof(struct endpoint_descriptor), \
+		DESC_ENDPOINT, \
+		address, \
+		attributes, \
+		max_packet_size, \
+		interval, \
+	},
+#define USB_DESC_INIT_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring) \
+	{ \
+		sizeof(struct interface_association_descriptor), \
+		DESC_INTERFACE_ASSOCIATION, \
+		first_interface, \
+		interface_count, \
+		cls, \
+		subclass, \
+		protocol, \
+		istring, \
+	},
+#define USB_DESC_INIT_CLASS(name, type, ...) \
+	{ __VA_ARGS__ },
+
+/* Interface counting */
+#define USB_DESC_NUMIF_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	+ ((alt) == 0)
+#define USB_DESC_NUMIF_ENDPOINT(name, address, attributes, max_packet_size, interval)
+#define USB_DESC_NUMIF_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring)
+#define USB_DESC_NUMIF_CLASS(name, type, ...)
+
+/* Endpoint sizes */
+#define USB_DESC_EPSIZE_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function)
+#define USB_DESC_EPSIZE_ENDPOINT(name, address, attributes, max_packet_size, interval) \
+	USB_DESC_EP_SIZE_##name = (max_packet_size),
+#define USB_DESC_EPSIZE_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring)
+#define USB_DESC_EPSIZE_CLASS(name, type, ...)
+
+/* Interface SETUP request handlers */
+#define USB_DESC_SETUP_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	[number] = USB_DESC_SETUP_HANDLER_##function,
+#define USB_DESC_SETUP_ENDPOINT(name, address, attributes, max_packet_size, interval)
+#define USB_DESC_SETUP_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring)
+#define USB_DESC_SETUP_CLASS(name, type, ...)
+
+#define USB_DESC_SETUP_HANDLER_CDC  process_cdc_setup_request
+#define USB_DESC_SETUP_HANDLER_HID  process_hid_setup_request
+#define USB_DESC_SETUP_HANDLER_MSC  process_msc_setup_request
+#define USB_DESC_SETUP_HANDLER_NONE NULL
+
+/* Interface lists. The preprocessor can't compare values, so each class
+ * has a selector for each possible function parameter. */
+#define USB_DESC_IFLIST_CDC_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	USB_DESC_CDC_IF_##function(number)
+#define USB_DESC_IFLIST_CDC_ENDPOINT(name, address, attributes, max_packet_size, interval)
+#define USB_DESC_IFLIST_CDC_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring)
+#define USB_DESC_IFLIST_CDC_CLASS(name, type, ...)
+
+#define USB_DESC_IFLIST_HID_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	USB_DESC_HID_IF_##function(number)
+#define USB_DESC_IFLIST_HID_ENDPOINT(name, address, attributes, max_packet_size, interval)
+#define USB_DESC_IFLIST_HID_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring)
+#define USB_DESC_IFLIST_HID_CLASS(name, type, ...)
+
+#define USB_DESC_IFLIST_MSC_INTERFACE(name, number, alt, num_endpoints, cls, subclass, protocol, istring, function) \
+	USB_DESC_MSC_IF_##function(number)
+#define USB_DESC_IFLIST_MSC_ENDPOINT(name, address, attributes, max_packet_size, interval)
+#define USB_DESC_IFLIST_MSC_IAD(name, first_interface, interface_count, cls, subclass, protocol, istring)
+#define USB_DESC_IFLIST_MSC_CLASS(name, type, ...)
+
+#define USB_DESC_CDC_IF_CDC(number) number,
+#define USB_DESC_CDC_IF_HID(number)
+#define USB_DESC_CDC_IF_MSC(number)
+#define USB_DESC_CDC_IF_NONE(number)
+
+#define USB_DESC_HID_IF_CDC(number)
+#define USB_DESC_HID_IF_HID(number) number,
+#define USB_DESC_HID_IF_MSC(number)
+#define USB_DESC_HID_IF_NONE(number)
+
+#define USB_DESC_MSC_IF_CDC(number)
+#define USB_DESC_MSC_IF_HID(number)
+#define USB_DESC_MSC_IF_MSC(number) number,
+#define USB_DESC_MSC_IF_NONE(number)
+
+/** @endcond */
+
+/* Doxygen end-of-group for desc_builder */
+/** @}*/
+
+/* Doxygen end-of-group for public_api */
+/** @}*/
+
+#endif /* USB_DESC_BUILDER_H__ */
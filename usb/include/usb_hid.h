@@ -326,7 +326,7 @@ void hid_set_interface_list(uint8_t *interfaces, uint8_t num_interfaces);
  * @returns
  *   Returns 0 if the setup packet could be processed or -1 if it could not.
  */
-uint8_t process_hid_setup_request(const struct setup_packet *setup);
+int8_t process_hid_setup_request(const struct setup_packet *setup);
 
 
 /* Doxygen end-of-group for hid_items */
@@ -126,6 +126,126 @@ struct microsoft_extended_property_section_header {
  */
 };
 
+/** MS OS 2.0 descriptor request index
+ *
+ * The wIndex of the vendor request (bRequest set to the bMS_VendorCode
+ * from the platform capability) by which the host asks for the MS OS 2.0
+ * descriptor set.
+ */
+#define MICROSOFT_OS_20_DESCRIPTOR_INDEX 0x7
+
+/** Minimum Windows version which supports MS OS 2.0 descriptors (8.1) */
+#define MICROSOFT_OS_20_WINDOWS_VERSION_8_1 0x06030000
+
+/** MS OS 2.0 Platform Capability UUID
+ *
+ * {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}, in the byte order in which it
+ * is sent on the bus.
+ */
+#define MICROSOFT_OS_20_PLATFORM_CAPABILITY_UUID \
+	{ 0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C, \
+	  0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F }
+
+/** MS OS 2.0 Descriptor Types
+ *
+ * Values for the wDescriptorType field of the MS OS 2.0 descriptors.
+ */
+enum MicrosoftOS20DescriptorTypes {
+	MS_OS_20_SET_HEADER_DESCRIPTOR = 0x0,
+	MS_OS_20_SUBSET_HEADER_CONFIGURATION = 0x1,
+	MS_OS_20_SUBSET_HEADER_FUNCTION = 0x2,
+	MS_OS_20_FEATURE_COMPATIBLE_ID = 0x3,
+	MS_OS_20_FEATURE_REG_PROPERTY = 0x4,
+};
+
+/** MS OS 2.0 Platform Capability Descriptor
+ *
+ * This Device Capability Descriptor is placed in the BOS descriptor to
+ * tell Windows 8.1 and later that the device supports MS OS 2.0
+ * descriptors, and with which vendor request to retrieve them.
+ */
+struct microsoft_os_20_platform_capability {
+	uint8_t bLength;            /**< Set to 28 */
+	uint8_t bDescriptorType;    /**< Set to DESC_DEVICE_CAPABILITY */
+	uint8_t bDevCapabilityType; /**< Set to DEVICE_CAPABILITY_PLATFORM */
+	uint8_t bReserved;
+	uint8_t PlatformCapabilityUUID[16]; /**< Set to
+	                   MICROSOFT_OS_20_PLATFORM_CAPABILITY_UUID */
+	uint32_t dwWindowsVersion;  /**< Minimum Windows version of the set */
+	uint16_t wMSOSDescriptorSetTotalLength; /**< Length of the set */
+	uint8_t bMS_VendorCode;     /**< Set to the bRequest by which the host
+	                                 should ask for the descriptor set */
+	uint8_t bAltEnumCode;       /**< Set to 0 */
+};
+
+/** MS OS 2.0 Descriptor Set Header
+ *
+ * This is the first descriptor in an MS OS 2.0 descriptor set.
+ * Descriptors which follow it directly apply to the whole device.
+ */
+struct microsoft_os_20_set_header {
+	uint16_t wLength;          /**< Set to 10 */
+	uint16_t wDescriptorType;  /**< MS_OS_20_SET_HEADER_DESCRIPTOR */
+	uint32_t dwWindowsVersion; /**< Minimum Windows version */
+	uint16_t wTotalLength;     /**< Length of the whole set */
+};
+
+/** MS OS 2.0 Configuration Subset Header
+ *
+ * Descriptors following this header apply only to the configuration
+ * indicated. This is only required for composite devices.
+ */
+struct microsoft_os_20_configuration_subset_header {
+	uint16_t wLength;             /**< Set to 8 */
+	uint16_t wDescriptorType;     /**< MS_OS_20_SUBSET_HEADER_CONFIGURATION */
+	uint8_t bConfigurationValue;  /**< Configuration index (not value) */
+	uint8_t bReserved;
+	uint16_t wTotalLength;        /**< Length of this header + subset */
+};
+
+/** MS OS 2.0 Function Subset Header
+ *
+ * Descriptors following this header apply only to the function (the
+ * interface or interface association) starting at bFirstInterface.
+ */
+struct microsoft_os_20_function_subset_header {
+	uint16_t wLength;          /**< Set to 8 */
+	uint16_t wDescriptorType;  /**< MS_OS_20_SUBSET_HEADER_FUNCTION */
+	uint8_t bFirstInterface;   /**< First interface of the function */
+	uint8_t bReserved;
+	uint16_t wSubsetLength;    /**< Length of this header + subset */
+};
+
+/** MS OS 2.0 Compatible ID Descriptor
+ *
+ * The MS OS 2.0 equivalent of the Extended Compat ID Function.
+ */
+struct microsoft_os_20_compat_id {
+	uint16_t wLength;           /**< Set to 20 */
+	uint16_t wDescriptorType;   /**< MS_OS_20_FEATURE_COMPATIBLE_ID */
+	uint8_t CompatibleID[8];    /**< Compatible String */
+	uint8_t SubCompatibleID[8]; /**< Subcompatible String */
+};
+
+/** MS OS 2.0 Registry Property Descriptor header
+ *
+ * This is the first part of the Registry Property Descriptor, which is a
+ * variable-length descriptor. The variable-length fields must be packed
+ * manually after this header.
+ */
+struct microsoft_os_20_registry_property_header {
+	uint16_t wLength;           /**< Size of this descriptor (header + data) */
+	uint16_t wDescriptorType;   /**< MS_OS_20_FEATURE_REG_PROPERTY */
+	uint16_t wPropertyDataType; /**< Property Data Format, eg: 7=REG_MULTI_SZ */
+
+/* Variable-length fields and lengths:
+	uint16_t wPropertyNameLength;
+	uint16_t PropertyName[];
+	uint16_t wPropertyDataLength;
+	uint8_t  PropertyData[];
+ */
+};
+
 #ifdef MICROSOFT_COMPAT_ID_DESCRIPTOR_FUNC
 /** @brief Callback for the GET_MS_DESCRIPTOR/CompatID request
  *
@@ -168,6 +288,26 @@ uint16_t MICROSOFT_CUSTOM_PROPERTY_DESCRIPTOR_FUNC(uint8_t interface,
                                                    const void **descriptor);
 #endif
 
+#ifdef MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC
+/** @brief Callback for the MS OS 2.0 descriptor set request
+ *
+ * MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC() is called when a vendor request
+ * with a bRequest of MICROSOFT_OS_DESC_VENDOR_CODE and a wIndex of
+ * MICROSOFT_OS_20_DESCRIPTOR_INDEX (0x7) is received from the host. The
+ * host learns the vendor code from the MS OS 2.0 platform capability in
+ * the BOS descriptor (see USB_BOS_DESCRIPTOR_FUNC). The whole descriptor
+ * set, including any configuration and function subsets, is returned in
+ * this single request.
+ *
+ * @param descriptor     a pointer to a pointer which should be set to the
+ *                       descriptor set.
+ * @returns
+ *   Return the length of the descriptor set pointed to by @p *descriptor,
+ *   or -1 if the descriptor set does not exist.
+ */
+int16_t MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC(const void **descriptor);
+#endif
+
 /* Doxygen end-of-group for microsoft_items */
 /** @}*/
 
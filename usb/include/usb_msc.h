@@ -50,7 +50,8 @@
  *  @brief Packet structs, constants, and callback functions implementing
  *  the "Universal Serial Bus Mass Storage Class", revision 1.4, and the
  *  "Universal Serial Bus Mass Storage Class Bulk-Only Transport", revision
- *  1.0.
+ *  1.0, and the "Universal Serial Bus Mass Storage Class USB Attached SCSI
+ *  Protocol (UASP)", revision 1.0.
  *
  *  An indespensible reference is Jan Axelson's "USB Mass Storage" book.
  *  The major value in this book is the real-life perspective regarding
@@ -62,6 +63,7 @@
  *  they reference as follows:\n
  *  \b MSCO: USB Mass Storage Class, revision 1.4\n
  *  \b BOT:  USB Mass Storage Class Bulk-Only Transport, revision 1.0\n
+ *  \b UAS:  USB Mass Storage Class USB Attached SCSI Protocol, revision 1.0\n
  *  \b Axelson: Jan Axelson's "USB Mass Storage" book\n
  *
  *  For more information, see the above referenced document, available from
@@ -76,6 +78,7 @@
  * contact with Signal 11 if you need something specific.  */
 
 #define MSC_PROTOCOL_CODE_BBB 0x50 /* Bulk-Only */
+#define MSC_PROTOCOL_CODE_UAS 0x62 /* USB Attached SCSI */
 /* Many of the protocol codes (MSCO: sec 3) are omitted here. Get in
  * contact with Signal 11 if you need something specific.  */
 
@@ -85,6 +88,51 @@
 	typedef uint16_t msc_lun_mask_t;
 #endif
 
+#ifdef MSC_UAS_SUPPORT
+	#ifndef MSC_UAS_QUEUE_DEPTH
+		#define MSC_UAS_QUEUE_DEPTH 4
+	#endif
+#endif
+
+#ifdef MSC_UNMAP
+	#ifndef MSC_WRITE_SUPPORT
+		#error "MSC_UNMAP requires MSC_WRITE_SUPPORT"
+	#endif
+	/* Reported in the Block Limits VPD page. The host won't send more
+	 * descriptors, or a descriptor with more blocks, than these in one
+	 * UNMAP command. Keep MSC_UNMAP_MAX_BLOCKS small enough that the
+	 * medium can discard that many blocks well within the host's
+	 * command timeout. */
+	#ifndef MSC_UNMAP_MAX_DESCRIPTORS
+		#define MSC_UNMAP_MAX_DESCRIPTORS 4
+	#endif
+	#ifndef MSC_UNMAP_MAX_BLOCKS
+		#define MSC_UNMAP_MAX_BLOCKS 0x40000
+	#endif
+	/* The number of blocks the medium discards in one piece (for an SD
+	 * card, its erase unit). Reported in the Block Limits VPD page. */
+	#ifndef MSC_UNMAP_GRANULARITY
+		#define MSC_UNMAP_GRANULARITY 1
+	#endif
+	/* The 8-byte parameter list header and the descriptors */
+	#define MSC_UNMAP_PARAMETER_LIST_SIZE (8 + 16 * MSC_UNMAP_MAX_DESCRIPTORS)
+#endif
+
+#ifdef MSC_SYNCHRONIZE_CACHE
+	#ifndef MSC_WRITE_SUPPORT
+		#error "MSC_SYNCHRONIZE_CACHE requires MSC_WRITE_SUPPORT"
+	#endif
+#endif
+
+#ifdef MSC_STATISTICS
+	#ifndef MSC_STATISTICS_HISTOGRAM_BUCKETS
+		#define MSC_STATISTICS_HISTOGRAM_BUCKETS 12
+	#endif
+	/* The number of entries in msc_statistics.commands. This must match
+	 * the command table in usb_msc.c. */
+	#define MSC_STATISTICS_NUM_COMMANDS 14
+#endif
+
 
 /** MSC Class Requests
  *
@@ -97,6 +145,19 @@ enum MSCRequests {
 	MSC_BULK_ONLY_MASS_STORAGE_RESET = 0xff,
 };
 
+/** MSC Statistics Vendor Requests
+ *
+ * With MSC_STATISTICS, the statistics of an interface are read and cleared
+ * with these vendor-type requests, addressed to the interface (see @p
+ * process_msc_setup_request()). They are not part of any MSC
+ * specification, so they have their own request number space and don't
+ * conflict with @p MSCRequests.
+ */
+enum MSCVendorRequests {
+	MSC_GET_STATISTICS = 0x01,   /**< IN: struct msc_statistics */
+	MSC_CLEAR_STATISTICS = 0x02, /**< OUT: no data stage */
+};
+
 /** MSC Command Block Status Values
  *
  * See BOT, 5.2
@@ -141,8 +202,157 @@ struct msc_command_status_wrapper {
 	uint8_t  bCSWStatus; /**< @see enum MSCStatus */
 };
 
+/** MSC Alternate Settings
+ *
+ * When UAS is supported, the MSC interface has Bulk-Only Transport as
+ * alternate setting 0 and UAS as alternate setting 1. A host which doesn't
+ * know about UAS never selects alternate setting 1, and the interface works
+ * as a Bulk-Only interface.
+ */
+enum MSCAlternateSettings {
+	MSC_ALT_SETTING_BOT = 0,
+	MSC_ALT_SETTING_UAS = 1,
+};
+
+/** UAS Pipe Usage Class-Specific Descriptor Type */
+#define MSC_PIPE_USAGE_DESCRIPTOR 0x24
+
+/** UAS Pipe IDs, used in the Pipe Usage Descriptor */
+enum MSCUASPipeIDs {
+	MSC_UAS_COMMAND_PIPE = 1,
+	MSC_UAS_STATUS_PIPE = 2,
+	MSC_UAS_DATA_IN_PIPE = 3,
+	MSC_UAS_DATA_OUT_PIPE = 4,
+};
+
+/** UAS Pipe Usage Descriptor
+ *
+ * One of these follows each endpoint descriptor of the UAS alternate
+ * setting, identifying what the endpoint is used for.
+ */
+struct msc_pipe_usage_descriptor {
+	uint8_t bLength; /**< Set to 4 */
+	uint8_t bDescriptorType; /**< Set to MSC_PIPE_USAGE_DESCRIPTOR */
+	uint8_t bPipeID; /**< @see enum MSCUASPipeIDs */
+	uint8_t reserved;
+};
+
+/** UAS Information Unit (IU) IDs
+ *
+ * See UAS, Information Units.
+ */
+enum MSCUASInformationUnits {
+	MSC_UAS_IU_COMMAND = 0x01,
+	MSC_UAS_IU_SENSE = 0x03,
+	MSC_UAS_IU_RESPONSE = 0x04,
+	MSC_UAS_IU_TASK_MANAGEMENT = 0x05,
+	MSC_UAS_IU_READ_READY = 0x06,
+	MSC_UAS_IU_WRITE_READY = 0x07,
+};
+
+/** UAS Command IU Task Attributes (lower 3 bits of task_attribute) */
+enum MSCUASTaskAttributes {
+	MSC_UAS_TASK_SIMPLE = 0x0,
+	MSC_UAS_TASK_HEAD_OF_QUEUE = 0x1,
+	MSC_UAS_TASK_ORDERED = 0x2,
+	MSC_UAS_TASK_ACA = 0x4,
+	MSC_UAS_TASK_ATTRIBUTE_MASK = 0x7,
+};
+
+/** UAS Task Management Functions
+ *
+ * See UAS, Information Units.
+ */
+enum MSCUASTaskManagementFunctions {
+	MSC_UAS_TMF_ABORT_TASK = 0x01,
+	MSC_UAS_TMF_ABORT_TASK_SET = 0x02,
+	MSC_UAS_TMF_CLEAR_TASK_SET = 0x04,
+	MSC_UAS_TMF_LOGICAL_UNIT_RESET = 0x08,
+	MSC_UAS_TMF_I_T_NEXUS_RESET = 0x10,
+	MSC_UAS_TMF_CLEAR_ACA = 0x40,
+	MSC_UAS_TMF_QUERY_TASK = 0x80,
+	MSC_UAS_TMF_QUERY_TASK_SET = 0x81,
+	MSC_UAS_TMF_QUERY_ASYNCHRONOUS_EVENT = 0x82,
+};
+
+/** UAS Response Codes, returned in the Response IU
+ *
+ * See UAS, Information Units.
+ */
+enum MSCUASResponseCodes {
+	MSC_UAS_RESPONSE_TMF_COMPLETE = 0x00,
+	MSC_UAS_RESPONSE_INVALID_IU = 0x02,
+	MSC_UAS_RESPONSE_TMF_NOT_SUPPORTED = 0x04,
+	MSC_UAS_RESPONSE_TMF_FAILED = 0x05,
+	MSC_UAS_RESPONSE_TMF_SUCCEEDED = 0x08,
+	MSC_UAS_RESPONSE_INCORRECT_LUN = 0x09,
+	MSC_UAS_RESPONSE_OVERLAPPED_TAG = 0x0a,
+};
+
+/* All UAS IU fields are big endian. The tags are never interpreted by the
+ * MSC class though, only compared and sent back, so they are kept in the
+ * byte order in which they were received. */
+
+/** UAS Command IU
+ *
+ * See UAS, Information Units.
+ */
+struct msc_uas_command_iu {
+	uint8_t iu_id; /**< MSC_UAS_IU_COMMAND */
+	uint8_t reserved;
+	uint16_t tag;
+	uint8_t task_attribute; /**< bits 0-2: enum MSCUASTaskAttributes,
+	                             bits 3-6: priority */
+	uint8_t reserved2;
+	uint8_t additional_cdb_length; /**< bits 2-7, in 4-byte words */
+	uint8_t reserved3;
+	uint8_t lun[8];
+	uint8_t cdb[16];
+};
+
+/** UAS Task Management IU
+ *
+ * See UAS, Information Units.
+ */
+struct msc_uas_task_management_iu {
+	uint8_t iu_id; /**< MSC_UAS_IU_TASK_MANAGEMENT */
+	uint8_t reserved;
+	uint16_t tag;
+	uint8_t function; /**< enum MSCUASTaskManagementFunctions */
+	uint8_t reserved2;
+	uint16_t task_tag; /**< Tag of the task to be managed */
+	uint8_t lun[8];
+};
+
+/** UAS Read Ready and Write Ready IUs
+ *
+ * See UAS, Information Units.
+ */
+struct msc_uas_ready_iu {
+	uint8_t iu_id; /**< MSC_UAS_IU_READ_READY or MSC_UAS_IU_WRITE_READY */
+	uint8_t reserved;
+	uint16_t tag;
+};
+
+/** UAS Response IU
+ *
+ * See UAS, Information Units.
+ */
+struct msc_uas_response_iu {
+	uint8_t iu_id; /**< MSC_UAS_IU_RESPONSE */
+	uint8_t reserved;
+	uint16_t tag;
+	uint8_t additional_response_information[3];
+	uint8_t response_code; /**< enum MSCUASResponseCodes */
+};
+
 /* SCSI Definitions and Structures */
 
+enum SCSIStatus {
+	SCSI_STATUS_GOOD = 0x00,
+	SCSI_STATUS_CHECK_CONDITION = 0x02,
+};
+
 enum MSCSCSICommands {
 	MSC_SCSI_FORMAT_UNIT = 0x04,
 	MSC_SCSI_INQUIRY = 0x12,
@@ -161,6 +371,23 @@ enum MSCSCSICommands {
 	MSC_SCSI_VERIFY = 0x2f,
 	MSC_SCSI_WRITE_6 = 0x0a,
 	MSC_SCSI_WRITE_10 = 0x2a,
+	MSC_SCSI_SYNCHRONIZE_CACHE_10 = 0x35,
+	MSC_SCSI_UNMAP = 0x42,
+	MSC_SCSI_READ_16 = 0x88,
+	MSC_SCSI_WRITE_16 = 0x8a,
+	MSC_SCSI_SERVICE_ACTION_IN_16 = 0x9e,
+};
+
+/* Service actions of SERVICE ACTION IN(16) */
+enum MSCSCSIServiceActionsIn16 {
+	MSC_SCSI_SA_READ_CAPACITY_16 = 0x10,
+};
+
+/* Vital Product Data pages, returned by INQUIRY with EVPD set */
+enum MSCSCSIVPDPages {
+	MSC_SCSI_VPD_SUPPORTED_PAGES = 0x00,
+	MSC_SCSI_VPD_BLOCK_LIMITS = 0xb0,
+	MSC_SCSI_VPD_LOGICAL_BLOCK_PROVISIONING = 0xb2,
 };
 
 struct msc_scsi_inquiry_command {
@@ -207,13 +434,79 @@ struct msc_scsi_read_10_command {
 
 struct msc_scsi_write_10_command {
 	uint8_t operation_code;
-	uint8_t wrprotect_flags;
+	uint8_t wrprotect_flags; /* bit 3: FUA */
 	uint32_t logical_block_address;
 	uint8_t group_number;
 	uint16_t transfer_length;
 	uint8_t control;
 };
 
+struct msc_scsi_read_16_command {
+	uint8_t opcode;
+	uint8_t unused_flags;
+	uint32_t logical_block_address_high;
+	uint32_t logical_block_address;
+	uint32_t transfer_length;
+	uint8_t group_number;
+	uint8_t control_flags;
+};
+
+struct msc_scsi_write_16_command {
+	uint8_t operation_code;
+	uint8_t wrprotect_flags; /* bit 3: FUA */
+	uint32_t logical_block_address_high;
+	uint32_t logical_block_address;
+	uint32_t transfer_length;
+	uint8_t group_number;
+	uint8_t control;
+};
+
+enum MSCSCSIWriteFlags {
+	MSC_SCSI_WRITE_FUA = 0x08, /**< Force Unit Access */
+};
+
+struct msc_scsi_synchronize_cache_10_command {
+	uint8_t operation_code; /* 0x35 */
+	uint8_t immed; /* bit 1 only */
+	uint32_t logical_block_address;
+	uint8_t group_number;
+	uint16_t num_blocks;
+	uint8_t control;
+};
+
+struct msc_scsi_service_action_in_16_command {
+	uint8_t operation_code; /* 0x9e */
+	uint8_t service_action; /* bits 0-4 */
+	uint32_t logical_block_address_high; /* obsolete for READ CAPACITY */
+	uint32_t logical_block_address;
+	uint32_t allocation_length;
+	uint8_t flags;
+	uint8_t control;
+};
+
+struct msc_scsi_unmap_command {
+	uint8_t operation_code; /* 0x42 */
+	uint8_t anchor; /* bit 0 only */
+	uint8_t reserved[4];
+	uint8_t group_number;
+	uint16_t parameter_list_length;
+	uint8_t control;
+};
+
+/* The UNMAP parameter list is a header followed by block descriptors */
+struct scsi_unmap_parameter_header {
+	uint16_t data_length; /**< Length of the rest of the list */
+	uint16_t block_descriptor_data_length;
+	uint8_t reserved[4];
+};
+
+struct scsi_unmap_block_descriptor {
+	uint32_t logical_block_address_high;
+	uint32_t logical_block_address;
+	uint32_t num_blocks;
+	uint8_t reserved[4];
+};
+
 enum MSCSCSIVersion {
 	MSC_SCSI_SPC_VERSION_2 = 4,
 	MSC_SCSI_SPC_VERSION_3 = 5,
@@ -237,6 +530,59 @@ struct scsi_capacity_response {
 	uint32_t block_length;
 };
 
+struct scsi_capacity_16_response {
+	uint32_t last_block_high;
+	uint32_t last_block;
+	uint32_t block_length;
+	uint8_t protection; /**< Set to 0x0 */
+	uint8_t exponents; /**< Set to 0x0 */
+	uint8_t lowest_aligned_high; /**< 0x80 bit = LBPME */
+	uint8_t lowest_aligned;
+	uint8_t reserved[16];
+};
+
+enum SCSICapacity16Flags {
+	SCSI_CAPACITY_16_LBPME = 0x80, /**< Logical block provisioning
+	                                  *  management enabled */
+};
+
+struct scsi_vpd_header {
+	uint8_t peripheral; /**< Set to 0x0 */
+	uint8_t page_code;
+	uint16_t page_length; /**< Length of the rest of the page */
+};
+
+struct scsi_vpd_block_limits {
+	struct scsi_vpd_header header;
+	uint8_t flags;
+	uint8_t max_compare_and_write_length;
+	uint16_t optimal_transfer_length_granularity;
+	uint32_t max_transfer_length;
+	uint32_t optimal_transfer_length;
+	uint32_t max_prefetch_length;
+	uint32_t max_unmap_lba_count;
+	uint32_t max_unmap_block_descriptor_count;
+	uint32_t optimal_unmap_granularity;
+	uint32_t unmap_granularity_alignment; /**< 0x80000000 bit = UGAVALID */
+	uint8_t max_write_same_length[8];
+	uint8_t reserved[20];
+};
+
+struct scsi_vpd_logical_block_provisioning {
+	struct scsi_vpd_header header;
+	uint8_t threshold_exponent;
+	uint8_t flags; /**< enum SCSIProvisioningFlags */
+	uint8_t provisioning_type; /**< Set to 0x0 (not reported) */
+	uint8_t reserved;
+};
+
+enum SCSIProvisioningFlags {
+	SCSI_LBP_UNMAP = 0x80, /**< LBPU: UNMAP is supported */
+	SCSI_LBP_WRITE_SAME_16 = 0x40, /**< LBPWS */
+	SCSI_LBP_WRITE_SAME_10 = 0x20, /**< LBPWS10 */
+	SCSI_LBP_READ_ZEROS = 0x04, /**< LBPRZ: unmapped blocks read as 0 */
+};
+
 enum SCSISenseResponseCode {
 	SCSI_SENSE_CURRENT_ERRORS = 0x70,
 	SCSI_SENSE_DEFERRED_ERRORS = 0x71,
@@ -257,6 +603,36 @@ struct scsi_mode_sense_response {
 	uint8_t block_descriptor_length; /**< Set to 0x0 */
 };
 
+enum SCSIModeSenseFlags {
+	SCSI_MODE_SENSE_WRITE_PROTECT = 0x80, /**< device_specific_parameter */
+	SCSI_MODE_SENSE_DPOFUA = 0x10, /**< device_specific_parameter, FUA supported */
+};
+
+enum SCSIModePages {
+	SCSI_MODE_PAGE_CACHING = 0x08,
+	SCSI_MODE_PAGE_ALL = 0x3f,
+};
+
+struct scsi_mode_page_caching {
+	uint8_t page_code; /**< SCSI_MODE_PAGE_CACHING */
+	uint8_t page_length; /**< sizeof(scsi_mode_page_caching) - 2 */
+	uint8_t flags; /**< enum SCSICachingFlags */
+	uint8_t retention_priority;
+	uint16_t disable_prefetch_transfer_length;
+	uint16_t min_prefetch;
+	uint16_t max_prefetch;
+	uint16_t max_prefetch_ceiling;
+	uint8_t flags2;
+	uint8_t num_cache_segments;
+	uint16_t cache_segment_size;
+	uint8_t reserved[4];
+};
+
+enum SCSICachingFlags {
+	SCSI_CACHING_WCE = 0x04, /**< Write-back cache enabled */
+	SCSI_CACHING_RCD = 0x01, /**< Read cache disabled */
+};
+
 enum SCSISenseKeys {
 	SCSI_SENSE_KEY_NOT_READY = 0x2,
 	SCSI_SENSE_KEY_MEDIUM_ERROR = 0x3,
@@ -271,6 +647,8 @@ enum SCSIAdditionalSenseCodes {
 	SCSI_ASC_INVALID_COMMAND_OPERATION_CODE = 0x20,
 	SCSI_ASC_INVALID_FIELD_IN_COMMAND_PACKET = 0x24,
 	SCSI_ASC_LOGICAL_UNIT_NOT_SUPPORTED = 0x25,
+	SCSI_ASC_INVALID_FIELD_IN_PARAMETER_LIST = 0x26,
+	SCSI_ASC_PARAMETER_LIST_LENGTH_ERROR = 0x1a,
 
 	/* MEDIUM_ERROR */
 	SCSI_ASC_PERIPHERAL_DEVICE_WRITE_FAULT = 0x03,
@@ -299,6 +677,87 @@ struct scsi_sense_response {
 	/* Additional, vendor-specific sense data goes here. */
 };
 
+/** UAS Sense IU
+ *
+ * The status of a command, with its sense data. See UAS, Information Units
+ */
+struct msc_uas_sense_iu {
+	uint8_t iu_id; /**< MSC_UAS_IU_SENSE */
+	uint8_t reserved;
+	uint16_t tag;
+	uint16_t status_qualifier;
+	uint8_t status; /**< enum SCSIStatus */
+	uint8_t reserved2[7];
+	uint16_t length; /**< Length of sense data (big endian) */
+	struct scsi_sense_response sense;
+};
+
+#ifdef MSC_STATISTICS
+/** MSC Statistics Version
+ *
+ * Reported in msc_statistics.version. Incremented whenever the layout of
+ * struct msc_statistics changes.
+ */
+#define MSC_STATISTICS_VERSION 1
+
+/** MSC Per-Command Statistics
+ *
+ * The statistics for one SCSI operation code. The latency of a command is
+ * the time from the receipt of its CBW (or for UAS, from when it is taken
+ * off the queue) until its CSW (or Sense IU) is sent. Entry N of @p
+ * latency_histogram counts the commands whose latency was less than 2^N
+ * ticks (and at least 2^(N-1) ticks), except that the last entry counts all
+ * the commands which took longer. The counts in the histogram stop at
+ * 0xffff rather than wrapping.
+ */
+struct msc_command_statistics {
+	uint8_t opcode;      /**< enum MSCSCSICommands */
+	uint8_t reserved[3];
+	uint32_t count;      /**< Commands completed */
+	uint32_t failed;     /**< Commands completed with a status other than passed */
+	uint64_t bytes;      /**< Bytes transferred in the data stage */
+	uint32_t total_ticks; /**< Sum of the latencies */
+	uint32_t max_ticks;  /**< Longest latency */
+	uint16_t latency_histogram[MSC_STATISTICS_HISTOGRAM_BUCKETS];
+};
+
+/** MSC Statistics
+ *
+ * Command and timing statistics for an interface, as returned by the
+ * @p MSC_GET_STATISTICS vendor request. Times are in the ticks of the
+ * @p MSC_GET_TIMESTAMP() clock.
+ *
+ * The time that commands take is split between waiting for the
+ * application (for the next block of read data, or for it to take the
+ * last block of write data) and waiting for the endpoint (for the host to
+ * read the data or status, or to send the write data). The part of the
+ * time waiting for the application which the application reported with @p
+ * msc_statistics_add_medium_time() as spent waiting for the medium is
+ * given separately as @p medium_busy_ticks, and is included in @p
+ * application_ticks.
+ *
+ * The last entry of @p commands counts all the commands which don't have
+ * an entry of their own (its opcode is not meaningful).
+ *
+ * The statistics are cleared by the first call to @p msc_init(), but not
+ * by later calls (made after a reset), so the application data structure
+ * must start out zeroed, as a global does.
+ *
+ * All fields are little endian.
+ */
+struct msc_statistics {
+	uint8_t version;      /**< MSC_STATISTICS_VERSION */
+	uint8_t num_commands; /**< Number of entries in commands */
+	uint8_t num_buckets;  /**< Number of latency histogram entries */
+	uint8_t reserved;
+	uint32_t ticks_per_second; /**< MSC_TIMESTAMP_TICKS_PER_SECOND */
+	uint32_t application_ticks;
+	uint32_t endpoint_ticks;
+	uint32_t medium_busy_ticks;
+	struct msc_command_statistics commands[MSC_STATISTICS_NUM_COMMANDS];
+};
+#endif
+
 #if defined(__XC16__) || defined(__XC32__)
 #pragma pack(pop)
 #elif __XC8
@@ -318,6 +777,8 @@ enum MSCApplicationStates {
 	MSC_STALL,              /**< Next transaction needs to stall */
 	MSC_CSW,                /**< Next transaction will contain the CSW */
 	MSC_NEEDS_RESET_RECOVERY, /**< Reset recovery is required */
+	MSC_CACHE_SYNC,         /**< Waiting for the application to write
+	                             back its cache */
 };
 
 /** Return codes used by application callbacks.
@@ -335,6 +796,15 @@ enum MSCReturnCodes {
 	MSC_ERROR_MEDIUM             = -7, /**< Unspecified medium error */
 };
 
+#ifdef MSC_UAS_SUPPORT
+/** A UAS command waiting in the queue of an interface */
+struct msc_uas_queued_command {
+	uint16_t tag;
+	uint8_t lun;
+	uint8_t cdb[16];
+};
+#endif
+
 /* Forward declare struct msc_application_data to enable the following:
  * 1. The struct be used by the callback,
  * 2. The callback can be used by the struct. */
@@ -353,6 +823,15 @@ struct msc_application_data;
 typedef void (*msc_completion_callback) (struct msc_application_data *app_data,
                                          bool transfer_ok);
 
+/** @brief Segment of Data to Send to the Host
+ *
+ * One entry of the list passed to @p msc_start_send_segments_to_host().
+ */
+struct msc_send_segment {
+	const uint8_t *data; /**< Data to send */
+	uint32_t len;        /**< Length of the data in bytes */
+};
+
 /** MSC Applicaiton Data
  *
  * The application shall provide one of these structures for each interface
@@ -365,6 +844,10 @@ typedef void (*msc_completion_callback) (struct msc_application_data *app_data,
  *
  * The application will pass this structure to the MSC class whenever it needs
  * the MSC class to process data for an interface.
+ *
+ * With MSC_UAS_SUPPORT, the UAS alternate setting uses @p in_endpoint and
+ * @p out_endpoint as its Data-In and Data-Out pipes, and the two endpoints
+ * below as its Command and Status pipes.
  */
 struct msc_application_data {
 	/* Application should initialize the following: */
@@ -373,7 +856,15 @@ struct msc_application_data {
 	uint8_t in_endpoint;
 	uint8_t out_endpoint;
 	uint8_t in_endpoint_size; /**< Size in bytes for IN endpoint */
+#ifdef MSC_UAS_SUPPORT
+	uint8_t uas_command_endpoint; /**< UAS Command pipe (OUT) */
+	uint8_t uas_status_endpoint;  /**< UAS Status pipe (IN) */
+#endif
 	msc_lun_mask_t media_is_removable_mask; /**< bitmask, one bit for each LUN */
+#ifdef MSC_SYNCHRONIZE_CACHE
+	msc_lun_mask_t write_cache_mask; /**< bitmask, one bit for each LUN
+	                                      with a write-back cache */
+#endif
 	const char *vendor; /**< SCSI-assigned vendor. Pointer to global or constant. */
 	const char *product; /**< Pointer to global or constant. */
 	const char *revision; /**< Pointer to global or constant. */
@@ -400,7 +891,9 @@ struct msc_application_data {
 		const uint8_t *tx_buf; /**< Data to be sent to the host. */
 		uint8_t *rx_buf;       /**< Data received from the host. */
 	};
-	uint16_t tx_len_remaining; /**< TX data remaining in the current block */
+	uint32_t tx_len_remaining; /**< TX data remaining in the current segment */
+	const struct msc_send_segment *tx_segments; /**< Segments not yet started */
+	uint8_t tx_segments_remaining;
 #ifdef MSC_WRITE_SUPPORT
 	uint8_t *rx_buf_cur; /**< Current position in the RX buffer */
 	size_t rx_buf_len;   /**< Length of the application's block RX buffer */
@@ -408,6 +901,44 @@ struct msc_application_data {
 	uint8_t out_ep_missed_transactions; /**< Number of out transactions not processed */
 #endif
 	msc_completion_callback operation_complete_callback;
+#ifdef MSC_SYNCHRONIZE_CACHE
+	/* Write-back cache handling */
+	uint8_t write_lun;      /**< LUN of the WRITE in progress */
+	bool sync_after_write;  /**< The WRITE in progress has FUA set */
+	bool stop_after_sync;   /**< START STOP UNIT waiting on the cache */
+	uint8_t stop_lun;       /**< LUN to stop after the cache is written */
+	bool stop_load_eject;   /**< LOEJ of the waiting START STOP UNIT */
+#endif
+#ifdef MSC_UNMAP
+	/* UNMAP command handling */
+	uint8_t unmap_params[MSC_UNMAP_PARAMETER_LIST_SIZE]; /**< Received
+	                                                        parameter list */
+	uint8_t unmap_lun;
+	uint8_t unmap_next;  /**< Next descriptor to pass to MSC_UNMAP() */
+	uint8_t unmap_count; /**< Number of descriptors in unmap_params */
+	bool unmap_pending;  /**< Waiting for msc_notify_unmap_complete() */
+#endif
+#ifdef MSC_UAS_SUPPORT
+	/* UAS state */
+	uint8_t alt_setting; /**< enum MSCAlternateSettings */
+	struct msc_uas_queued_command uas_queue[MSC_UAS_QUEUE_DEPTH];
+	uint8_t uas_queue_head;  /**< Index of the next command to run */
+	uint8_t uas_queue_count; /**< Number of commands in the queue */
+	bool uas_response_pending; /**< A Response IU is waiting to be sent */
+	uint8_t uas_response_code; /**< enum MSCUASResponseCodes */
+	uint16_t uas_response_tag;
+	uint8_t uas_command_ep_missed_transactions; /**< Number of command
+	                                                 pipe transactions
+	                                                 not processed */
+#endif
+#ifdef MSC_STATISTICS
+	/* Statistics */
+	struct msc_statistics stats;
+	uint8_t stats_command; /**< Index in stats.commands of the current command */
+	uint8_t stats_phase; /**< What the current command is waiting for */
+	uint32_t stats_command_start; /**< Timestamp of the current command's CBW */
+	uint32_t stats_phase_start;   /**< Timestamp of the last phase change */
+#endif
 };
 
 /** Initialize the MSC class for all interfaces
@@ -430,6 +961,36 @@ struct msc_application_data {
  */
 uint8_t msc_init(struct msc_application_data *app_data, uint8_t count);
 
+/** Set the Alternate Setting of an MSC Interface
+ *
+ * Call this function from the application's @p SET_INTERFACE_CALLBACK for
+ * MSC interfaces. Alternate setting 0 is Bulk-Only Transport. If
+ * MSC_UAS_SUPPORT is defined, alternate setting 1 is UAS (see
+ * @p MSCAlternateSettings). Selecting an alternate setting resets the state
+ * of the transport and drops any queued UAS commands.
+ *
+ * @param interface      The interface number
+ * @param alt_setting    The alternate setting requested by the host
+ *
+ * @returns
+ *   Returns 0 if the alternate setting was selected, or -1 if the interface
+ *   is not an MSC interface or the alternate setting is not supported.
+ */
+int8_t msc_set_interface(uint8_t interface, uint8_t alt_setting);
+
+/** Get the Alternate Setting of an MSC Interface
+ *
+ * Call this function from the application's @p GET_INTERFACE_CALLBACK for
+ * MSC interfaces.
+ *
+ * @param interface      The interface number
+ *
+ * @returns
+ *   Returns the current alternate setting, or -1 if the interface is not an
+ *   MSC interface.
+ */
+int8_t msc_get_interface(uint8_t interface);
+
 /** Process MSC Setup Request
  *
  * Process a setup request which has been unhandled as if it is potentially
@@ -458,8 +1019,8 @@ void msc_clear_halt(uint8_t endpoint_num, uint8_t direction);
 /** Notify of a transaction completing on the Data-IN endpoint
  *
  * Notify the MSC class that an IN transaction has completed on the Data-IN
- * endpoint.  If using interrupts, call this function from the
- * @p IN_TRANSACTION_COMPLETE_CALLBACK.
+ * endpoint (or, for UAS, on the Status endpoint).  If using interrupts,
+ * call this function from the @p IN_TRANSACTION_COMPLETE_CALLBACK.
  *
  * This function will not block.
  *
@@ -470,9 +1031,9 @@ void msc_in_transaction_complete(uint8_t endpoint_num);
 /** Notify of a transaction completing on the Data-OUT endpoint
  *
  * Notify the MSC class that an OUT transaction has completed on the
- * Data-OUT endpoint.  This function will process the data which is
- * available on endpoint @p endpoint_num and will re-arm the endpoint when
- * appropriate.
+ * Data-OUT endpoint (or, for UAS, on the Command endpoint).  This function
+ * will process the data which is available on endpoint @p endpoint_num and
+ * will re-arm the endpoint when appropriate.
  *
  * If using interrupts, call this function from the
  * @p OUT_TRANSACTION_CALLBACK.
@@ -499,10 +1060,15 @@ void msc_out_transaction_complete(uint8_t endpoint_num);
  * This function does not block.
  *
  * @p completion_callback will be called from interrupt context and must
- * not block.
+ * not block. It may call @p msc_start_send_to_host() for the next block,
+ * or @p msc_notify_read_operation_complete() after the last one, which
+ * lets an application with the data already in memory (such as a RAM
+ * disk) complete a read without involving its main loop.
  *
  * @p len needs to be multiple of the IN endpoint size for all calls to
  * this function except the last in response to an @p MSC_READ() callback.
+ * There is no other limit on @p len, so data which is all in memory (such
+ * as a RAM disk) can be sent in one call.
  *
  * @param app_data             Pointer to application data for this interface.
  * @param data                 Pointer to the data to send.
@@ -515,7 +1081,39 @@ void msc_out_transaction_complete(uint8_t endpoint_num);
  *   Returns 0 if the transmission could be started or -1 if it could not.
  */
 uint8_t msc_start_send_to_host(struct msc_application_data *app_data,
-                               const uint8_t *data, uint16_t len,
+                               const uint8_t *data, uint32_t len,
+                               msc_completion_callback completion_callback);
+
+/** Send a list of data segments to the host
+ *
+ * Like @p msc_start_send_to_host(), but send several pieces of data, one
+ * after the other, as if they were one. The MSC class moves from one
+ * segment to the next in interrupt context, as each packet is sent, so the
+ * application isn't involved until @p completion_callback is called after
+ * the last segment has been sent. This suits data which is in memory, but
+ * not all in one place, such as the sectors of a flash disk.
+ *
+ * Each packet comes from one segment, so the length of every segment
+ * except the last one in response to an @p MSC_READ() callback must be a
+ * multiple of the IN endpoint size. Segments with a length of zero are
+ * skipped.
+ *
+ * The list itself is read as the data is sent, so it (as well as the data)
+ * must not change until @p completion_callback has been called.
+ *
+ * @param app_data             Pointer to application data for this interface.
+ * @param segments             The segments to send, in order.
+ * @param num_segments         The number of segments.
+ * @param completion_callback  Pointer to a function which is called when
+ *                             the transmission has completed.
+ *
+ * @returns
+ *   Returns 0 if the transmission could be started or -1 if it could not.
+ */
+uint8_t msc_start_send_segments_to_host(
+                               struct msc_application_data *app_data,
+                               const struct msc_send_segment *segments,
+                               uint8_t num_segments,
                                msc_completion_callback completion_callback);
 
 /** Notify the MSC class that a Read Operation has Completed
@@ -594,6 +1192,70 @@ void msc_notify_write_operation_complete(struct msc_application_data *app_data,
                                          uint32_t bytes_processed);
 #endif
 
+#ifdef MSC_SYNCHRONIZE_CACHE
+/** Notify Cache Synchronization Complete
+ *
+ * Tell the MSC class that the data written to the cache of the LUN passed
+ * to @p MSC_SYNCHRONIZE_CACHE() has been written to the medium, or that
+ * writing it failed. The MSC class then reports the status of the command
+ * which asked for it to the host. This may be called from
+ * @p MSC_SYNCHRONIZE_CACHE() itself, if the cache is already clean.
+ *
+ * If writing back the cache failed, pass false to @p passed. This will
+ * cause a SCSI MEDIUM_ERROR to be returned to the host.
+ *
+ * @param app_data       Pointer to application data for this interface.
+ * @param passed         Whether the cache was written back successfully
+ */
+void msc_notify_synchronize_cache_complete(
+                                    struct msc_application_data *app_data,
+                                    bool passed);
+#endif
+
+#ifdef MSC_UNMAP
+/** Notify Unmap Operation Complete
+ *
+ * Tell the MSC class that the blocks passed to @p MSC_UNMAP() have been
+ * discarded, or that discarding them failed. The MSC class then passes
+ * the next block descriptor of the UNMAP command to @p MSC_UNMAP(), or
+ * reports the status of the command to the host. This may be called from
+ * @p MSC_UNMAP() itself, if there is nothing for the medium to wait for.
+ *
+ * If the unmap failed, pass false to @p passed. This will cause a SCSI
+ * MEDIUM_ERROR to be returned to the host.
+ *
+ * @param app_data       Pointer to application data for this interface.
+ * @param passed         Whether the unmap operation completed successfully
+ */
+void msc_notify_unmap_complete(struct msc_application_data *app_data,
+                               bool passed);
+#endif
+
+#ifdef MSC_STATISTICS
+/** Add Time Spent Waiting for the Medium to the Statistics
+ *
+ * Tell the MSC class how long the application waited for the medium (for
+ * example, for a block to be read from an SD card, or for a write to
+ * finish), in @p MSC_GET_TIMESTAMP() ticks. This is reported in
+ * msc_statistics.medium_busy_ticks, to tell it apart from other time spent
+ * in the application. Calling this function is optional.
+ *
+ * @param app_data       Pointer to application data for this interface.
+ * @param ticks          The time spent waiting for the medium
+ */
+void msc_statistics_add_medium_time(struct msc_application_data *app_data,
+                                    uint32_t ticks);
+
+/** Clear the Statistics
+ *
+ * Clear the statistics of an interface. This is the same as the host
+ * sending the @p MSC_CLEAR_STATISTICS request.
+ *
+ * @param app_data       Pointer to application data for this interface.
+ */
+void msc_statistics_clear(struct msc_application_data *app_data);
+#endif
+
 /** MSC Bulk-Only Mass Storage Reset callback
  *
  * The MSC class will call this function when a Bulk-Only Mass Storage Reset
@@ -696,6 +1358,12 @@ extern int8_t MSC_UNIT_READY(
  * if (!start && !load_eject):  neither load nor eject
  *
  * @returns
+ * If @p MSC_SYNCHRONIZE_CACHE is defined, a stop is only passed to this
+ * function once the cache for @p lun has been written back, so the
+ * application may release the medium here. If writing back the cache
+ * fails, this function is not called for the stop.
+ *
+ * @returns
  *   Return a code from @p MSCReturnCodes. Returning non-success will cause
  *   an error to be returned to the host.
  */
@@ -727,7 +1395,10 @@ extern int8_t MSC_START_STOP_UNIT(
  * @param app_data       Pointer to application data for this interface.
  * @param lun            The Logical Unit Number (LUN) of the medium requested.
  * @param lba_address    Logical Block Address to start reading from.
- * @param num_blocks     Number of blocks to read.
+ * @param num_blocks     Number of blocks to read, each of the block size
+ *                       returned by @p MSC_GET_STORAGE_INFORMATION. A
+ *                       READ(16) of more than 65535 blocks, or beyond the
+ *                       first 2^32 blocks, is rejected without calling this.
  *
  * @returns
  *   Return a code from @p MSCReturnCodes. Returning non-success will cause
@@ -765,6 +1436,8 @@ extern int8_t MSC_START_READ(
  * @param lun            The Logical Unit Number (LUN) of the medium requested.
  * @param lba_address    Logical Block Address the data is intended for.
  * @param num_blocks     Number of blocks which will eventually be written.
+ *                       As with @p MSC_START_READ, a WRITE(16) which
+ *                       doesn't fit is rejected without calling this.
  * @param buffer         The place to put the data from the USB bus
  * @param buffer_len     The size of the buffer in bytes. It must be a
  *                       multiple of the OUT endpoint size.
@@ -789,6 +1462,102 @@ extern int8_t MSC_START_WRITE(
 #endif /* MSC_START_WRITE */
 #endif /* MSC_WRITE_SUPPORT */
 
+#ifdef MSC_SYNCHRONIZE_CACHE
+/** MSC Synchronize Cache Callback
+ *
+ * Defining MSC_SYNCHRONIZE_CACHE lets the application keep a write-back
+ * cache for the LUNs whose bits are set in @p write_cache_mask. For those
+ * LUNs, the application may call @p msc_notify_write_operation_complete()
+ * once written data is in its cache, before it has been written to the
+ * medium. The MSC class reports the cache to the host (the WCE bit of the
+ * Caching mode page), and calls this function when the data must be on
+ * the medium before a command completes:
+ *   - for SYNCHRONIZE CACHE,
+ *   - after a WRITE with the FUA (Force Unit Access) bit set, before its
+ *     status is sent,
+ *   - before the unit is stopped with @p MSC_START_STOP_UNIT(), such
+ *     as when the medium is ejected.
+ *
+ * From @p MSC_START_WRITE(), the application can tell whether a WRITE has
+ * the FUA bit set from @p sync_after_write in @p app_data, and write that
+ * data straight to the medium instead of caching it.
+ *
+ * The application must write back its whole cache for @p lun, and then
+ * call @p msc_notify_synchronize_cache_complete(). The application is
+ * responsible for writing back its cache on a reset, which the MSC class
+ * doesn't know about in advance.
+ *
+ * Note that this function must simply kick-off the write-back and return
+ * quickly. In other words, this function must not block.
+ *
+ * @param app_data       Pointer to application data for this interface.
+ * @param lun            The Logical Unit Number (LUN) of the cache.
+ *
+ * @returns
+ *   Return a code from @p MSCReturnCodes. Returning non-success will cause
+ *   an error to be returned to the host.
+ */
+extern int8_t MSC_SYNCHRONIZE_CACHE(
+		struct msc_application_data *app_data,
+		uint8_t lun);
+#endif /* MSC_SYNCHRONIZE_CACHE */
+
+#ifdef MSC_UNMAP
+/** MSC Unmap Callback
+ *
+ * The USB Stack will call this function for each block descriptor of a
+ * SCSI UNMAP command, when the host no longer needs the data in a range of
+ * blocks (for example, after files have been deleted). The application
+ * may discard the blocks, letting the medium erase them in the background
+ * or skip copying them. Once the blocks have been discarded, the
+ * application must call @p msc_notify_unmap_complete().
+ *
+ * Defining MSC_UNMAP makes the MSC class report logical block provisioning
+ * (in READ CAPACITY(16) and the Logical Block Provisioning VPD page), which
+ * tells the host it can send UNMAP. Unmapped blocks are not reported to
+ * read as zeros, so the application may leave the blocks as they are, and
+ * reads of unmapped blocks may return any data.
+ *
+ * Note that this function must simply kick-off the discard and return
+ * quickly. In other words, this function must not block.
+ *
+ * @param app_data       Pointer to application data for this interface.
+ * @param lun            The Logical Unit Number (LUN) of the medium requested.
+ * @param lba_address    Logical Block Address of the first block to unmap.
+ * @param num_blocks     Number of blocks to unmap. This is at least one and
+ *                       at most MSC_UNMAP_MAX_BLOCKS.
+ *
+ * @returns
+ *   Return a code from @p MSCReturnCodes. Returning non-success will cause
+ *   an error to be returned to the host.
+ */
+extern int8_t MSC_UNMAP(
+		struct msc_application_data *app_data,
+		uint8_t lun,
+		uint32_t lba_address,
+		uint32_t num_blocks);
+#endif /* MSC_UNMAP */
+
+#ifdef MSC_STATISTICS
+#if defined(MSC_GET_TIMESTAMP) && defined(MSC_TIMESTAMP_TICKS_PER_SECOND)
+/** MSC Get Timestamp Callback
+ *
+ * The MSC class will call this function to time commands when
+ * MSC_STATISTICS is defined. It must return the value of a free-running
+ * counter which counts up at @p MSC_TIMESTAMP_TICKS_PER_SECOND and wraps
+ * from 0xffffffff to zero (a hardware timer, or a count of Start-of-Frame
+ * packets, for example). It is called from interrupt context, and must be
+ * quick.
+ *
+ * @returns
+ *   Return the current value of the counter.
+ */
+extern uint32_t MSC_GET_TIMESTAMP(void);
+#else
+#error "You must define MSC_GET_TIMESTAMP and MSC_TIMESTAMP_TICKS_PER_SECOND in your usb_config.h or undefine MSC_STATISTICS"
+#endif
+#endif /* MSC_STATISTICS */
+
 /* Doxygen end-of-group for msc_items */
 /** @}*/
 
@@ -178,10 +178,40 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 4);
 #error "Must select a valid PPB_MODE"
 #endif
 
+#if defined(USB_INTERFACE_SETUP_HANDLERS) && !defined(NUMBER_OF_INTERFACES)
+#error "Must define NUMBER_OF_INTERFACES when using USB_INTERFACE_SETUP_HANDLERS"
+#endif
+
 #if defined(AUTOMATIC_WINUSB_SUPPORT) && !defined(MICROSOFT_OS_DESC_VENDOR_CODE)
 #error "Must define a MICROSOFT_OS_DESC_VENDOR_CODE for Automatic WinUSB"
 #endif
 
+/* Milliseconds for which usb_remote_wakeup() drives resume signaling. The
+ * USB spec (7.1.7.7) requires 1-15ms. Before that, the bus must have been
+ * idle for 5ms, and suspend is detected after 3ms of idle (7.1.7.6), so
+ * it waits REMOTE_WAKEUP_IDLE_MS first. */
+#define REMOTE_WAKEUP_MS 5
+#define REMOTE_WAKEUP_IDLE_MS 2
+
+/* Resume signaling is timed by the application's USB_DELAY_MS_FUNC if it
+ * has one, or else from the CPU clock, if usb_config.h (or the command
+ * line) gives it. Without either, usb_remote_wakeup() isn't built. */
+#if defined(USB_DELAY_MS_FUNC)
+	#define REMOTE_WAKEUP_DELAY(ms) USB_DELAY_MS_FUNC(ms)
+#elif defined(__XC32__) && defined(SYS_CLOCK)
+	/* The core timer counts at half the system clock. */
+	#define REMOTE_WAKEUP_DELAY(ms) do { \
+		uint32_t start = _CP0_GET_COUNT(); \
+		while (_CP0_GET_COUNT() - start < SYS_CLOCK / 2000 * (ms)) \
+			; \
+	} while (0)
+#elif defined(__XC16__) && defined(FCY)
+	#define REMOTE_WAKEUP_DELAY(ms) \
+		__delay32((unsigned long) (FCY / 1000) * (ms))
+#elif defined(__XC8) && defined(_XTAL_FREQ)
+	#define REMOTE_WAKEUP_DELAY(ms) __delay_ms(ms)
+#endif
+
 #ifdef AUTOMATIC_WINUSB_SUPPORT
 	/* Make sure the Microsoft descriptor functions aren't defined */
 	#ifdef MICROSOFT_COMPAT_ID_DESCRIPTOR_FUNC
@@ -190,11 +220,19 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 4);
 	#ifdef MICROSOFT_CUSTOM_PROPERTY_DESCRIPTOR_FUNC
 		#error "Must not define MICROSOFT_CUSTOM_PROPERTY_DESCRIPTOR_FUNC when using Automatic WinUSB"
 	#endif
+	#ifdef MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC
+		#error "Must not define MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC when using Automatic WinUSB"
+	#endif
+	#ifdef USB_BOS_DESCRIPTOR_FUNC
+		#error "Must not define USB_BOS_DESCRIPTOR_FUNC when using Automatic WinUSB"
+	#endif
 
 	/* Define the Microsoft descriptor functions to the handlers
 	 * implemented in usb_winusb.c */
 	#define MICROSOFT_COMPAT_ID_DESCRIPTOR_FUNC m_stack_winusb_get_microsoft_compat
 	#define MICROSOFT_CUSTOM_PROPERTY_DESCRIPTOR_FUNC m_stack_winusb_get_microsoft_property
+	#define MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC m_stack_winusb_get_microsoft_os_20_set
+	#define USB_BOS_DESCRIPTOR_FUNC m_stack_winusb_get_bos
 #endif
 
 static struct buffer_descriptor bds[NUM_BD] BD_ATTR_TAG;
@@ -432,6 +470,8 @@ static uint8_t addr;
 static uint8_t g_configuration;
 static bool control_need_zlp;
 static bool returning_short;
+static bool usb_suspended;
+static bool remote_wakeup_enabled;
 
 /* Data associated with multi-packet control transfers */
 static usb_ep0_data_stage_callback ep0_data_stage_callback;
@@ -599,10 +639,18 @@ void usb_init(void)
 
 	CLEAR_ALL_USB_IF();
 
+	/* Leave suspend. The Activity interrupt is only used while suspended */
+	SFR_USB_SUSPEND = 0;
+	SFR_ACTIVITY_IE = 0;
+	CLEAR_USB_ACTIVITY_IF();
+	usb_suspended = 0;
+	remote_wakeup_enabled = 0;
+
 #ifdef USB_USE_INTERRUPTS
 	SFR_TRANSFER_IE = 1; /* USB Transfer Interrupt Enable */
 	SFR_STALL_IE = 1;    /* USB Stall Interrupt Enable */
 	SFR_RESET_IE = 1;    /* USB Reset Interrupt Enable */
+	SFR_IDLE_IE = 1;     /* USB Idle (suspend) Interrupt Enable */
 #ifdef START_OF_FRAME_CALLBACK
 	SFR_SOF_IE = 1;      /* USB Start-Of-Frame Interrupt Enable */
 #endif
@@ -821,6 +869,42 @@ static void copy_to_ep0_in_buf(const void *ptr, size_t len)
 	#define copy_to_ep0_in_buf(PTR, LEN) memcpy_from_rom(ep0_buf.in, PTR, LEN);
 #endif
 
+/* Send Next EP0 IN Packet
+ *
+ * Load the next transaction of a multi-transaction IN data stage into the
+ * next available EP0 IN buffer and hand it to the SIE. If the data stage
+ * has been exhausted and a zero-length packet is required to terminate
+ * it, send the zero-length packet instead. If there is nothing left to
+ * send, do nothing.
+ */
+static void send_next_ep0_in_packet(void)
+{
+	uint8_t bytes_to_send;
+
+	if (ep0_data_stage_buf_remaining == 0) {
+		if (control_need_zlp) {
+			usb_send_in_buffer_0(0);
+			control_need_zlp = 0;
+		}
+		return;
+	}
+
+	bytes_to_send = MIN(ep0_data_stage_buf_remaining, EP_0_IN_LEN);
+	copy_to_ep0_in_buf(ep0_data_stage_in_buffer, bytes_to_send);
+	ep0_data_stage_buf_remaining -= bytes_to_send;
+	ep0_data_stage_in_buffer += bytes_to_send;
+
+	/* If we hit the end with a full-length packet, set up
+	   to send a zero-length packet at the next IN token, but only
+	   if we are returning less data than was requested. */
+	if (ep0_data_stage_buf_remaining == 0 &&
+	    bytes_to_send == EP_0_IN_LEN &&
+	    returning_short)
+		control_need_zlp = 1;
+
+	usb_send_in_buffer_0(bytes_to_send);
+}
+
 /* Start Control Return
  *
  * Start the data stage of an IN control transfer. This is primarily used
@@ -829,7 +913,10 @@ static void copy_to_ep0_in_buf(const void *ptr, size_t len)
  * handled by the application.
  *
  * This function sets up the global state variables necessary to do a
- * multi-transaction IN data stage and sends the first transaction.
+ * multi-transaction IN data stage and sends the first transaction. When
+ * EP0 IN is ping-ponged, the second transaction is also loaded into the
+ * odd buffer right away so that the SIE never has to wait (NAK) for
+ * handle_ep0_in() to provide the next packet.
  *
  * Params:
  *   ptr             - a pointer to the data to send
@@ -840,19 +927,42 @@ static void copy_to_ep0_in_buf(const void *ptr, size_t len)
  */
 static void start_control_return(const void *ptr, size_t len, size_t bytes_asked_for)
 {
-	uint8_t bytes_to_send = MIN(len, EP_0_IN_LEN);
-	bytes_to_send = MIN(bytes_to_send, bytes_asked_for);
 	returning_short = len < bytes_asked_for;
-	if (bytes_to_send > 0)
-		copy_to_ep0_in_buf(ptr, bytes_to_send);
-	ep0_data_stage_in_buffer = ((char*)ptr) + bytes_to_send;
-	ep0_data_stage_buf_remaining = MIN(bytes_asked_for, len) - bytes_to_send;
-	if (ep0_data_stage_buf_remaining == 0 && returning_short)
-		control_need_zlp = 1;
+	control_need_zlp = 0;
+	ep0_data_stage_in_buffer = (char*) ptr;
+	ep0_data_stage_buf_remaining = MIN(bytes_asked_for, len);
 
 	/* Send back the first transaction */
 	ep0_buf.flags |= EP_TX_DTS;
-	usb_send_in_buffer_0(bytes_to_send);
+	if (ep0_data_stage_buf_remaining == 0)
+		usb_send_in_buffer_0(0);
+	else
+		send_next_ep0_in_packet();
+
+#ifdef PPB_EP0_IN
+	/* Stage the second transaction (if any) in the other buffer. */
+	send_next_ep0_in_packet();
+#endif
+}
+
+/* Return whether the configuration whose bConfigurationValue is config
+ * has the remote wakeup bit set in its bmAttributes. While the device is
+ * not configured (config is 0), any configuration having it will do. */
+static bool config_has_remote_wakeup(uint8_t config)
+{
+	uint8_t i;
+
+	for (i = 0; i < NUMBER_OF_CONFIGURATIONS; i++) {
+		const struct configuration_descriptor *desc =
+			USB_CONFIG_DESCRIPTOR_MAP[i];
+
+		if (config != 0 && desc->bConfigurationValue != config)
+			continue;
+		if (desc->bmAttributes & 0x20 /*Remote Wakeup*/)
+			return true;
+	}
+
+	return false;
 }
 
 static inline int8_t handle_standard_control_request()
@@ -930,6 +1040,18 @@ static inline int8_t handle_standard_control_request()
 #endif
 			}
 		}
+#ifdef USB_BOS_DESCRIPTOR_FUNC
+		else if (descriptor == DESC_BOS) {
+			const void *desc;
+			int16_t len;
+
+			len = USB_BOS_DESCRIPTOR_FUNC(&desc);
+			if (len < 0)
+				stall_ep0();
+			else
+				start_control_return(desc, len, setup->wLength);
+		}
+#endif
 		else {
 #ifdef UNKNOWN_GET_DESCRIPTOR_CALLBACK
 			int16_t len;
@@ -974,6 +1096,8 @@ static inline int8_t handle_standard_control_request()
 
 		send_zero_length_packet_ep0();
 		g_configuration = req;
+		if (req != 0 && !config_has_remote_wakeup(req))
+			remote_wakeup_enabled = 0;
 
 		SERIAL("Set configuration to");
 		SERIAL_VAL(req);
@@ -996,10 +1120,13 @@ static inline int8_t handle_standard_control_request()
 			   Return as a single byte in the return packet. */
 			uint16_t ret;
 #ifdef GET_DEVICE_STATUS_CALLBACK
-			ret = GET_DEVICE_STATUS_CALLBACK();
+			ret = GET_DEVICE_STATUS_CALLBACK() & ~0x0002;
 #else
 			ret = 0x0000;
 #endif
+			/* Bit 1 is the Remote Wakeup feature, set by the host */
+			if (remote_wakeup_enabled)
+				ret |= 0x0002;
 			start_control_return(&ret, 2, setup->wLength);
 		}
 		else if (setup->REQUEST.destination == 2 /*2=endpoint*/) {
@@ -1074,7 +1201,14 @@ static inline int8_t handle_standard_control_request()
 		uint8_t stall = 1;
 		if (setup->REQUEST.destination == 0/*0=device*/) {
 			SERIAL("Set/Clear feature for device");
-			/* TODO Remote Wakeup flag */
+			/* The feature only exists if the configuration
+			 * says the device can do it (9.4.5). */
+			if (setup->wValue == 1/*1=DEVICE_REMOTE_WAKEUP*/ &&
+			    config_has_remote_wakeup(g_configuration)) {
+				remote_wakeup_enabled =
+					(setup->bRequest == SET_FEATURE);
+				stall = 0;
+			}
 		}
 
 		if (setup->REQUEST.destination == 2/*2=endpoint*/) {
@@ -1180,14 +1314,20 @@ static inline void handle_ep0_setup()
 	 * transactions which were pending. */
 #ifdef PPB_EP0_IN
 	/* For ping-pong mode on EP 0, note below that ppbi is the next
-	 * ping-pong buffer which would be written to, meaning that !ppbi is
-	 * the buffer which would have an IN transaction pending (if any).
-	 *
-	 * Only one ping-pong buffer is cleared (instead of both) because
-	 * M-Stack only puts one transfer at a time on the control IN endpoint.
+	 * ping-pong buffer which would be written to. Since both buffers
+	 * can be loaded during a data stage, there are three cases:
+	 *   1. Neither buffer is pending. Nothing needs to be done.
+	 *   2. Only !ppbi is pending. The SIE is waiting on !ppbi, so
+	 *      after it's cleared, !ppbi becomes the next buffer.
+	 *   3. Both are pending. ppbi was loaded first, so the SIE is
+	 *      waiting on ppbi, which remains the next buffer.
 	 */
 	uint8_t ppbi = (ep0_buf.flags & EP_TX_PPBI)? 1: 0;
-	if (BDS0IN(!ppbi).STAT.UOWN) {
+	if (BDS0IN(ppbi).STAT.UOWN) {
+		SET_BDN(BDS0IN(ppbi), 0, EP_0_LEN);
+		SET_BDN(BDS0IN(!ppbi), 0, EP_0_LEN);
+	}
+	else if (BDS0IN(!ppbi).STAT.UOWN) {
 		SET_BDN(BDS0IN(!ppbi), 0, EP_0_LEN);
 		ep0_buf.flags ^= EP_TX_PPBI;
 	}
@@ -1196,6 +1336,7 @@ static inline void handle_ep0_setup()
 		SET_BDN(BDS0IN(0), 0, EP_0_LEN);
 	}
 #endif
+	control_need_zlp = 0;
 
 	if (ep0_data_stage_buf_remaining) {
 		/* A SETUP transaction has been received while waiting
@@ -1230,6 +1371,12 @@ static inline void handle_ep0_setup()
 				setup->wValue,
 				&desc);
 		}
+#ifdef MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC
+		else if (setup->REQUEST.bmRequestType == 0xC0 &&
+		         setup->wIndex == MICROSOFT_OS_20_DESCRIPTOR_INDEX) {
+			len = MICROSOFT_OS_20_DESCRIPTOR_SET_FUNC(&desc);
+		}
+#endif
 
 		if (len < 0)
 			stall_ep0();
@@ -1244,6 +1391,22 @@ static inline void handle_ep0_setup()
 
 handle_unknown:
 
+#ifdef USB_INTERFACE_SETUP_HANDLERS
+	if (setup->REQUEST.destination == 1/*1=interface*/) {
+		/* Route directly to the handler which owns this interface.
+		 * It is the only one which can handle the request, so stall
+		 * if it doesn't. */
+		uint8_t interface = setup->wIndex & 0x00ff;
+		if (interface < NUMBER_OF_INTERFACES &&
+		    USB_INTERFACE_SETUP_HANDLERS[interface]) {
+			res = USB_INTERFACE_SETUP_HANDLERS[interface](setup);
+			if (res < 0)
+				stall_ep0();
+			goto out;
+		}
+	}
+#endif
+
 #ifdef UNKNOWN_SETUP_REQUEST_CALLBACK
 	res = UNKNOWN_SETUP_REQUEST_CALLBACK(setup);
 	if (res < 0)
@@ -1356,28 +1519,19 @@ static inline void handle_ep0_in()
 		addr_pending = 0;
 	}
 
-	if (ep0_data_stage_buf_remaining) {
-		/* There's already a multi-transaction transfer in process. */
-		uint8_t bytes_to_send = MIN(ep0_data_stage_buf_remaining, EP_0_IN_LEN);
-
-		copy_to_ep0_in_buf(ep0_data_stage_in_buffer, bytes_to_send);
-		ep0_data_stage_buf_remaining -= bytes_to_send;
-		ep0_data_stage_in_buffer += bytes_to_send;
-
-		/* If we hit the end with a full-length packet, set up
-		   to send a zero-length packet at the next IN token, but only
-		   if we are returning less data than was requested. */
-		if (ep0_data_stage_buf_remaining == 0 &&
-		    bytes_to_send == EP_0_IN_LEN &&
-		    returning_short)
-			control_need_zlp = 1;
-
-		usb_send_in_buffer_0(bytes_to_send);
-	}
-	else if (control_need_zlp) {
-		usb_send_in_buffer_0(0);
-		control_need_zlp = 0;
-		reset_ep0_data_stage();
+	if (ep0_data_stage_buf_remaining || control_need_zlp) {
+		/* There's already a multi-transaction transfer in process.
+		 * The buffer which just completed is free again, so load the
+		 * next transaction into it. In ping-pong mode, the other
+		 * buffer already holds the transaction which the SIE
+		 * will send next. */
+#ifdef PPB_EP0_IN
+		uint8_t ppbi = (ep0_buf.flags & EP_TX_PPBI)? 1: 0;
+		if (!BDS0IN(ppbi).STAT.UOWN)
+			send_next_ep0_in_packet();
+#else
+		send_next_ep0_in_packet();
+#endif
 	}
 	else {
 		if (ep0_data_stage_direc == 0/*OUT*/) {
@@ -1396,6 +1550,19 @@ static inline void handle_ep0_in()
    and service USB requests */
 void usb_service(void)
 {
+	if (usb_suspended && SFR_USB_ACTIVITY_IF) {
+		/* Activity on the bus while suspended: resume signaling from
+		 * the host, or a reset. Wake the SIE before anything else. */
+		SFR_USB_SUSPEND = 0;
+		CLEAR_USB_ACTIVITY_IF();
+		SFR_ACTIVITY_IE = 0;
+		usb_suspended = 0;
+#ifdef USB_RESUME_CALLBACK
+		USB_RESUME_CALLBACK();
+#endif
+		SERIAL("USB Resume");
+	}
+
 	if (SFR_USB_RESET_IF) {
 		/* A Reset was detected on the wire. Re-init the SIE. */
 #ifdef USB_RESET_CALLBACK
@@ -1471,9 +1638,18 @@ void usb_service(void)
 				if (ep_buf[SFR_USB_STATUS_EP].flags & EP_IN_HALT_FLAG)
 					stall_ep_in(SFR_USB_STATUS_EP);
 				else {
+#ifdef USB_IN_TRANSACTION_HANDLERS
+					usb_transaction_handler handler =
+						USB_IN_TRANSACTION_HANDLERS[SFR_USB_STATUS_EP];
+					if (handler)
+						handler(SFR_USB_STATUS_EP);
+					else
+#endif
+					{
 #ifdef IN_TRANSACTION_COMPLETE_CALLBACK
-					IN_TRANSACTION_COMPLETE_CALLBACK(SFR_USB_STATUS_EP);
+						IN_TRANSACTION_COMPLETE_CALLBACK(SFR_USB_STATUS_EP);
 #endif
+					}
 				}
 			}
 			else {
@@ -1482,9 +1658,18 @@ void usb_service(void)
 				if (ep_buf[SFR_USB_STATUS_EP].flags & EP_OUT_HALT_FLAG)
 					stall_ep_out(SFR_USB_STATUS_EP);
 				else {
+#ifdef USB_OUT_TRANSACTION_HANDLERS
+					usb_transaction_handler handler =
+						USB_OUT_TRANSACTION_HANDLERS[SFR_USB_STATUS_EP];
+					if (handler)
+						handler(SFR_USB_STATUS_EP);
+					else
+#endif
+					{
 #ifdef OUT_TRANSACTION_CALLBACK
-					OUT_TRANSACTION_CALLBACK(SFR_USB_STATUS_EP);
+						OUT_TRANSACTION_CALLBACK(SFR_USB_STATUS_EP);
 #endif
+					}
 				}
 			}
 		}
@@ -1505,12 +1690,71 @@ void usb_service(void)
 		CLEAR_USB_SOF_IF();
 	}
 
+	/* Check for Idle. The bus has been idle for 3ms, meaning the host has
+	 * suspended the device. Put the SIE into suspend and wait for bus
+	 * activity to wake it. */
+	if (SFR_USB_IDLE_IF) {
+		CLEAR_USB_IDLE_IF();
+		if (!usb_suspended) {
+			usb_suspended = 1;
+			CLEAR_USB_ACTIVITY_IF();
+#ifdef USB_USE_INTERRUPTS
+			SFR_ACTIVITY_IE = 1;
+#endif
+			SFR_USB_SUSPEND = 1;
+#ifdef USB_SUSPEND_CALLBACK
+			USB_SUSPEND_CALLBACK();
+#endif
+			SERIAL("USB Suspend");
+		}
+	}
+
 	/* Check for USB Interrupt. */
 	if (SFR_USB_IF) {
 		SFR_USB_IF = 0;
 	}
 }
 
+bool usb_is_suspended(void)
+{
+	return usb_suspended;
+}
+
+#ifdef REMOTE_WAKEUP_DELAY
+int8_t usb_remote_wakeup(void)
+{
+	if (!usb_suspended || !remote_wakeup_enabled)
+		return -1;
+
+	REMOTE_WAKEUP_DELAY(REMOTE_WAKEUP_IDLE_MS);
+	if (!usb_suspended)
+		return -1; /* The host resumed the bus meanwhile. */
+
+	/* Drive resume signaling. The host will continue it and then
+	 * resume the bus, which is handled like any other resume in
+	 * usb_service(). */
+	SFR_USB_SUSPEND = 0;
+	SFR_USB_RESUME = 1;
+	REMOTE_WAKEUP_DELAY(REMOTE_WAKEUP_MS);
+	SFR_USB_RESUME = 0;
+
+	return 0;
+}
+#endif
+
+#ifdef USB_USE_INTERRUPTS
+void usb_idle(void)
+{
+#ifdef USB_SLEEP_WHEN_SUSPENDED
+	if (usb_suspended) {
+		CPU_SLEEP();
+		return;
+	}
+#endif
+	CPU_IDLE();
+}
+#endif
+
 uint8_t usb_get_configuration(void)
 {
 	return g_configuration;
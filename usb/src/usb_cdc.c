@@ -117,7 +117,7 @@ static int8_t set_line_coding(bool transfer_ok, void *context) {
 #endif
 
 
-uint8_t process_cdc_setup_request(const struct setup_packet *setup)
+int8_t process_cdc_setup_request(const struct setup_packet *setup)
 {
 	/* The following comes from the CDC spec 1.1, chapter 6. */
 
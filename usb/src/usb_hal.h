@@ -44,6 +44,8 @@
 #define SFR_USB_STALL_IF         UIRbits.STALLIF
 #define SFR_USB_TOKEN_IF         UIRbits.TRNIF
 #define SFR_USB_SOF_IF           UIRbits.SOFIF
+#define SFR_USB_IDLE_IF          UIRbits.IDLEIF
+#define SFR_USB_ACTIVITY_IF      UIRbits.ACTVIF
 #define SFR_USB_IF               PIR2bits.USBIF
 
 #define SFR_USB_INTERRUPT_EN     UIE
@@ -51,6 +53,8 @@
 #define SFR_STALL_IE             UIEbits.STALLIE
 #define SFR_RESET_IE             UIEbits.URSTIE
 #define SFR_SOF_IE               UIEbits.SOFIE
+#define SFR_IDLE_IE              UIEbits.IDLEIE
+#define SFR_ACTIVITY_IE          UIEbits.ACTVIE
 #define SFR_USB_IE               PIE2bits.USBIE
 
 #define SFR_USB_EXTENDED_INTERRUPT_EN UEIE
@@ -68,6 +72,8 @@
 #define SFR_USB_EN               UCONbits.USBEN
 #define SFR_USB_PKT_DIS          UCONbits.PKTDIS
 #define SFR_USB_PING_PONG_RESET  UCONbits.PPBRST
+#define SFR_USB_SUSPEND          UCONbits.SUSPND
+#define SFR_USB_RESUME           UCONbits.RESUME
 
 #define SFR_USB_STATUS           USTAT
 #define SFR_USB_STATUS_EP        USTATbits.ENDP
@@ -79,6 +85,10 @@
 #define CLEAR_USB_STALL_IF()     SFR_USB_STALL_IF = 0
 #define CLEAR_USB_TOKEN_IF()     SFR_USB_TOKEN_IF = 0
 #define CLEAR_USB_SOF_IF()       SFR_USB_SOF_IF = 0
+#define CLEAR_USB_IDLE_IF()      SFR_USB_IDLE_IF = 0
+/* ACTVIF can't be cleared until the USB clock is running again after
+ * suspend, so keep clearing it until it sticks. */
+#define CLEAR_USB_ACTIVITY_IF()  do { while (SFR_USB_ACTIVITY_IF) SFR_USB_ACTIVITY_IF = 0; } while(0)
 
 /* Buffer Descriptor BDnSTAT flags. On Some MCUs, apparently, when handing
  * a buffer descriptor to the SIE, there's a race condition that can happen
@@ -155,6 +165,11 @@ struct buffer_descriptor {
 #define PPB_ALL          2
 #define PPB_EPN_ONLY     3
 
+/* Power-saving modes. There is no Idle mode on these parts, and the USB
+ * clock stops in Sleep, so the CPU can only sleep while suspended. */
+#define CPU_IDLE()
+#define CPU_SLEEP()              SLEEP()
+
 #if defined __XC8
 	#define memcpy_from_rom(x,y,z) memcpy(x,y,z)
 	#define FAR
@@ -186,6 +201,8 @@ struct buffer_descriptor {
 #define SFR_USB_STALL_IF         UIRbits.STALLIF
 #define SFR_USB_TOKEN_IF         UIRbits.TRNIF
 #define SFR_USB_SOF_IF           UIRbits.SOFIF
+#define SFR_USB_IDLE_IF          UIRbits.IDLEIF
+#define SFR_USB_ACTIVITY_IF      UIRbits.ACTVIF
 #define SFR_USB_IF               PIR2bits.USBIF
 
 #define SFR_USB_INTERRUPT_EN     UIE
@@ -193,6 +210,8 @@ struct buffer_descriptor {
 #define SFR_STALL_IE             UIEbits.STALLIE
 #define SFR_RESET_IE             UIEbits.URSTIE
 #define SFR_SOF_IE               UIEbits.SOFIE
+#define SFR_IDLE_IE              UIEbits.IDLEIE
+#define SFR_ACTIVITY_IE          UIEbits.ACTVIE
 #define SFR_USB_IE               PIE2bits.USBIE
 
 #define SFR_USB_EXTENDED_INTERRUPT_EN UEIE
@@ -210,6 +229,8 @@ struct buffer_descriptor {
 #define SFR_USB_EN               UCONbits.USBEN
 #define SFR_USB_PKT_DIS          UCONbits.PKTDIS
 #define SFR_USB_PING_PONG_RESET  UCONbits.PPBRST
+#define SFR_USB_SUSPEND          UCONbits.SUSPND
+#define SFR_USB_RESUME           UCONbits.RESUME
 
 #define SFR_USB_STATUS           USTAT
 #define SFR_USB_STATUS_EP        USTATbits.ENDP
@@ -221,6 +242,10 @@ struct buffer_descriptor {
 #define CLEAR_USB_STALL_IF()     SFR_USB_STALL_IF = 0
 #define CLEAR_USB_TOKEN_IF()     SFR_USB_TOKEN_IF = 0
 #define CLEAR_USB_SOF_IF()       SFR_USB_SOF_IF = 0
+#define CLEAR_USB_IDLE_IF()      SFR_USB_IDLE_IF = 0
+/* ACTVIF can't be cleared until the USB clock is running again after
+ * suspend, so keep clearing it until it sticks. */
+#define CLEAR_USB_ACTIVITY_IF()  do { while (SFR_USB_ACTIVITY_IF) SFR_USB_ACTIVITY_IF = 0; } while(0)
 
 /* Buffer Descriptor BDnSTAT flags. On Some MCUs, apparently, when handing
  * a buffer descriptor to the SIE, there's a race condition that can happen
@@ -297,14 +322,21 @@ struct buffer_descriptor {
 #define PPB_ALL          2
 #define PPB_EPN_ONLY     3
 
+/* Power-saving modes. The SLEEP instruction enters Idle mode (CPU stopped,
+ * peripherals clocked) when IDLEN is set. */
+#define CPU_IDLE()               do { OSCCONbits.IDLEN = 1; SLEEP_INSTRUCTION(); } while(0)
+#define CPU_SLEEP()              do { OSCCONbits.IDLEN = 0; SLEEP_INSTRUCTION(); } while(0)
+
 /* Compiler stuff. Probably should be somewhere else. */
 #ifdef __C18
 	#define FAR far
 	#define memcpy_from_rom(x,y,z) memcpypgm2ram(x,(rom void*)y,z)
+	#define SLEEP_INSTRUCTION() Sleep()
 	#define BD_ATTR_TAG
 	#define XC8_BUFFER_ADDR_TAG
 #elif defined __XC8
 	#define memcpy_from_rom(x,y,z) memcpy(x,y,z)
+	#define SLEEP_INSTRUCTION() SLEEP()
 	#define FAR
 	#define BD_ATTR_TAG @##BD_ADDR
 	#ifdef BUFFER_ADDR
@@ -332,6 +364,8 @@ struct buffer_descriptor {
 #define SFR_USB_STALL_IF         U1IRbits.STALLIF
 #define SFR_USB_TOKEN_IF         U1IRbits.TRNIF
 #define SFR_USB_SOF_IF           U1IRbits.SOFIF
+#define SFR_USB_IDLE_IF          U1IRbits.IDLEIF
+#define SFR_USB_ACTIVITY_IF      U1OTGIRbits.ACTVIF
 #define SFR_USB_IF               IFS5bits.USB1IF
 
 #define SFR_USB_INTERRUPT_EN     U1IE
@@ -339,6 +373,8 @@ struct buffer_descriptor {
 #define SFR_STALL_IE             U1IEbits.STALLIE
 #define SFR_RESET_IE             U1IEbits.URSTIE
 #define SFR_SOF_IE               U1IEbits.SOFIE
+#define SFR_IDLE_IE              U1IEbits.IDLEIE
+#define SFR_ACTIVITY_IE          U1OTGIEbits.ACTVIE
 #define SFR_USB_IE               IEC5bits.USB1IE
 
 #define SFR_USB_EXTENDED_INTERRUPT_EN U1EIE
@@ -356,6 +392,7 @@ struct buffer_descriptor {
 #define SFR_USB_EN               U1CONbits.USBEN
 #define SFR_USB_PKT_DIS          U1CONbits.PKTDIS
 #define SFR_USB_PING_PONG_RESET  U1CONbits.PPBRST
+#define SFR_USB_RESUME           U1CONbits.RESUME
 
 
 #define SFR_USB_STATUS           U1STAT
@@ -364,6 +401,7 @@ struct buffer_descriptor {
 #define SFR_USB_STATUS_PPBI      U1STATbits.PPBI
 
 #define SFR_USB_POWER            U1PWRCbits.USBPWR
+#define SFR_USB_SUSPEND          U1PWRCbits.USUSPND
 #define SFR_BD_ADDR_REG          U1BDTP1
 
 #define BDnCNT                   STAT.BDnCNT_byte /* buffer descriptor */
@@ -376,6 +414,8 @@ struct buffer_descriptor {
 #define CLEAR_USB_STALL_IF()     SFR_USB_INTERRUPT_FLAGS = 0x80
 #define CLEAR_USB_TOKEN_IF()     SFR_USB_INTERRUPT_FLAGS = 0x08
 #define CLEAR_USB_SOF_IF()       SFR_USB_INTERRUPT_FLAGS = 0x4
+#define CLEAR_USB_IDLE_IF()      SFR_USB_INTERRUPT_FLAGS = 0x10
+#define CLEAR_USB_ACTIVITY_IF()  U1OTGIR = 0x10
 
 #define BDNSTAT_UOWN   0x8000
 #define BDNSTAT_DTS    0x4000
@@ -433,6 +473,10 @@ struct buffer_descriptor {
 #define PPB_ALL          2
 #define PPB_EPN_ONLY     3
 
+/* Power-saving modes */
+#define CPU_IDLE()               Idle()
+#define CPU_SLEEP()              Sleep()
+
 /* Compiler stuff. Probably should be somewhere else. */
 #define FAR
 #define memcpy_from_rom(x,y,z) memcpy(x,y,z)
@@ -455,6 +499,8 @@ struct buffer_descriptor {
 #define SFR_USB_STALL_IF         U1IRbits.STALLIF
 #define SFR_USB_TOKEN_IF         U1IRbits.TRNIF
 #define SFR_USB_SOF_IF           U1IRbits.SOFIF
+#define SFR_USB_IDLE_IF          U1IRbits.IDLEIF
+#define SFR_USB_ACTIVITY_IF      U1OTGIRbits.ACTVIF
 #define SFR_USB_IF               IFS1bits.USBIF
 
 #define SFR_USB_INTERRUPT_EN     U1IE
@@ -462,6 +508,8 @@ struct buffer_descriptor {
 #define SFR_STALL_IE             U1IEbits.STALLIE
 #define SFR_RESET_IE             U1IEbits.URSTIE
 #define SFR_SOF_IE               U1IEbits.SOFIE
+#define SFR_IDLE_IE              U1IEbits.IDLEIE
+#define SFR_ACTIVITY_IE          U1OTGIEbits.ACTVIE
 #define SFR_USB_IE               IEC1bits.USBIE
 
 #define SFR_USB_EXTENDED_INTERRUPT_EN U1EIE
@@ -479,6 +527,7 @@ struct buffer_descriptor {
 #define SFR_USB_EN               U1CONbits.USBEN
 #define SFR_USB_PKT_DIS          U1CONbits.PKTDIS
 #define SFR_USB_PING_PONG_RESET  U1CONbits.PPBRST
+#define SFR_USB_RESUME           U1CONbits.RESUME
 
 
 #define SFR_USB_STATUS           U1STAT
@@ -487,6 +536,7 @@ struct buffer_descriptor {
 #define SFR_USB_STATUS_PPBI      U1STATbits.PPBI
 
 #define SFR_USB_POWER            U1PWRCbits.USBPWR
+#define SFR_USB_SUSPEND          U1PWRCbits.USUSPEND
 #define SFR_BD_ADDR_REG1         U1BDTP1
 #define SFR_BD_ADDR_REG2         U1BDTP2
 #define SFR_BD_ADDR_REG3         U1BDTP3
@@ -499,6 +549,8 @@ struct buffer_descriptor {
 #define CLEAR_USB_STALL_IF()     SFR_USB_INTERRUPT_FLAGS = 0x80
 #define CLEAR_USB_TOKEN_IF()     SFR_USB_INTERRUPT_FLAGS = 0x08
 #define CLEAR_USB_SOF_IF()       SFR_USB_INTERRUPT_FLAGS = 0x4
+#define CLEAR_USB_IDLE_IF()      SFR_USB_INTERRUPT_FLAGS = 0x10
+#define CLEAR_USB_ACTIVITY_IF()  U1OTGIR = 0x10
 
 #define BDNSTAT_UOWN   0x0080
 #define BDNSTAT_DTS    0x0040
@@ -566,6 +618,12 @@ struct buffer_descriptor {
 #define PPB_ALL          2 /* Unused on PIC32 */
 #define PPB_EPN_ONLY     3
 
+/* Power-saving modes. The WAIT instruction enters Idle or Sleep depending
+ * on OSCCON.SLPEN, which requires a system unlock to change and is left to
+ * the application. */
+#define CPU_IDLE()               __asm__ volatile ("wait")
+#define CPU_SLEEP()              CPU_IDLE()
+
 /* Compiler stuff. Probably should be somewhere else. */
 #define FAR
 #define memcpy_from_rom(x,y,z) memcpy(x,y,z)
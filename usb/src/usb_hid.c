@@ -47,7 +47,7 @@ void hid_set_interface_list(uint8_t *interfaces, uint8_t num_interfaces)
 }
 #endif
 
-uint8_t process_hid_setup_request(const struct setup_packet *setup)
+int8_t process_hid_setup_request(const struct setup_packet *setup)
 {
 	/* The following comes from the HID spec 1.11, section 7.1.1 */
 
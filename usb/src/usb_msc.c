@@ -44,10 +44,29 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_mode_sense_6_command), 6);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_start_stop_unit), 6);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_read_10_command), 10);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_write_10_command), 10);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_read_16_command), 16);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_write_16_command), 16);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_inquiry_response), 36);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_capacity_response), 8);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_mode_sense_response), 4);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_synchronize_cache_10_command), 10);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_mode_page_caching), 20);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_sense_response), 18);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_service_action_in_16_command), 16);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_scsi_unmap_command), 10);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_unmap_parameter_header), 8);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_unmap_block_descriptor), 16);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_capacity_16_response), 32);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_vpd_block_limits), 64);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_vpd_logical_block_provisioning), 8);
+#ifdef MSC_UAS_SUPPORT
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_pipe_usage_descriptor), 4);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_uas_command_iu), 32);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_uas_task_management_iu), 16);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_uas_ready_iu), 4);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_uas_response_iu), 8);
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct msc_uas_sense_iu), 34);
+#endif
 
 
 #if MSC_MAX_LUNS_PER_INTERFACE > 0x10
@@ -58,9 +77,26 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct scsi_sense_response), 18);
 	#error At least one LUN must be supported.
 #endif
 
+#ifdef MSC_UAS_SUPPORT
+	#if MSC_UAS_QUEUE_DEPTH < 1 || MSC_UAS_QUEUE_DEPTH > 32
+		#error MSC_UAS_QUEUE_DEPTH must be between 1 and 32
+	#endif
+
+	/* UAS has no transfer length outside of the CDB. Commands from the
+	 * UAS queue are run with this in their CBW's dCBWDataTransferLength,
+	 * so that the transfer is sized by the CDB alone. */
+	#define UAS_TRANSFER_LENGTH 0xffffffff
+#endif
+
 static struct msc_application_data *g_application_data;
 #ifdef MSC_SUPPORT_MULTIPLE_MSC_INTERFACES
 static uint8_t g_application_data_count;
+
+/* Map endpoint numbers to instances (index + 1 into g_application_data,
+ * with 0 meaning no instance) so that the per-transaction lookup does not
+ * have to search all the instances. These are filled out by msc_init(). */
+static uint8_t in_endpoint_instance[NUM_ENDPOINT_NUMBERS+1];
+static uint8_t out_endpoint_instance[NUM_ENDPOINT_NUMBERS+1];
 #endif
 
 static inline void swap(uint8_t *v1, uint8_t *v2)
@@ -104,6 +140,16 @@ static bool direction_is_out(uint8_t flags)
 	return ~flags & MSC_DIRECTION_IN_BIT;
 }
 
+#ifdef MSC_UAS_SUPPORT
+/* Whether the interface is using UAS rather than Bulk-Only Transport */
+static inline bool uas_active(const struct msc_application_data *msc)
+{
+	return msc->alt_setting == MSC_ALT_SETTING_UAS;
+}
+#else
+#define uas_active(msc) false
+#endif
+
 #ifdef MSC_SUPPORT_MULTIPLE_MSC_INTERFACES
 /* Lookup applicaiton data by interface number. */
 static struct msc_application_data *get_app_data(uint8_t interface)
@@ -124,24 +170,17 @@ static struct msc_application_data *get_app_data(uint8_t interface)
 static struct msc_application_data *get_app_data_by_endpoint(
 					uint8_t endpoint_num, uint8_t direction)
 {
-	uint8_t i;
+	uint8_t inst;
 
-	for (i = 0; i < g_application_data_count; i++) {
-		struct msc_application_data *d = &g_application_data[i];
-		/* The if-else inside the loop is slower than doing it
-		 * outside the loop, but it's less code, and since this
-		 * doesn't happen very often (just in the clear_halt case
-		 * which only happens on error), this is an acceptable
-		 * tradeoff. */
-		if (direction && d->in_endpoint == endpoint_num) {
-			return d;
-		}
-		else if (d->out_endpoint == endpoint_num) {
-			return d;
-		}
-	}
+	if (endpoint_num > NUM_ENDPOINT_NUMBERS)
+		return NULL;
 
-	return NULL;
+	inst = (direction)? in_endpoint_instance[endpoint_num]:
+	                    out_endpoint_instance[endpoint_num];
+	if (inst == 0)
+		return NULL;
+
+	return &g_application_data[inst - 1];
 }
 #else
 /* Lookup applicaiton data by interface number. */
@@ -160,14 +199,251 @@ static inline struct msc_application_data *get_app_data_by_endpoint(
 	if (direction && g_application_data[0].in_endpoint == endpoint_num) {
 		return g_application_data;
 	}
-	else if (g_application_data[0].out_endpoint == endpoint_num) {
+	else if (!direction && g_application_data[0].out_endpoint == endpoint_num) {
+		return g_application_data;
+	}
+#ifdef MSC_UAS_SUPPORT
+	else if (direction &&
+	         g_application_data[0].uas_status_endpoint == endpoint_num) {
+		return g_application_data;
+	}
+	else if (!direction &&
+	         g_application_data[0].uas_command_endpoint == endpoint_num) {
 		return g_application_data;
 	}
+#endif
 
 	return NULL;
 }
 #endif
 
+#ifdef MSC_STATISTICS
+/* Statistics
+ *
+ * A command is timed from process_scsi_command() until its status is sent.
+ * In between, it is always waiting for either the application or the
+ * endpoint, and stats_set_phase() is called whenever that changes, adding
+ * the time since the last change to one total or the other. Bytes are
+ * counted as they are moved to or from the endpoint buffers. */
+enum MSCStatisticsPhases {
+	STATS_PHASE_NONE, /* No command is running */
+	STATS_PHASE_APPLICATION,
+	STATS_PHASE_ENDPOINT,
+};
+
+/* Operation codes which have their own entry in msc_statistics.commands,
+ * in order. The last entry is for all other commands. */
+static const uint8_t stats_opcodes[] = {
+	MSC_SCSI_TEST_UNIT_READY,
+	MSC_SCSI_REQUEST_SENSE,
+	MSC_SCSI_INQUIRY,
+	MSC_SCSI_MODE_SENSE_6,
+	MSC_SCSI_START_STOP_UNIT,
+	MSC_SCSI_READ_CAPACITY_10,
+	MSC_SCSI_READ_10,
+	MSC_SCSI_WRITE_10,
+	MSC_SCSI_SYNCHRONIZE_CACHE_10,
+	MSC_SCSI_SERVICE_ACTION_IN_16,
+	MSC_SCSI_UNMAP,
+	MSC_SCSI_READ_16,
+	MSC_SCSI_WRITE_16,
+};
+STATIC_SIZE_CHECK_EQUAL(sizeof(stats_opcodes) + 1, MSC_STATISTICS_NUM_COMMANDS);
+
+static void stats_clear(struct msc_application_data *msc)
+{
+	struct msc_statistics *s = &msc->stats;
+	uint8_t i;
+
+	memset(s, 0, sizeof(*s));
+	s->version = MSC_STATISTICS_VERSION;
+	s->num_commands = MSC_STATISTICS_NUM_COMMANDS;
+	s->num_buckets = MSC_STATISTICS_HISTOGRAM_BUCKETS;
+	s->ticks_per_second = MSC_TIMESTAMP_TICKS_PER_SECOND;
+
+	for (i = 0; i < sizeof(stats_opcodes); i++)
+		s->commands[i].opcode = stats_opcodes[i];
+}
+
+static void stats_command_start(struct msc_application_data *msc,
+                                uint8_t opcode)
+{
+	uint8_t i;
+
+	for (i = 0; i < sizeof(stats_opcodes); i++) {
+		if (stats_opcodes[i] == opcode)
+			break;
+	}
+
+	msc->stats_command = i;
+	msc->stats_command_start = MSC_GET_TIMESTAMP();
+	msc->stats_phase_start = msc->stats_command_start;
+	msc->stats_phase = STATS_PHASE_APPLICATION;
+}
+
+static void stats_set_phase(struct msc_application_data *msc, uint8_t phase)
+{
+	uint32_t now;
+
+	if (msc->stats_phase == STATS_PHASE_NONE)
+		return;
+
+	now = MSC_GET_TIMESTAMP();
+	if (msc->stats_phase == STATS_PHASE_APPLICATION)
+		msc->stats.application_ticks += now - msc->stats_phase_start;
+	else
+		msc->stats.endpoint_ticks += now - msc->stats_phase_start;
+
+	msc->stats_phase = phase;
+	msc->stats_phase_start = now;
+}
+
+static void stats_add_bytes(struct msc_application_data *msc, uint16_t len)
+{
+	if (msc->stats_phase != STATS_PHASE_NONE)
+		msc->stats.commands[msc->stats_command].bytes += len;
+}
+
+/* Account for the command which is running, once its status is sent. */
+static void stats_command_done(struct msc_application_data *msc,
+                               uint8_t status)
+{
+	struct msc_command_statistics *cmd;
+	uint32_t latency;
+	uint8_t bucket;
+
+	if (msc->stats_phase == STATS_PHASE_NONE)
+		return;
+
+	stats_set_phase(msc, STATS_PHASE_NONE);
+
+	cmd = &msc->stats.commands[msc->stats_command];
+	latency = msc->stats_phase_start - msc->stats_command_start;
+
+	cmd->count++;
+	if (status != MSC_STATUS_PASSED)
+		cmd->failed++;
+	cmd->total_ticks += latency;
+	if (latency > cmd->max_ticks)
+		cmd->max_ticks = latency;
+
+	/* The bucket is the number of significant bits in the latency. */
+	bucket = 0;
+	while (latency > 0 && bucket < MSC_STATISTICS_HISTOGRAM_BUCKETS - 1) {
+		latency >>= 1;
+		bucket++;
+	}
+	if (cmd->latency_histogram[bucket] < 0xffff)
+		cmd->latency_histogram[bucket]++;
+}
+
+void msc_statistics_add_medium_time(struct msc_application_data *app_data,
+                                    uint32_t ticks)
+{
+	usb_disable_transaction_interrupt();
+	app_data->stats.medium_busy_ticks += ticks;
+	usb_enable_transaction_interrupt();
+}
+
+void msc_statistics_clear(struct msc_application_data *app_data)
+{
+	usb_disable_transaction_interrupt();
+	stats_clear(app_data);
+	usb_enable_transaction_interrupt();
+}
+#else
+#define stats_command_start(msc, opcode)
+#define stats_set_phase(msc, phase)
+#define stats_add_bytes(msc, len)
+#define stats_command_done(msc, status)
+#endif
+
+/* Fill out the sense data for the last error, as returned by
+ * REQUEST_SENSE (or for UAS, in the Sense IU). */
+static void fill_sense_response(struct msc_application_data *msc,
+                                struct scsi_sense_response *resp)
+{
+	memset(resp, 0, sizeof(*resp));
+	resp->response_code = SCSI_SENSE_CURRENT_ERRORS;
+	resp->flags = msc->sense_key;
+	resp->additional_sense_length = 0xa;
+	resp->additional_sense_code = msc->additional_sense_code;
+}
+
+#ifdef MSC_UAS_SUPPORT
+/* Send a Read Ready or Write Ready IU for the current command on the
+ * Status pipe. The Status pipe is always free when a command is started
+ * (see uas_run_next_command()). */
+static int8_t send_uas_ready_iu(struct msc_application_data *msc,
+                                uint8_t iu_id)
+{
+	struct msc_uas_ready_iu *iu;
+
+	if (usb_in_endpoint_busy(msc->uas_status_endpoint))
+		return -1;
+
+	iu = (struct msc_uas_ready_iu *)
+		usb_get_in_buffer(msc->uas_status_endpoint);
+	iu->iu_id = iu_id;
+	iu->reserved = 0;
+	iu->tag = (uint16_t) msc->current_tag;
+
+	usb_send_in_buffer(msc->uas_status_endpoint, sizeof(*iu));
+
+	return 0;
+}
+
+/* Send the status of the current command as a Sense IU. The status must
+ * follow any Ready IU and data sent for the command, so if either the
+ * Status or the Data-In pipe is still busy, the status is saved and the
+ * state is set to MSC_CSW, and it will be sent from
+ * msc_in_transaction_complete(). Sense data is included with a status of
+ * CHECK CONDITION, so the host doesn't have to ask for it with
+ * REQUEST_SENSE. UAS has no residue; the host counts what it received. */
+static int8_t send_uas_sense_iu(struct msc_application_data *msc,
+                                uint8_t status)
+{
+	struct msc_uas_sense_iu *iu;
+	uint16_t len;
+
+	if (usb_in_endpoint_busy(msc->uas_status_endpoint) ||
+	    usb_in_endpoint_busy(msc->in_endpoint)) {
+		msc->status = status;
+		msc->state = MSC_CSW;
+		stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+		return -1;
+	}
+
+	iu = (struct msc_uas_sense_iu *)
+		usb_get_in_buffer(msc->uas_status_endpoint);
+	memset(iu, 0, sizeof(*iu));
+	iu->iu_id = MSC_UAS_IU_SENSE;
+	iu->tag = (uint16_t) msc->current_tag;
+
+	if (status == MSC_STATUS_PASSED) {
+		iu->status = SCSI_STATUS_GOOD;
+		len = sizeof(*iu) - sizeof(iu->sense);
+	}
+	else {
+		iu->status = SCSI_STATUS_CHECK_CONDITION;
+		iu->length = sizeof(iu->sense);
+		swap2(&iu->length);
+		fill_sense_response(msc, &iu->sense);
+		len = sizeof(*iu);
+	}
+
+	usb_send_in_buffer(msc->uas_status_endpoint, len);
+	stats_command_done(msc, status);
+
+	/* Reset states and status */
+	msc->state = MSC_IDLE;
+	msc->status = MSC_STATUS_PASSED;
+	msc->residue = 0;
+
+	return 0;
+}
+#endif
+
 /* Stall the IN endpoint and set the status which will be returned by the
  * next CSW. */
 static void stall_in_and_set_status(struct msc_application_data *msc,
@@ -175,6 +451,15 @@ static void stall_in_and_set_status(struct msc_application_data *msc,
 {
 	msc->residue = residue;
 	msc->status = status;
+	stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+#ifdef MSC_UAS_SUPPORT
+	/* UAS doesn't stall the data pipes. The host stops the data
+	 * transfer when it receives the status. */
+	if (uas_active(msc)) {
+		send_uas_sense_iu(msc, status);
+		return;
+	}
+#endif
 	usb_halt_ep_in(msc->in_endpoint);
 	msc->state = MSC_CSW;
 }
@@ -186,19 +471,43 @@ static void stall_out_and_set_status(struct msc_application_data *msc,
 {
 	msc->residue = residue;
 	msc->status = status;
+	stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+#ifdef MSC_UAS_SUPPORT
+	if (uas_active(msc)) {
+#ifdef MSC_WRITE_SUPPORT
+		/* Without a stall, data held back in the Data-Out
+		 * endpoint's buffers has to be dropped here. */
+		while (msc->out_ep_missed_transactions > 0) {
+			usb_arm_out_endpoint(msc->out_endpoint);
+			msc->out_ep_missed_transactions--;
+		}
+#endif
+		send_uas_sense_iu(msc, status);
+		return;
+	}
+#endif
 	usb_halt_ep_out(msc->out_endpoint);
 	msc->state = MSC_CSW;
 }
 
-/* Send a Command Status Word (CSW) */
+/* Send a Command Status Word (CSW), or for UAS, a Sense IU */
 static int8_t send_csw(struct msc_application_data *msc,
                        uint32_t residue, uint8_t status)
 {
 	struct msc_command_status_wrapper *csw;
 
+#ifdef MSC_UAS_SUPPORT
+	if (uas_active(msc)) {
+		msc->residue = residue;
+		return send_uas_sense_iu(msc, status);
+	}
+#endif
+
 	/* Make sure endpoint is free */
-	if (usb_in_endpoint_busy(msc->in_endpoint))
+	if (usb_in_endpoint_busy(msc->in_endpoint)) {
+		stats_set_phase(msc, STATS_PHASE_ENDPOINT);
 		return -1;
+	}
 
 	csw = (struct msc_command_status_wrapper *)
 			usb_get_in_buffer(msc->in_endpoint);
@@ -208,6 +517,7 @@ static int8_t send_csw(struct msc_application_data *msc,
 	csw->bCSWStatus = status;
 
 	usb_send_in_buffer(msc->in_endpoint, sizeof(*csw));
+	stats_command_done(msc, status);
 
 	/* Reset states and status */
 	msc->state = MSC_IDLE;
@@ -253,6 +563,99 @@ static void set_scsi_sense(struct msc_application_data *msc,
 	}
 }
 
+#ifdef MSC_SYNCHRONIZE_CACHE
+/* Finish a cache synchronization: stop the unit if a START STOP UNIT was
+ * waiting on it, then send the status. */
+static void cache_sync_done(struct msc_application_data *msc)
+{
+	int8_t res;
+
+	if (msc->stop_after_sync) {
+		msc->stop_after_sync = false;
+		if (msc->status == MSC_STATUS_PASSED) {
+			res = MSC_START_STOP_UNIT(msc, msc->stop_lun,
+			                          false, msc->stop_load_eject);
+			if (res < 0) {
+				set_scsi_sense(msc, res);
+				msc->status = MSC_STATUS_FAILED;
+			}
+		}
+	}
+
+	/* If the IN endpoint is busy, the CSW is sent when the current
+	 * transaction completes. */
+	msc->state = MSC_CSW;
+	send_csw(msc, msc->residue, msc->status);
+}
+
+/* Have the application write back its cache for lun, and send the status
+ * once it has (see msc_notify_synchronize_cache_complete()). A LUN without
+ * a write-back cache has nothing to write, so it is finished now. */
+static void synchronize_cache(struct msc_application_data *msc,
+                              uint8_t lun, uint32_t residue)
+{
+	int8_t res;
+
+	msc->residue = residue;
+	msc->status = MSC_STATUS_PASSED;
+
+	if (!(msc->write_cache_mask & (1 << lun))) {
+		cache_sync_done(msc);
+		return;
+	}
+
+	/* The application may call msc_notify_synchronize_cache_complete()
+	 * from MSC_SYNCHRONIZE_CACHE(), so the state is set first. */
+	msc->state = MSC_CACHE_SYNC;
+	stats_set_phase(msc, STATS_PHASE_APPLICATION);
+
+	res = MSC_SYNCHRONIZE_CACHE(msc, lun);
+	if (res < 0 && msc->state == MSC_CACHE_SYNC) {
+		set_scsi_sense(msc, res);
+		msc->status = MSC_STATUS_FAILED;
+		cache_sync_done(msc);
+	}
+}
+#endif
+
+/* Get the blocks addressed by a READ(10), WRITE(10), READ(16) or WRITE(16)
+ * command, swapping its fields to host byte order in place. The
+ * MSC_START_READ() and MSC_START_WRITE() callbacks take a 32-bit LBA and a
+ * 16-bit number of blocks, so for a 16-byte command outside of that,
+ * MSC_ERROR_INVALID_ADDRESS is returned, with num_blocks limited to 0xffff
+ * so that the length of the transfer can still be checked. */
+static int8_t get_transfer_blocks(uint8_t *cdb,
+                                  uint32_t *lba, uint16_t *num_blocks)
+{
+	if (cdb[0] == MSC_SCSI_READ_16 || cdb[0] == MSC_SCSI_WRITE_16) {
+		struct msc_scsi_read_16_command *cmd =
+			(struct msc_scsi_read_16_command *) cdb;
+
+		swap4(&cmd->logical_block_address_high);
+		swap4(&cmd->logical_block_address);
+		swap4(&cmd->transfer_length); /* length in blocks */
+
+		*lba = cmd->logical_block_address;
+		*num_blocks = MIN(cmd->transfer_length, 0xffff);
+
+		if (cmd->logical_block_address_high != 0 ||
+		    cmd->transfer_length > 0xffff)
+			return MSC_ERROR_INVALID_ADDRESS;
+	}
+	else {
+		struct msc_scsi_read_10_command *cmd =
+			(struct msc_scsi_read_10_command *) cdb;
+
+		swap4(&cmd->logical_block_address);
+		swap2(&cmd->transfer_length); /* length in blocks */
+
+		*lba = cmd->logical_block_address;
+		*num_blocks = cmd->transfer_length;
+	}
+
+	return MSC_SUCCESS;
+}
+
 /* Whether the CBW is valid and meaningful, per the MSC BOT spec */
 static bool msc_cbw_valid_and_meaningful(struct msc_application_data *msc,
                                          const uint8_t *data, uint16_t len)
@@ -322,6 +725,19 @@ static void set_data_in_endpoint_state(struct msc_application_data *msc,
                               size_t sent_length)
 {
 	msc->status = MSC_STATUS_PASSED;
+	stats_add_bytes(msc, sent_length);
+	stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+
+#ifdef MSC_UAS_SUPPORT
+	/* For UAS, tell the host the data is ready to be read. The status
+	 * is sent once both the Read Ready IU and the data have gone. */
+	if (uas_active(msc)) {
+		send_uas_ready_iu(msc, MSC_UAS_IU_READ_READY);
+		msc->residue = 0;
+		msc->state = MSC_CSW;
+		return;
+	}
+#endif
 
 	if (cbw_length > sent_length) {
 		/* Case 5 (Hi > Di): Stall the IN EP and set residue */
@@ -354,6 +770,19 @@ static int8_t check_di_cases(struct msc_application_data *msc,
 	const uint32_t cbw_length = cbw->dCBWDataTransferLength;
 	const bool direc_is_out = direction_is_out(cbw->bmCBWFlags);
 
+#ifdef MSC_UAS_SUPPORT
+	/* UAS has no host-side length or direction to check against. The
+	 * host reads as much as the device sends (up to what the CDB asked
+	 * for). A command which would send nothing just gets its status. */
+	if (uas_active(msc)) {
+		if (intended_length == 0) {
+			send_csw(msc, 0, MSC_STATUS_PASSED);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
 	/* Case 2 (Hn < Di): set phase error (no stall) */
 	if (cbw_length == 0) {
 		phase_error(msc);
@@ -395,6 +824,11 @@ static int8_t check_dn_cases(struct msc_application_data *msc,
 	const uint32_t cbw_length = cbw->dCBWDataTransferLength;
 	const bool direc_is_out = direction_is_out(cbw->bmCBWFlags);
 
+#ifdef MSC_UAS_SUPPORT
+	if (uas_active(msc))
+		return 0;
+#endif
+
 	/* Case 9 (Ho > Dn): stall OUT and set status FAILED */
 	if (direc_is_out && cbw_length > 0) {
 		stall_out_and_set_status(msc, cbw_length, MSC_STATUS_FAILED);
@@ -430,6 +864,11 @@ static int8_t check_do_cases(struct msc_application_data *msc,
 	const uint32_t cbw_length = cbw->dCBWDataTransferLength;
 	const bool direc_is_in = direction_is_in(cbw->bmCBWFlags);
 
+#ifdef MSC_UAS_SUPPORT
+	if (uas_active(msc))
+		return 0;
+#endif
+
 	/* Case 3 (Hn < Do): set phase error (no stall) */
 	if (cbw_length == 0) {
 		phase_error(msc);
@@ -508,6 +947,9 @@ uint8_t msc_init(struct msc_application_data *app_data, uint8_t count)
 #ifndef MSC_SUPPORT_MULTIPLE_MSC_INTERFACES
 	if (count > 1)
 		return -1;
+#else
+	memset(in_endpoint_instance, 0, sizeof(in_endpoint_instance));
+	memset(out_endpoint_instance, 0, sizeof(out_endpoint_instance));
 #endif
 
 	for (i = 0; i < count; i++) {
@@ -520,10 +962,18 @@ uint8_t msc_init(struct msc_application_data *app_data, uint8_t count)
 			return -1;
 		if (d->in_endpoint_size != 64)
 			return -1;
-		if (d->in_endpoint > 15)
+		if (d->in_endpoint > NUM_ENDPOINT_NUMBERS)
+			return -1;
+		if (d->out_endpoint > NUM_ENDPOINT_NUMBERS)
 			return -1;
-		if (d->out_endpoint > 15)
+#ifdef MSC_UAS_SUPPORT
+		if (d->uas_command_endpoint > NUM_ENDPOINT_NUMBERS ||
+		    d->uas_command_endpoint == d->out_endpoint)
 			return -1;
+		if (d->uas_status_endpoint > NUM_ENDPOINT_NUMBERS ||
+		    d->uas_status_endpoint == d->in_endpoint)
+			return -1;
+#endif
 
 		/* Initialize the MSC-Class-Controlled members.*/
 		d->state = MSC_IDLE;
@@ -535,6 +985,8 @@ uint8_t msc_init(struct msc_application_data *app_data, uint8_t count)
 		d->transferred_bytes = 0;
 		d->tx_buf = NULL;
 		d->tx_len_remaining = 0;
+		d->tx_segments = NULL;
+		d->tx_segments_remaining = 0;
 #ifdef MSC_WRITE_SUPPORT
 		d->rx_buf_cur = NULL;
 		d->rx_buf_len = 0;
@@ -542,6 +994,38 @@ uint8_t msc_init(struct msc_application_data *app_data, uint8_t count)
 #endif
 		d->operation_complete_callback = NULL;
 		memset(d->block_size, 0, sizeof(d->block_size));
+#ifdef MSC_SYNCHRONIZE_CACHE
+		d->write_lun = 0;
+		d->sync_after_write = false;
+		d->stop_after_sync = false;
+#endif
+#ifdef MSC_UNMAP
+		d->unmap_pending = false;
+#endif
+#ifdef MSC_UAS_SUPPORT
+		d->alt_setting = MSC_ALT_SETTING_BOT;
+		d->uas_queue_head = 0;
+		d->uas_queue_count = 0;
+		d->uas_response_pending = false;
+		d->uas_command_ep_missed_transactions = 0;
+#endif
+#ifdef MSC_STATISTICS
+		/* Applications call msc_init() again after a reset. Keep
+		 * the statistics in that case, since what led up to the
+		 * reset is often what they're being read for. */
+		if (d->stats.version != MSC_STATISTICS_VERSION)
+			stats_clear(d);
+		d->stats_phase = STATS_PHASE_NONE;
+#endif
+
+#ifdef MSC_SUPPORT_MULTIPLE_MSC_INTERFACES
+		in_endpoint_instance[d->in_endpoint] = i + 1;
+		out_endpoint_instance[d->out_endpoint] = i + 1;
+#ifdef MSC_UAS_SUPPORT
+		in_endpoint_instance[d->uas_status_endpoint] = i + 1;
+		out_endpoint_instance[d->uas_command_endpoint] = i + 1;
+#endif
+#endif
 	}
 
 	g_application_data = app_data;
@@ -552,6 +1036,68 @@ uint8_t msc_init(struct msc_application_data *app_data, uint8_t count)
 	return 0;
 }
 
+int8_t msc_set_interface(uint8_t interface, uint8_t alt_setting)
+{
+	struct msc_application_data *msc;
+
+#ifdef MULTI_CLASS_DEVICE
+	if (!interface_is_msc(interface))
+		return -1;
+#endif
+
+	msc = get_app_data(interface);
+	if (!msc)
+		return -1;
+
+#ifdef MSC_UAS_SUPPORT
+	if (alt_setting > MSC_ALT_SETTING_UAS)
+		return -1;
+
+	/* Drop the queue, and hand any Command pipe transactions which were
+	 * being held back to the hardware again. */
+	while (msc->uas_command_ep_missed_transactions > 0) {
+		usb_arm_out_endpoint(msc->uas_command_endpoint);
+		msc->uas_command_ep_missed_transactions--;
+	}
+	msc->uas_queue_head = 0;
+	msc->uas_queue_count = 0;
+	msc->uas_response_pending = false;
+	msc->alt_setting = alt_setting;
+#else
+	if (alt_setting != MSC_ALT_SETTING_BOT)
+		return -1;
+#endif
+
+	msc->state = MSC_IDLE;
+	msc->status = MSC_STATUS_PASSED;
+	msc->residue = 0;
+#ifdef MSC_SYNCHRONIZE_CACHE
+	msc->stop_after_sync = false;
+#endif
+
+	return 0;
+}
+
+int8_t msc_get_interface(uint8_t interface)
+{
+	struct msc_application_data *msc;
+
+#ifdef MULTI_CLASS_DEVICE
+	if (!interface_is_msc(interface))
+		return -1;
+#endif
+
+	msc = get_app_data(interface);
+	if (!msc)
+		return -1;
+
+#ifdef MSC_UAS_SUPPORT
+	return msc->alt_setting;
+#else
+	return MSC_ALT_SETTING_BOT;
+#endif
+}
+
 int8_t process_msc_setup_request(const struct setup_packet *setup)
 {
 	uint8_t interface = setup->wIndex;
@@ -601,6 +1147,9 @@ int8_t process_msc_setup_request(const struct setup_packet *setup)
 			d->state = MSC_IDLE;
 		else
 			return -1;
+#ifdef MSC_SYNCHRONIZE_CACHE
+		d->stop_after_sync = false;
+#endif
 
 #ifdef MSC_BULK_ONLY_MASS_STORAGE_RESET_CALLBACK
 		int8_t res = 0;
@@ -617,6 +1166,41 @@ int8_t process_msc_setup_request(const struct setup_packet *setup)
 
 		return 0;
 	}
+
+#ifdef MSC_STATISTICS
+	/* The statistics are sent straight from the live structure, so
+	 * a command which completes during the data stage can make the
+	 * snapshot slightly inconsistent. */
+	if (setup->bRequest == MSC_GET_STATISTICS &&
+	    setup->REQUEST.bmRequestType == 0xc1) {
+
+		/* Stall invalid value */
+		if (setup->wValue != 0)
+			return -1;
+
+		usb_send_data_stage((void*)&msc->stats,
+		                    MIN(setup->wLength, sizeof(msc->stats)),
+		                    NULL, 0);
+		return 0;
+	}
+
+	if (setup->bRequest == MSC_CLEAR_STATISTICS &&
+	    setup->REQUEST.bmRequestType == 0x41) {
+
+		/* Stall invalid value/length */
+		if (setup->wValue != 0 ||
+		    setup->wLength != 0)
+			return -1;
+
+		stats_clear(msc);
+
+		/* Return zero-length packet. No data stage. */
+		usb_send_data_stage(NULL, 0, NULL, NULL);
+
+		return 0;
+	}
+#endif
+
 	return -1;
 }
 
@@ -649,11 +1233,13 @@ static inline uint8_t receive_data(struct msc_application_data *msc,
 	/* Copy to the application's buffer. */
 	memcpy(msc->rx_buf_cur, data, len);
 	msc->rx_buf_cur += len;
+	stats_add_bytes(msc, len);
 
 	/* If this is the last piece of the data block, notify the
 	 * application that it's buffer is now full and that it can start
 	 * writing to the medium.  */
 	if (msc->rx_buf_cur >= msc->rx_buf + msc->rx_buf_len) {
+		stats_set_phase(msc, STATS_PHASE_APPLICATION);
 		msc->operation_complete_callback(msc, true);
 	}
 
@@ -664,39 +1250,52 @@ static inline uint8_t receive_data(struct msc_application_data *msc,
 /* Send the next transaction containing data from the medium to the host. */
 static int8_t send_next_data_transaction(struct msc_application_data *msc)
 {
-	const uint8_t *cur = msc->tx_buf;
-	const uint16_t len = msc->tx_len_remaining;
-
 	if (!usb_is_configured() || usb_in_endpoint_busy(msc->in_endpoint))
 		return -1;
 
-	if (len > 0) {
+	/* Move on to the next segment of the data, if there is one. */
+	while (msc->tx_len_remaining == 0 && msc->tx_segments_remaining > 0) {
+		msc->tx_buf = msc->tx_segments->data;
+		msc->tx_len_remaining = msc->tx_segments->len;
+		msc->tx_segments++;
+		msc->tx_segments_remaining--;
+	}
+
+	if (msc->tx_len_remaining > 0) {
 		/* There is data to send; send one packet worth. */
 		uint8_t *buf;
 		uint16_t to_copy;
 
 		buf = usb_get_in_buffer(msc->in_endpoint);
-		to_copy = MIN(len, msc->in_endpoint_size);
-		memcpy(buf, cur, to_copy);
+		to_copy = MIN(msc->tx_len_remaining, msc->in_endpoint_size);
+		memcpy(buf, msc->tx_buf, to_copy);
 
 		usb_send_in_buffer(msc->in_endpoint, to_copy);
 
 		msc->transferred_bytes += to_copy;
 		msc->tx_buf += to_copy;
 		msc->tx_len_remaining -= to_copy;
+		stats_add_bytes(msc, to_copy);
 	}
 	else {
-		/* Transfer of block has completed */
-		msc->operation_complete_callback(msc, true);
+		/* Transfer of block has completed. Clear the block before
+		 * calling the callback, since the callback may start the
+		 * next one with msc_start_send_to_host(). */
+		msc_completion_callback callback =
+			msc->operation_complete_callback;
+
 		msc->operation_complete_callback = NULL;
 		msc->tx_buf = NULL;
+		msc->tx_segments = NULL;
+		stats_set_phase(msc, STATS_PHASE_APPLICATION);
+		callback(msc, true);
 	}
 
 	return 0;
 }
 
 uint8_t msc_start_send_to_host(struct msc_application_data *msc,
-                               const uint8_t *data, uint16_t len,
+                               const uint8_t *data, uint32_t len,
                                msc_completion_callback completion_callback)
 {
 	int8_t res;
@@ -710,7 +1309,52 @@ uint8_t msc_start_send_to_host(struct msc_application_data *msc,
 
 	msc->tx_buf = data;
 	msc->tx_len_remaining = len;
+	msc->tx_segments = NULL;
+	msc->tx_segments_remaining = 0;
+	msc->operation_complete_callback = completion_callback;
+	stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+
+	/* Kick off the transmission. */
+	res = send_next_data_transaction(msc);
+
+out:
+	usb_enable_transaction_interrupt();
+	return res;
+}
+
+uint8_t msc_start_send_segments_to_host(
+                               struct msc_application_data *msc,
+                               const struct msc_send_segment *segments,
+                               uint8_t num_segments,
+                               msc_completion_callback completion_callback)
+{
+	int8_t res;
+	uint8_t i;
+
+	usb_disable_transaction_interrupt();
+
+	if (msc->state != MSC_DATA_TRANSPORT_IN) {
+		res = -1;
+		goto out;
+	}
+
+	/* Like msc_start_send_to_host(), there must be something to send. */
+	for (i = 0; i < num_segments; i++) {
+		if (segments[i].len > 0)
+			break;
+	}
+	if (i == num_segments) {
+		res = -1;
+		goto out;
+	}
+
+	/* The first segment is started by send_next_data_transaction(). */
+	msc->tx_buf = NULL;
+	msc->tx_len_remaining = 0;
+	msc->tx_segments = segments;
+	msc->tx_segments_remaining = num_segments;
 	msc->operation_complete_callback = completion_callback;
+	stats_set_phase(msc, STATS_PHASE_ENDPOINT);
 
 	/* Kick off the transmission. */
 	res = send_next_data_transaction(msc);
@@ -746,7 +1390,6 @@ void msc_notify_read_operation_complete(
 	}
 	else {
 		send_csw(app_data, residue, status);
-		app_data->state = MSC_IDLE;
 	}
 
 out:
@@ -810,6 +1453,7 @@ void msc_notify_write_data_handled(struct msc_application_data *msc)
 		 * buffer pointer to the beginning of the buffer to prepare
 		 * to receive more data from the host. */
 		msc->rx_buf_cur = msc->rx_buf;
+		stats_set_phase(msc, STATS_PHASE_ENDPOINT);
 	}
 
 out:
@@ -854,8 +1498,16 @@ void msc_notify_write_operation_complete(struct msc_application_data *msc,
 	}
 	else {
 		/* No more data left to transfer */
+#ifdef MSC_SYNCHRONIZE_CACHE
+		/* With FUA, the data has to reach the medium before the
+		 * status is sent. */
+		if (msc->sync_after_write) {
+			msc->sync_after_write = false;
+			synchronize_cache(msc, msc->write_lun, residue);
+			goto out;
+		}
+#endif
 		send_csw(msc, residue, MSC_STATUS_PASSED);
-		msc->state = MSC_IDLE;
 	}
 
 out:
@@ -865,20 +1517,218 @@ fail:
 }
 #endif /* MSC_WRITE_SUPPORT */
 
-static void process_msc_command(struct msc_application_data *msc,
-                                const uint8_t *data, uint16_t len)
+#ifdef MSC_SYNCHRONIZE_CACHE
+void msc_notify_synchronize_cache_complete(
+                                    struct msc_application_data *msc,
+                                    bool passed)
+{
+	usb_disable_transaction_interrupt();
+
+	if (msc->state != MSC_CACHE_SYNC)
+		goto out;
+
+	if (!passed) {
+		set_scsi_sense(msc, MSC_ERROR_WRITE);
+		msc->status = MSC_STATUS_FAILED;
+	}
+
+	cache_sync_done(msc);
+
+out:
+	usb_enable_transaction_interrupt();
+}
+#endif /* MSC_SYNCHRONIZE_CACHE */
+
+#ifdef MSC_UNMAP
+/* Send the status of an UNMAP command. If it failed, the sense has been
+ * set already. */
+static void unmap_finish(struct msc_application_data *msc, bool passed)
+{
+	msc->unmap_pending = false;
+	send_csw(msc, msc->requested_bytes_cbw - msc->transferred_bytes,
+	         passed? MSC_STATUS_PASSED: MSC_STATUS_FAILED);
+}
+
+/* Pass the next block descriptor of an UNMAP command to the application,
+ * or finish the command if there are no more. Descriptors are handled one
+ * at a time, each completed with msc_notify_unmap_complete(). */
+static void unmap_next_descriptor(struct msc_application_data *msc)
+{
+	struct scsi_unmap_block_descriptor *desc;
+	int8_t res;
+
+	while (msc->unmap_next < msc->unmap_count) {
+		desc = (struct scsi_unmap_block_descriptor *)
+			(msc->unmap_params +
+			 sizeof(struct scsi_unmap_parameter_header));
+		desc += msc->unmap_next++;
+
+		swap4(&desc->logical_block_address_high);
+		swap4(&desc->logical_block_address);
+		swap4(&desc->num_blocks);
+
+		/* A descriptor with no blocks is allowed, and does
+		 * nothing. */
+		if (desc->num_blocks == 0)
+			continue;
+
+		if (desc->logical_block_address_high != 0) {
+			set_scsi_sense(msc, MSC_ERROR_INVALID_ADDRESS);
+			unmap_finish(msc, false);
+			return;
+		}
+
+		/* The host was told not to send more than this in the
+		 * Block Limits VPD page. */
+		if (desc->num_blocks > MSC_UNMAP_MAX_BLOCKS) {
+			msc->sense_key = SCSI_SENSE_KEY_ILLEGAL_REQUEST;
+			msc->additional_sense_code =
+				SCSI_ASC_INVALID_FIELD_IN_PARAMETER_LIST;
+			unmap_finish(msc, false);
+			return;
+		}
+
+		/* The application may call msc_notify_unmap_complete()
+		 * from MSC_UNMAP(), so this is set first. */
+		msc->unmap_pending = true;
+		stats_set_phase(msc, STATS_PHASE_APPLICATION);
+		res = MSC_UNMAP(msc, msc->unmap_lun,
+		                desc->logical_block_address,
+		                desc->num_blocks);
+		if (res < 0) {
+			set_scsi_sense(msc, res);
+			unmap_finish(msc, false);
+		}
+		return;
+	}
+
+	unmap_finish(msc, true);
+}
+
+/* The UNMAP parameter list has been received into unmap_params. This is
+ * called from receive_data(), in interrupt context. */
+static void unmap_parameters_received(struct msc_application_data *msc,
+                                      bool transfer_ok)
+{
+	struct scsi_unmap_parameter_header *header =
+		(struct scsi_unmap_parameter_header *) msc->unmap_params;
+	uint16_t len;
+
+	msc->transferred_bytes = msc->requested_bytes;
+
+	/* Ignore any part of a descriptor which is past the end of the
+	 * parameter list. */
+	swap2(&header->block_descriptor_data_length);
+	len = MIN(header->block_descriptor_data_length,
+	          msc->requested_bytes - sizeof(*header));
+
+	msc->unmap_count = len / sizeof(struct scsi_unmap_block_descriptor);
+	msc->unmap_next = 0;
+
+	unmap_next_descriptor(msc);
+}
+
+void msc_notify_unmap_complete(struct msc_application_data *msc,
+                               bool passed)
+{
+	usb_disable_transaction_interrupt();
+
+	if (msc->state != MSC_DATA_TRANSPORT_OUT || !msc->unmap_pending)
+		goto out;
+
+	msc->unmap_pending = false;
+
+	if (passed) {
+		unmap_next_descriptor(msc);
+	}
+	else {
+		set_scsi_sense(msc, MSC_ERROR_WRITE);
+		unmap_finish(msc, false);
+	}
+
+out:
+	usb_enable_transaction_interrupt();
+}
+#endif /* MSC_UNMAP */
+
+/* Vital Product Data pages which INQUIRY can return, in order */
+static const uint8_t vpd_pages[] = {
+	MSC_SCSI_VPD_SUPPORTED_PAGES,
+#ifdef MSC_UNMAP
+	MSC_SCSI_VPD_BLOCK_LIMITS,
+	MSC_SCSI_VPD_LOGICAL_BLOCK_PROVISIONING,
+#endif
+};
+
+/* Return the length of a VPD page, or 0 if it isn't supported */
+static uint16_t vpd_page_length(uint8_t page_code)
+{
+	if (page_code == MSC_SCSI_VPD_SUPPORTED_PAGES)
+		return sizeof(struct scsi_vpd_header) + sizeof(vpd_pages);
+#ifdef MSC_UNMAP
+	if (page_code == MSC_SCSI_VPD_BLOCK_LIMITS)
+		return sizeof(struct scsi_vpd_block_limits);
+	if (page_code == MSC_SCSI_VPD_LOGICAL_BLOCK_PROVISIONING)
+		return sizeof(struct scsi_vpd_logical_block_provisioning);
+#endif
+	return 0;
+}
+
+/* Fill out a supported VPD page, of vpd_page_length(page_code) bytes */
+static void fill_vpd_page(uint8_t page_code, uint8_t *buf)
+{
+	struct scsi_vpd_header *header = (struct scsi_vpd_header *) buf;
+	const uint16_t len = vpd_page_length(page_code);
+
+	memset(buf, 0, len);
+	header->page_code = page_code;
+	header->page_length = len - sizeof(*header);
+	swap2(&header->page_length);
+
+	if (page_code == MSC_SCSI_VPD_SUPPORTED_PAGES) {
+		memcpy(buf + sizeof(*header), vpd_pages, sizeof(vpd_pages));
+	}
+#ifdef MSC_UNMAP
+	else if (page_code == MSC_SCSI_VPD_BLOCK_LIMITS) {
+		struct scsi_vpd_block_limits *page =
+			(struct scsi_vpd_block_limits *) buf;
+
+		/* Zero means no limit for the fields not set here. The
+		 * transfer length is limited by the 16-bit num_blocks of
+		 * MSC_START_READ() and MSC_START_WRITE(). */
+		page->max_transfer_length = 0xffff;
+		page->max_unmap_lba_count = MSC_UNMAP_MAX_BLOCKS;
+		page->max_unmap_block_descriptor_count =
+			MSC_UNMAP_MAX_DESCRIPTORS;
+		page->optimal_unmap_granularity = MSC_UNMAP_GRANULARITY;
+		swap4(&page->max_transfer_length);
+		swap4(&page->max_unmap_lba_count);
+		swap4(&page->max_unmap_block_descriptor_count);
+		swap4(&page->optimal_unmap_granularity);
+	}
+	else if (page_code == MSC_SCSI_VPD_LOGICAL_BLOCK_PROVISIONING) {
+		struct scsi_vpd_logical_block_provisioning *page =
+			(struct scsi_vpd_logical_block_provisioning *) buf;
+
+		/* UNMAP only. WRITE SAME isn't supported, and unmapped
+		 * blocks may read as anything. */
+		page->flags = SCSI_LBP_UNMAP;
+	}
+#endif
+}
+
+/* Process the SCSI command in a CBW. For UAS, the CBW is made up from a
+ * queued Command IU by uas_run_next_command(). */
+static void process_scsi_command(struct msc_application_data *msc,
+                                 const struct msc_command_block_wrapper *cbw)
 {
-	const struct msc_command_block_wrapper *cbw = (const void *) data;
 	const uint8_t command = cbw->CBWCB[0];
 	const uint8_t lun = cbw->bCBWLUN;
 	const uint32_t cbw_length = cbw->dCBWDataTransferLength;
 	int8_t res;
 
-	/* Check the Command Block Wrapper (CBW) */
-	if (!msc_cbw_valid_and_meaningful(msc, data,len))
-		goto bad_cbw;
-
 	msc->current_tag = cbw->dCBWTag;
+	stats_command_start(msc, command);
 
 	if (command == MSC_SCSI_INQUIRY) {
 		uint32_t scsi_request_len;
@@ -888,11 +1738,33 @@ static void process_msc_command(struct msc_application_data *msc,
 			(struct scsi_inquiry_response *)
 				usb_get_in_buffer(msc->in_endpoint);
 
+		const bool evpd = (cmd->evpd & 0x1) != 0;
+		uint16_t len;
+
 		swap2(&cmd->allocation_length);
 
+		/* With EVPD set, the host is asking for a Vital Product
+		 * Data page. Otherwise, the page code must be zero. */
+		if (evpd)
+			len = vpd_page_length(cmd->page_code);
+		else
+			len = (cmd->page_code == 0)? sizeof(*resp): 0;
+
 		/* The host may request just the first part of the inquiry
 		 * response structure. */
-		scsi_request_len = MIN(cmd->allocation_length, sizeof(*resp));
+		scsi_request_len = MIN(cmd->allocation_length, len);
+		scsi_request_len = MIN(scsi_request_len,
+		                       msc->in_endpoint_size);
+
+		if (len == 0) {
+			msc->sense_key = SCSI_SENSE_KEY_ILLEGAL_REQUEST;
+			msc->additional_sense_code =
+			     SCSI_ASC_INVALID_FIELD_IN_COMMAND_PACKET;
+			stall_in_and_set_status(msc,
+			                        cbw_length,
+			                        MSC_STATUS_FAILED);
+			goto fail;
+		}
 
 		/* INQUIRY: Device indends to send data to the host (Di). */
 		res = check_di_cases(msc, cbw, scsi_request_len);
@@ -902,16 +1774,31 @@ static void process_msc_command(struct msc_application_data *msc,
 		if (usb_in_endpoint_busy(msc->in_endpoint))
 			goto fail;
 
-		/* Send INQUIRY response */
-		memset(resp, 0, sizeof(*resp));
-		resp->peripheral = 0x0;
-		resp->rmb = (msc->media_is_removable_mask & (1<<lun))? 0x80: 0;
-		resp->version = MSC_SCSI_SPC_VERSION_2;
-		resp->response_data_format = 0x2;
-		resp->additional_length = sizeof(*resp) - 4;
-		strncpy(resp->vendor, msc->vendor, sizeof(resp->vendor));
-		strncpy(resp->product, msc->product, sizeof(resp->product));
-		strncpy(resp->revision, msc->revision, sizeof(resp->revision));
+		if (evpd) {
+			fill_vpd_page(cmd->page_code, (uint8_t *) resp);
+		}
+		else {
+			/* Send INQUIRY response */
+			memset(resp, 0, sizeof(*resp));
+			resp->peripheral = 0x0;
+			resp->rmb = (msc->media_is_removable_mask & (1<<lun))?
+			            0x80: 0;
+#ifdef MSC_UNMAP
+			/* Hosts look for logical block provisioning on
+			 * SPC-3 devices. */
+			resp->version = MSC_SCSI_SPC_VERSION_3;
+#else
+			resp->version = MSC_SCSI_SPC_VERSION_2;
+#endif
+			resp->response_data_format = 0x2;
+			resp->additional_length = sizeof(*resp) - 4;
+			strncpy(resp->vendor, msc->vendor,
+			        sizeof(resp->vendor));
+			strncpy(resp->product, msc->product,
+			        sizeof(resp->product));
+			strncpy(resp->revision, msc->revision,
+			        sizeof(resp->revision));
+		}
 
 		usb_send_in_buffer(msc->in_endpoint, scsi_request_len);
 
@@ -975,6 +1862,57 @@ static void process_msc_command(struct msc_application_data *msc,
 
 		set_data_in_endpoint_state(msc, cbw_length, sizeof(*resp));
 	}
+	else if (command == MSC_SCSI_SERVICE_ACTION_IN_16 &&
+	         (cbw->CBWCB[1] & 0x1f) == MSC_SCSI_SA_READ_CAPACITY_16) {
+		uint32_t scsi_request_len;
+		struct msc_scsi_service_action_in_16_command *cmd =
+			(struct msc_scsi_service_action_in_16_command *)
+				cbw->CBWCB;
+		struct scsi_capacity_16_response *resp =
+			(struct scsi_capacity_16_response *)
+				usb_get_in_buffer(msc->in_endpoint);
+		uint32_t block_size, num_blocks;
+		bool write_protect;
+
+		swap4(&cmd->allocation_length);
+		scsi_request_len = MIN(cmd->allocation_length, sizeof(*resp));
+
+		/* Read Capacity 16: Device intends to send data
+		 *                   to the host (Di) */
+		res = check_di_cases(msc, cbw, scsi_request_len);
+		if (res < 0)
+			goto fail;
+
+		if (usb_in_endpoint_busy(msc->in_endpoint))
+			goto fail;
+
+		res = MSC_GET_STORAGE_INFORMATION(
+				msc, lun,
+				&block_size, &num_blocks, &write_protect);
+		if (res < 0) {
+			/* Stall and set error */
+			set_scsi_sense(msc, res);
+			stall_in_and_set_status(
+			                 msc, cbw_length, MSC_STATUS_FAILED);
+			goto fail;
+		}
+
+		/* Pack and send the response buffer */
+		memset(resp, 0, sizeof(*resp));
+		resp->last_block = num_blocks - 1;
+		resp->block_length = block_size;
+		swap4(&resp->last_block);
+		swap4(&resp->block_length);
+#ifdef MSC_UNMAP
+		resp->lowest_aligned_high = SCSI_CAPACITY_16_LBPME;
+#endif
+		usb_send_in_buffer(msc->in_endpoint, scsi_request_len);
+
+		/* Save off block_size */
+		msc->block_size[lun] = block_size;
+
+		set_data_in_endpoint_state(msc, cbw_length, scsi_request_len);
+	}
 	else if (command == MSC_SCSI_REQUEST_SENSE) {
 		uint32_t scsi_request_len;
 		struct msc_scsi_request_sense_command *cmd =
@@ -994,11 +1932,7 @@ static void process_msc_command(struct msc_application_data *msc,
 		if (usb_in_endpoint_busy(msc->in_endpoint))
 			goto fail;
 
-		memset(resp, 0, sizeof(*resp));
-		resp->response_code = SCSI_SENSE_CURRENT_ERRORS;
-		resp->flags = msc->sense_key;
-		resp->additional_sense_length = 0xa;
-		resp->additional_sense_code = msc->additional_sense_code;
+		fill_sense_response(msc, resp);
 
 		usb_send_in_buffer(msc->in_endpoint, scsi_request_len);
 
@@ -1006,6 +1940,7 @@ static void process_msc_command(struct msc_application_data *msc,
 	}
 	else if (command == MSC_SCSI_MODE_SENSE_6) {
 		uint32_t block_size, num_blocks;
+		uint8_t len = sizeof(struct scsi_mode_sense_response);
 		int8_t res;
 		bool write_protect;
 
@@ -1015,17 +1950,36 @@ static void process_msc_command(struct msc_application_data *msc,
 			(struct scsi_mode_sense_response *)
 				usb_get_in_buffer(msc->in_endpoint);
 
+#ifdef MSC_SYNCHRONIZE_CACHE
+		/* The Caching page is the only page there is. */
+		if (cmd->pc_page_code == SCSI_MODE_PAGE_ALL ||
+		    cmd->pc_page_code == SCSI_MODE_PAGE_CACHING)
+			len += sizeof(struct scsi_mode_page_caching);
+
+		/* Send no more than the host asked for, but always at
+		 * least the header. */
+		if (cmd->allocation_length > sizeof(*resp))
+			len = MIN(len, cmd->allocation_length);
+		else
+			len = sizeof(*resp);
+#endif
+
 		/* MODE_SENSE(6): Device intends to send data
 		 *                to the host (Di) */
-		res = check_di_cases(msc, cbw, sizeof(*resp));
+		res = check_di_cases(msc, cbw, len);
 		if (res < 0)
 			goto fail;
 
 		if (usb_in_endpoint_busy(msc->in_endpoint))
 			goto fail;
 
-		/* Look for page code 0x3f, subpage code 0x0. */
-		if (cmd->pc_page_code != 0x3f || cmd->subpage_code != 0) {
+		/* Look for page code 0x3f (or with a write-back cache, the
+		 * Caching page 0x08), current values, subpage code 0x0. */
+		if ((cmd->pc_page_code != SCSI_MODE_PAGE_ALL
+#ifdef MSC_SYNCHRONIZE_CACHE
+		     && cmd->pc_page_code != SCSI_MODE_PAGE_CACHING
+#endif
+		    ) || cmd->subpage_code != 0) {
 			msc->sense_key = SCSI_SENSE_KEY_ILLEGAL_REQUEST;
 			msc->additional_sense_code =
 			     SCSI_ASC_INVALID_FIELD_IN_COMMAND_PACKET;
@@ -1057,8 +2011,28 @@ static void process_msc_command(struct msc_application_data *msc,
 		resp->device_specific_parameter = (write_protect)? 0x80: 0;
 		resp->block_descriptor_length = 0;
 
-		usb_send_in_buffer(msc->in_endpoint, sizeof(*resp));
-		set_data_in_endpoint_state(msc, cbw_length, sizeof(*resp));
+#ifdef MSC_SYNCHRONIZE_CACHE
+		resp->device_specific_parameter |= SCSI_MODE_SENSE_DPOFUA;
+
+		if (cmd->pc_page_code == SCSI_MODE_PAGE_ALL ||
+		    cmd->pc_page_code == SCSI_MODE_PAGE_CACHING) {
+			struct scsi_mode_page_caching *page =
+				(struct scsi_mode_page_caching *) (resp + 1);
+
+			/* The mode data length is of all the data, even
+			 * if less of it is sent. */
+			resp->mode_data_length += sizeof(*page);
+
+			memset(page, 0, sizeof(*page));
+			page->page_code = SCSI_MODE_PAGE_CACHING;
+			page->page_length = sizeof(*page) - 2;
+			if (msc->write_cache_mask & (1 << lun))
+				page->flags = SCSI_CACHING_WCE;
+		}
+#endif
+
+		usb_send_in_buffer(msc->in_endpoint, len);
+		set_data_in_endpoint_state(msc, cbw_length, len);
 	}
 	else if (command == MSC_SCSI_START_STOP_UNIT) {
 		int8_t res;
@@ -1083,6 +2057,19 @@ static void process_msc_command(struct msc_application_data *msc,
 		start      = ((cmd->command & 0x1) != 0);
 		load_eject = ((cmd->command & 0x2) != 0);
 
+#ifdef MSC_SYNCHRONIZE_CACHE
+		/* The medium may be removed once the unit has stopped, so
+		 * anything cached is written first. The unit is stopped
+		 * when that completes (see cache_sync_done()). */
+		if (!start) {
+			msc->stop_after_sync = true;
+			msc->stop_lun = lun;
+			msc->stop_load_eject = load_eject;
+			synchronize_cache(msc, lun, 0);
+			goto fail; /* Not a failure, but handled the same */
+		}
+#endif
+
 		res = MSC_START_STOP_UNIT(msc, lun, start, load_eject);
 		if (res < 0) {
 			set_scsi_sense(msc, res);
@@ -1092,18 +2079,19 @@ static void process_msc_command(struct msc_application_data *msc,
 
 		send_csw(msc, 0, MSC_STATUS_PASSED);
 	}
-	else if (command == MSC_SCSI_READ_10) {
+	else if (command == MSC_SCSI_READ_10 || command == MSC_SCSI_READ_16) {
 		uint32_t scsi_request_len;
-		struct msc_scsi_read_10_command *cmd =
-			(struct msc_scsi_read_10_command *) cbw->CBWCB;
+		uint32_t lba;
+		uint16_t num_blocks;
+		int8_t range_res;
 
-		swap4(&cmd->logical_block_address);
-		swap2(&cmd->transfer_length); /* length in blocks */
+		range_res = get_transfer_blocks((uint8_t *) cbw->CBWCB,
+		                                &lba, &num_blocks);
 
 		if (usb_in_endpoint_busy(msc->in_endpoint))
 			goto fail;
 
-		scsi_request_len = cmd->transfer_length * msc->block_size[lun];
+		scsi_request_len = (uint32_t) num_blocks * msc->block_size[lun];
 
 		/* Handle the nonsensical, but possible case of the host
 		 * asking to read 0 bytes in the SCSI. That actually makes
@@ -1119,11 +2107,20 @@ static void process_msc_command(struct msc_application_data *msc,
 			goto fail; /* Not a failure, but handled the same */
 		}
 
-		/* READ(10): Device intends to send data to the host (Di) */
+		/* READ(10), READ(16): Device intends to send data to the
+		 *                     host (Di) */
 		res = check_di_cases(msc, cbw, scsi_request_len);
 		if (res < 0)
 			goto fail;
 
+		if (range_res < 0) {
+			set_scsi_sense(msc, range_res);
+			stall_in_and_set_status(msc,
+			                        cbw_length,
+			                        MSC_STATUS_FAILED);
+			goto fail;
+		}
+
 		/* Set up the transport state. It's important that this is
 		 * done before the call to the MSC_START_READ() callback
 		 * below, because the application could concievably start
@@ -1133,37 +2130,46 @@ static void process_msc_command(struct msc_application_data *msc,
 		msc->transferred_bytes = 0;
 		msc->state = MSC_DATA_TRANSPORT_IN;
 
+#ifdef MSC_UAS_SUPPORT
+		/* The Read Ready IU goes first, since the application may
+		 * start sending data from the callback. */
+		if (uas_active(msc))
+			send_uas_ready_iu(msc, MSC_UAS_IU_READ_READY);
+#endif
+
 		/* Start the Data-Transport. After receiving the call to
 		 * MSC_START_READ() the application will repeatedly call
 		 * msc_send_to_host() with data read from the medium
 		 * and then call msc_data_complete() when finished. */
-		res = MSC_START_READ(msc, lun,
-			             cmd->logical_block_address,
-			             cmd->transfer_length);
+		res = MSC_START_READ(msc, lun, lba, num_blocks);
 		if (res < 0) {
+			/* Reset the state. This has to come before the
+			 * stall, which sets the state for sending the
+			 * status. */
+			msc->requested_bytes = 0;
+			msc->requested_bytes_cbw = 0;
+			msc->state = MSC_IDLE;
+
 			set_scsi_sense(msc, res);
 			stall_in_and_set_status(msc,
 			                        cbw_length,
 			                        MSC_STATUS_FAILED);
-
-			/* Reset the state */
-			msc->requested_bytes = 0;
-			msc->requested_bytes_cbw = 0;
-			msc->state = MSC_IDLE;
 			goto fail;
 		}
 	}
 #ifdef MSC_WRITE_SUPPORT
-	else if (command == MSC_SCSI_WRITE_10) {
+	else if (command == MSC_SCSI_WRITE_10 ||
+	         command == MSC_SCSI_WRITE_16) {
 		uint32_t scsi_request_len;
+		uint32_t lba;
+		uint16_t num_blocks;
+		int8_t range_res;
 		int8_t res;
-		struct msc_scsi_write_10_command *cmd =
-			(struct msc_scsi_write_10_command *) cbw->CBWCB;
 
-		swap4(&cmd->logical_block_address);
-		swap2(&cmd->transfer_length); /* length in blocks */
+		range_res = get_transfer_blocks((uint8_t *) cbw->CBWCB,
+		                                &lba, &num_blocks);
 
-		scsi_request_len = cmd->transfer_length * msc->block_size[lun];
+		scsi_request_len = (uint32_t) num_blocks * msc->block_size[lun];
 
 		/* Handle the nonsensical, but possible case of the host
 		 * asking to write 0 bytes in the SCSI command. That actually
@@ -1180,18 +2186,36 @@ static void process_msc_command(struct msc_application_data *msc,
 			goto fail; /* Not a failure, but handled the same */
 		}
 
-		/* Write(10): Device intends to receive data
-		 *            from the host (Do) */
+		/* WRITE(10), WRITE(16): Device intends to receive data
+		 *                       from the host (Do) */
 		res = check_do_cases(msc, cbw, scsi_request_len);
 		if (res < 0)
 			goto fail;
 
+		if (range_res < 0) {
+			set_scsi_sense(msc, range_res);
+			stall_out_and_set_status(msc,
+			                         cbw_length,
+			                         MSC_STATUS_FAILED);
+			goto fail;
+		}
+
+#ifdef MSC_SYNCHRONIZE_CACHE
+		/* Set before the callback, so the application can see
+		 * whether the data may be cached. FUA is in byte 1 of both
+		 * WRITE(10) and WRITE(16). */
+		msc->write_lun = lun;
+		msc->sync_after_write =
+			(cbw->CBWCB[1] & MSC_SCSI_WRITE_FUA) != 0 &&
+			(msc->write_cache_mask & (1 << lun)) != 0;
+#endif
+
 		/* Start the Data-Transport. The application will give
 		 * a buffer to put the data into. */
 		res = MSC_START_WRITE(msc,
 		               lun,
-		               cmd->logical_block_address,
-		               cmd->transfer_length,
+		               lba,
+		               num_blocks,
 		               &msc->rx_buf,
 		               &msc->rx_buf_len,
 		               &msc->operation_complete_callback);
@@ -1210,8 +2234,100 @@ static void process_msc_command(struct msc_application_data *msc,
 		msc->transferred_bytes = 0;
 		msc->rx_buf_cur = msc->rx_buf;
 		msc->state = MSC_DATA_TRANSPORT_OUT;
+		stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+
+#ifdef MSC_UAS_SUPPORT
+		/* The host sends the data once it has the Write Ready IU. */
+		if (uas_active(msc))
+			send_uas_ready_iu(msc, MSC_UAS_IU_WRITE_READY);
+#endif
 	}
 #endif /* MSC_WRITE_SUPPORT */
+#ifdef MSC_SYNCHRONIZE_CACHE
+	else if (command == MSC_SCSI_SYNCHRONIZE_CACHE_10) {
+		int8_t res;
+
+		/* SYNCHRONIZE CACHE(10): Device intends to not send or
+		 *                        receive any data (Dn). The whole
+		 *                        cache is written back, whatever
+		 *                        range is given, and IMMED is
+		 *                        ignored. */
+		res = check_dn_cases(msc, cbw);
+		if (res < 0)
+			goto fail;
+
+		if (usb_in_endpoint_busy(msc->in_endpoint))
+			goto fail;
+
+		synchronize_cache(msc, lun, 0);
+	}
+#endif /* MSC_SYNCHRONIZE_CACHE */
+#ifdef MSC_UNMAP
+	else if (command == MSC_SCSI_UNMAP) {
+		uint16_t scsi_request_len;
+		int8_t res;
+		struct msc_scsi_unmap_command *cmd =
+			(struct msc_scsi_unmap_command *) cbw->CBWCB;
+
+		swap2(&cmd->parameter_list_length);
+		scsi_request_len = cmd->parameter_list_length;
+
+		/* An empty parameter list unmaps nothing (Dn) */
+		if (scsi_request_len == 0) {
+			res = check_dn_cases(msc, cbw);
+			if (res < 0)
+				goto fail;
+
+			send_csw(msc, 0, MSC_STATUS_PASSED);
+			goto fail; /* Not a failure, but handled the same */
+		}
+
+		/* UNMAP: Device intends to receive the parameter list
+		 *        from the host (Do) */
+		res = check_do_cases(msc, cbw, scsi_request_len);
+		if (res < 0)
+			goto fail;
+
+		/* The parameter list must hold at least its header, and
+		 * no more descriptors than unmap_params has room for. */
+		if (scsi_request_len <
+		                sizeof(struct scsi_unmap_parameter_header) ||
+		    scsi_request_len > sizeof(msc->unmap_params)) {
+			msc->sense_key = SCSI_SENSE_KEY_ILLEGAL_REQUEST;
+			msc->additional_sense_code =
+			     (scsi_request_len > sizeof(msc->unmap_params))?
+			     SCSI_ASC_INVALID_FIELD_IN_COMMAND_PACKET:
+			     SCSI_ASC_PARAMETER_LIST_LENGTH_ERROR;
+			stall_out_and_set_status(msc,
+			                         cbw_length,
+			                         MSC_STATUS_FAILED);
+			goto fail;
+		}
+
+		/* Receive the parameter list into the MSC class's own
+		 * buffer. Once it has all arrived,
+		 * unmap_parameters_received() passes the descriptors to
+		 * the application. */
+		msc->rx_buf = msc->unmap_params;
+		msc->rx_buf_len = scsi_request_len;
+		msc->operation_complete_callback = &unmap_parameters_received;
+		msc->unmap_lun = lun;
+		msc->unmap_pending = false;
+
+		/* Initialize the data transport */
+		msc->requested_bytes = scsi_request_len;
+		msc->requested_bytes_cbw = cbw_length;
+		msc->transferred_bytes = 0;
+		msc->rx_buf_cur = msc->rx_buf;
+		msc->state = MSC_DATA_TRANSPORT_OUT;
+		stats_set_phase(msc, STATS_PHASE_ENDPOINT);
+
+#ifdef MSC_UAS_SUPPORT
+		if (uas_active(msc))
+			send_uas_ready_iu(msc, MSC_UAS_IU_WRITE_READY);
+#endif
+	}
+#endif /* MSC_UNMAP */
 	else {
 		/* Unsupported command. See Axelson, page 69. */
 		const bool direc_is_in = direction_is_in(cbw->bmCBWFlags);
@@ -1233,19 +2349,300 @@ static void process_msc_command(struct msc_application_data *msc,
 		goto fail;
 	}
 
-	return;
-
-bad_cbw:
-	/* If the CBW is not valid or is not meaningful, then stall both
-	 * endpoints until a Reset Recovery (BOT 5.3.4) procedure is
-	 * completed by the host (BOT 5.3, Figure 2). */
-	usb_halt_ep_in(msc->in_endpoint);
-	usb_halt_ep_out(msc->out_endpoint);
-	msc->state = MSC_NEEDS_RESET_RECOVERY;
 fail:
 	return;
 }
 
+static void process_msc_command(struct msc_application_data *msc,
+                                const uint8_t *data, uint16_t len)
+{
+	/* Check the Command Block Wrapper (CBW) */
+	if (!msc_cbw_valid_and_meaningful(msc, data, len)) {
+		/* If the CBW is not valid or is not meaningful, then stall
+		 * both endpoints until a Reset Recovery (BOT 5.3.4)
+		 * procedure is completed by the host (BOT 5.3, Figure 2). */
+		usb_halt_ep_in(msc->in_endpoint);
+		usb_halt_ep_out(msc->out_endpoint);
+		msc->state = MSC_NEEDS_RESET_RECOVERY;
+		return;
+	}
+
+	process_scsi_command(msc, (const void *) data);
+}
+
+#ifdef MSC_UAS_SUPPORT
+/* UAS Command Queue
+ *
+ * The host may send Command IUs for several tasks without waiting for
+ * each one to complete, which saves it the round trip between commands
+ * that Bulk-Only Transport has. The Command IUs are kept in a small ring
+ * buffer, and are run one at a time, in order, through the same SCSI
+ * command handling (and application callbacks) as Bulk-Only Transport
+ * commands. A HEAD OF QUEUE task is put at the front of the queue.
+ *
+ * When the queue is full, or when a Response IU is waiting to be sent,
+ * Command pipe transactions are left in the endpoint buffer (which NAKs
+ * the host) in the same way Data-Out transactions are when the
+ * application's buffer is full. They are handled once a command has been
+ * taken off the queue or the Response IU has been sent.
+ *
+ * Task management functions only affect the commands in the queue. The
+ * command which is running is always allowed to complete. */
+
+/* Whether a UAS LUN field is a single-level LUN which exists. */
+static bool uas_lun_valid(struct msc_application_data *msc,
+                          const uint8_t *lun)
+{
+	uint8_t i;
+
+	for (i = 0; i < 8; i++) {
+		if (i != 1 && lun[i] != 0)
+			return false;
+	}
+
+	return lun[1] <= msc->max_lun &&
+	       lun[1] < MSC_MAX_LUNS_PER_INTERFACE;
+}
+
+/* Find a tag in the queue. Returns the position in the queue (from the
+ * head), or -1 if it is not queued. */
+static int8_t uas_find_queued_tag(struct msc_application_data *msc,
+                                  uint16_t tag)
+{
+	uint8_t i;
+
+	for (i = 0; i < msc->uas_queue_count; i++) {
+		uint8_t idx = (msc->uas_queue_head + i) % MSC_UAS_QUEUE_DEPTH;
+		if (msc->uas_queue[idx].tag == tag)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Whether a tag belongs to a task which is queued or running. */
+static bool uas_tag_in_use(struct msc_application_data *msc, uint16_t tag)
+{
+	if (msc->state != MSC_IDLE && msc->current_tag == tag)
+		return true;
+
+	return uas_find_queued_tag(msc, tag) >= 0;
+}
+
+/* Remove the command at position pos (from the head) from the queue. */
+static void uas_remove_queued(struct msc_application_data *msc, uint8_t pos)
+{
+	uint8_t i;
+
+	for (i = pos; i + 1 < msc->uas_queue_count; i++) {
+		uint8_t idx = (msc->uas_queue_head + i) % MSC_UAS_QUEUE_DEPTH;
+		uint8_t next = (idx + 1) % MSC_UAS_QUEUE_DEPTH;
+		msc->uas_queue[idx] = msc->uas_queue[next];
+	}
+
+	msc->uas_queue_count--;
+}
+
+/* Remove all queued commands for a LUN, or for all LUNs if lun is 0xff. */
+static void uas_clear_queue(struct msc_application_data *msc, uint8_t lun)
+{
+	uint8_t i = 0;
+
+	while (i < msc->uas_queue_count) {
+		uint8_t idx = (msc->uas_queue_head + i) % MSC_UAS_QUEUE_DEPTH;
+		if (lun == 0xff || msc->uas_queue[idx].lun == lun)
+			uas_remove_queued(msc, i);
+		else
+			i++;
+	}
+}
+
+static void uas_set_response(struct msc_application_data *msc,
+                             uint16_t tag, uint8_t response_code)
+{
+	msc->uas_response_tag = tag;
+	msc->uas_response_code = response_code;
+	msc->uas_response_pending = true;
+}
+
+static void uas_enqueue_command(struct msc_application_data *msc,
+                                const struct msc_uas_command_iu *iu)
+{
+	struct msc_uas_queued_command *cmd;
+	uint8_t idx;
+
+	if ((iu->task_attribute & MSC_UAS_TASK_ATTRIBUTE_MASK) ==
+	    MSC_UAS_TASK_HEAD_OF_QUEUE) {
+		msc->uas_queue_head = (msc->uas_queue_head +
+		                       MSC_UAS_QUEUE_DEPTH - 1) %
+		                       MSC_UAS_QUEUE_DEPTH;
+		idx = msc->uas_queue_head;
+	}
+	else {
+		idx = (msc->uas_queue_head + msc->uas_queue_count) %
+		      MSC_UAS_QUEUE_DEPTH;
+	}
+
+	cmd = &msc->uas_queue[idx];
+	cmd->tag = iu->tag;
+	cmd->lun = iu->lun[1];
+	memcpy(cmd->cdb, iu->cdb, sizeof(cmd->cdb));
+	msc->uas_queue_count++;
+}
+
+static void uas_process_task_management(
+                           struct msc_application_data *msc,
+                           const struct msc_uas_task_management_iu *iu)
+{
+	int8_t pos;
+	uint8_t response = MSC_UAS_RESPONSE_TMF_COMPLETE;
+
+	if (!uas_lun_valid(msc, iu->lun) &&
+	    iu->function != MSC_UAS_TMF_I_T_NEXUS_RESET) {
+		uas_set_response(msc, iu->tag, MSC_UAS_RESPONSE_INCORRECT_LUN);
+		return;
+	}
+
+	switch (iu->function) {
+	case MSC_UAS_TMF_ABORT_TASK:
+		pos = uas_find_queued_tag(msc, iu->task_tag);
+		if (pos >= 0)
+			uas_remove_queued(msc, pos);
+		break;
+	case MSC_UAS_TMF_ABORT_TASK_SET:
+	case MSC_UAS_TMF_CLEAR_TASK_SET:
+	case MSC_UAS_TMF_LOGICAL_UNIT_RESET:
+		uas_clear_queue(msc, iu->lun[1]);
+		break;
+	case MSC_UAS_TMF_I_T_NEXUS_RESET:
+		uas_clear_queue(msc, 0xff);
+		break;
+	case MSC_UAS_TMF_QUERY_TASK:
+		if (uas_tag_in_use(msc, iu->task_tag))
+			response = MSC_UAS_RESPONSE_TMF_SUCCEEDED;
+		break;
+	default:
+		response = MSC_UAS_RESPONSE_TMF_NOT_SUPPORTED;
+		break;
+	}
+
+	uas_set_response(msc, iu->tag, response);
+}
+
+/* Handle an IU received on the Command pipe. If it can't be handled yet,
+ * return -1, and the caller will leave it in the endpoint buffer. */
+static int8_t uas_receive_iu(struct msc_application_data *msc,
+                             const uint8_t *data, uint16_t len)
+{
+	const struct msc_uas_command_iu *iu = (const void *) data;
+
+	if (msc->uas_queue_count >= MSC_UAS_QUEUE_DEPTH ||
+	    msc->uas_response_pending)
+		return -1;
+
+	/* Too short to even have a tag to respond to. Drop it. */
+	if (len < sizeof(struct msc_uas_ready_iu))
+		return 0;
+
+	if (iu->iu_id == MSC_UAS_IU_COMMAND) {
+		if (len != sizeof(*iu) || iu->additional_cdb_length != 0)
+			uas_set_response(msc, iu->tag,
+			                 MSC_UAS_RESPONSE_INVALID_IU);
+		else if (!uas_lun_valid(msc, iu->lun))
+			uas_set_response(msc, iu->tag,
+			                 MSC_UAS_RESPONSE_INCORRECT_LUN);
+		else if (uas_tag_in_use(msc, iu->tag))
+			uas_set_response(msc, iu->tag,
+			                 MSC_UAS_RESPONSE_OVERLAPPED_TAG);
+		else
+			uas_enqueue_command(msc, iu);
+	}
+	else if (iu->iu_id == MSC_UAS_IU_TASK_MANAGEMENT &&
+	         len == sizeof(struct msc_uas_task_management_iu)) {
+		uas_process_task_management(msc, (const void *) data);
+	}
+	else {
+		uas_set_response(msc, iu->tag, MSC_UAS_RESPONSE_INVALID_IU);
+	}
+
+	return 0;
+}
+
+/* Handle Command pipe transactions which were held back by
+ * msc_out_transaction_complete(). See handle_missed_out_transactions()
+ * for why this counts rather than checking the endpoint. The count is
+ * decremented before each call because the call can end up back here
+ * (through uas_run_next_command()). */
+static void handle_missed_command_transactions(
+                                        struct msc_application_data *msc)
+{
+	uint8_t i, count;
+
+	count = msc->uas_command_ep_missed_transactions;
+	for (i = 0; i < count; i++) {
+		msc->uas_command_ep_missed_transactions--;
+		msc_out_transaction_complete(msc->uas_command_endpoint);
+	}
+}
+
+/* Start the command at the head of the queue once the previous command
+ * has completed and its status has been sent. A command which completes
+ * without using the pipes lets the next one start right away. */
+static void uas_run_next_command(struct msc_application_data *msc)
+{
+	struct msc_command_block_wrapper cbw;
+	struct msc_uas_queued_command *cmd;
+
+	while (msc->state == MSC_IDLE && msc->uas_queue_count > 0 &&
+	       !usb_in_endpoint_busy(msc->uas_status_endpoint) &&
+	       !usb_in_endpoint_busy(msc->in_endpoint)) {
+
+		cmd = &msc->uas_queue[msc->uas_queue_head];
+		memset(&cbw, 0, sizeof(cbw));
+		cbw.dCBWTag = cmd->tag;
+		cbw.dCBWDataTransferLength = UAS_TRANSFER_LENGTH;
+		cbw.bCBWLUN = cmd->lun;
+		cbw.bCBWCBLength = sizeof(cbw.CBWCB);
+		memcpy(cbw.CBWCB, cmd->cdb, sizeof(cbw.CBWCB));
+
+		msc->uas_queue_head = (msc->uas_queue_head + 1) %
+		                      MSC_UAS_QUEUE_DEPTH;
+		msc->uas_queue_count--;
+
+		process_scsi_command(msc, &cbw);
+
+		/* There's room in the queue again. */
+		handle_missed_command_transactions(msc);
+	}
+}
+
+/* Send whatever the Status pipe is waiting to send, and start the next
+ * command when the pipes are free. */
+static void uas_service(struct msc_application_data *msc)
+{
+	if (msc->state == MSC_CSW)
+		send_csw(msc, msc->residue, msc->status);
+
+	if (msc->uas_response_pending &&
+	    !usb_in_endpoint_busy(msc->uas_status_endpoint)) {
+		struct msc_uas_response_iu *iu =
+			(struct msc_uas_response_iu *)
+				usb_get_in_buffer(msc->uas_status_endpoint);
+
+		memset(iu, 0, sizeof(*iu));
+		iu->iu_id = MSC_UAS_IU_RESPONSE;
+		iu->tag = msc->uas_response_tag;
+		iu->response_code = msc->uas_response_code;
+		usb_send_in_buffer(msc->uas_status_endpoint, sizeof(*iu));
+
+		msc->uas_response_pending = false;
+		handle_missed_command_transactions(msc);
+	}
+
+	uas_run_next_command(msc);
+}
+#endif /* MSC_UAS_SUPPORT */
+
 void msc_clear_halt(uint8_t endpoint, uint8_t direction)
 {
 	struct msc_application_data *msc;
@@ -1256,7 +2653,6 @@ void msc_clear_halt(uint8_t endpoint, uint8_t direction)
 
 	if (msc->state == MSC_CSW) {
 		send_csw(msc, msc->residue, msc->status);
-		msc->state = MSC_IDLE;
 	}
 	else if (msc->state == MSC_NEEDS_RESET_RECOVERY) {
 		/* The device needs a Reset Recovery (BOT 5.3.4) but the
@@ -1278,6 +2674,20 @@ void msc_in_transaction_complete(uint8_t endpoint)
 	if (!msc)
 		return;
 
+#ifdef MSC_UAS_SUPPORT
+	if (uas_active(msc)) {
+		if (endpoint == msc->in_endpoint &&
+		    msc->state == MSC_DATA_TRANSPORT_IN)
+			send_next_data_transaction(msc);
+		uas_service(msc);
+		return;
+	}
+
+	/* The Status pipe isn't used by Bulk-Only Transport. */
+	if (endpoint != msc->in_endpoint)
+		return;
+#endif
+
 	if (msc->state == MSC_DATA_TRANSPORT_IN) {
 		send_next_data_transaction(msc);
 	}
@@ -1287,7 +2697,6 @@ void msc_in_transaction_complete(uint8_t endpoint)
 	}
 	else if (msc->state == MSC_CSW) {
 		send_csw(msc, msc->residue, msc->status);
-		msc->state = MSC_IDLE;
 	}
 }
 
@@ -1316,6 +2725,23 @@ void msc_out_transaction_complete(uint8_t endpoint)
 
 	out_buf_len = usb_get_out_buffer(endpoint, &out_buf);
 
+#ifdef MSC_UAS_SUPPORT
+	if (endpoint == msc->uas_command_endpoint) {
+		/* Command pipe. Like Data-Out below, an IU which can't be
+		 * handled yet is left in the endpoint buffer. */
+		if (uas_active(msc) &&
+		    uas_receive_iu(msc, out_buf, out_buf_len) < 0) {
+			msc->uas_command_ep_missed_transactions++;
+			return;
+		}
+
+		usb_arm_out_endpoint(endpoint);
+		if (uas_active(msc))
+			uas_service(msc);
+		return;
+	}
+#endif
+
 #ifdef MSC_WRITE_SUPPORT
 	if (msc->state == MSC_DATA_TRANSPORT_OUT) {
 		/* In the DATA_TRANSPORT_OUT state, treat this transaction
@@ -1326,7 +2752,7 @@ void msc_out_transaction_complete(uint8_t endpoint)
 		 * in the application's buffer. */
 		res = receive_data(msc, out_buf, out_buf_len);
 	}
-	else if (msc->state == MSC_IDLE) {
+	else if (msc->state == MSC_IDLE && !uas_active(msc)) {
 		process_msc_command(msc, out_buf, out_buf_len);
 		res = 0;
 	}
@@ -1350,7 +2776,7 @@ void msc_out_transaction_complete(uint8_t endpoint)
 	/* If read-only, then OUT transactions are always processed
 	 * and fully handled, leaving no reason to have missed
 	 * transactions, as above. */
-	if (msc->state == MSC_IDLE)
+	if (msc->state == MSC_IDLE && !uas_active(msc))
 		process_msc_command(msc, out_buf, out_buf_len);
 	usb_arm_out_endpoint(endpoint);
 #endif
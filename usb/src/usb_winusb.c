@@ -26,11 +26,21 @@
 
 #include <stdint.h>
 #include "usb_config.h"
+#include "usb_ch9.h"
 #include "usb_microsoft.h"
 #include "usb_winusb.h"
 
 #ifdef AUTOMATIC_WINUSB_SUPPORT
 
+/* For composite devices, AUTOMATIC_WINUSB_INTERFACE can be defined in
+ * usb_config.h to the interface to which WinUSB should be bound. Otherwise
+ * WinUSB is bound to the whole device. */
+#ifdef AUTOMATIC_WINUSB_INTERFACE
+	#define WINUSB_FIRST_INTERFACE AUTOMATIC_WINUSB_INTERFACE
+#else
+	#define WINUSB_FIRST_INTERFACE 0
+#endif
+
 /* Microsoft-specific descriptors for automatic binding of the WinUSB driver.
  * See docs/winusb.txt for details. */
 struct extended_compat_descriptor_packet {
@@ -52,7 +62,7 @@ static struct extended_compat_descriptor_packet
 
 	/* Function */
 	{
-	0x0,      /* bFirstInterfaceNumber */
+	WINUSB_FIRST_INTERFACE, /* bFirstInterfaceNumber */
 	0x1,      /* reserved. Set to 1 in the Microsoft example */
 	"WINUSB", /* compatibleID[8] */
 	"",       /* subCompatibleID[8] */
@@ -69,6 +79,131 @@ static struct microsoft_extended_properties_header
 	0x0,    /* bCount, Number of custom property sections */
 };
 
+/* MS OS 2.0 descriptors, used by Windows 8.1 and later in place of the
+ * above. Windows will only ask for these if the device descriptor reports a
+ * bcdUSB of 0x0201 or higher. See docs/winusb.txt for details. */
+#ifdef WINUSB_DEVICE_INTERFACE_GUID
+struct os_20_guid_property {
+	struct microsoft_os_20_registry_property_header header;
+	uint16_t wPropertyNameLength;
+	uint16_t PropertyName[21];
+	uint16_t wPropertyDataLength;
+	uint16_t PropertyData[40];
+};
+STATIC_SIZE_CHECK_EQUAL(sizeof(struct os_20_guid_property), 132);
+#endif
+
+struct os_20_descriptor_set {
+	struct microsoft_os_20_set_header header;
+#ifdef AUTOMATIC_WINUSB_INTERFACE
+	struct microsoft_os_20_configuration_subset_header configuration;
+	struct microsoft_os_20_function_subset_header function;
+#endif
+	struct microsoft_os_20_compat_id compat_id;
+#ifdef WINUSB_DEVICE_INTERFACE_GUID
+	struct os_20_guid_property guid_property;
+#endif
+};
+
+/* Length of the part of the set which applies to the WinUSB function */
+#define OS_20_FUNCTION_LENGTH (sizeof(struct os_20_descriptor_set) - \
+                               sizeof(struct microsoft_os_20_set_header))
+
+static const struct os_20_descriptor_set os_20_descriptor_set =
+{
+	/* Set Header */
+	{
+	sizeof(struct microsoft_os_20_set_header), /* wLength */
+	MS_OS_20_SET_HEADER_DESCRIPTOR,            /* wDescriptorType */
+	MICROSOFT_OS_20_WINDOWS_VERSION_8_1,       /* dwWindowsVersion */
+	sizeof(struct os_20_descriptor_set),       /* wTotalLength */
+	},
+
+#ifdef AUTOMATIC_WINUSB_INTERFACE
+	/* Configuration Subset Header */
+	{
+	sizeof(struct microsoft_os_20_configuration_subset_header), /* wLength */
+	MS_OS_20_SUBSET_HEADER_CONFIGURATION, /* wDescriptorType */
+	0,                                    /* bConfigurationValue (index) */
+	0,                                    /* bReserved */
+	OS_20_FUNCTION_LENGTH,                /* wTotalLength */
+	},
+
+	/* Function Subset Header */
+	{
+	sizeof(struct microsoft_os_20_function_subset_header), /* wLength */
+	MS_OS_20_SUBSET_HEADER_FUNCTION, /* wDescriptorType */
+	AUTOMATIC_WINUSB_INTERFACE,      /* bFirstInterface */
+	0,                               /* bReserved */
+	OS_20_FUNCTION_LENGTH -
+		sizeof(struct microsoft_os_20_configuration_subset_header),
+	                                 /* wSubsetLength */
+	},
+#endif
+
+	/* Compatible ID */
+	{
+	sizeof(struct microsoft_os_20_compat_id), /* wLength */
+	MS_OS_20_FEATURE_COMPATIBLE_ID,           /* wDescriptorType */
+	"WINUSB", /* CompatibleID[8] */
+	"",       /* SubCompatibleID[8] */
+	},
+
+#ifdef WINUSB_DEVICE_INTERFACE_GUID
+	/* Registry Property: DeviceInterfaceGUIDs */
+	{
+		{
+		sizeof(struct os_20_guid_property), /* wLength */
+		MS_OS_20_FEATURE_REG_PROPERTY,      /* wDescriptorType */
+		7,                                  /* REG_MULTI_SZ */
+		},
+		42, /* wPropertyNameLength */
+		{'D','e','v','i','c','e','I','n','t','e','r','f','a','c','e',
+		 'G','U','I','D','s',0},
+		80, /* wPropertyDataLength */
+		WINUSB_DEVICE_INTERFACE_GUID, /* Double NUL-terminated by padding */
+	},
+#endif
+};
+
+struct bos_packet {
+	struct bos_descriptor bos;
+	struct usb_2_0_extension_capability_descriptor usb_2_0_extension;
+	struct microsoft_os_20_platform_capability platform;
+};
+
+static const struct bos_packet bos_packet =
+{
+	/* BOS Descriptor */
+	{
+	sizeof(struct bos_descriptor), /* bLength */
+	DESC_BOS,                      /* bDescriptorType */
+	sizeof(struct bos_packet),     /* wTotalLength */
+	2,                             /* bNumDeviceCaps */
+	},
+
+	/* USB 2.0 Extension */
+	{
+	sizeof(struct usb_2_0_extension_capability_descriptor), /* bLength */
+	DESC_DEVICE_CAPABILITY,              /* bDescriptorType */
+	DEVICE_CAPABILITY_USB_2_0_EXTENSION, /* bDevCapabilityType */
+	0x0,                                 /* bmAttributes: No LPM */
+	},
+
+	/* MS OS 2.0 Platform Capability */
+	{
+	sizeof(struct microsoft_os_20_platform_capability), /* bLength */
+	DESC_DEVICE_CAPABILITY,     /* bDescriptorType */
+	DEVICE_CAPABILITY_PLATFORM, /* bDevCapabilityType */
+	0,                          /* bReserved */
+	MICROSOFT_OS_20_PLATFORM_CAPABILITY_UUID,
+	MICROSOFT_OS_20_WINDOWS_VERSION_8_1, /* dwWindowsVersion */
+	sizeof(struct os_20_descriptor_set), /* wMSOSDescriptorSetTotalLength */
+	MICROSOFT_OS_DESC_VENDOR_CODE,       /* bMS_VendorCode */
+	0,                                   /* bAltEnumCode */
+	},
+};
+
 uint16_t m_stack_winusb_get_microsoft_compat(uint8_t interface,
                                               const void **descriptor)
 {
@@ -85,4 +220,16 @@ uint16_t m_stack_winusb_get_microsoft_property(uint8_t interface,
 	return sizeof(interface_0_property_descriptor);
 }
 
+int16_t m_stack_winusb_get_microsoft_os_20_set(const void **descriptor)
+{
+	*descriptor = &os_20_descriptor_set;
+	return sizeof(os_20_descriptor_set);
+}
+
+int16_t m_stack_winusb_get_bos(const void **descriptor)
+{
+	*descriptor = &bos_packet;
+	return sizeof(bos_packet);
+}
+
 #endif /* AUTOMATIC_WINUSB_SUPPORT */
@@ -37,4 +37,8 @@ uint16_t m_stack_winusb_get_microsoft_compat(uint8_t interface,
 uint16_t m_stack_winusb_get_microsoft_property(uint8_t interface,
                                                 const void **descriptor);
 
+int16_t m_stack_winusb_get_microsoft_os_20_set(const void **descriptor);
+
+int16_t m_stack_winusb_get_bos(const void **descriptor);
+
 #endif /* USB_WINUSB_H__ */